@@ -0,0 +1,68 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Implementation of bench_utils.h.
+ *
+ * @see bench_utils.h
+ */
+
+
+#include "bench_utils.h"
+#include "../src/include/netascii.h"
+#include <string.h>
+#include <time.h>
+
+
+double bench_now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+long encode_all(char *in, long in_len, char *out){
+  struct netascii_encoder encoder;
+  long in_pos, out_pos;
+
+  netascii_encoder_init(&encoder);
+  in_pos = 0;
+  out_pos = 0;
+
+  for (;;){
+    if (encoder.pos == encoder.len && encoder.pending == -1){
+      if (in_pos == in_len)
+        break;
+      encoder.len = in_len - in_pos < NETASCII_BUF_LEN ? 
+                    in_len - in_pos : NETASCII_BUF_LEN;
+      memcpy(encoder.buf, in + in_pos, encoder.len);
+      encoder.pos = 0;
+      in_pos += encoder.len;
+    }
+    out_pos += netascii_encode(&encoder, out + out_pos, NETASCII_BUF_LEN);
+  }
+
+  return out_pos;
+}
+
+
+long decode_all(char *in, long in_len, char *out){
+  struct netascii_decoder decoder;
+  long in_pos, out_pos;
+  int chunk, n;
+
+  netascii_decoder_init(&decoder);
+  out_pos = 0;
+
+  for (in_pos = 0; in_pos < in_len; in_pos += chunk){
+    chunk = in_len - in_pos < NETASCII_BUF_LEN ? 
+            in_len - in_pos : NETASCII_BUF_LEN;
+    n = netascii_decode(&decoder, in + in_pos, chunk);
+    if (n < 0)
+      return -1;
+    memcpy(out + out_pos, decoder.buf, n);
+    out_pos += n;
+  }
+
+  return out_pos;
+}
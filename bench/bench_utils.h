@@ -0,0 +1,41 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Helpers shared by the benchmarks.
+ *
+ * They are linked in every benchmark, together with the sources of the 
+ * utilities under test.
+ */
+
+#ifndef BENCH_UTILS
+#define BENCH_UTILS
+
+
+/**
+ * Returns the current time in seconds (monotonic clock).
+ */
+double bench_now();
+
+/**
+ * Encodes a whole buffer to netascii.
+ *
+ * @param in      Unix bytes
+ * @param in_len  number of Unix bytes
+ * @param out     netascii bytes (must be large enough) [out]
+ * @return        number of netascii bytes
+ */
+long encode_all(char *in, long in_len, char *out);
+
+/**
+ * Decodes a whole buffer from netascii.
+ *
+ * @param in      netascii bytes
+ * @param in_len  number of netascii bytes
+ * @param out     Unix bytes (must be large enough) [out]
+ * @return        number of Unix bytes, -1 in case of bad formatted netascii
+ */
+long decode_all(char *in, long in_len, char *out);
+
+
+#endif
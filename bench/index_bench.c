@@ -0,0 +1,213 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Benchmark of the in-memory index of the served directory.
+ *
+ * Creates a tree with a given number of files (100 files per directory, 10
+ * directories per parent directory, like a large PXE/boot server), then
+ * reports:
+ *  - how long it takes to build the index (server startup), with 1 to
+ *    DIR_INDEX_MAX_THREADS threads;
+ *  - the latency of the lookup of requested files (existing and missing,
+ *    picked at random) by resolve_indexed_path, with and without the index,
+ *    and by comparing real paths (fallback for old kernels).
+ *
+ * Each successful lookup includes opening the file (and closing it). The
+ * tree is removed at the end.
+ *
+ * Usage: index_bench [n_files] [dir]
+ */
+
+
+#define _GNU_SOURCE
+#include "../src/include/server_utils.h"
+#include "../src/include/dir_index.h"
+#include "../src/include/logging.h"
+#include "bench_utils.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Only errors are logged */
+const int LOG_LEVEL = LOG_ERR;
+
+/** Default number of files */
+#define DEFAULT_N_FILES 100000
+
+/** Default directory of the tree */
+#define DEFAULT_DIR "/tmp"
+
+/** Name of the tree */
+#define TREE_NAME "index_bench.d"
+
+/** Number of files in each directory */
+#define FILES_PER_DIR 100
+
+/** Number of subdirectories of each top level directory */
+#define DIRS_PER_DIR 10
+
+/** Number of lookups of each kind */
+#define N_LOOKUPS 100000
+
+
+/**
+ * Builds the name of the i-th file (missing ones have another extension).
+ */
+void file_name(int i, int missing, char *name){
+  sprintf(name, "%03d/%02d/01-52-54-00-%02x-%02x.%s",
+          i / (FILES_PER_DIR * DIRS_PER_DIR),
+          i / FILES_PER_DIR % DIRS_PER_DIR,
+          i / 256 % 256,
+          i % 256,
+          missing ? "missing" : "cfg"
+  );
+}
+
+
+/**
+ * Creates the tree.
+ *
+ * @return  0 in case of success, 1 otherwise
+ */
+int make_tree(char *root, int n_files){
+  char name[64], path[PATH_MAX];
+  FILE *f;
+  int i;
+
+  if (mkdir(root, 0755) != 0)
+    return 1;
+
+  for (i = 0; i < n_files; i++){
+    file_name(i, 0, name);
+    if (i % FILES_PER_DIR == 0){
+      snprintf(path, sizeof(path), "%s/%.3s", root, name);
+      mkdir(path, 0755);
+      snprintf(path, sizeof(path), "%s/%.6s", root, name);
+      mkdir(path, 0755);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    f = fopen(path, "w");
+    if (f == NULL)
+      return 1;
+    fprintf(f, "default linux\nappend initrd=initrd.img ip=dhcp\n");
+    fclose(f);
+  }
+
+  return 0;
+}
+
+
+/** Removes a file or an empty directory (for nftw) */
+int remove_entry(const char *path, const struct stat *st, int flag,
+                 struct FTW *ftw){
+  return remove(path);
+}
+
+
+/**
+ * Looks up N_LOOKUPS random files.
+ *
+ * @return  average latency (us), negative if the result was not the
+ *          expected one
+ */
+double run(struct dir_index *index, int dir_fd, char *dir_realpath,
+           int n_files, int missing){
+  char name[64], file_realpath[PATH_MAX];
+  unsigned int seed = 42;
+  double elapsed;
+  off_t size;
+  int i, ret, fd;
+
+  elapsed = 0;
+  for (i = 0; i < N_LOOKUPS; i++){
+    file_name(rand_r(&seed) % n_files, missing, name);
+
+    elapsed -= bench_now();
+    ret = resolve_indexed_path(index, dir_fd, dir_realpath, name,
+                               file_realpath, &fd, &size
+    );
+    if (fd != -1)
+      close(fd);
+    elapsed += bench_now();
+
+    if (ret != missing)
+      return -1;
+  }
+  return elapsed / N_LOOKUPS * 1e6;
+}
+
+
+/**
+ * Prints a latency (or an error).
+ */
+void print_latency(double latency){
+  if (latency < 0)
+    printf("  unexpected");
+  else
+    printf("  %10.2f", latency);
+}
+
+
+/** Main */
+int main(int argc, char** argv){
+  struct dir_index index;
+  struct dir_index_stats stats;
+  char root[PATH_MAX], dir_realpath[PATH_MAX];
+  double start, elapsed;
+  int n_files, n_threads, dir_fd, missing;
+
+  n_files = argc > 1 ? atoi(argv[1]) : DEFAULT_N_FILES;
+  snprintf(root, sizeof(root), "%s/%s",
+           argc > 2 ? argv[2] : DEFAULT_DIR,
+           TREE_NAME
+  );
+
+  nftw(root, remove_entry, 64, FTW_DEPTH|FTW_PHYS);
+
+  start = bench_now();
+  if (make_tree(root, n_files) != 0 || realpath(root, dir_realpath) == NULL){
+    printf("Could not create %s\n", root);
+    return 1;
+  }
+  printf("Created %d files in %s in %.2f s\n",
+         n_files, dir_realpath, bench_now() - start
+  );
+
+  // the first build also brings the tree in the page cache
+  printf("threads  index build (s)\n");
+  for (n_threads = 1; n_threads <= DIR_INDEX_MAX_THREADS; n_threads *= 2){
+    start = bench_now();
+    dir_index_init(&index, dir_realpath, n_threads);
+    elapsed = bench_now() - start;
+    dir_index_get_stats(&index, &stats);
+    dir_index_free(&index);
+    printf("%7d  %15.3f  (%d files, %d directories)\n",
+           n_threads, elapsed, stats.files, stats.dirs
+    );
+  }
+
+  dir_fd = open_served_dir(dir_realpath);
+  dir_index_init(&index, dir_realpath, DIR_INDEX_MAX_THREADS);
+
+  printf("RRQ lookup (us)  by path     openat2       index\n");
+  for (missing = 0; missing <= 1; missing++){
+    printf("%-15s", missing ? "missing" : "existing");
+    print_latency(run(NULL, -1, dir_realpath, n_files, missing));
+    print_latency(run(NULL, dir_fd, dir_realpath, n_files, missing));
+    print_latency(run(&index, dir_fd, dir_realpath, n_files, missing));
+    printf("\n");
+  }
+
+  dir_index_free(&index);
+  close(dir_fd);
+  nftw(root, remove_entry, 64, FTW_DEPTH|FTW_PHYS);
+  return 0;
+}
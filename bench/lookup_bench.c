@@ -0,0 +1,191 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Latency benchmark of the lookup of requested files.
+ *
+ * Creates a small tree in a temporary directory, with a file at its top and
+ * another one DEEP_LEVELS directories below, and resolves requests for them with
+ * resolve_request_path, as the server does for each RRQ:
+ *  - by path: the real paths of the file and of its parents are compared
+ *    with the one of the served directory (fallback for old kernels);
+ *  - by openat2: the file is opened relative to the descriptor of the
+ *    served directory with RESOLVE_BENEATH.
+ *
+ * Missing files and paths outside of the directory are measured too. Each
+ * successful lookup includes opening the file (and closing it).
+ *
+ * Usage: lookup_bench [iterations] [dir]
+ */
+
+
+#include "../src/include/server_utils.h"
+#include "../src/include/logging.h"
+#include "bench_utils.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Only errors are logged */
+const int LOG_LEVEL = LOG_ERR;
+
+/** Default number of lookups of each request */
+#define DEFAULT_ITERATIONS 100000
+
+/** Default directory of the tree */
+#define DEFAULT_DIR "/tmp"
+
+/** Name of the tree */
+#define TREE_NAME "lookup_bench.d"
+
+/** Depth of the deep file */
+#define DEEP_LEVELS 8
+
+
+/**
+ * A request to be resolved.
+ */
+struct request{
+  char *name;           /**< Name of the case */
+  char filename[PATH_MAX];  /**< Requested file name */
+  int depth;            /**< Number of directories in filename */
+  int expected;         /**< Expected result of resolve_request_path */
+};
+
+
+/**
+ * Creates a file with some content.
+ */
+void make_file(char *path){
+  FILE *f;
+
+  f = fopen(path, "w");
+  if (f != NULL){
+    fputs("default linux\n", f);
+    fclose(f);
+  }
+}
+
+
+/**
+ * Resolves a request many times.
+ *
+ * @return  average latency (us), negative if the result was not the
+ *          expected one
+ */
+double run(int dir_fd, char *dir_realpath, struct request *req,
+           int iterations){
+  char file_realpath[PATH_MAX];
+  double start;
+  int i, ret, fd;
+
+  start = bench_now();
+  for (i = 0; i < iterations; i++){
+    ret = resolve_request_path(dir_fd, dir_realpath, req->filename,
+                               file_realpath, &fd
+    );
+    if (ret != req->expected)
+      return -1;
+    if (fd != -1)
+      close(fd);
+  }
+  return (bench_now() - start) / iterations * 1e6;
+}
+
+
+/** Main */
+int main(int argc, char** argv){
+  struct request requests[4];
+  char root[PATH_MAX], dir_realpath[PATH_MAX], path[PATH_MAX];
+  double by_path, by_openat2;
+  int i, iterations, dir_fd;
+
+  iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+  snprintf(root, sizeof(root), "%s/%s",
+           argc > 2 ? argv[2] : DEFAULT_DIR,
+           TREE_NAME
+  );
+
+  // tree: root/default, root/d/d/.../d/default
+  mkdir(root, 0755);
+  strcpy(path, root);
+  for (i = 0; i < DEEP_LEVELS; i++){
+    strcat(path, "/d");
+    mkdir(path, 0755);
+  }
+  strcat(path, "/default");
+  make_file(path);
+  strcpy(path, root);
+  strcat(path, "/default");
+  make_file(path);
+
+  if (realpath(root, dir_realpath) == NULL){
+    printf("Could not create %s\n", root);
+    return 1;
+  }
+  dir_fd = open_served_dir(dir_realpath);
+  if (dir_fd == -1)
+    return 1;
+
+  requests[0].name = "shallow";
+  strcpy(requests[0].filename, "default");
+  requests[0].depth = 0;
+  requests[0].expected = 0;
+  requests[1].name = "deep";
+  requests[1].filename[0] = '\0';
+  for (i = 0; i < DEEP_LEVELS; i++)
+    strcat(requests[1].filename, "d/");
+  strcat(requests[1].filename, "default");
+  requests[1].depth = DEEP_LEVELS;
+  requests[1].expected = 0;
+  requests[2].name = "deep missing";
+  strcpy(requests[2].filename, requests[1].filename);
+  strcat(requests[2].filename, ".missing");
+  requests[2].depth = DEEP_LEVELS;
+  requests[2].expected = 1;
+  requests[3].name = "outside";
+  strcpy(requests[3].filename, "d/../../default");
+  requests[3].depth = 1;
+  requests[3].expected = 2;
+
+  printf("%d lookups per request, directory: %s\n", iterations, dir_realpath);
+  printf("request          depth   by path (us)  openat2 (us)  speedup\n");
+
+  for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++){
+    by_path = run(-1, dir_realpath, &requests[i], iterations);
+    by_openat2 = run(dir_fd, dir_realpath, &requests[i], iterations);
+
+    printf("%-15s  %5d  ", requests[i].name, requests[i].depth);
+    if (by_path < 0)
+      printf("  unexpected  ");
+    else
+      printf("%12.2f  ", by_path);
+    if (by_openat2 < 0)
+      printf("  unexpected\n");
+    else
+      printf("%12.2f  %6.1fx\n", by_openat2, by_path / by_openat2);
+  }
+
+  // removes the tree
+  close(dir_fd);
+  strcpy(path, root);
+  strcat(path, "/default");
+  unlink(path);
+  strcpy(path, root);
+  for (i = 0; i < DEEP_LEVELS; i++)
+    strcat(path, "/d");
+  strcat(path, "/default");
+  unlink(path);
+  for (i = 0; i < DEEP_LEVELS; i++){
+    *strrchr(path, '/') = '\0';
+    rmdir(path);
+  }
+  rmdir(root);
+
+  return 0;
+}
@@ -0,0 +1,287 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Throughput benchmark of file transfers over a lossy link.
+ *
+ * A file is sent over loopback by tftp_send_file (in a thread) to
+ * tftp_receive_file, while every outgoing datagram (DATA, ACK, OACK and
+ * RRQ) is dropped with a given probability. Loss is simulated by replacing
+ * sendto and sendmsg, so that no root privileges (or netem) are needed.
+ *
+ * For each loss rate and transfer configuration, the benchmark reports the
+ * throughput and how many DATA messages were sent for each block of the
+ * file: values close to 1 + loss show that there are no useless
+ * retransmissions (eg. Sorcerer's Apprentice Syndrome would double them).
+ *
+ * The library should be built with small TFTP_TIMEOUT and TFTP_MIN_RTO,
+ * since loopback round trip times are much shorter than on real networks.
+ *
+ * Usage: loss_bench [file_size_kb]
+ */
+
+
+#define _GNU_SOURCE
+#include "../src/include/tftp.h"
+#include "../src/include/tftp_msgs.h"
+#include "../src/include/fblock.h"
+#include "../src/include/inet_utils.h"
+#include "../src/include/logging.h"
+#include "bench_utils.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Only errors are logged */
+const int LOG_LEVEL = LOG_ERR;
+
+/** Default size of the transferred file (KB) */
+#define DEFAULT_SIZE_KB 1024
+
+/** Path of the received file */
+#define OUT_FILE "/tmp/loss_bench.out"
+
+
+/** Probability of dropping an outgoing datagram */
+double loss_rate;
+
+/** Seed of the loss generator, per thread */
+__thread unsigned int loss_seed = 1;
+
+/** Number of DATA messages sent (dropped ones included) */
+volatile long data_sent;
+
+/** Number of datagrams dropped */
+volatile long dropped;
+
+
+/**
+ * Decides whether the next datagram is lost and counts DATA messages.
+ */
+int lose(const void *buf, size_t len){
+  if (len >= 2 && tftp_msg_type((char*) buf) == TFTP_TYPE_DATA)
+    __sync_fetch_and_add(&data_sent, 1);
+
+  if ((double) rand_r(&loss_seed) / RAND_MAX < loss_rate){
+    __sync_fetch_and_add(&dropped, 1);
+    return 1;
+  }
+  return 0;
+}
+
+/** Replaces libc sendto, dropping datagrams */
+ssize_t sendto(int sd, const void *buf, size_t len, int flags,
+               const struct sockaddr *addr, socklen_t addrlen){
+  if (lose(buf, len))
+    return len;
+  return syscall(SYS_sendto, sd, buf, len, flags, addr, addrlen);
+}
+
+/** Replaces libc sendmsg, dropping datagrams */
+ssize_t sendmsg(int sd, const struct msghdr *mh, int flags){
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < mh->msg_iovlen; i++)
+    len += mh->msg_iov[i].iov_len;
+
+  if (lose(mh->msg_iov[0].iov_base, mh->msg_iov[0].iov_len))
+    return len;
+  return syscall(SYS_sendmsg, sd, mh, flags);
+}
+
+
+/**
+ * Transfer configuration.
+ */
+struct config{
+  int blksize;     /**< Requested block size (0 for default) */
+  int windowsize;  /**< Requested window size (0 for default) */
+};
+
+/**
+ * Arguments of the server thread.
+ */
+struct server_args{
+  int sd;          /**< Listening socket */
+  char *data;      /**< File content */
+  off_t size;      /**< File size */
+  int result;      /**< Result of tftp_send_file */
+};
+
+
+/**
+ * Serves a single RRQ from memory. Retransmitted RRQs are ignored.
+ */
+void* server_main(void *arg){
+  struct server_args *args = (struct server_args*) arg;
+  char in_buffer[TFTP_MAX_REQUEST_LEN];
+  char filename[TFTP_MAX_FILENAME_LEN+1], mode[TFTP_MAX_MODE_LEN+1];
+  struct sockaddr_in cl_addr, my_addr;
+  struct tftp_opts opts;
+  struct fblock m_fblock;
+  unsigned int addrlen;
+  int len, sd, block_size;
+
+  loss_seed = 2;
+
+  addrlen = sizeof(cl_addr);
+  len = recvfrom(args->sd, in_buffer, sizeof(in_buffer), 0,
+                 (struct sockaddr*) &cl_addr, &addrlen
+  );
+  if (len < 0 || tftp_msg_unpack_rrq(in_buffer, len, filename, mode, &opts)){
+    args->result = -1;
+    return NULL;
+  }
+
+  block_size = opts.blksize != 0 ? opts.blksize : TFTP_DATA_BLOCK;
+  m_fblock = fblock_open_mem(args->data, args->size, block_size,
+                             FBLOCK_READ|FBLOCK_MODE_BINARY
+  );
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  my_addr = make_my_sockaddr_in(0);
+  bind_random_port(sd, &my_addr);
+
+  args->result = tftp_send_file(&m_fblock, &opts, sd, &cl_addr, NULL);
+
+  fblock_close(&m_fblock);
+  close(sd);
+  return NULL;
+}
+
+
+/**
+ * Checks that the received file matches the sent one.
+ */
+int check_output(char *data, off_t size){
+  FILE *f;
+  char *buf;
+  int ok;
+
+  buf = malloc(size + 1);
+  f = fopen(OUT_FILE, "rb");
+  ok = f != NULL && fread(buf, 1, size + 1, f) == size &&
+       memcmp(buf, data, size) == 0;
+  if (f != NULL)
+    fclose(f);
+  free(buf);
+  return ok;
+}
+
+
+/**
+ * Transfers the file once and prints the results.
+ */
+void run(struct config *config, char *data, off_t size){
+  struct server_args args;
+  struct sockaddr_in sv_addr, my_addr;
+  struct tftp_opts opts;
+  struct fblock m_fblock;
+  pthread_t server;
+  char request[TFTP_MAX_REQUEST_LEN];
+  int sd, ret, request_len, block_size;
+  long n_blocks;
+  double start, elapsed;
+
+  data_sent = 0;
+  dropped = 0;
+  loss_seed = 1;
+
+  args.sd = socket(AF_INET, SOCK_DGRAM, 0);
+  sv_addr = make_my_sockaddr_in(0);
+  bind_random_port(args.sd, &sv_addr);
+  sv_addr = make_sv_sockaddr_in("127.0.0.1", ntohs(sv_addr.sin_port));
+  args.data = data;
+  args.size = size;
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  my_addr = make_my_sockaddr_in(0);
+  bind_random_port(sd, &my_addr);
+
+  tftp_opts_init(&opts);
+  opts.blksize = config->blksize;
+  opts.windowsize = config->windowsize;
+  request_len = tftp_msg_get_size_rrq("bench", TFTP_STR_OCTET, &opts);
+  tftp_msg_build_rrq("bench", TFTP_STR_OCTET, &opts, request);
+
+  m_fblock = fblock_open(OUT_FILE, TFTP_DATA_BLOCK,
+                         FBLOCK_WRITE|FBLOCK_MODE_BINARY
+  );
+
+  start = bench_now();
+  pthread_create(&server, NULL, server_main, &args);
+  ret = tftp_receive_file(&m_fblock, &opts, request, request_len, sd,
+                          &sv_addr, NULL
+  );
+  pthread_join(server, NULL);
+  elapsed = bench_now() - start;
+
+  fblock_close(&m_fblock);
+  close(sd);
+  close(args.sd);
+
+  block_size = config->blksize != 0 ? config->blksize : TFTP_DATA_BLOCK;
+  n_blocks = size / block_size + 1;
+
+  if (ret != 0 || args.result != 0 || !check_output(data, size)){
+    printf("%5.1f%%  %7d  %6d  FAILED (receiver %d, sender %d)\n",
+           loss_rate * 100, block_size, config->windowsize, ret, args.result
+    );
+    return;
+  }
+
+  printf("%5.1f%%  %7d  %6d  %9.2f  %8.3f  %7ld\n",
+         loss_rate * 100,
+         block_size,
+         config->windowsize,
+         size / elapsed / (1024*1024),
+         (double) data_sent / n_blocks,
+         dropped
+  );
+}
+
+
+/** Main */
+int main(int argc, char** argv){
+  double loss_rates[] = {0, 0.001, 0.01, 0.05};
+  struct config configs[] = {
+    {0, 0},       // RFC 1350
+    {1428, 0},    // large blocks
+    {1428, 8},    // window
+    {1428, 32}    // large window
+  };
+  off_t size;
+  char *data;
+  int i, j;
+
+  size = (argc > 1 ? atol(argv[1]) : DEFAULT_SIZE_KB) * 1024;
+  data = malloc(size);
+  srand(42);
+  for (i = 0; i < size; i++)
+    data[i] = rand();
+
+  printf("File size: %lld KB, initial timeout: %d ms, minimum: %d ms\n",
+         (long long) size / 1024,
+         TFTP_TIMEOUT,
+         TFTP_MIN_RTO
+  );
+  printf("  loss  blksize  window      MB/s  DATA/blk  dropped\n");
+
+  for (i = 0; i < sizeof(loss_rates) / sizeof(loss_rates[0]); i++){
+    loss_rate = loss_rates[i];
+    for (j = 0; j < sizeof(configs) / sizeof(configs[0]); j++)
+      run(&configs[j], data, size);
+  }
+
+  unlink(OUT_FILE);
+  free(data);
+  return 0;
+}
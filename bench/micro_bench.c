@@ -0,0 +1,613 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Microbenchmarks of the per-packet hot paths.
+ *
+ * Measures in isolation, for several input sizes, the cost of:
+ *  - building DATA messages and unpacking RRQ (with and without options) and
+ *    ACK messages (tftp_msgs.c);
+ *  - encoding to and decoding from netascii a block of text (netascii.c,
+ *    with the fastest kernels supported by the CPU);
+ *  - reading a block from a file (fblock_read in binary and text mode, and
+ *    fblock_read_ptr of a mapped file) and writing a block to a file
+ *    (fblock_write in binary and text mode). Files are read from the page
+ *    cache and written to /dev/null, so that only the CPU cost is measured.
+ *
+ * The process is pinned to a CPU. Each benchmark is warmed up, then timed in
+ * a number of samples, each one a batch of operations lasting about
+ * SAMPLE_TIME: the time of an operation is reported as the mean of the
+ * samples with its 95% confidence interval (Student's t), together with the
+ * throughput.
+ *
+ * Results can be saved and later used as a baseline: a benchmark regressed
+ * if it is slower than the threshold (in percent) and the confidence
+ * intervals of the two runs do not overlap. The exit status is 1 if any
+ * benchmark regressed.
+ *
+ * Usage: micro_bench [-r SAMPLES] [-c CPU] [-f FILTER] [-o SAVE_FILE]
+ *                    [-b BASELINE_FILE] [-t THRESHOLD]
+ */
+
+
+#define _GNU_SOURCE
+#include "../src/include/tftp_msgs.h"
+#include "../src/include/netascii.h"
+#include "../src/include/fblock.h"
+#include "../src/include/logging.h"
+#include "bench_utils.h"
+#include <sched.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Only errors are logged */
+const int LOG_LEVEL = LOG_ERR;
+
+/** Default number of samples of each benchmark */
+#define DEFAULT_SAMPLES 20
+
+/** Maximum number of samples of each benchmark */
+#define MAX_SAMPLES 1000
+
+/** Default regression threshold (percent) */
+#define DEFAULT_THRESHOLD 10.0
+
+/** Duration of the warm up of each benchmark (seconds) */
+#define WARMUP_TIME 0.1
+
+/** Duration of each sample (seconds) */
+#define SAMPLE_TIME 0.01
+
+/** Size of the file read by fblock benchmarks */
+#define FILE_SIZE (16 * 1024 * 1024)
+
+/** Length of a line of generated text (LF included) */
+#define LINE_LEN 64
+
+/** Maximum number of benchmarks */
+#define MAX_MICRO 64
+
+/** Maximum length of the name of a benchmark */
+#define MICRO_NAME_LEN 48
+
+
+/**
+ * A benchmark.
+ */
+struct micro{
+  char name[MICRO_NAME_LEN];    /**< Name (operation/variant/size) */
+  void (*op)(struct micro *m);  /**< Operation to be measured */
+  int size;                 /**< Input size (bytes) */
+  long bytes;               /**< Bytes processed by each operation */
+  char *in;                 /**< Input */
+  int in_len;               /**< Length of the input */
+  int in_pos;               /**< Position of the next input (streams) */
+  char *out;                /**< Output buffer */
+  char *path;               /**< File (fblock benchmarks) */
+  char mode;                /**< Mode of the file (fblock benchmarks) */
+  struct fblock m_fblock;   /**< Open file (fblock benchmarks) */
+  double mean;              /**< Mean time of an operation (ns) */
+  double ci;                /**< Half width of the 95% confidence interval */
+};
+
+/**
+ * A result of a previous run.
+ */
+struct baseline{
+  char name[MICRO_NAME_LEN];  /**< Name of the benchmark */
+  double mean;                /**< Mean time of an operation (ns) */
+  double ci;                  /**< Half width of the confidence interval */
+};
+
+
+/** Keeps results of operations alive */
+volatile long sink;
+
+
+/**
+ * Returns the 97.5th percentile of Student's t distribution, for a two-sided
+ * 95% confidence interval.
+ *
+ * @param df  degrees of freedom
+ */
+double t_975(int df){
+  static const double table[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+  };
+
+  if (df < 1)
+    return 0;
+  if (df <= 30)
+    return table[df - 1];
+  return 1.96;
+}
+
+
+/**
+ * Fills buf with lines of text (LINE_LEN bytes each, LF included).
+ */
+void make_text(char *buf, long len){
+  long i;
+
+  for (i = 0; i < len; i++)
+    buf[i] = i % LINE_LEN == LINE_LEN - 1 ? '\n' : 'a' + (i * 7) % 26;
+}
+
+
+/** Builds a DATA message */
+void op_build_data(struct micro *m){
+  tftp_msg_build_data(m->in_pos++ & 0xFFFF, m->in, m->size, m->out);
+  sink += m->out[3];
+}
+
+
+/** Unpacks a RRQ message */
+void op_unpack_rrq(struct micro *m){
+  char filename[TFTP_MAX_FILENAME_LEN+1], mode[TFTP_MAX_MODE_LEN+1];
+  struct tftp_opts opts;
+
+  sink += tftp_msg_unpack_rrq(m->in, m->in_len, filename, mode, &opts);
+}
+
+
+/** Unpacks an ACK message */
+void op_unpack_ack(struct micro *m){
+  int block_n;
+
+  sink += tftp_msg_unpack_ack(m->in, m->in_len, &block_n) + block_n;
+}
+
+
+/** Encodes a block of text to netascii */
+void op_encode(struct micro *m){
+  sink += encode_all(m->in, m->size, m->out);
+}
+
+
+/** Decodes a block of netascii text */
+void op_decode(struct micro *m){
+  sink += decode_all(m->in, m->in_len, m->out);
+}
+
+
+/** Reads a block of a file, starting again at its end */
+void op_fblock_read(struct micro *m){
+  if (fblock_read(&m->m_fblock, m->out) < m->size){
+    fblock_close(&m->m_fblock);
+    m->m_fblock = fblock_open(m->path, m->size, m->mode);
+  }
+  sink += m->out[0];
+}
+
+
+/** Gets a pointer to a block of a mapped file, starting again at its end */
+void op_fblock_read_ptr(struct micro *m){
+  char *data;
+
+  if (fblock_read_ptr(&m->m_fblock, &data) < m->size)
+    fblock_seek(&m->m_fblock, 0);
+  else
+    sink += data[0];
+}
+
+
+/** Writes a block (of a stream of blocks) to /dev/null */
+void op_fblock_write(struct micro *m){
+  sink += fblock_write(&m->m_fblock, m->in + m->in_pos, m->size);
+  m->in_pos += m->size;
+  if (m->in_pos + m->size > m->in_len)
+    m->in_pos = 0;
+}
+
+
+/**
+ * Adds a benchmark to the list, unless its name does not contain filter.
+ *
+ * @return  the benchmark, NULL if it was filtered out
+ */
+struct micro* micro_add(struct micro *list, int *n, char *filter,
+                        void (*op)(struct micro*), char *name, int size){
+  struct micro *m;
+
+  m = &list[*n];
+  memset(m, 0, sizeof(*m));
+  snprintf(m->name, sizeof(m->name), "%s/%d", name, size);
+  if ((filter != NULL && strstr(m->name, filter) == NULL) ||
+      *n == MAX_MICRO)
+    return NULL;
+
+  m->op = op;
+  m->size = size;
+  m->bytes = size;
+  (*n)++;
+  return m;
+}
+
+
+/**
+ * Builds the list of benchmarks, with their inputs.
+ *
+ * @param path    file read by fblock benchmarks
+ * @return        number of benchmarks
+ */
+int micro_setup(struct micro *list, char *filter, char *path){
+  int data_sizes[] = {512, 1428, 8192, 65464};
+  int text_sizes[] = {512, 8192, 65536};
+  char *names[] = {"fblock_read/octet", "fblock_read/netascii",
+                   "fblock_read_ptr/mmap"};
+  char modes[] = {FBLOCK_READ|FBLOCK_MODE_BINARY, FBLOCK_READ|FBLOCK_MODE_TEXT,
+                  FBLOCK_READ|FBLOCK_MODE_BINARY|FBLOCK_MMAP};
+  struct tftp_opts opts;
+  struct micro *m;
+  int i, j, n = 0;
+  char *text;
+
+  for (i = 0; i < sizeof(data_sizes) / sizeof(int); i++){
+    m = micro_add(list, &n, filter, op_build_data, "msg_build_data",
+                  data_sizes[i]
+    );
+    if (m != NULL){
+      m->in = malloc(m->size);
+      make_text(m->in, m->size);
+      m->out = malloc(tftp_msg_get_size_data(m->size));
+    }
+  }
+
+  tftp_opts_init(&opts);
+  for (i = 0; i < 2; i++){
+    m = micro_add(list, &n, filter, op_unpack_rrq,
+                  i == 0 ? "msg_unpack_rrq/plain" : "msg_unpack_rrq/options",
+                  0
+    );
+    if (m == NULL)
+      continue;
+    if (i == 1){
+      opts.blksize = 1428;
+      opts.windowsize = 16;
+      opts.timeout = 1;
+      opts.tsize = 0;
+    }
+    m->in_len = tftp_msg_get_size_rrq("pxelinux.cfg/01-52-54-00-12-34-56",
+                                      TFTP_STR_OCTET, &opts
+    );
+    m->in = malloc(m->in_len);
+    tftp_msg_build_rrq("pxelinux.cfg/01-52-54-00-12-34-56", TFTP_STR_OCTET,
+                       &opts, m->in
+    );
+    m->bytes = m->in_len;
+    snprintf(m->name, sizeof(m->name), "%s/%d",
+             i == 0 ? "msg_unpack_rrq/plain" : "msg_unpack_rrq/options",
+             m->in_len
+    );
+  }
+
+  m = micro_add(list, &n, filter, op_unpack_ack, "msg_unpack_ack",
+                tftp_msg_get_size_ack()
+  );
+  if (m != NULL){
+    m->in_len = tftp_msg_get_size_ack();
+    m->in = malloc(m->in_len);
+    tftp_msg_build_ack(1234, m->in);
+  }
+
+  for (i = 0; i < sizeof(text_sizes) / sizeof(int); i++){
+    m = micro_add(list, &n, filter, op_encode, "netascii_encode",
+                  text_sizes[i]
+    );
+    if (m != NULL){
+      m->in = malloc(m->size);
+      make_text(m->in, m->size);
+      m->out = malloc(2 * m->size);
+    }
+
+    m = micro_add(list, &n, filter, op_decode, "netascii_decode",
+                  text_sizes[i]
+    );
+    if (m != NULL){
+      text = malloc(text_sizes[i]);
+      make_text(text, text_sizes[i]);
+      m->in = malloc(2 * text_sizes[i]);
+      m->in_len = encode_all(text, text_sizes[i], m->in);
+      m->out = malloc(text_sizes[i]);
+      free(text);
+    }
+  }
+
+  for (i = 0; i < sizeof(data_sizes) / sizeof(int); i++){
+    for (j = 0; j < 3; j++){
+      m = micro_add(list, &n, filter,
+                    j == 2 ? op_fblock_read_ptr : op_fblock_read, names[j],
+                    data_sizes[i]
+      );
+      if (m == NULL)
+        continue;
+      m->path = path;
+      m->mode = modes[j];
+      m->out = malloc(m->size);
+      m->m_fblock = fblock_open(path, m->size, m->mode);
+    }
+
+    for (j = 0; j < 2; j++){
+      m = micro_add(list, &n, filter, op_fblock_write,
+                    j == 0 ? "fblock_write/octet" : "fblock_write/netascii",
+                    data_sizes[i]
+      );
+      if (m == NULL)
+        continue;
+
+      // netascii lines are LINE_LEN + 1 bytes long: the stream starts again
+      // at the beginning of a line
+      m->in_len = (LINE_LEN + 1) * m->size;
+      text = malloc(m->in_len);
+      make_text(text, LINE_LEN * m->size);
+      m->in = malloc(m->in_len);
+      encode_all(text, LINE_LEN * m->size, m->in);
+      free(text);
+      if (j == 0)
+        make_text(m->in, m->in_len);
+      m->m_fblock = fblock_open("/dev/null", m->size, FBLOCK_WRITE |
+                                (j == 0 ? FBLOCK_MODE_BINARY :
+                                          FBLOCK_MODE_TEXT)
+      );
+    }
+  }
+
+  return n;
+}
+
+
+/**
+ * Releases the inputs of a benchmark.
+ */
+void micro_free(struct micro *m){
+  free(m->in);
+  free(m->out);
+  if (m->m_fblock.file != NULL)
+    fblock_close(&m->m_fblock);
+}
+
+
+/**
+ * Measures a benchmark.
+ *
+ * @param samples  number of samples
+ */
+void micro_run(struct micro *m, int samples){
+  double start, elapsed, times[MAX_SAMPLES], sum, var;
+  long batch, i;
+  int s;
+
+  // warm up (caches, branch predictors, frequency) and size the batches
+  batch = 0;
+  start = bench_now();
+  do{
+    m->op(m);
+    batch++;
+  } while ((elapsed = bench_now() - start) < WARMUP_TIME);
+  batch = batch * SAMPLE_TIME / elapsed;
+  if (batch < 1)
+    batch = 1;
+
+  sum = 0;
+  for (s = 0; s < samples; s++){
+    start = bench_now();
+    for (i = 0; i < batch; i++)
+      m->op(m);
+    times[s] = (bench_now() - start) * 1e9 / batch;
+    sum += times[s];
+  }
+
+  m->mean = sum / samples;
+  var = 0;
+  for (s = 0; s < samples; s++)
+    var += (times[s] - m->mean) * (times[s] - m->mean);
+  var = samples > 1 ? var / (samples - 1) : 0;
+  m->ci = t_975(samples - 1) * sqrt(var / samples);
+}
+
+
+/**
+ * Loads the results of a previous run.
+ *
+ * @return  number of results, -1 if the file could not be read
+ */
+int load_baseline(char *path, struct baseline *list){
+  char line[256];
+  FILE *in;
+  int n = 0;
+
+  in = fopen(path, "r");
+  if (in == NULL)
+    return -1;
+  while (n < MAX_MICRO && fgets(line, sizeof(line), in) != NULL){
+    if (line[0] != '#' &&
+        sscanf(line, "%47s %lf %lf", list[n].name, &list[n].mean,
+               &list[n].ci) == 3)
+      n++;
+  }
+  fclose(in);
+  return n;
+}
+
+
+/**
+ * Compares a result with its baseline (if any).
+ *
+ * @param verdict  comparison, printable [out]
+ * @return         1 if the benchmark regressed, 0 otherwise
+ */
+int compare(struct micro *m, struct baseline *list, int n, double threshold,
+            char *verdict){
+  double delta;
+  int i;
+
+  verdict[0] = '\0';
+  for (i = 0; i < n && strcmp(list[i].name, m->name) != 0; i++)
+    ;
+  if (i == n)
+    return 0;
+
+  delta = (m->mean - list[i].mean) / list[i].mean * 100;
+  if (delta > threshold && m->mean - m->ci > list[i].mean + list[i].ci){
+    sprintf(verdict, "%+6.1f%% REGRESSION", delta);
+    return 1;
+  } else if (delta < -threshold &&
+             m->mean + m->ci < list[i].mean - list[i].ci)
+    sprintf(verdict, "%+6.1f%% improved", delta);
+  else
+    sprintf(verdict, "%+6.1f%%", delta);
+  return 0;
+}
+
+
+/**
+ * Prints command usage information.
+ */
+void print_help(char *name){
+  printf("Usage: %s [-r SAMPLES] [-c CPU] [-f FILTER] [-o SAVE_FILE] "
+         "[-b BASELINE_FILE]\n"
+         "       [-t THRESHOLD]\n", name
+  );
+  printf("Options:\n");
+  printf("  -r SAMPLES        samples of each benchmark (default %d)\n",
+         DEFAULT_SAMPLES
+  );
+  printf("  -c CPU            pin to CPU (default: the current one)\n");
+  printf("  -f FILTER         only run benchmarks whose name contains "
+         "FILTER\n");
+  printf("  -o SAVE_FILE      save results to SAVE_FILE\n");
+  printf("  -b BASELINE_FILE  compare results with BASELINE_FILE\n");
+  printf("  -t THRESHOLD      slowdown (percent) which is a regression "
+         "(default %.0f)\n", DEFAULT_THRESHOLD
+  );
+}
+
+
+/** Main */
+int main(int argc, char** argv){
+  char path[] = "/tmp/micro_bench.XXXXXX", verdict[64], *text;
+  char *filter, *save_path, *baseline_path;
+  struct baseline baseline[MAX_MICRO];
+  struct micro list[MAX_MICRO];
+  double threshold;
+  int opt, samples, cpu, fd, i, n, n_baseline, regressions;
+  cpu_set_t set;
+  FILE *out;
+
+  samples = DEFAULT_SAMPLES;
+  cpu = -1;
+  filter = NULL;
+  save_path = NULL;
+  baseline_path = NULL;
+  threshold = DEFAULT_THRESHOLD;
+
+  while ((opt = getopt(argc, argv, "r:c:f:o:b:t:")) != -1){
+    switch (opt){
+      case 'r':
+        samples = atoi(optarg);
+        if (samples < 2 || samples > MAX_SAMPLES){
+          printf("SAMPLES must be within 2 and %d\n", MAX_SAMPLES);
+          return 1;
+        }
+        break;
+      case 'c':
+        cpu = atoi(optarg);
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      case 'o':
+        save_path = optarg;
+        break;
+      case 'b':
+        baseline_path = optarg;
+        break;
+      case 't':
+        threshold = atof(optarg);
+        break;
+      default:
+        print_help(argv[0]);
+        return 1;
+    }
+  }
+
+  // the baseline may be the same file results are saved to
+  n_baseline = 0;
+  if (baseline_path != NULL){
+    n_baseline = load_baseline(baseline_path, baseline);
+    if (n_baseline < 0){
+      printf("Could not read baseline %s\n", baseline_path);
+      return 1;
+    }
+  }
+
+  if (cpu < 0)
+    cpu = sched_getcpu();
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0){
+    printf("Could not pin to CPU %d\n", cpu);
+    return 1;
+  }
+
+  // file read by fblock benchmarks (from the page cache)
+  fd = mkstemp(path);
+  text = malloc(FILE_SIZE);
+  make_text(text, FILE_SIZE);
+  if (fd == -1 || write(fd, text, FILE_SIZE) != FILE_SIZE){
+    printf("Could not write %s\n", path);
+    return 1;
+  }
+  close(fd);
+  free(text);
+
+  n = micro_setup(list, filter, path);
+  printf("%d benchmarks on CPU %d, %d samples of %.0f ms each\n",
+         n, cpu, samples, SAMPLE_TIME * 1000
+  );
+  printf("%-32s %12s %10s %11s %s\n",
+         "benchmark", "ns/op", "+/- 95%", "MB/s",
+         n_baseline > 0 ? "vs baseline" : ""
+  );
+
+  regressions = 0;
+  for (i = 0; i < n; i++){
+    micro_run(&list[i], samples);
+    regressions += compare(&list[i], baseline, n_baseline, threshold,
+                           verdict
+    );
+    printf("%-32s %12.1f %10.1f %11.1f %s\n",
+           list[i].name, list[i].mean, list[i].ci,
+           list[i].bytes / list[i].mean * 1e3, verdict
+    );
+    fflush(stdout);
+  }
+
+  if (save_path != NULL){
+    out = fopen(save_path, "w");
+    if (out == NULL)
+      printf("Could not write %s\n", save_path);
+    else{
+      fprintf(out, "# benchmark ns/op +/-95%%\n");
+      for (i = 0; i < n; i++)
+        fprintf(out, "%s %.3f %.3f\n", list[i].name, list[i].mean,
+                list[i].ci
+        );
+      fclose(out);
+    }
+  }
+
+  if (n_baseline > 0)
+    printf("%d regressions beyond %.1f%%\n", regressions, threshold);
+
+  for (i = 0; i < n; i++)
+    micro_free(&list[i]);
+  unlink(path);
+  return regressions > 0;
+}
@@ -0,0 +1,219 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ * 
+ * @brief Microbenchmark of netascii conversion kernels.
+ * 
+ * Measures the throughput (GB/s of Unix bytes) of the streaming netascii 
+ * encoder and decoder for every implementation supported by the CPU, both 
+ * on the files in the given directory (test/ by default) and on synthetic 
+ * inputs.
+ * 
+ * Usage: netascii_bench [corpus_dir]
+ */
+
+
+#include "../src/include/netascii.h"
+#include "../src/include/logging.h"
+#include "bench_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+/** Only errors are logged */
+const int LOG_LEVEL = LOG_ERR;
+
+/** Size of each synthetic input */
+#define SYNTH_LEN (16*1024*1024)
+
+/** Minimum duration of each measurement (seconds) */
+#define MIN_TIME 0.5
+
+
+/**
+ * Input to be converted.
+ */
+struct input{
+  char *name;     /**< Name of the input */
+  char *text;     /**< Unix bytes */
+  long unix_len;  /**< Number of Unix bytes */
+  char *net;      /**< Netascii conversion of text */
+  long net_len;   /**< Number of netascii bytes */
+  char *dec;      /**< Unix conversion of net (CRNUL in text becomes CR) */
+  long dec_len;   /**< Number of bytes in dec */
+};
+
+
+/**
+ * Fills buf with synthetic Unix text of the given kind.
+ * 
+ * @param kind  "text" (lines of 0 to 120 printable chars), "plain" (no CR 
+ *              nor LF) or "dense" (random CR, LF, NUL and letters)
+ */
+void make_synthetic(char *kind, char *buf, long len){
+  long i, line;
+
+  srand(42);
+  line = rand() % 121;
+  for (i = 0; i < len; i++){
+    if (strcmp(kind, "dense") == 0){
+      buf[i] = "\r\n\0a"[rand() % 4];
+    } else if (strcmp(kind, "text") == 0 && line-- == 0){
+      buf[i] = '\n';
+      line = rand() % 121;
+    } else{
+      buf[i] = ' ' + rand() % 95;
+    }
+  }
+}
+
+
+/**
+ * Reads all regular files in dir and concatenates them.
+ * 
+ * @return number of bytes read
+ */
+long load_corpus(char *dir, char **buf){
+  DIR *d;
+  struct dirent *entry;
+  struct stat st;
+  char path[1024];
+  FILE *f;
+  long len;
+
+  *buf = NULL;
+  len = 0;
+
+  d = opendir(dir);
+  if (d == NULL)
+    return 0;
+
+  while ((entry = readdir(d)) != NULL){
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+      continue;
+
+    *buf = realloc(*buf, len + st.st_size);
+    len += fread(*buf + len, sizeof(char), st.st_size, f);
+    fclose(f);
+  }
+
+  closedir(d);
+  return len;
+}
+
+
+/**
+ * Prepares the expected outputs for an input (using the scalar kernels).
+ */
+void prepare_input(struct input *in, char *name, char *buf, long len){
+  in->name = name;
+  in->text = buf;
+  in->unix_len = len;
+  in->net = malloc(2 * len + 1);
+  netascii_select_impl(NETASCII_IMPL_SCALAR);
+  in->net_len = encode_all(in->text, in->unix_len, in->net);
+  in->dec = malloc(in->net_len + 1);
+  in->dec_len = decode_all(in->net, in->net_len, in->dec);
+}
+
+
+/**
+ * Measures the current implementation on an input and checks its output 
+ * against the expected one.
+ * 
+ * @return 0 if output is correct, 1 otherwise
+ */
+int bench_input(struct input *in, char *impl_name){
+  char *out;
+  double start, elapsed;
+  long iters, len;
+  double enc_gbps, dec_gbps;
+  int result = 0;
+
+  out = malloc(2 * in->unix_len + 1);
+
+  // encoder
+  iters = 0;
+  start = bench_now();
+  do{
+    len = encode_all(in->text, in->unix_len, out);
+    iters++;
+    elapsed = bench_now() - start;
+  } while (elapsed < MIN_TIME);
+  enc_gbps = in->unix_len * iters / elapsed / 1e9;
+  if (len != in->net_len || memcmp(out, in->net, len) != 0)
+    result = 1;
+
+  // decoder
+  iters = 0;
+  start = bench_now();
+  do{
+    len = decode_all(in->net, in->net_len, out);
+    iters++;
+    elapsed = bench_now() - start;
+  } while (elapsed < MIN_TIME);
+  dec_gbps = in->unix_len * iters / elapsed / 1e9;
+  if (len != in->dec_len || memcmp(out, in->dec, len) != 0)
+    result = 1;
+
+  printf("%-8s %-8s %12ld %10.3f %10.3f %s\n", 
+         in->name, 
+         impl_name, 
+         in->unix_len, 
+         enc_gbps, 
+         dec_gbps, 
+         result == 0 ? "ok" : "MISMATCH"
+  );
+
+  free(out);
+  return result;
+}
+
+
+int main(int argc, char** argv){
+  struct input inputs[4];
+  char *impl_names[] = {"scalar", "sse2", "avx2"};
+  char *kinds[] = {"text", "plain", "dense"};
+  char *buf;
+  int n_inputs, i, impl, result;
+  long len;
+
+  n_inputs = 0;
+
+  len = load_corpus(argc > 1 ? argv[1] : "test", &buf);
+  if (len > 0)
+    prepare_input(&inputs[n_inputs++], "corpus", buf, len);
+  else
+    printf("Corpus is empty, skipping it\n");
+
+  for (i = 0; i < 3; i++){
+    buf = malloc(SYNTH_LEN);
+    make_synthetic(kinds[i], buf, SYNTH_LEN);
+    prepare_input(&inputs[n_inputs++], kinds[i], buf, SYNTH_LEN);
+  }
+
+  printf("%-8s %-8s %12s %10s %10s\n", 
+         "input", "impl", "bytes", "enc GB/s", "dec GB/s"
+  );
+
+  result = 0;
+  for (i = 0; i < n_inputs; i++){
+    for (impl = NETASCII_IMPL_SCALAR; impl <= NETASCII_IMPL_AVX2; impl++){
+      if (netascii_select_impl(impl) != 0){
+        printf("%-8s %-8s not supported\n", inputs[i].name, impl_names[impl]);
+        continue;
+      }
+      result |= bench_input(&inputs[i], impl_names[impl]);
+    }
+  }
+
+  return result;
+}
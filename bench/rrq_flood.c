@@ -0,0 +1,176 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Flood of invalid read requests against a running TFTP server.
+ *
+ * Sends a given number of junk RRQs, cycling among malformed requests,
+ * unknown modes, paths outside of the served directory and missing files,
+ * one at a time. Each one is expected to be answered with an ERROR.
+ *
+ * Missing files are the configuration files probed by a pool of PXE clients
+ * booting again and again (pxelinux looks for its MAC address and then for
+ * shorter and shorter prefixes of its IP address in hex, before falling back
+ * to "default"), so that the same names are requested many times, as seen
+ * by the server negative cache.
+ *
+ * The benchmark reports the number of replies for each error code and the
+ * reply latency. How many processes the server spawned is logged by the
+ * server itself when it is stopped (fork model).
+ *
+ * Usage: rrq_flood SERVER_IP SERVER_PORT [n_requests]
+ */
+
+
+#include "../src/include/tftp_msgs.h"
+#include "../src/include/inet_utils.h"
+#include "../src/include/logging.h"
+#include "bench_utils.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Only errors are logged */
+const int LOG_LEVEL = LOG_ERR;
+
+/** Default number of requests */
+#define DEFAULT_N_REQUESTS 10000
+
+/** How long to wait for each reply (ms) */
+#define REPLY_TIMEOUT 1000
+
+/** Number of simulated PXE clients */
+#define N_PXE_CLIENTS 64
+
+/** Number of files probed by each PXE client (MAC, 8 IP prefixes) */
+#define N_PXE_PROBES 9
+
+/** Number of kinds of junk requests */
+#define N_KINDS 4
+
+/** Names of the kinds of junk requests */
+char *kind_names[N_KINDS] = {
+  "malformed", "bad mode", "outside dir", "not found"
+};
+
+
+/**
+ * Builds the i-th junk request.
+ *
+ * @return  length of the request
+ */
+int build_junk(int i, char *buffer){
+  char filename[TFTP_MAX_FILENAME_LEN], hex_ip[9];
+  int client, probe;
+
+  switch (i % N_KINDS){
+    case 0:  // no terminators
+      memcpy(buffer, "\0\1junk", 6);
+      return 6;
+    case 1:
+      tftp_msg_build_rrq("0.txt", "mail", NULL, buffer);
+      return tftp_msg_get_size_rrq("0.txt", "mail", NULL);
+    case 2:
+      tftp_msg_build_rrq("../../../etc/passwd", TFTP_STR_OCTET, NULL, buffer);
+      return tftp_msg_get_size_rrq("../../../etc/passwd", TFTP_STR_OCTET,
+                                   NULL
+      );
+    default:  // pxelinux config names
+      probe = (i / N_KINDS) % N_PXE_PROBES;
+      client = (i / N_KINDS / N_PXE_PROBES) % N_PXE_CLIENTS;
+      if (probe == 0)
+        sprintf(filename, "pxelinux.cfg/01-52-54-00-12-34-%02x", client);
+      else{  // 192.168.0.(100+client), one less hex digit at each probe
+        sprintf(hex_ip, "%08X", 0xC0A80064 + client);
+        sprintf(filename, "pxelinux.cfg/%.*s", 9 - probe, hex_ip);
+      }
+      tftp_msg_build_rrq(filename, TFTP_STR_OCTET, NULL, buffer);
+      return tftp_msg_get_size_rrq(filename, TFTP_STR_OCTET, NULL);
+  }
+}
+
+
+/** Main */
+int main(int argc, char** argv){
+  char out_buffer[TFTP_MAX_REQUEST_LEN], in_buffer[TFTP_MAX_REQUEST_LEN];
+  char error_msg[TFTP_MAX_ERROR_LEN+1];
+  long replies[8], lost, kind_replies[N_KINDS];
+  struct sockaddr_in sv_addr, my_addr;
+  struct pollfd pfd;
+  double start, sent, elapsed, latency, max_latency;
+  int i, n, sd, len, error_code;
+
+  if (argc < 3){
+    printf("Usage: %s SERVER_IP SERVER_PORT [n_requests]\n", argv[0]);
+    return 1;
+  }
+
+  sv_addr = make_sv_sockaddr_in(argv[1], atoi(argv[2]));
+  n = argc > 3 ? atoi(argv[3]) : DEFAULT_N_REQUESTS;
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  my_addr = make_my_sockaddr_in(0);
+  bind_random_port(sd, &my_addr);
+
+  memset(replies, 0, sizeof(replies));
+  memset(kind_replies, 0, sizeof(kind_replies));
+  lost = 0;
+  latency = 0;
+  max_latency = 0;
+
+  pfd.fd = sd;
+  pfd.events = POLLIN;
+
+  start = bench_now();
+  for (i = 0; i < n; i++){
+    len = build_junk(i, out_buffer);
+    sent = bench_now();
+    sendto(sd, out_buffer, len, 0, (struct sockaddr*) &sv_addr,
+           sizeof(sv_addr)
+    );
+
+    if (poll(&pfd, 1, REPLY_TIMEOUT) != 1){
+      lost++;
+      continue;
+    }
+
+    len = recv(sd, in_buffer, sizeof(in_buffer), 0);
+    elapsed = bench_now() - sent;
+    latency += elapsed;
+    if (elapsed > max_latency)
+      max_latency = elapsed;
+
+    if (len >= 4 && tftp_msg_type(in_buffer) == TFTP_TYPE_ERROR &&
+        tftp_msg_unpack_error(in_buffer, len, &error_code, error_msg) == 0 &&
+        error_code >= 0 && error_code < 8){
+      replies[error_code]++;
+      kind_replies[i % N_KINDS]++;
+    } else
+      lost++;
+  }
+  elapsed = bench_now() - start;
+
+  printf("%d junk requests in %.2f s (%.0f requests/s)\n",
+         n, elapsed, n / elapsed
+  );
+  for (i = 0; i < N_KINDS; i++)
+    printf("  %-12s %ld ERRORs\n", kind_names[i], kind_replies[i]);
+  for (i = 0; i < 8; i++)
+    if (replies[i] != 0)
+      printf("  error %d:    %ld\n", i, replies[i]);
+  printf("  no reply:    %ld\n", lost);
+  if (n > lost)
+    printf("Reply latency: avg %.1f us, max %.1f us\n",
+           latency / (n - lost) * 1e6,
+           max_latency * 1e6
+    );
+
+  close(sd);
+  return 0;
+}
@@ -0,0 +1,826 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Load generator for the TFTP server.
+ *
+ * Starts the server (given binary and flags) on a temporary directory of
+ * generated text files, one for each configured size, and downloads them
+ * with many concurrent clients. All clients are driven by a single epoll
+ * event loop, each one with its own socket and tftp_receiver (data is
+ * written to /dev/null), so that thousands of them cost no threads. Each
+ * client downloads files one after another, cycling among the configured
+ * sizes and modes, and waits for a think time between two transfers.
+ *
+ * The benchmark reports aggregate throughput, transfers per second,
+ * percentiles of the transfer latency (from the first RRQ sent to the last
+ * block) and of the time to the first reply (OACK or DATA), and what the
+ * server used:
+ *  - CPU time of the server process (all of its threads, but not its forked
+ *    children, which are reaped by the server itself);
+ *  - CPU time of the whole machine minus the load generator, which also
+ *    includes forked children and kernel network processing (the machine is
+ *    assumed to be otherwise idle);
+ *  - peak resident memory of the server and its children, sampled every
+ *    RSS_SAMPLE_INTERVAL ms (pages shared by forked children are counted
+ *    once for each of them).
+ *
+ * Results can also be written as a JSON object, for regression tracking.
+ *
+ * Usage: tftp_bench [options] SERVER_BINARY
+ */
+
+
+#define _GNU_SOURCE
+#include "../src/include/tftp.h"
+#include "../src/include/tftp_msgs.h"
+#include "../src/include/fblock.h"
+#include "../src/include/inet_utils.h"
+#include "../src/include/histogram.h"
+#include "../src/include/logging.h"
+#include "bench_utils.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+/** Only errors are logged */
+const int LOG_LEVEL = LOG_ERR;
+
+/** Default number of concurrent clients */
+#define DEFAULT_CLIENTS 100
+
+/** Default number of transfers */
+#define DEFAULT_TRANSFERS 1000
+
+/** Default file sizes */
+#define DEFAULT_SIZES "512,64k"
+
+/** Default server port */
+#define DEFAULT_PORT 9999
+
+/** Maximum number of file sizes */
+#define MAX_FILES 16
+
+/** Maximum number of server flags */
+#define MAX_SERVER_ARGS 32
+
+/** Events handled at each epoll_wait */
+#define MAX_EVENTS 256
+
+/** How often resident memory of the server is sampled (ms) */
+#define RSS_SAMPLE_INTERVAL 100
+
+/** How long to wait for the server to start (ms) */
+#define SERVER_START_TIMEOUT 5000
+
+/** Client is waiting for its next transfer */
+#define CLIENT_IDLE 0
+
+/** Client is downloading a file */
+#define CLIENT_BUSY 1
+
+
+/**
+ * A generated file.
+ */
+struct bench_file{
+  char name[32];          /**< Name in the served directory */
+  long long size;         /**< Size in bytes */
+  long long text_size;    /**< Size in netascii (LF become CR LF) */
+};
+
+/**
+ * A simulated client.
+ */
+struct client{
+  int sd;                   /**< Socket of the transfer (-1 if idle) */
+  int state;                /**< CLIENT_IDLE or CLIENT_BUSY */
+  struct fblock m_fblock;   /**< Output (/dev/null) */
+  struct tftp_receiver receiver;  /**< State of the download */
+  long long expected;       /**< Expected bytes of the download */
+  long long start;          /**< When the RRQ was sent (us) */
+  long long next_start;     /**< When the next download starts (ms) */
+};
+
+/**
+ * Configuration and results of a run.
+ */
+struct bench{
+  int n_clients;            /**< Concurrent clients */
+  int n_transfers;          /**< Transfers to make */
+  struct bench_file files[MAX_FILES];  /**< Generated files */
+  int n_files;              /**< Number of generated files */
+  char *sizes;              /**< File sizes, as given */
+  char *modes;              /**< octet, netascii or both */
+  struct tftp_opts opts;    /**< Requested options */
+  int think;                /**< Think time between two transfers (ms) */
+  char *server_flags;       /**< Flags of the server */
+  struct sockaddr_in sv_addr;  /**< Address of the server */
+  int epfd;                 /**< Epoll instance of the client sockets */
+  int issued;               /**< Transfers started */
+  int completed;            /**< Transfers completed */
+  int failed;               /**< Transfers failed (or with a wrong size) */
+  long long bytes;          /**< Bytes received by completed transfers */
+  struct histogram latency;      /**< Transfer latencies (us) */
+  struct histogram first_reply;  /**< Times to the first reply (us) */
+  long long next_scan;      /**< Earliest deadline or start (ms) */
+};
+
+
+/**
+ * Parses a size with an optional k or m suffix.
+ *
+ * @return  size in bytes, -1 if invalid
+ */
+long long parse_size(char *str){
+  char *end;
+  long long size;
+
+  size = strtoll(str, &end, 10);
+  if (*end == 'k' || *end == 'K')
+    size *= 1024, end++;
+  else if (*end == 'm' || *end == 'M')
+    size *= 1024 * 1024, end++;
+  return end == str || *end != '\0' || size < 0 ? -1 : size;
+}
+
+
+/**
+ * Creates a text file of the given size (lines of 64 characters).
+ *
+ * @return  0 in case of success, 1 otherwise
+ */
+int make_file(char *dir, struct bench_file *file){
+  char path[PATH_MAX], line[64];
+  long long i, len;
+  FILE *out;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+  out = fopen(path, "w");
+  if (out == NULL)
+    return 1;
+
+  for (i = 0; i < sizeof(line) - 1; i++)
+    line[i] = 'a' + (i * 7) % 26;
+  line[sizeof(line) - 1] = '\n';
+
+  file->text_size = file->size;
+  for (i = 0; i < file->size; i += len){
+    len = file->size - i < sizeof(line) ? file->size - i : sizeof(line);
+    fwrite(line, 1, len, out);
+    if (len == sizeof(line))
+      file->text_size++;
+  }
+
+  return fclose(out) != 0;
+}
+
+
+/**
+ * Generates the files of the configured sizes.
+ *
+ * @return  0 in case of success, 1 otherwise
+ */
+int make_files(struct bench *b, char *dir){
+  char *sizes, *token, *saveptr;
+  long long size;
+
+  sizes = strdup(b->sizes);
+  b->n_files = 0;
+  for (token = strtok_r(sizes, ",", &saveptr); token != NULL;
+       token = strtok_r(NULL, ",", &saveptr)){
+    size = parse_size(token);
+    if (size < 0 || b->n_files == MAX_FILES){
+      printf("Invalid size %s (at most %d sizes)\n", token, MAX_FILES);
+      free(sizes);
+      return 1;
+    }
+    b->files[b->n_files].size = size;
+    snprintf(b->files[b->n_files].name, sizeof(b->files[0].name),
+             "bench_%lld.txt", size
+    );
+    if (make_file(dir, &b->files[b->n_files]) != 0){
+      printf("Could not create %s\n", b->files[b->n_files].name);
+      free(sizes);
+      return 1;
+    }
+    b->n_files++;
+  }
+
+  free(sizes);
+  return b->n_files == 0;
+}
+
+
+/**
+ * Removes the generated files and their directory.
+ */
+void remove_files(struct bench *b, char *dir){
+  char path[PATH_MAX];
+  int i;
+
+  for (i = 0; i < b->n_files; i++){
+    snprintf(path, sizeof(path), "%s/%s", dir, b->files[i].name);
+    unlink(path);
+  }
+  rmdir(dir);
+}
+
+
+/**
+ * Starts the server in another process (its output is discarded).
+ *
+ * @return  pid of the server, -1 in case of error
+ */
+pid_t start_server(char *binary, char *flags, int port, char *dir){
+  char *argv[MAX_SERVER_ARGS + 4], *copy, *saveptr, port_str[8];
+  pid_t pid;
+  int argc, fd;
+
+  copy = strdup(flags);
+  argc = 0;
+  argv[argc++] = binary;
+  for (argv[argc] = strtok_r(copy, " ", &saveptr);
+       argv[argc] != NULL && argc <= MAX_SERVER_ARGS;
+       argv[argc] = strtok_r(NULL, " ", &saveptr))
+    argc++;
+  sprintf(port_str, "%d", port);
+  argv[argc++] = port_str;
+  argv[argc++] = dir;
+  argv[argc] = NULL;
+
+  pid = fork();
+  if (pid == 0){
+    fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    execv(binary, argv);
+    _exit(127);
+  }
+
+  free(copy);
+  return pid;
+}
+
+
+/**
+ * Waits until the server answers a request for a missing file.
+ *
+ * @return  0 if it answered, 1 otherwise
+ */
+int wait_server(struct sockaddr_in *sv_addr, pid_t pid){
+  char request[TFTP_MAX_REQUEST_LEN], reply[TFTP_MAX_REQUEST_LEN];
+  struct pollfd pfd;
+  double deadline;
+  int sd, len, ret;
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  len = tftp_msg_get_size_rrq("tftp_bench_probe", TFTP_STR_OCTET, NULL);
+  tftp_msg_build_rrq("tftp_bench_probe", TFTP_STR_OCTET, NULL, request);
+  pfd.fd = sd;
+  pfd.events = POLLIN;
+
+  ret = 1;
+  deadline = bench_now() + SERVER_START_TIMEOUT / 1000.0;
+  while (ret != 0 && bench_now() < deadline && waitpid(pid, NULL, WNOHANG) == 0){
+    sendto(sd, request, len, 0, (struct sockaddr*) sv_addr,
+           sizeof(*sv_addr)
+    );
+    if (poll(&pfd, 1, 50) == 1 &&
+        recv(sd, reply, sizeof(reply), 0) >= 4 &&
+        tftp_msg_type(reply) == TFTP_TYPE_ERROR)
+      ret = 0;
+  }
+
+  close(sd);
+  return ret;
+}
+
+
+/**
+ * Returns the busy CPU time of the whole machine (s).
+ */
+double host_cpu(){
+  unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+  FILE *stat;
+  int n;
+
+  stat = fopen("/proc/stat", "r");
+  if (stat == NULL)
+    return 0;
+  n = fscanf(stat, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+             &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal
+  );
+  fclose(stat);
+  if (n != 8)
+    return 0;
+
+  return (double) (user + nice + system + irq + softirq + steal) /
+         sysconf(_SC_CLK_TCK);
+}
+
+
+/**
+ * Returns the CPU time used by this process (s).
+ */
+double self_cpu(){
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+
+/**
+ * Returns the CPU time used by a process and its threads (s).
+ */
+double process_cpu(pid_t pid){
+  char path[64], buffer[1024], *fields;
+  unsigned long utime, stime;
+  FILE *stat;
+  int len;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  stat = fopen(path, "r");
+  if (stat == NULL)
+    return 0;
+  len = fread(buffer, 1, sizeof(buffer) - 1, stat);
+  fclose(stat);
+  buffer[len > 0 ? len : 0] = '\0';
+
+  // fields after the name of the executable (which can contain spaces)
+  fields = strrchr(buffer, ')');
+  if (fields == NULL ||
+      sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+             &utime, &stime) != 2)
+    return 0;
+
+  return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+/**
+ * Returns the resident memory of a process (KB, 0 if it does not exist).
+ */
+long process_rss(pid_t pid){
+  char path[64];
+  long size, resident;
+  FILE *statm;
+
+  snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+  statm = fopen(path, "r");
+  if (statm == NULL)
+    return 0;
+  if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+    resident = 0;
+  fclose(statm);
+
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/**
+ * Returns the resident memory of the server and its children (KB).
+ */
+long server_rss(pid_t pid){
+  char path[64];
+  FILE *children;
+  long rss;
+  int child;
+
+  rss = process_rss(pid);
+  snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+  children = fopen(path, "r");
+  if (children == NULL)
+    return rss;
+  while (fscanf(children, "%d", &child) == 1)
+    rss += process_rss(child);
+  fclose(children);
+
+  return rss;
+}
+
+
+/**
+ * Starts the next transfer of a client, from a new port (like a real client,
+ * so that late messages of the previous transfer are never mistaken for
+ * replies).
+ */
+void client_start(struct bench *b, struct client *c){
+  char request[TFTP_MAX_REQUEST_LEN];
+  struct epoll_event ev;
+  struct bench_file *file;
+  struct tftp_opts opts;
+  char *mode;
+  int i, text, len;
+
+  c->sd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK, 0);
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  epoll_ctl(b->epfd, EPOLL_CTL_ADD, c->sd, &ev);
+
+  i = b->issued++;
+  file = &b->files[i % b->n_files];
+  if (strcmp(b->modes, "both") == 0)
+    text = (i / b->n_files) % 2;
+  else
+    text = strcmp(b->modes, TFTP_STR_NETASCII) == 0;
+  mode = text ? TFTP_STR_NETASCII : TFTP_STR_OCTET;
+
+  c->m_fblock = fblock_open("/dev/null", TFTP_DATA_BLOCK, FBLOCK_WRITE |
+                            (text ? FBLOCK_MODE_TEXT : FBLOCK_MODE_BINARY)
+  );
+  c->expected = text ? file->text_size : file->size;
+  c->state = CLIENT_BUSY;
+
+  opts = b->opts;
+  len = tftp_msg_get_size_rrq(file->name, mode, &opts);
+  tftp_msg_build_rrq(file->name, mode, &opts, request);
+  c->start = tftp_clock_us();
+  tftp_receiver_start(&c->receiver, &c->m_fblock, &opts, request, len, c->sd,
+                      &b->sv_addr
+  );
+
+  if (c->receiver.deadline < b->next_scan)
+    b->next_scan = c->receiver.deadline;
+}
+
+
+/**
+ * Ends the transfer of a client and schedules its next one.
+ *
+ * @param ret  result of the transfer (see tftp_receive_file)
+ */
+void client_end(struct bench *b, struct client *c, int ret){
+  long long written;
+
+  written = c->m_fblock.written;
+  tftp_receiver_free(&c->receiver);
+  fblock_close(&c->m_fblock);
+  close(c->sd);   // also removed from epoll
+  c->sd = -1;
+  c->state = CLIENT_IDLE;
+
+  if (ret == 0 && written == c->expected){
+    b->completed++;
+    b->bytes += written;
+    histogram_record(&b->latency, tftp_clock_us() - c->start);
+  } else{
+    if (ret == 0)
+      LOG(LOG_ERR, "Received %lld bytes instead of %lld",
+          written, c->expected
+      );
+    else
+      LOG(LOG_ERR, "Transfer failed: %d", ret);
+    b->failed++;
+  }
+
+  if (b->issued == b->n_transfers)
+    return;
+
+  if (b->think == 0)
+    client_start(b, c);
+  else{
+    c->next_start = tftp_clock_ms() + b->think;
+    if (c->next_start < b->next_scan)
+      b->next_scan = c->next_start;
+  }
+}
+
+
+/**
+ * Handles the messages received by a client.
+ */
+void client_recv(struct bench *b, struct client *c, char *in_buffer,
+                 int in_buffer_len){
+  struct sockaddr_in src_addr;
+  unsigned int addrlen;
+  int sd, len, first, ret;
+
+  while (c->state == CLIENT_BUSY){
+    sd = c->sd;
+    addrlen = sizeof(src_addr);
+    len = recvfrom(sd, in_buffer, in_buffer_len, 0,
+                   (struct sockaddr*) &src_addr, &addrlen
+    );
+    if (len < 0)  // EAGAIN: nothing else to read
+      break;
+
+    first = c->receiver.first;
+    ret = tftp_receiver_recv(&c->receiver, in_buffer, len, &src_addr);
+    if (first && !c->receiver.first)
+      histogram_record(&b->first_reply, tftp_clock_us() - c->start);
+
+    if (ret != 0 || (c->receiver.done && !c->receiver.dally))
+      client_end(b, c, ret);
+
+    // the next transfer has its own socket, which will get its own events
+    if (c->sd != sd)
+      break;
+  }
+}
+
+
+/**
+ * Handles the expired deadlines of all clients and finds the next one.
+ */
+void clients_scan(struct bench *b, struct client *clients){
+  struct client *c;
+  long long now_ms;
+  int i, ret;
+
+  now_ms = tftp_clock_ms();
+  b->next_scan = now_ms + RSS_SAMPLE_INTERVAL;
+  for (i = 0; i < b->n_clients; i++){
+    c = &clients[i];
+    if (c->state == CLIENT_BUSY && c->receiver.deadline <= now_ms){
+      // dallying receivers are done when nothing else arrives
+      ret = c->receiver.done ? 0 : tftp_receiver_timeout(&c->receiver);
+      if (ret != 0 || c->receiver.done)
+        client_end(b, c, ret);
+    } else if (c->state == CLIENT_IDLE && c->next_start != 0 &&
+               c->next_start <= now_ms && b->issued < b->n_transfers){
+      c->next_start = 0;
+      client_start(b, c);
+    }
+
+    if (c->state == CLIENT_BUSY && c->receiver.deadline < b->next_scan)
+      b->next_scan = c->receiver.deadline;
+    else if (c->state == CLIENT_IDLE && c->next_start != 0 &&
+             c->next_start < b->next_scan)
+      b->next_scan = c->next_start;
+  }
+}
+
+
+/**
+ * Prints (or writes as a JSON object) percentiles of latencies in ms.
+ */
+void print_latency(FILE *out, int json, char *name, struct histogram *h){
+  double avg;
+  unsigned long count;
+
+  count = histogram_count(h);
+  avg = count > 0 ? h->sum / 1000.0 / count : 0;
+  fprintf(out, json ? "  \"%s_ms\": {\"avg\": %.3f, \"p50\": %.3f, "
+                      "\"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, "
+                      "\"max\": %.3f},\n"
+                    : "%-14s avg %.3f ms, p50/p90/p99/p99.9/max "
+                      "%.3f/%.3f/%.3f/%.3f/%.3f ms\n",
+          name, avg,
+          histogram_percentile(h, 50) / 1000.0,
+          histogram_percentile(h, 90) / 1000.0,
+          histogram_percentile(h, 99) / 1000.0,
+          histogram_percentile(h, 99.9) / 1000.0,
+          histogram_percentile(h, 100) / 1000.0
+  );
+}
+
+
+/**
+ * Prints command usage information.
+ */
+void print_help(char *name){
+  printf("Usage: %s [-c CLIENTS] [-n TRANSFERS] [-s SIZES] [-m MODE] "
+         "[-b BLKSIZE]\n"
+         "       [-w WINDOWSIZE] [-t THINK_MS] [-p PORT] [-f SERVER_FLAGS] "
+         "[-j JSON_FILE]\n"
+         "       SERVER_BINARY\n", name
+  );
+  printf("Options:\n");
+  printf("  -c CLIENTS     concurrent clients (default %d)\n",
+         DEFAULT_CLIENTS
+  );
+  printf("  -n TRANSFERS   total transfers (default %d)\n",
+         DEFAULT_TRANSFERS
+  );
+  printf("  -s SIZES       comma separated file sizes, with k or m suffix "
+         "(default %s)\n", DEFAULT_SIZES
+  );
+  printf("  -m MODE        octet (default), netascii or both\n");
+  printf("  -b BLKSIZE     request block size BLKSIZE\n");
+  printf("  -w WINDOWSIZE  request window size WINDOWSIZE\n");
+  printf("  -t THINK_MS    wait THINK_MS between two transfers of a client\n");
+  printf("  -p PORT        port of the server (default %d)\n", DEFAULT_PORT);
+  printf("  -f FLAGS       flags of the server (eg. \"-e -c 64\")\n");
+  printf("  -j JSON_FILE   also write results to JSON_FILE (- for stdout)\n");
+}
+
+
+/** Main */
+int main(int argc, char** argv){
+  char dir[] = "/tmp/tftp_bench.XXXXXX", *json_path, *in_buffer;
+  struct epoll_event events[MAX_EVENTS];
+  struct client *clients;
+  struct rlimit limit;
+  struct bench b;
+  double start, elapsed, host_start, self_start, server_start;
+  double host_used, server_used;
+  long long next_sample;
+  long rss, max_rss;
+  int opt, port, i, n, in_buffer_len;
+  pid_t pid;
+  FILE *out;
+
+  memset(&b, 0, sizeof(b));
+  b.n_clients = DEFAULT_CLIENTS;
+  b.n_transfers = DEFAULT_TRANSFERS;
+  b.sizes = DEFAULT_SIZES;
+  b.modes = TFTP_STR_OCTET;
+  b.server_flags = "";
+  tftp_opts_init(&b.opts);
+  port = DEFAULT_PORT;
+  json_path = NULL;
+
+  while ((opt = getopt(argc, argv, "c:n:s:m:b:w:t:p:f:j:")) != -1){
+    switch (opt){
+      case 'c':
+        b.n_clients = atoi(optarg);
+        break;
+      case 'n':
+        b.n_transfers = atoi(optarg);
+        break;
+      case 's':
+        b.sizes = optarg;
+        break;
+      case 'm':
+        b.modes = optarg;
+        break;
+      case 'b':
+        b.opts.blksize = atoi(optarg);
+        break;
+      case 'w':
+        b.opts.windowsize = atoi(optarg);
+        break;
+      case 't':
+        b.think = atoi(optarg);
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'f':
+        b.server_flags = optarg;
+        break;
+      case 'j':
+        json_path = optarg;
+        break;
+      default:
+        print_help(argv[0]);
+        return 1;
+    }
+  }
+
+  if (argc - optind != 1 || b.n_clients < 1 || b.n_transfers < 1 ||
+      b.think < 0 || (strcmp(b.modes, TFTP_STR_OCTET) != 0 &&
+      strcmp(b.modes, TFTP_STR_NETASCII) != 0 &&
+      strcmp(b.modes, "both") != 0)){
+    print_help(argv[0]);
+    return 1;
+  }
+
+  // each client needs a socket and /dev/null
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < 2 * b.n_clients + 16){
+    printf("Too many clients: at most %ld files can be opened\n",
+           (long) limit.rlim_cur
+    );
+    return 1;
+  }
+
+  if (mkdtemp(dir) == NULL || make_files(&b, dir) != 0){
+    printf("Could not create files in %s\n", dir);
+    remove_files(&b, dir);
+    return 1;
+  }
+
+  b.sv_addr = make_sv_sockaddr_in("127.0.0.1", port);
+  pid = start_server(argv[optind], b.server_flags, port, dir);
+  if (pid < 0 || wait_server(&b.sv_addr, pid) != 0){
+    printf("Server %s did not start\n", argv[optind]);
+    if (pid > 0){
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+    }
+    remove_files(&b, dir);
+    return 1;
+  }
+
+  b.epfd = epoll_create1(0);
+  clients = calloc(b.n_clients, sizeof(struct client));
+  for (i = 0; i < b.n_clients; i++)
+    clients[i].sd = -1;
+  in_buffer_len = tftp_msg_get_size_data(b.opts.blksize != 0 ?
+                                         b.opts.blksize : TFTP_DATA_BLOCK
+  );
+  in_buffer = malloc(in_buffer_len);
+
+  printf("%d clients, %d transfers of %s bytes (%s), blksize %d, "
+         "windowsize %d, think time %d ms, server flags \"%s\"\n",
+         b.n_clients, b.n_transfers, b.sizes, b.modes,
+         b.opts.blksize, b.opts.windowsize, b.think, b.server_flags
+  );
+
+  max_rss = server_rss(pid);
+  host_start = host_cpu();
+  self_start = self_cpu();
+  server_start = process_cpu(pid);
+  start = bench_now();
+
+  b.next_scan = tftp_clock_ms() + RSS_SAMPLE_INTERVAL;
+  for (i = 0; i < b.n_clients && b.issued < b.n_transfers; i++)
+    client_start(&b, &clients[i]);
+
+  next_sample = tftp_clock_ms() + RSS_SAMPLE_INTERVAL;
+  while (b.completed + b.failed < b.n_transfers){
+    n = epoll_wait(b.epfd, events, MAX_EVENTS,
+                   b.next_scan > tftp_clock_ms() ?
+                   b.next_scan - tftp_clock_ms() : 0
+    );
+    for (i = 0; i < n; i++)
+      client_recv(&b, events[i].data.ptr, in_buffer, in_buffer_len);
+
+    if (tftp_clock_ms() >= b.next_scan)
+      clients_scan(&b, clients);
+
+    if (tftp_clock_ms() >= next_sample){
+      rss = server_rss(pid);
+      if (rss > max_rss)
+        max_rss = rss;
+      next_sample = tftp_clock_ms() + RSS_SAMPLE_INTERVAL;
+    }
+  }
+
+  elapsed = bench_now() - start;
+  server_used = process_cpu(pid) - server_start;
+  host_used = host_cpu() - host_start - (self_cpu() - self_start);
+  if (host_used < 0)
+    host_used = 0;
+
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+
+  printf("%d transfers completed, %d failed in %.2f s\n",
+         b.completed, b.failed, elapsed
+  );
+  printf("Throughput:    %.1f transfers/s, %.2f MB/s\n",
+         b.completed / elapsed, b.bytes / elapsed / 1e6
+  );
+  print_latency(stdout, 0, "Transfer:", &b.latency);
+  print_latency(stdout, 0, "First reply:", &b.first_reply);
+  printf("Server CPU:    %.2f s (process), %.2f s (machine minus load "
+         "generator)\n", server_used, host_used
+  );
+  printf("Server memory: %ld KB peak resident (with children)\n", max_rss);
+
+  if (json_path != NULL){
+    out = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+    if (out == NULL)
+      printf("Could not write %s\n", json_path);
+    else{
+      fprintf(out, "{\n");
+      fprintf(out, "  \"clients\": %d,\n  \"transfers\": %d,\n"
+              "  \"sizes\": \"%s\",\n  \"mode\": \"%s\",\n"
+              "  \"blksize\": %d,\n  \"windowsize\": %d,\n"
+              "  \"think_ms\": %d,\n  \"server_flags\": \"%s\",\n",
+              b.n_clients, b.n_transfers, b.sizes, b.modes, b.opts.blksize,
+              b.opts.windowsize, b.think, b.server_flags
+      );
+      fprintf(out, "  \"completed\": %d,\n  \"failed\": %d,\n"
+              "  \"elapsed_s\": %.3f,\n  \"bytes\": %lld,\n"
+              "  \"transfers_per_s\": %.1f,\n  \"throughput_mb_s\": %.3f,\n",
+              b.completed, b.failed, elapsed, b.bytes,
+              b.completed / elapsed, b.bytes / elapsed / 1e6
+      );
+      print_latency(out, 1, "latency", &b.latency);
+      print_latency(out, 1, "first_reply", &b.first_reply);
+      fprintf(out, "  \"server_cpu_s\": %.3f,\n  \"host_cpu_s\": %.3f,\n"
+              "  \"server_rss_peak_kb\": %ld\n}\n",
+              server_used, host_used, max_rss
+      );
+      if (out != stdout)
+        fclose(out);
+    }
+  }
+
+  free(clients);
+  free(in_buffer);
+  close(b.epfd);
+  remove_files(&b, dir);
+  return b.failed != 0;
+}
@@ -0,0 +1,710 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief UDP proxy impairing the traffic between TFTP clients and a server.
+ *
+ * Clients send their requests to the listening port of the proxy instead of
+ * the server. Every datagram going through the proxy, in both directions, is
+ * delayed by a fixed time plus a random jitter, and can be dropped,
+ * duplicated or reordered (held back for a while longer, so that the next
+ * ones overtake it), each with a given probability. Like on a real link, 
+ * jitter alone never reorders datagrams: a datagram is never sent before the
+ * previous one sent through the same socket (unless that one was held back). It all happens in user
+ * space, so that no root privileges (or netem) are needed, and random
+ * choices are made with a seeded generator, so that runs are reproducible.
+ *
+ * Each client address gets a session with its own socket towards the server,
+ * so that the server sees a different client for each of them. TFTP transfer
+ * IDs are preserved: when the server replies from a new port (the port of the
+ * transfer), the proxy replies to the client from a new port of its own, to
+ * which the client then sends the rest of the transfer. Replies from the
+ * listening port of the server (eg. errors sent by the listening process) are
+ * sent from the listening port of the proxy.
+ *
+ * Datagrams sent to a multicast group (RFC 2090) do not go through the proxy.
+ * Counters for each direction are printed when the proxy is stopped (SIGINT
+ * or SIGTERM).
+ *
+ * Usage: udp_proxy [-d DELAY] [-j JITTER] [-l LOSS] [-D DUPLICATE]
+ *                  [-r REORDER] [-g GAP] [-s SEED]
+ *                  LISTEN_PORT SERVER_IP SERVER_PORT
+ */
+
+
+#include "../src/include/inet_utils.h"
+#include "../src/include/logging.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+
+/** Only warnings and errors are logged */
+const int LOG_LEVEL = LOG_WARN;
+
+/** Maximum length of a datagram */
+#define MAX_DATAGRAM_LEN 65536
+
+/** Maximum number of clients with a session */
+#define MAX_SESSIONS 4096
+
+/** Maximum number of server ports (transfers) for each client */
+#define MAX_FACES 16
+
+/** A session is closed after this time without traffic (us) */
+#define IDLE_TIMEOUT 60000000LL
+
+/** Maximum delay of a datagram (ms), so that no session is closed with
+ *  datagrams waiting to be sent through it */
+#define MAX_DELAY 10000
+
+/** Default extra delay of reordered datagrams (ms) */
+#define DEFAULT_GAP 2.0
+
+/** Maximum number of epoll events handled at once */
+#define MAX_EVENTS 64
+
+/** Directions of the traffic */
+#define TO_SERVER 0
+#define TO_CLIENT 1
+
+
+/**
+ * A socket of the proxy.
+ */
+struct endpoint{
+  int sd;                   /**< Socket */
+  struct session *session;  /**< Session (NULL for the listening socket) */
+  struct sockaddr_in server;  /**< Server port behind it (client side only) */
+  long long last_due;       /**< When the last datagram sent through it (not
+                                 held back) is due (us) */
+};
+
+/**
+ * Sockets of the proxy for a client.
+ */
+struct session{
+  struct sockaddr_in client;  /**< Address of the client */
+  struct endpoint upstream;   /**< Socket towards the server */
+  struct endpoint faces[MAX_FACES];  /**< Sockets towards the client, one
+                                          for each port of the server */
+  int n_faces;                /**< Number of faces */
+  long long last_seen;        /**< Time of the last datagram (us) */
+};
+
+/**
+ * A datagram waiting to be sent.
+ */
+struct packet{
+  long long due;            /**< When it must be sent (us) */
+  long long seq;            /**< Order of arrival (among equally due ones) */
+  int dir;                  /**< Direction (TO_SERVER or TO_CLIENT) */
+  int sd;                   /**< Socket it is sent from */
+  struct sockaddr_in dst;   /**< Destination */
+  int len;                  /**< Length of the datagram */
+  char data[];              /**< Datagram */
+};
+
+/**
+ * Counters of a direction.
+ */
+struct stats{
+  long received;      /**< Datagrams received */
+  long long bytes;    /**< Bytes received */
+  long dropped;       /**< Datagrams dropped */
+  long duplicated;    /**< Datagrams sent twice */
+  long reordered;     /**< Datagrams held back */
+  long sent;          /**< Datagrams sent (duplicates included) */
+};
+
+
+/** Fixed delay (us) */
+long long delay;
+
+/** Maximum jitter, added or subtracted to the delay (us) */
+long long jitter;
+
+/** Extra delay of reordered datagrams (us) */
+long long gap;
+
+/** Probabilities of dropping, duplicating and reordering a datagram */
+double loss_rate, dup_rate, reorder_rate;
+
+/** State of the random generator */
+unsigned long long rnd_state;
+
+/** Address of the server */
+struct sockaddr_in sv_addr;
+
+/** Listening socket */
+struct endpoint listener;
+
+/** Sessions of the clients */
+struct session *sessions[MAX_SESSIONS];
+
+/** Number of sessions */
+int n_sessions;
+
+/** Datagrams waiting to be sent (min heap on due time) */
+struct packet **heap;
+
+/** Number of datagrams in heap and its capacity */
+int heap_len, heap_cap;
+
+/** Number of datagrams queued so far */
+long long n_queued;
+
+/** Counters of each direction */
+struct stats stats[2];
+
+/** Set when the proxy is asked to stop */
+volatile sig_atomic_t stop;
+
+
+/**
+ * Returns the current time in microseconds.
+ */
+long long now_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * Returns a random number in [0, 1) (xorshift64*).
+ */
+double rnd(){
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return ((rnd_state * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+
+/**
+ * Returns 1 if packet a must be sent before packet b.
+ */
+int packet_before(struct packet *a, struct packet *b){
+  return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+
+/**
+ * Adds a packet to the heap.
+ *
+ * @return  0 in case of success, 1 otherwise
+ */
+int heap_push(struct packet *p){
+  struct packet **new_heap;
+  int i;
+
+  if (heap_len == heap_cap){
+    new_heap = realloc(heap, 2 * heap_cap * sizeof(struct packet*));
+    if (new_heap == NULL)
+      return 1;
+    heap = new_heap;
+    heap_cap *= 2;
+  }
+
+  for (i = heap_len++; i > 0 && packet_before(p, heap[(i - 1) / 2]);
+       i = (i - 1) / 2)
+    heap[i] = heap[(i - 1) / 2];
+  heap[i] = p;
+  return 0;
+}
+
+
+/**
+ * Removes the first packet from the heap.
+ */
+struct packet* heap_pop(){
+  struct packet *first, *last;
+  int i, child;
+
+  first = heap[0];
+  last = heap[--heap_len];
+  for (i = 0; (child = 2 * i + 1) < heap_len; i = child){
+    if (child + 1 < heap_len && packet_before(heap[child + 1], heap[child]))
+      child++;
+    if (!packet_before(heap[child], last))
+      break;
+    heap[i] = heap[child];
+  }
+  heap[i] = last;
+  return first;
+}
+
+
+/**
+ * Queues a copy of a datagram, to be sent after a random delay.
+ *
+ * @param held  hold it back for gap more
+ * @return      0 in case of success, 1 otherwise
+ */
+int queue_copy(int dir, char *data, int len, struct endpoint *from,
+               struct sockaddr_in *dst, int held){
+  struct packet *p;
+  long long d;
+
+  p = malloc(sizeof(struct packet) + len);
+  if (p == NULL)
+    return 1;
+
+  d = delay;
+  if (jitter > 0)
+    d += (long long) ((2 * rnd() - 1) * jitter);
+  if (d < 0)
+    d = 0;
+
+  p->due = now_us() + d;
+  if (held)
+    p->due += gap;
+  else if (p->due < from->last_due)
+    p->due = from->last_due;
+  else
+    from->last_due = p->due;
+  p->seq = n_queued++;
+  p->dir = dir;
+  p->sd = from->sd;
+  p->dst = *dst;
+  p->len = len;
+  memcpy(p->data, data, len);
+
+  if (heap_push(p)){
+    free(p);
+    return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Impairs a datagram and queues what is left of it.
+ *
+ * @param dir   direction (TO_SERVER or TO_CLIENT)
+ * @param from  socket it will be sent from
+ * @param dst   destination
+ */
+void forward(int dir, char *data, int len, struct endpoint *from,
+             struct sockaddr_in *dst){
+  int held;
+
+  stats[dir].received++;
+  stats[dir].bytes += len;
+
+  if (rnd() < loss_rate){
+    stats[dir].dropped++;
+    return;
+  }
+
+  held = rnd() < reorder_rate;
+  if (held)
+    stats[dir].reordered++;
+  if (queue_copy(dir, data, len, from, dst, held)){
+    LOG(LOG_ERR, "Out of memory");
+    return;
+  }
+
+  if (rnd() < dup_rate){
+    stats[dir].duplicated++;
+    if (queue_copy(dir, data, len, from, dst, 0))
+      LOG(LOG_ERR, "Out of memory");
+  }
+}
+
+
+/**
+ * Sends the datagrams which are due and sets the timer for the next one.
+ *
+ * @param timer_fd  timer
+ */
+void send_due(int timer_fd){
+  struct itimerspec its;
+  struct packet *p;
+  long long now;
+
+  now = now_us();
+  while (heap_len > 0 && heap[0]->due <= now){
+    p = heap_pop();
+    if (sendto(p->sd, p->data, p->len, 0, (struct sockaddr*) &p->dst,
+               sizeof(p->dst)) == p->len)
+      stats[p->dir].sent++;
+    else
+      LOG(LOG_WARN, "Error sending datagram: %s", strerror(errno));
+    free(p);
+  }
+
+  // a zero it_value would disarm the timer
+  memset(&its, 0, sizeof(its));
+  if (heap_len > 0){
+    its.it_value.tv_sec = heap[0]->due / 1000000;
+    its.it_value.tv_nsec = heap[0]->due % 1000000 * 1000;
+  }
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+/**
+ * Opens a socket on a random port and adds it to epoll.
+ *
+ * @return  0 in case of success, 1 otherwise
+ */
+int endpoint_open(struct endpoint *e, int epfd){
+  struct sockaddr_in addr;
+  struct epoll_event ev;
+
+  e->sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (e->sd == -1)
+    return 1;
+
+  addr = make_my_sockaddr_in(0);
+  if (bind_random_port(e->sd, &addr) == 0){
+    close(e->sd);
+    return 1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = e;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, e->sd, &ev) != 0){
+    close(e->sd);
+    return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Finds the session of a client, opening it if it is new.
+ *
+ * @return  the session, NULL in case of failure
+ */
+struct session* session_get(struct sockaddr_in *client, int epfd){
+  struct session *s;
+  int i;
+
+  for (i = 0; i < n_sessions; i++)
+    if (sockaddr_in_cmp(sessions[i]->client, *client) == 0)
+      return sessions[i];
+
+  if (n_sessions == MAX_SESSIONS){
+    LOG(LOG_WARN, "Too many sessions");
+    return NULL;
+  }
+
+  s = malloc(sizeof(struct session));
+  if (s == NULL)
+    return NULL;
+  s->client = *client;
+  s->upstream.session = s;
+  s->upstream.last_due = 0;
+  s->n_faces = 0;
+  if (endpoint_open(&s->upstream, epfd)){
+    LOG(LOG_ERR, "Could not open socket towards the server");
+    free(s);
+    return NULL;
+  }
+
+  sessions[n_sessions++] = s;
+  return s;
+}
+
+
+/**
+ * Finds the socket of a session towards the client for a port of the server,
+ * opening it if it is new.
+ *
+ * @return  the socket, NULL in case of failure
+ */
+struct endpoint* session_face(struct session *s, struct sockaddr_in *server, int epfd){
+  struct endpoint *e;
+  int i;
+
+  for (i = 0; i < s->n_faces; i++)
+    if (sockaddr_in_cmp(s->faces[i].server, *server) == 0)
+      return &s->faces[i];
+
+  if (s->n_faces == MAX_FACES){
+    LOG(LOG_WARN, "Too many transfers for a client");
+    return NULL;
+  }
+
+  e = &s->faces[s->n_faces];
+  e->session = s;
+  e->server = *server;
+  e->last_due = 0;
+  if (endpoint_open(e, epfd)){
+    LOG(LOG_ERR, "Could not open socket towards the client");
+    return NULL;
+  }
+  s->n_faces++;
+  return e;
+}
+
+
+/**
+ * Closes the sessions which have been idle for IDLE_TIMEOUT.
+ */
+void sessions_expire(){
+  struct session *s;
+  long long now;
+  int i, j;
+
+  now = now_us();
+  for (i = 0; i < n_sessions; i++){
+    s = sessions[i];
+    if (now - s->last_seen < IDLE_TIMEOUT)
+      continue;
+
+    close(s->upstream.sd);
+    for (j = 0; j < s->n_faces; j++)
+      close(s->faces[j].sd);
+    free(s);
+    sessions[i--] = sessions[--n_sessions];
+  }
+}
+
+
+/**
+ * Handles a datagram received by one of the sockets of the proxy.
+ */
+void on_datagram(struct endpoint *e, char *data, int len,
+                 struct sockaddr_in *src, int epfd){
+  struct endpoint *face;
+  struct session *s;
+
+  if (e == &listener){
+    // new request: from the client to the listening port of the server
+    s = session_get(src, epfd);
+    if (s == NULL)
+      return;
+    s->last_seen = now_us();
+    forward(TO_SERVER, data, len, &s->upstream, &sv_addr);
+
+  } else if (e == &e->session->upstream){
+    // from the server to the client, through the face of the server port
+    s = e->session;
+    s->last_seen = now_us();
+    if (sockaddr_in_cmp(*src, sv_addr) == 0)
+      face = &listener;
+    else
+      face = session_face(s, src, epfd);
+    if (face != NULL)
+      forward(TO_CLIENT, data, len, face, &s->client);
+
+  } else{
+    // from the client to the server port behind the face
+    s = e->session;
+    if (sockaddr_in_cmp(*src, s->client) != 0)
+      return;
+    s->last_seen = now_us();
+    forward(TO_SERVER, data, len, &s->upstream, &e->server);
+  }
+}
+
+
+/**
+ * Prints the counters of a direction.
+ */
+void print_stats(char *name, struct stats *st){
+  printf("%s: %ld datagrams (%lld bytes), %ld dropped (%.2f%%), "
+         "%ld duplicated, %ld reordered, %ld sent\n",
+         name, st->received, st->bytes, st->dropped,
+         st->received > 0 ? st->dropped * 100.0 / st->received : 0,
+         st->duplicated, st->reordered, st->sent
+  );
+}
+
+
+/**
+ * Stops the proxy.
+ */
+void on_signal(int sig){
+  stop = 1;
+}
+
+
+/**
+ * Prints command usage information.
+ */
+void print_help(char *name){
+  printf("Usage: %s [-d DELAY] [-j JITTER] [-l LOSS] [-D DUPLICATE] "
+         "[-r REORDER] [-g GAP]\n"
+         "       [-s SEED] LISTEN_PORT SERVER_IP SERVER_PORT\n", name
+  );
+  printf("Options:\n");
+  printf("  -d DELAY      delay of each datagram (ms, default 0)\n");
+  printf("  -j JITTER     random variation of the delay, +/- (ms, "
+         "default 0)\n");
+  printf("  -l LOSS       datagrams dropped (percent, default 0)\n");
+  printf("  -D DUPLICATE  datagrams sent twice (percent, default 0)\n");
+  printf("  -r REORDER    datagrams held back by GAP (percent, default 0)\n");
+  printf("  -g GAP        extra delay of reordered datagrams (ms, "
+         "default %.0f)\n", DEFAULT_GAP
+  );
+  printf("  -s SEED       seed of the random generator (default 1)\n");
+}
+
+
+/** Main */
+int main(int argc, char** argv){
+  char buffer[MAX_DATAGRAM_LEN], addr_str[MAX_SOCKADDR_STR_LEN];
+  struct epoll_event ev, events[MAX_EVENTS];
+  struct sockaddr_in addr;
+  struct sigaction sa;
+  struct endpoint *e;
+  socklen_t addr_len;
+  double delay_ms, jitter_ms, gap_ms;
+  int opt, epfd, timer_fd, n, i, len;
+  unsigned long long timer_count;
+  long long last_expire;
+
+  delay_ms = 0;
+  jitter_ms = 0;
+  gap_ms = DEFAULT_GAP;
+  rnd_state = 1;
+
+  while ((opt = getopt(argc, argv, "d:j:l:D:r:g:s:")) != -1){
+    switch (opt){
+      case 'd':
+        delay_ms = atof(optarg);
+        break;
+      case 'j':
+        jitter_ms = atof(optarg);
+        break;
+      case 'l':
+        loss_rate = atof(optarg) / 100;
+        break;
+      case 'D':
+        dup_rate = atof(optarg) / 100;
+        break;
+      case 'r':
+        reorder_rate = atof(optarg) / 100;
+        break;
+      case 'g':
+        gap_ms = atof(optarg);
+        break;
+      case 's':
+        rnd_state = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        print_help(argv[0]);
+        return 1;
+    }
+  }
+
+  if (argc - optind != 3){
+    print_help(argv[0]);
+    return 1;
+  }
+
+  if (delay_ms < 0 || jitter_ms < 0 || gap_ms < 0 ||
+      delay_ms + jitter_ms + gap_ms > MAX_DELAY){
+    printf("Delays must be positive and add up to at most %d ms\n",
+           MAX_DELAY
+    );
+    return 1;
+  }
+  if (loss_rate < 0 || loss_rate > 1 || dup_rate < 0 || dup_rate > 1 ||
+      reorder_rate < 0 || reorder_rate > 1){
+    printf("Probabilities must be within 0 and 100\n");
+    return 1;
+  }
+  if (rnd_state == 0)
+    rnd_state = 1;  // xorshift would stay at 0
+
+  delay = delay_ms * 1000;
+  jitter = jitter_ms * 1000;
+  gap = gap_ms * 1000;
+  sv_addr = make_sv_sockaddr_in(argv[optind+1], atoi(argv[optind+2]));
+
+  heap_cap = 1024;
+  heap = malloc(heap_cap * sizeof(struct packet*));
+
+  epfd = epoll_create1(0);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (heap == NULL || epfd == -1 || timer_fd == -1){
+    LOG(LOG_FATAL, "Could not initialize the event loop");
+    return 1;
+  }
+
+  listener.sd = socket(AF_INET, SOCK_DGRAM, 0);
+  addr = make_my_sockaddr_in(atoi(argv[optind]));
+  if (listener.sd == -1 ||
+      bind(listener.sd, (struct sockaddr*) &addr, sizeof(addr)) != 0){
+    LOG(LOG_FATAL, "Could not bind to port %s: %s", argv[optind],
+        strerror(errno)
+    );
+    return 1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &listener;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listener.sd, &ev);
+  ev.data.ptr = NULL;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  sockaddr_in_to_string(sv_addr, addr_str);
+  printf("Proxying port %s to %s: delay %.1f +/- %.1f ms, loss %.2f%%, "
+         "duplicate %.2f%%, reorder %.2f%% (gap %.1f ms)\n",
+         argv[optind], addr_str, delay_ms, jitter_ms, loss_rate * 100,
+         dup_rate * 100, reorder_rate * 100, gap_ms
+  );
+  fflush(stdout);
+
+  last_expire = now_us();
+  while (!stop){
+    n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+    if (n == -1 && errno != EINTR){
+      LOG(LOG_FATAL, "epoll_wait failed: %s", strerror(errno));
+      return 1;
+    }
+
+    for (i = 0; i < n; i++){
+      e = events[i].data.ptr;
+      if (e == NULL){
+        if (read(timer_fd, &timer_count, sizeof(timer_count)) < 0)
+          LOG(LOG_DEBUG, "Spurious timer wake up");
+        continue;
+      }
+
+      // drain the socket, so that datagrams arriving together are queued
+      // in order
+      for (;;){
+        addr_len = sizeof(addr);
+        len = recvfrom(e->sd, buffer, sizeof(buffer), MSG_DONTWAIT,
+                       (struct sockaddr*) &addr, &addr_len);
+        if (len < 0)
+          break;
+        on_datagram(e, buffer, len, &addr, epfd);
+      }
+    }
+
+    // sessions are only closed when none of their datagrams can be queued,
+    // since no datagram waits longer than MAX_DELAY
+    if (now_us() - last_expire > 1000000){
+      sessions_expire();
+      last_expire = now_us();
+    }
+
+    send_due(timer_fd);
+  }
+
+  print_stats("client -> server", &stats[TO_SERVER]);
+  print_stats("server -> client", &stats[TO_CLIENT]);
+  return 0;
+}
@@ -0,0 +1,316 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Throughput benchmark of file uploads and of their disk writes.
+ *
+ * A file is uploaded over loopback by tftp_upload_file to tftp_accept_file
+ * (in a thread), which writes it to a file opened by open_upload_file, like
+ * the server does.
+ *
+ * A receiver which ignores options (answering the WRQ with ACK 0) is also
+ * tried, with a sender reading the file from disk, so that its blocks are 
+ * copied in buffers sized for the requested block size.
+ *
+ * For each transfer configuration and sync policy, the benchmark reports the
+ * throughput (up to the last ACK, after which the file is on disk if a sync
+ * policy is set) and how many write and sync system calls were made. Writes
+ * and syncs are counted by replacing pwrite, fsync and fdatasync.
+ *
+ * Usage: upload_bench [file_size_kb] [dir]
+ */
+
+
+#define _GNU_SOURCE
+#include "../src/include/tftp.h"
+#include "../src/include/tftp_msgs.h"
+#include "../src/include/fblock.h"
+#include "../src/include/inet_utils.h"
+#include "../src/include/server_utils.h"
+#include "../src/include/logging.h"
+#include "bench_utils.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Only errors are logged */
+const int LOG_LEVEL = LOG_ERR;
+
+/** Default size of the uploaded file (KB) */
+#define DEFAULT_SIZE_KB 8192
+
+/** Default directory of the uploaded file */
+#define DEFAULT_DIR "/tmp"
+
+/** Name of the uploaded file */
+#define OUT_NAME "upload_bench.out"
+
+
+/** Number of pwrite calls */
+volatile long writes;
+
+/** Number of fsync and fdatasync calls */
+volatile long syncs;
+
+
+/** Replaces libc pwrite, counting calls */
+ssize_t pwrite(int fd, const void *buf, size_t len, off_t offset){
+  __sync_fetch_and_add(&writes, 1);
+  return syscall(SYS_pwrite64, fd, buf, len, offset);
+}
+
+/** Replaces libc fsync, counting calls */
+int fsync(int fd){
+  __sync_fetch_and_add(&syncs, 1);
+  return syscall(SYS_fsync, fd);
+}
+
+/** Replaces libc fdatasync, counting calls */
+int fdatasync(int fd){
+  __sync_fetch_and_add(&syncs, 1);
+  return syscall(SYS_fdatasync, fd);
+}
+
+
+/**
+ * Transfer configuration.
+ */
+struct config{
+  int blksize;     /**< Requested block size (0 for default) */
+  int windowsize;  /**< Requested window size (0 for default) */
+  int ignore_opts; /**< 1 if the receiver ignores options (the file is read
+                        from disk by the sender), 0 otherwise */
+};
+
+/**
+ * Sync policy.
+ */
+struct policy{
+  char *name;      /**< Name of the policy (as in tftp_server -s) */
+  char sync;       /**< FBLOCK_SYNC flags */
+};
+
+/**
+ * Arguments of the server thread.
+ */
+struct server_args{
+  int sd;          /**< Listening socket */
+  char *path;      /**< Path of the uploaded file */
+  char sync;       /**< Sync policy */
+  int ignore_opts; /**< 1 if options are ignored */
+  int result;      /**< Result of tftp_accept_file */
+};
+
+
+/**
+ * Accepts a single WRQ. Retransmitted WRQs are ignored.
+ */
+void* server_main(void *arg){
+  struct server_args *args = (struct server_args*) arg;
+  char in_buffer[TFTP_MAX_REQUEST_LEN];
+  char filename[TFTP_MAX_FILENAME_LEN+1], mode[TFTP_MAX_MODE_LEN+1];
+  struct sockaddr_in cl_addr, my_addr;
+  struct tftp_opts opts;
+  struct fblock m_fblock;
+  unsigned int addrlen;
+  int len, sd;
+
+  addrlen = sizeof(cl_addr);
+  len = recvfrom(args->sd, in_buffer, sizeof(in_buffer), 0,
+                 (struct sockaddr*) &cl_addr, &addrlen
+  );
+  if (len < 0 || tftp_msg_unpack_wrq(in_buffer, len, filename, mode, &opts)){
+    args->result = -1;
+    return NULL;
+  }
+
+  if (args->ignore_opts)
+    tftp_opts_init(&opts);
+  else
+    negotiate_options(&opts);
+
+  if (open_upload_file(args->path, mode, &opts, args->sync, &m_fblock)){
+    args->result = -1;
+    return NULL;
+  }
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  my_addr = make_my_sockaddr_in(0);
+  bind_random_port(sd, &my_addr);
+
+  args->result = tftp_accept_file(&m_fblock, &opts, sd, &cl_addr);
+
+  if (close_upload_file(args->path, &m_fblock, args->result == 0) != 0 &&
+      args->result == 0)
+    args->result = -1;
+  close(sd);
+  return NULL;
+}
+
+
+/**
+ * Checks that the uploaded file matches the sent one.
+ */
+int check_output(char *path, char *data, off_t size){
+  FILE *f;
+  char *buf;
+  int ok;
+
+  buf = malloc(size + 1);
+  f = fopen(path, "rb");
+  ok = f != NULL && fread(buf, 1, size + 1, f) == size &&
+       memcmp(buf, data, size) == 0;
+  if (f != NULL)
+    fclose(f);
+  free(buf);
+  return ok;
+}
+
+
+/**
+ * Uploads the file once and prints the results.
+ */
+void run(struct config *config, struct policy *policy, char *path,
+         char *data, off_t size){
+  struct server_args args;
+  struct sockaddr_in sv_addr, my_addr;
+  struct tftp_opts opts;
+  struct fblock m_fblock;
+  pthread_t server;
+  char request[TFTP_MAX_REQUEST_LEN], in_path[PATH_MAX];
+  int sd, ret, request_len, block_size;
+  FILE *in;
+  long n_writes, n_syncs;
+  double start, elapsed;
+
+  unlink(path);
+
+  args.sd = socket(AF_INET, SOCK_DGRAM, 0);
+  sv_addr = make_my_sockaddr_in(0);
+  bind_random_port(args.sd, &sv_addr);
+  sv_addr = make_sv_sockaddr_in("127.0.0.1", ntohs(sv_addr.sin_port));
+  args.path = path;
+  args.sync = policy->sync;
+  args.ignore_opts = config->ignore_opts;
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  my_addr = make_my_sockaddr_in(0);
+  bind_random_port(sd, &my_addr);
+
+  block_size = config->blksize != 0 ? config->blksize : TFTP_DATA_BLOCK;
+
+  tftp_opts_init(&opts);
+  opts.blksize = config->blksize;
+  opts.windowsize = config->windowsize;
+  opts.tsize = size;
+  request_len = tftp_msg_get_size_wrq(OUT_NAME, TFTP_STR_OCTET, &opts);
+  tftp_msg_build_wrq(OUT_NAME, TFTP_STR_OCTET, &opts, request);
+
+  snprintf(in_path, sizeof(in_path), "%s.in", path);
+  if (config->ignore_opts){
+    in = fopen(in_path, "wb");
+    fwrite(data, 1, size, in);
+    fclose(in);
+    m_fblock = fblock_open(in_path, block_size, 
+                           FBLOCK_READ|FBLOCK_MODE_BINARY
+    );
+  } else
+    m_fblock = fblock_open_mem(data, size, block_size,
+                               FBLOCK_READ|FBLOCK_MODE_BINARY
+    );
+
+  writes = 0;
+  syncs = 0;
+
+  start = bench_now();
+  pthread_create(&server, NULL, server_main, &args);
+  ret = tftp_upload_file(&m_fblock, &opts, request, request_len, sd,
+                         &sv_addr
+  );
+  elapsed = bench_now() - start;
+
+  // writes made up to the last ACK (server then waits for retransmissions)
+  n_writes = writes;
+  n_syncs = syncs;
+  pthread_join(server, NULL);
+
+  fblock_close(&m_fblock);
+  if (config->ignore_opts)
+    unlink(in_path);
+  close(sd);
+  close(args.sd);
+
+  if (ret != 0 || args.result != 0 || !check_output(path, data, size)){
+    printf("%7d  %6d  %5s  FAILED (sender %d, receiver %d)%s\n",
+           block_size, config->windowsize, policy->name, ret, args.result,
+           config->ignore_opts ? "  options ignored" : ""
+    );
+    return;
+  }
+
+  printf("%7d  %6d  %5s  %9.2f  %7ld  %9.1f  %6ld%s\n",
+         block_size,
+         config->windowsize,
+         policy->name,
+         size / elapsed / (1024*1024),
+         n_writes,
+         n_writes > 0 ? (double) size / n_writes / 1024 : 0,
+         n_syncs,
+         config->ignore_opts ? "  options ignored" : ""
+  );
+}
+
+
+/** Main */
+int main(int argc, char** argv){
+  struct config configs[] = {
+    {0, 0, 0},       // RFC 1350
+    {1428, 0, 0},    // large blocks
+    {1428, 16, 0},   // window
+    {8192, 16, 0},   // jumbo blocks and window
+    {8, 4, 1}        // tiny blocks, receiver falls back to RFC 1350
+  };
+  struct policy policies[] = {
+    {"none", 0},
+    {"end", FBLOCK_SYNC},
+    {"all", FBLOCK_SYNC_ALL}
+  };
+  char path[PATH_MAX];
+  off_t size;
+  char *data;
+  int i, j;
+
+  size = (argc > 1 ? atol(argv[1]) : DEFAULT_SIZE_KB) * 1024;
+  snprintf(path, sizeof(path), "%s/%s",
+           argc > 2 ? argv[2] : DEFAULT_DIR,
+           OUT_NAME
+  );
+
+  data = malloc(size);
+  srand(42);
+  for (i = 0; i < size; i++)
+    data[i] = rand();
+
+  printf("File size: %lld KB, write buffer: %d KB, file: %s\n",
+         (long long) size / 1024,
+         FBLOCK_BUFFER_SIZE / 1024,
+         path
+  );
+  printf("blksize  window   sync       MB/s   writes  KB/write   syncs\n");
+
+  for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+    for (j = 0; j < sizeof(policies) / sizeof(policies[0]); j++)
+      run(&configs[i], &policies[j], path, data, size);
+
+  unlink(path);
+  free(data);
+  return 0;
+}
@@ -0,0 +1,734 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Implementation of dir_index.h.
+ *
+ * @see dir_index.h
+ */
+
+
+#define _GNU_SOURCE
+#include "include/dir_index.h"
+#include "include/logging.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <linux/limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+
+/** LOG_LEVEL will be defined in another file */
+extern const int LOG_LEVEL;
+
+
+/** Events which change the tree */
+#define DIR_INDEX_EVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|\
+                          IN_ATTRIB|IN_MODIFY|IN_CLOSE_WRITE)
+
+
+/**
+ * State shared by the threads building an index.
+ */
+struct dir_index_build{
+  struct dir_index *index;        /**< Index being built */
+  pthread_mutex_t lock;           /**< Protects every other field */
+  pthread_cond_t cond;            /**< Signalled when queue or busy change */
+  struct dir_index_entry **queue; /**< Directories still to be read (NULL 
+                                       for the served one) */
+  int n_queue;                    /**< Number of directories in queue */
+  int queue_size;                 /**< Allocated size of queue */
+  int busy;                       /**< Threads reading a directory */
+  struct dir_index_entry *entries;  /**< Entries read so far (by hnext) */
+  int failed;                     /**< Set to 1 if a directory could not be
+                                       watched (or the served one read) */
+};
+
+
+/**
+ * Hashes a path (djb2).
+ */
+unsigned int dir_index_hash(char *path){
+  unsigned int hash = 5381;
+  while (*path != '\0')
+    hash = hash * 33 + (unsigned char) *path++;
+  return hash;
+}
+
+
+/**
+ * Looks for the entry of a path. Index must be locked.
+ */
+struct dir_index_entry* dir_index_find(struct dir_index *index, char *path){
+  struct dir_index_entry *entry;
+  unsigned int hash;
+
+  hash = dir_index_hash(path);
+  entry = index->buckets[hash % index->n_buckets];
+  while (entry != NULL &&
+         (entry->hash != hash || strcmp(entry->path, path) != 0))
+    entry = entry->hnext;
+  return entry;
+}
+
+
+/**
+ * Updates file and directory counters. Index must be locked.
+ */
+void dir_index_count(struct dir_index *index, struct dir_index_entry *entry,
+                     int delta){
+  if (entry->type == DIR_INDEX_FILE)
+    index->stats.files += delta;
+  else if (entry->type == DIR_INDEX_DIR)
+    index->stats.dirs += delta;
+}
+
+
+/**
+ * Adds an entry, growing the hash table if needed. Index must be locked.
+ */
+void dir_index_add(struct dir_index *index, struct dir_index_entry *entry){
+  struct dir_index_entry **buckets, *e, *next;
+  int i, n_buckets;
+
+  if (index->n_entries >= index->n_buckets){
+    n_buckets = index->n_buckets * 2;
+    buckets = calloc(n_buckets, sizeof(struct dir_index_entry*));
+    for (i = 0; i < index->n_buckets; i++)
+      for (e = index->buckets[i]; e != NULL; e = next){
+        next = e->hnext;
+        e->hnext = buckets[e->hash % n_buckets];
+        buckets[e->hash % n_buckets] = e;
+      }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->n_buckets = n_buckets;
+  }
+
+  entry->hnext = index->buckets[entry->hash % index->n_buckets];
+  index->buckets[entry->hash % index->n_buckets] = entry;
+  index->n_entries++;
+  dir_index_count(index, entry, 1);
+}
+
+
+/**
+ * Unlinks an entry from its bucket and frees it. Index must be locked.
+ */
+void dir_index_remove(struct dir_index *index, struct dir_index_entry *entry){
+  struct dir_index_entry **p;
+
+  p = &index->buckets[entry->hash % index->n_buckets];
+  while (*p != entry)
+    p = &(*p)->hnext;
+  *p = entry->hnext;
+  index->n_entries--;
+  dir_index_count(index, entry, -1);
+  free(entry->path);
+  free(entry);
+}
+
+
+/**
+ * Removes an entry and all entries below it (if it is a directory), and
+ * stops watching removed directories. Index must be locked.
+ *
+ * Only removing a directory needs a walk of the whole table: a file is 
+ * looked up and unlinked from its bucket.
+ */
+void dir_index_remove_tree(struct dir_index *index, char *path){
+  struct dir_index_entry **p, *entry;
+  int i, len;
+
+  entry = dir_index_find(index, path);
+  if (entry == NULL)
+    return;
+
+  if (entry->type != DIR_INDEX_DIR){
+    dir_index_remove(index, entry);
+    return;
+  }
+
+  len = strlen(path);
+
+  for (i = 0; i < index->n_buckets; i++){
+    p = &index->buckets[i];
+    while (*p != NULL){
+      entry = *p;
+      if (strncmp(entry->path, path, len) == 0 &&
+          (entry->path[len] == '\0' || entry->path[len] == '/')){
+        *p = entry->hnext;
+        index->n_entries--;
+        dir_index_count(index, entry, -1);
+        free(entry->path);
+        free(entry);
+      } else
+        p = &entry->hnext;
+    }
+  }
+
+  // watches of moved directories would report events with their old path
+  for (i = 0; i < index->n_paths; i++)
+    if (index->paths[i] != NULL && strncmp(index->paths[i], path, len) == 0
+        && (index->paths[i][len] == '\0' || index->paths[i][len] == '/')){
+      inotify_rm_watch(index->fd, i);
+      free(index->paths[i]);
+      index->paths[i] = NULL;
+    }
+}
+
+
+/**
+ * Creates the entry of a path.
+ */
+struct dir_index_entry* dir_index_entry_new(char *path, struct stat *st){
+  struct dir_index_entry *entry;
+
+  entry = malloc(sizeof(struct dir_index_entry));
+  entry->hnext = NULL;
+  entry->path = strdup(path);
+  entry->hash = dir_index_hash(path);
+  if (S_ISREG(st->st_mode))
+    entry->type = DIR_INDEX_FILE;
+  else if (S_ISDIR(st->st_mode))
+    entry->type = DIR_INDEX_DIR;
+  else
+    entry->type = DIR_INDEX_OTHER;
+  entry->size = st->st_size;
+  return entry;
+}
+
+
+/**
+ * Watches a directory.
+ *
+ * @param index       index instance
+ * @param path        path of the directory, relative to the served one
+ * @param watch_lock  lock protecting the watched paths (NULL if the caller
+ *                    has locked the whole index)
+ * @return            0 in case of success, 1 otherwise
+ */
+int dir_index_watch(struct dir_index *index, char *path,
+                    pthread_mutex_t *watch_lock){
+  char full_path[PATH_MAX];
+  int wd, n, ret;
+
+  if (snprintf(full_path, sizeof(full_path), "%s/%s",
+               index->dir_realpath, path) >= sizeof(full_path))
+    return 1;
+
+  if (watch_lock != NULL)
+    pthread_mutex_lock(watch_lock);
+
+  wd = inotify_add_watch(index->fd, full_path,
+                         DIR_INDEX_EVENTS|IN_ONLYDIR|IN_DONT_FOLLOW
+  );
+  if (wd == -1){
+    LOG(LOG_WARN, "Could not watch directory %s", full_path);
+    ret = 1;
+  } else{
+    if (wd >= index->n_paths){
+      n = index->n_paths;
+      index->n_paths = wd * 2 + 16;
+      index->paths = realloc(index->paths, index->n_paths * sizeof(char*));
+      memset(index->paths + n, 0, (index->n_paths - n) * sizeof(char*));
+    }
+    free(index->paths[wd]);
+    index->paths[wd] = strdup(path);
+    ret = 0;
+  }
+
+  if (watch_lock != NULL)
+    pthread_mutex_unlock(watch_lock);
+  return ret;
+}
+
+
+/**
+ * Reads the entries of a directory (not recursively), after watching it.
+ *
+ * @param index       index instance
+ * @param path        path of the directory, relative to the served one (""
+ *                    for the served one)
+ * @param watch_lock  lock protecting the watched paths (see dir_index_watch)
+ * @param entries     list of entries (linked by hnext), new entries are
+ *                    added at its head [in/out]
+ * @return            0 in case of success, 1 if the directory could not be
+ *                    watched, 2 if it could not be read
+ */
+int dir_index_read_dir(struct dir_index *index, char *path,
+                       pthread_mutex_t *watch_lock,
+                       struct dir_index_entry **entries){
+  char sub_path[PATH_MAX];
+  struct dir_index_entry *entry;
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+  int fd;
+
+  // watched first, so that changes made while it is read are not lost
+  if (dir_index_watch(index, path, watch_lock) != 0)
+    return 1;
+
+  fd = openat(index->dir_fd, path[0] != '\0' ? path : ".",
+              O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC
+  );
+  if (fd == -1)
+    return 2;
+  dir = fdopendir(fd);
+  if (dir == NULL){
+    close(fd);
+    return 2;
+  }
+
+  while ((de = readdir(dir)) != NULL){
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    if (snprintf(sub_path, sizeof(sub_path), "%s%s%s",
+                 path, path[0] != '\0' ? "/" : "", de->d_name)
+        >= sizeof(sub_path))
+      continue;
+
+    // directories and symbolic links do not need their size
+    if (de->d_type == DT_DIR){
+      st.st_mode = S_IFDIR;
+      st.st_size = 0;
+    } else if (de->d_type == DT_LNK){
+      st.st_mode = S_IFLNK;
+      st.st_size = 0;
+    } else if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+      continue;  // already removed
+
+    entry = dir_index_entry_new(sub_path, &st);
+    entry->hnext = *entries;
+    *entries = entry;
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+
+/**
+ * Reads a directory and, recursively, all of its subdirectories, adding
+ * their entries to the index. Index must be locked.
+ *
+ * @return  0 in case of success, 1 if a directory could not be watched
+ */
+int dir_index_scan(struct dir_index *index, char *path){
+  struct dir_index_entry *entries, *entry;
+  int ret;
+
+  entries = NULL;
+  ret = dir_index_read_dir(index, path, NULL, &entries);
+  if (ret == 2){
+    // its files may still be opened by name (no read permission)
+    entry = dir_index_find(index, path);
+    if (entry != NULL){
+      dir_index_count(index, entry, -1);
+      entry->type = DIR_INDEX_OTHER;
+    }
+    return 0;
+  }
+
+  while (entries != NULL){
+    entry = entries;
+    entries = entry->hnext;
+
+    // it may have been indexed by an event read in the meantime
+    if (dir_index_find(index, entry->path) != NULL){
+      free(entry->path);
+      free(entry);
+      continue;
+    }
+
+    dir_index_add(index, entry);
+    if (entry->type == DIR_INDEX_DIR && ret == 0)
+      ret = dir_index_scan(index, entry->path);
+  }
+
+  return ret;
+}
+
+
+/**
+ * Reads directories from the queue until all of them have been read.
+ */
+void* dir_index_build_thread(void *arg){
+  struct dir_index_build *build = (struct dir_index_build*) arg;
+  struct dir_index_entry *entries, *entry, *tail, *dir;
+  int ret;
+
+  pthread_mutex_lock(&build->lock);
+  while (1){
+    while (build->n_queue == 0 && build->busy > 0)
+      pthread_cond_wait(&build->cond, &build->lock);
+    if (build->n_queue == 0)
+      break;  // nothing left to read, and nobody reading
+
+    dir = build->queue[--build->n_queue];
+    build->busy++;
+    pthread_mutex_unlock(&build->lock);
+
+    entries = NULL;
+    ret = dir_index_read_dir(build->index, dir != NULL ? dir->path : "", 
+                             &build->lock, &entries
+    );
+
+    pthread_mutex_lock(&build->lock);
+    if (ret == 1 || (ret == 2 && dir == NULL))
+      build->failed = 1;
+    else if (ret == 2)  // its files may still be opened by name
+      dir->type = DIR_INDEX_OTHER;
+
+    // subdirectories are queued, entries are handed over
+    tail = NULL;
+    for (entry = entries; entry != NULL; entry = entry->hnext){
+      if (entry->type == DIR_INDEX_DIR && !build->failed){
+        if (build->n_queue == build->queue_size){
+          build->queue_size *= 2;
+          build->queue = realloc(build->queue, build->queue_size * 
+                                 sizeof(struct dir_index_entry*)
+          );
+        }
+        build->queue[build->n_queue++] = entry;
+      }
+      tail = entry;
+    }
+    if (tail != NULL){
+      tail->hnext = build->entries;
+      build->entries = entries;
+    }
+
+    build->busy--;
+    pthread_cond_broadcast(&build->cond);
+  }
+  pthread_mutex_unlock(&build->lock);
+
+  return NULL;
+}
+
+
+/**
+ * Stops watching the directory and disables the index. Index must be
+ * locked.
+ */
+void dir_index_disable(struct dir_index *index){
+  struct dir_index_entry *entry, *next;
+  int i;
+
+  if (index->fd != -1)
+    close(index->fd);
+  index->fd = -1;
+
+  for (i = 0; i < index->n_buckets; i++){
+    for (entry = index->buckets[i]; entry != NULL; entry = next){
+      next = entry->hnext;
+      free(entry->path);
+      free(entry);
+    }
+    index->buckets[i] = NULL;
+  }
+  index->n_entries = 0;
+  index->stats.files = 0;
+  index->stats.dirs = 0;
+
+  for (i = 0; i < index->n_paths; i++)
+    free(index->paths[i]);
+  free(index->paths);
+  index->paths = NULL;
+  index->n_paths = 0;
+}
+
+
+/**
+ * Applies a change to a path of the tree, as it is now on disk. Index must
+ * be locked.
+ *
+ * @return  0 in case of success, 1 if a new directory could not be watched
+ */
+int dir_index_update(struct dir_index *index, char *path){
+  struct dir_index_entry *entry, *new_entry;
+  struct stat st;
+
+  entry = dir_index_find(index, path);
+
+  if (fstatat(index->dir_fd, path, &st, AT_SYMLINK_NOFOLLOW) != 0){
+    if (entry != NULL)
+      dir_index_remove_tree(index, path);
+    return 0;
+  }
+
+  new_entry = dir_index_entry_new(path, &st);
+
+  if (entry != NULL && entry->type == new_entry->type){
+    entry->size = new_entry->size;
+    free(new_entry->path);
+    free(new_entry);
+    return 0;
+  } else if (entry != NULL)
+    dir_index_remove_tree(index, path);
+
+  dir_index_add(index, new_entry);
+
+  // files may have been created before the directory was watched
+  if (new_entry->type == DIR_INDEX_DIR)
+    return dir_index_scan(index, path);
+  return 0;
+}
+
+
+/**
+ * Reads pending inotify events and applies them. Index must be locked.
+ */
+void dir_index_read_events(struct dir_index *index){
+  char buffer[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  char path[PATH_MAX];
+  struct inotify_event *event;
+  struct dir_index_entry *entry;
+  ssize_t len;
+  char *ptr, *dir_path;
+  int ret;
+
+  while (index->fd != -1 &&
+         (len = read(index->fd, buffer, sizeof(buffer))) > 0){
+    for (ptr = buffer; ptr < buffer + len;
+         ptr += sizeof(struct inotify_event) + event->len){
+      event = (struct inotify_event*) ptr;
+
+      if (event->mask & IN_Q_OVERFLOW){
+        LOG(LOG_WARN, "Lost directory events, disabling directory index");
+        dir_index_disable(index);
+        return;
+      }
+
+      if (event->wd >= index->n_paths ||
+          (dir_path = index->paths[event->wd]) == NULL)
+        continue;  // directory not watched anymore
+
+      if (event->mask & IN_IGNORED){  // directory was removed
+        free(index->paths[event->wd]);
+        index->paths[event->wd] = NULL;
+        continue;
+      }
+
+      if (event->len == 0 ||  // event on the directory itself
+          snprintf(path, sizeof(path), "%s%s%s",
+                   dir_path, dir_path[0] != '\0' ? "/" : "", event->name)
+          >= sizeof(path))
+        continue;
+
+      index->stats.updates++;
+      ret = 0;
+      if (event->mask & (IN_DELETE|IN_MOVED_FROM))
+        dir_index_remove_tree(index, path);
+      else if (event->mask & (IN_CREATE|IN_MOVED_TO|IN_ATTRIB|
+                              IN_CLOSE_WRITE))
+        ret = dir_index_update(index, path);
+      else if ((event->mask & IN_MODIFY) &&
+               (entry = dir_index_find(index, path)) != NULL)
+        entry->size = -1;  // size is read again once it is closed
+
+      if (ret != 0){
+        LOG(LOG_WARN, "Disabling directory index");
+        dir_index_disable(index);
+        return;
+      }
+    }
+  }
+}
+
+
+/**
+ * Checks whether a path is in normal form: not empty, with no empty, "."
+ * or ".." components.
+ */
+int dir_index_is_normal(char *path){
+  char *component, *end;
+
+  if (path[0] == '\0')
+    return 0;
+
+  for (component = path; ; component = end + 1){
+    end = strchr(component, '/');
+    if (end == NULL)
+      end = component + strlen(component);
+
+    if (end == component ||
+        (end - component == 1 && component[0] == '.') ||
+        (end - component == 2 && component[0] == '.' && component[1] == '.'))
+      return 0;
+
+    if (*end == '\0')
+      return 1;
+  }
+}
+
+
+int dir_index_init(struct dir_index *index, char *dir_realpath,
+                   int n_threads){
+  struct dir_index_build build;
+  struct dir_index_entry *entry;
+  pthread_t threads[DIR_INDEX_MAX_THREADS];
+  struct timespec start, end;
+  int i;
+
+  memset(index, 0, sizeof(struct dir_index));
+  pthread_mutex_init(&index->lock, NULL);
+  index->dir_realpath = dir_realpath;
+  index->n_buckets = DIR_INDEX_BUCKETS;
+  index->buckets = calloc(index->n_buckets, sizeof(struct dir_index_entry*));
+
+  index->dir_fd = open(dir_realpath, O_PATH|O_DIRECTORY|O_CLOEXEC);
+  index->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (index->dir_fd == -1 || index->fd == -1){
+    LOG(LOG_WARN, "inotify not available, directory index disabled");
+    dir_index_disable(index);
+    return 1;
+  }
+
+  if (n_threads < 1)
+    n_threads = 1;
+  else if (n_threads > DIR_INDEX_MAX_THREADS)
+    n_threads = DIR_INDEX_MAX_THREADS;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  memset(&build, 0, sizeof(build));
+  build.index = index;
+  pthread_mutex_init(&build.lock, NULL);
+  pthread_cond_init(&build.cond, NULL);
+  build.queue_size = 64;
+  build.queue = malloc(build.queue_size * sizeof(struct dir_index_entry*));
+  build.queue[build.n_queue++] = NULL;
+
+  for (i = 0; i < n_threads; i++)
+    pthread_create(&threads[i], NULL, dir_index_build_thread, &build);
+  for (i = 0; i < n_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  // entries are added to the hash table by this thread only
+  while (build.entries != NULL){
+    entry = build.entries;
+    build.entries = entry->hnext;
+    dir_index_add(index, entry);
+  }
+
+  free(build.queue);
+  pthread_cond_destroy(&build.cond);
+  pthread_mutex_destroy(&build.lock);
+
+  if (build.failed){
+    LOG(LOG_WARN, "Directory index disabled");
+    dir_index_disable(index);
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  index->stats.build_time = end.tv_sec - start.tv_sec +
+                            (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  LOG(LOG_INFO, "Indexed %d files in %d directories in %.3f s (%d threads)",
+      index->stats.files,
+      index->stats.dirs,
+      index->stats.build_time,
+      n_threads
+  );
+  return 0;
+}
+
+
+int dir_index_lookup(struct dir_index *index, char *filename, off_t *size){
+  struct dir_index_entry *entry;
+  char parent[PATH_MAX];
+  char *slash;
+  int ret;
+
+  *size = -1;
+
+  // as for the server, a leading / refers to the served directory
+  while (*filename == '/')
+    filename++;
+
+  pthread_mutex_lock(&index->lock);
+
+  index->stats.lookups++;
+  dir_index_read_events(index);
+
+  if (index->fd == -1 || !dir_index_is_normal(filename) ||
+      strlen(filename) >= sizeof(parent)){
+    ret = 2;
+  } else if ((entry = dir_index_find(index, filename)) != NULL){
+    // directories and symbolic links are left to the caller
+    if (entry->type == DIR_INDEX_FILE){
+      *size = entry->size;
+      ret = 0;
+    } else
+      ret = 2;
+  } else{
+    // it is missing if its parent is an indexed directory (or a file)
+    slash = strrchr(filename, '/');
+    if (slash == NULL)
+      ret = 1;
+    else{
+      memcpy(parent, filename, slash - filename);
+      parent[slash - filename] = '\0';
+      entry = dir_index_find(index, parent);
+      ret = entry != NULL && entry->type != DIR_INDEX_OTHER ? 1 : 2;
+    }
+  }
+
+  if (ret == 0)
+    index->stats.found++;
+  else if (ret == 1)
+    index->stats.missing++;
+  else
+    index->stats.unknown++;
+
+  pthread_mutex_unlock(&index->lock);
+  return ret;
+}
+
+
+void dir_index_get_stats(struct dir_index *index,
+                         struct dir_index_stats *stats){
+  pthread_mutex_lock(&index->lock);
+  *stats = index->stats;
+  pthread_mutex_unlock(&index->lock);
+}
+
+
+void dir_index_log_stats(struct dir_index *index){
+  struct dir_index_stats stats;
+
+  dir_index_get_stats(index, &stats);
+  LOG(LOG_INFO,
+      "Directory index: %d files, %d directories, %lu lookups, %lu found, "
+      "%lu missing, %lu looked up on disk, %lu updates",
+      stats.files,
+      stats.dirs,
+      stats.lookups,
+      stats.found,
+      stats.missing,
+      stats.unknown,
+      stats.updates
+  );
+}
+
+
+void dir_index_free(struct dir_index *index){
+  dir_index_disable(index);
+  free(index->buckets);
+  index->buckets = NULL;
+  if (index->dir_fd != -1)
+    close(index->dir_fd);
+  index->dir_fd = -1;
+  pthread_mutex_destroy(&index->lock);
+}
@@ -8,9 +8,16 @@
  */
 
 
+#define _GNU_SOURCE
 #include "include/fblock.h"
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include "include/logging.h"
 
 
@@ -22,23 +29,120 @@ extern const int LOG_LEVEL;
  * Returns file length
  *
  * @param f  file pointer
- * @return   file length in bytes
+ * @return   file length in bytes (64 bits, files may be larger than 4GB)
  */
-int get_length(FILE *f){
-  int size;
-  fseek(f, 0, SEEK_END); // seek to end of file
-  size = ftell(f); // get current file pointer
-  fseek(f, 0, SEEK_SET); // seek back to beginning of file
-  return size;
+off_t get_length(FILE *f){
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0)
+    return 0;
+  return st.st_size;
 }
 
 
-struct fblock fblock_open(char* filename, int block_size, char mode){
+/**
+ * Builds the fopen mode string of an fblock mode.
+ *
+ * @param mode      mode (read, write, text, binary, exclusive)
+ * @param mode_str  fopen mode, at least 5 bytes long [out]
+ */
+void fblock_mode_str(char mode, char *mode_str){
+  mode_str[0] = '\0';
+
+  if ((mode & FBLOCK_RW_MASK) == FBLOCK_WRITE)
+    strcat(mode_str, "w");
+  else
+    strcat(mode_str, "r");
+
+  if ((mode & FBLOCK_MODE_MASK) == FBLOCK_MODE_BINARY)
+    strcat(mode_str, "b");
+  // text otherwise
+
+  if ((mode & FBLOCK_RW_MASK) == FBLOCK_WRITE && (mode & FBLOCK_EXCL))
+    strcat(mode_str, "x");
+}
+
+
+/**
+ * Builds the fblock of an opened file.
+ *
+ * @param file        opened file (NULL in case of error)
+ * @param filename    name of the file, used in logs
+ * @param size        size of the file, if already known (-1 otherwise)
+ * @param block_size  size of the blocks
+ * @param mode        mode (read, write, text, binary)
+ * @return            fblock structure
+ */
+struct fblock fblock_init(FILE *file, char* filename, off_t size, 
+                          int block_size, char mode){
   struct fblock m_fblock;
+  struct stat st;
+  m_fblock.file = file;
   m_fblock.block_size = block_size;
   m_fblock.mode = mode;
+  m_fblock.encoder = NULL;
+  m_fblock.decoder = NULL;
+  m_fblock.map = NULL;
+  m_fblock.map_len = 0;
+  m_fblock.buffer = NULL;
+  m_fblock.buffer_len = 0;
+  m_fblock.offset = 0;
+
+  if (m_fblock.file == NULL){
+    LOG(LOG_ERR, "Error while opening file %s", filename);
+    return m_fblock;
+  }
+  if ((mode & FBLOCK_RW_MASK) == FBLOCK_WRITE){
+    m_fblock.written = 0;
+    m_fblock.buffer = malloc(FBLOCK_BUFFER_SIZE);
+  }
+
+  if ((mode & FBLOCK_RW_MASK) == FBLOCK_WRITE && 
+      (mode & FBLOCK_MODE_MASK) == FBLOCK_MODE_TEXT){
+    m_fblock.decoder = malloc(sizeof(struct netascii_decoder));
+    netascii_decoder_init(m_fblock.decoder);
+  }
+
+  if ((mode & FBLOCK_RW_MASK) == FBLOCK_READ){
+    m_fblock.remaining = size >= 0 ? size : get_length(m_fblock.file);
+
+    if ((mode & FBLOCK_MODE_MASK) == FBLOCK_MODE_TEXT){
+      m_fblock.encoder = malloc(sizeof(struct netascii_encoder));
+      netascii_encoder_init(m_fblock.encoder);
+    } else if ((mode & FBLOCK_MMAP) && 
+               fstat(fileno(m_fblock.file), &st) == 0){
+      // never map past the end of the file (size may come from a stale index)
+      if (st.st_size != m_fblock.remaining){
+        LOG(LOG_INFO, "File %s is now %lld bytes long",
+            filename,
+            (long long) st.st_size
+        );
+        m_fblock.remaining = st.st_size;
+      }
+    }
+
+    if ((mode & FBLOCK_MMAP) && m_fblock.encoder == NULL && 
+        m_fblock.remaining > 0){
+      m_fblock.map = mmap(NULL, m_fblock.remaining, PROT_READ, MAP_SHARED, 
+                          fileno(m_fblock.file), 0
+      );
+      if (m_fblock.map == MAP_FAILED){
+        // fread is still available
+        LOG(LOG_WARN, "Could not map file %s in memory", filename);
+        m_fblock.map = NULL;
+      } else{
+        m_fblock.map_len = m_fblock.remaining;
+        madvise(m_fblock.map, m_fblock.map_len, MADV_SEQUENTIAL);
+      }
+    }
+  }
+
+  LOG(LOG_DEBUG, "Successfully opened file");
+  return m_fblock;
+}
 
-  char mode_str[4] = "";
+
+struct fblock fblock_open(char* filename, int block_size, char mode){
+  char mode_str[5];
 
   LOG(LOG_DEBUG, "Opening file %s (%s %s), block_size = %d", 
       filename, 
@@ -47,33 +151,147 @@ struct fblock fblock_open(char* filename, int block_size, char mode){
       block_size
   );
 
-  if ((mode & FBLOCK_RW_MASK) == FBLOCK_WRITE){
-    strcat(mode_str, "w");
-    m_fblock.written = 0;
-  } else {
-    strcat(mode_str, "r");
-  }
+  fblock_mode_str(mode, mode_str);
+  return fblock_init(fopen(filename, mode_str), filename, -1, block_size, 
+                     mode
+  );
+}
 
-  if ((mode & FBLOCK_MODE_MASK) == FBLOCK_MODE_BINARY)
-    strcat(mode_str, "b");
-  // text otherwise
 
-  m_fblock.file = fopen(filename, mode_str);
-  if (m_fblock.file == NULL){
-    LOG(LOG_ERR, "Error while opening file %s", filename);
-    return m_fblock;
+struct fblock fblock_fdopen(int fd, char* filename, off_t size, 
+                            int block_size, char mode){
+  char mode_str[5];
+  FILE *file;
+
+  LOG(LOG_DEBUG, "Opening descriptor %d of file %s (%s %s), block_size = %d",
+      fd,
+      filename, 
+      (mode & FBLOCK_MODE_MASK) == FBLOCK_MODE_BINARY ? "binary" : "text",
+      (mode & FBLOCK_RW_MASK) == FBLOCK_WRITE ? "write" : "read",
+      block_size
+  );
+
+  // exclusive creation is up to whoever opened the descriptor
+  fblock_mode_str(mode & ~FBLOCK_EXCL, mode_str);
+  file = fdopen(fd, mode_str);
+  if (file == NULL)
+    close(fd);
+  return fblock_init(file, filename, size, block_size, mode);
+}
+
+
+struct fblock fblock_open_mem(char* data, off_t size, int block_size, 
+                              char mode){
+  struct fblock m_fblock;
+  m_fblock.file = NULL;
+  m_fblock.block_size = block_size;
+  m_fblock.mode = (mode & FBLOCK_MODE_MASK) | FBLOCK_READ;
+  m_fblock.remaining = size;
+  m_fblock.encoder = NULL;
+  m_fblock.decoder = NULL;
+  m_fblock.map = data;
+  m_fblock.map_len = size;
+  m_fblock.buffer = NULL;
+  m_fblock.buffer_len = 0;
+  m_fblock.offset = 0;
+
+  LOG(LOG_DEBUG, "Opening file from memory (%s), block_size = %d", 
+      (mode & FBLOCK_MODE_MASK) == FBLOCK_MODE_BINARY ? "binary" : "text",
+      block_size
+  );
+
+  if ((mode & FBLOCK_MODE_MASK) == FBLOCK_MODE_TEXT){
+    m_fblock.encoder = malloc(sizeof(struct netascii_encoder));
+    netascii_encoder_init(m_fblock.encoder);
   }
-  if ((mode & FBLOCK_RW_MASK) == FBLOCK_READ)
-    m_fblock.remaining = get_length(m_fblock.file);
 
-  LOG(LOG_DEBUG, "Successfully opened file");
   return m_fblock;
 }
 
 
+/**
+ * Copies at most len bytes of a mapped file to buffer.
+ * 
+ * @return  number of bytes copied
+ */
+int fblock_copy_map(struct fblock *m_fblock, char* buffer, int len){
+  ssize_t n;
+  int done;
+
+  if (m_fblock->remaining < len)
+    len = m_fblock->remaining;
+
+  if (m_fblock->file == NULL){
+    memcpy(buffer, m_fblock->map + (m_fblock->map_len - m_fblock->remaining),
+           len
+    );
+    m_fblock->remaining -= len;
+    return len;
+  }
+
+  // a mapped file is never touched from user space (see FBLOCK_MMAP)
+  for (done = 0; done < len; done += n){
+    n = pread(fileno(m_fblock->file), buffer + done, len - done, 
+              m_fblock->map_len - m_fblock->remaining + done
+    );
+    if (n < 0 && errno == EINTR)
+      n = 0;
+    else if (n <= 0)
+      return -1;
+  }
+
+  m_fblock->remaining -= len;
+  return len;
+}
+
+
+/**
+ * Reads next block_size bytes of the netascii conversion of the file.
+ * 
+ * @see fblock_read
+ */
+int fblock_read_netascii(struct fblock *m_fblock, char* buffer){
+  struct netascii_encoder *encoder = m_fblock->encoder;
+  int n;
+
+  n = 0;
+  while (n < m_fblock->block_size){
+    if (encoder->pos == encoder->len && encoder->pending == -1){
+      // everything has been converted: load more bytes from the file
+      if (m_fblock->map != NULL){
+        encoder->len = fblock_copy_map(m_fblock, encoder->buf, 
+                                       NETASCII_BUF_LEN
+        );
+      } else{
+        encoder->len = fread(encoder->buf, sizeof(char), NETASCII_BUF_LEN, 
+                             m_fblock->file
+        );
+        if (encoder->len == 0 && ferror(m_fblock->file))
+          return -1;
+        m_fblock->remaining -= encoder->len;
+      }
+      encoder->pos = 0;
+
+      if (encoder->len == 0)
+        break;  // end of file
+    }
+
+    n += netascii_encode(encoder, buffer + n, m_fblock->block_size - n);
+  }
+
+  return n;
+}
+
+
 int fblock_read(struct fblock *m_fblock, char* buffer){
   int bytes_read, bytes_to_read;
 
+  if (m_fblock->encoder != NULL)
+    return fblock_read_netascii(m_fblock, buffer);
+
+  if (m_fblock->map != NULL)
+    return fblock_copy_map(m_fblock, buffer, m_fblock->block_size);
+
   if (m_fblock->remaining > m_fblock->block_size)
     bytes_to_read = m_fblock->block_size;
   else
@@ -82,21 +300,246 @@ int fblock_read(struct fblock *m_fblock, char* buffer){
   bytes_read = fread(buffer, sizeof(char), bytes_to_read, m_fblock->file);
   m_fblock->remaining -= bytes_read;
 
-  return bytes_to_read - bytes_read;
+  if (bytes_read != bytes_to_read)
+    return -1;
+
+  return bytes_read;
+}
+
+
+/**
+ * Writes the content of the buffer to the file, syncing it if the sync 
+ * policy is FBLOCK_SYNC_ALL.
+ * 
+ * @return  0 in case of success, 1 otherwise
+ */
+int fblock_write_buffer(struct fblock *m_fblock){
+  ssize_t n;
+  int done;
+
+  for (done = 0; done < m_fblock->buffer_len; done += n){
+    n = pwrite(fileno(m_fblock->file), 
+               m_fblock->buffer + done, 
+               m_fblock->buffer_len - done, 
+               m_fblock->offset + done
+    );
+    if (n < 0 && errno == EINTR){
+      n = 0;
+    } else if (n <= 0){
+      LOG(LOG_ERR, "Error writing to file: %s", 
+          n < 0 ? strerror(errno) : "no progress"
+      );
+      return 1;
+    }
+  }
+
+  m_fblock->offset += m_fblock->buffer_len;
+  m_fblock->buffer_len = 0;
+
+  if ((m_fblock->mode & FBLOCK_SYNC_MASK) == FBLOCK_SYNC_ALL && 
+      fdatasync(fileno(m_fblock->file)) != 0){
+    LOG(LOG_ERR, "Error syncing file: %s", strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Appends len bytes to the buffer, writing it to the file whenever it is 
+ * full.
+ * 
+ * @return  0 in case of success, otherwise number of bytes it could not 
+ *          write.
+ */
+int fblock_append(struct fblock *m_fblock, char* data, int len){
+  int done, chunk;
+
+  for (done = 0; done < len; done += chunk){
+    if (m_fblock->buffer_len == FBLOCK_BUFFER_SIZE && 
+        fblock_write_buffer(m_fblock))
+      return len - done;
+
+    chunk = FBLOCK_BUFFER_SIZE - m_fblock->buffer_len;
+    if (chunk > len - done)
+      chunk = len - done;
+    memcpy(m_fblock->buffer + m_fblock->buffer_len, data + done, chunk);
+    m_fblock->buffer_len += chunk;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Converts block_size netascii bytes and writes them to file.
+ * 
+ * @see fblock_write
+ */
+int fblock_write_netascii(struct fblock *m_fblock, char* buffer, 
+                          int block_size){
+  struct netascii_decoder *decoder = m_fblock->decoder;
+  int i, chunk, n;
+
+  // decoded bytes are never more than netascii ones
+  for (i = 0; i < block_size; i += chunk){
+    chunk = block_size - i;
+    if (chunk > NETASCII_BUF_LEN)
+      chunk = NETASCII_BUF_LEN;
+
+    n = netascii_decode(decoder, buffer + i, chunk);
+    if (n < 0)
+      return -1;
+
+    if (fblock_append(m_fblock, decoder->buf, n) != 0)
+      return block_size - i;
+
+    m_fblock->written += chunk;
+  }
+
+  return 0;
+}
+
+
+int fblock_read_ptr(struct fblock *m_fblock, char** data){
+  int bytes_to_read;
+
+  if ((m_fblock->map == NULL && m_fblock->remaining > 0) || 
+      m_fblock->encoder != NULL)
+    return -1;
+
+  if (m_fblock->remaining > m_fblock->block_size)
+    bytes_to_read = m_fblock->block_size;
+  else
+    bytes_to_read = m_fblock->remaining;
+
+  *data = m_fblock->map + (m_fblock->map_len - m_fblock->remaining);
+  m_fblock->remaining -= bytes_to_read;
+
+  return bytes_to_read;
+}
+
+
+int fblock_seek(struct fblock *m_fblock, off_t offset){
+  off_t size;
+
+  if ((m_fblock->mode & FBLOCK_RW_MASK) != FBLOCK_READ || 
+      m_fblock->encoder != NULL || offset < 0)
+    return 1;
+
+  if (m_fblock->map != NULL){
+    if (offset > m_fblock->map_len)
+      return 1;
+    m_fblock->remaining = m_fblock->map_len - offset;
+    return 0;
+  }
+
+  if (m_fblock->file == NULL)  // empty file in memory
+    return offset != 0;
+
+  size = ftello(m_fblock->file) + m_fblock->remaining;
+  if (offset > size || fseeko(m_fblock->file, offset, SEEK_SET) != 0)
+    return 1;
+  m_fblock->remaining = size - offset;
+  return 0;
+}
+
+
+int fblock_reserve(struct fblock *m_fblock, off_t size){
+  if (size <= 0)
+    return 0;
+
+  if (fallocate(fileno(m_fblock->file), FALLOC_FL_KEEP_SIZE, 0, size) == 0){
+    LOG(LOG_DEBUG, "Reserved %lld bytes", (long long) size);
+    return 0;
+  }
+
+  if (errno == ENOSPC || errno == EFBIG || errno == EDQUOT){
+    LOG(LOG_ERR, "Not enough space for %lld bytes", (long long) size);
+    return 1;
+  }
+
+  LOG(LOG_DEBUG, "Could not reserve space: %s", strerror(errno));
+  return 0;
 }
 
 
 int fblock_write(struct fblock *m_fblock, char* buffer, int block_size){
-  int written_bytes;
+  int not_written;
 
   if (!block_size)
     block_size = m_fblock->block_size;
 
-  written_bytes = fwrite(buffer, sizeof(char), block_size, m_fblock->file);
-  m_fblock->written += written_bytes;
-  return block_size - written_bytes;
+  if (m_fblock->decoder != NULL)
+    return fblock_write_netascii(m_fblock, buffer, block_size);
+
+  not_written = fblock_append(m_fblock, buffer, block_size);
+  m_fblock->written += block_size - not_written;
+  return not_written;
+}
+
+
+int fblock_write_at(struct fblock *m_fblock, char* buffer, int len, 
+                    off_t offset){
+  int not_written;
+
+  if (m_fblock->decoder != NULL)
+    return len;
+
+  if (offset != m_fblock->offset + m_fblock->buffer_len){
+    if (m_fblock->buffer_len > 0 && fblock_write_buffer(m_fblock))
+      return len;
+    m_fblock->offset = offset;
+  }
+
+  not_written = fblock_append(m_fblock, buffer, len);
+  m_fblock->written += len - not_written;
+  return not_written;
+}
+
+
+int fblock_flush(struct fblock *m_fblock){
+  if (m_fblock->buffer_len > 0 && fblock_write_buffer(m_fblock))
+    return 1;
+
+  if ((m_fblock->mode & FBLOCK_SYNC_MASK) != 0 && 
+      fsync(fileno(m_fblock->file)) != 0){
+    LOG(LOG_ERR, "Error syncing file: %s", strerror(errno));
+    return 1;
+  }
+
+  return 0;
 }
 
 int fblock_close(struct fblock *m_fblock){
-  return fclose(m_fblock->file);
+  int result = 0;
+
+  if (m_fblock->decoder != NULL && m_fblock->decoder->pending_cr)
+    LOG(LOG_WARN, "Bad formatted netascii: unexpected EOF after CR");
+
+  free(m_fblock->encoder);
+  free(m_fblock->decoder);
+  m_fblock->encoder = NULL;
+  m_fblock->decoder = NULL;
+
+  // memory of files opened with fblock_open_mem is borrowed
+  if (m_fblock->file == NULL){
+    m_fblock->map = NULL;
+    return 0;
+  }
+
+  if (m_fblock->map != NULL)
+    munmap(m_fblock->map, m_fblock->map_len);
+  m_fblock->map = NULL;
+
+  if (m_fblock->buffer != NULL){
+    result = fblock_flush(m_fblock);
+    free(m_fblock->buffer);
+    m_fblock->buffer = NULL;
+  }
+
+  if (fclose(m_fblock->file) != 0 || result != 0)
+    return EOF;
+  return 0;
 }
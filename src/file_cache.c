@@ -0,0 +1,365 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Implementation of file_cache.h.
+ *
+ * @see file_cache.h
+ */
+
+
+#include "include/file_cache.h"
+#include "include/logging.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+/** LOG_LEVEL will be defined in another file */
+extern const int LOG_LEVEL;
+
+
+/**
+ * Hashes a path (djb2).
+ */
+unsigned int file_cache_hash(char *path){
+  unsigned int hash = 5381;
+  while (*path != '\0')
+    hash = hash * 33 + (unsigned char) *path++;
+  return hash % FILE_CACHE_BUCKETS;
+}
+
+
+/**
+ * Checks whether an entry is a copy of the file described by st.
+ */
+int file_cache_entry_matches(struct file_cache_entry *entry, struct stat *st){
+  return entry->dev == st->st_dev &&
+         entry->ino == st->st_ino &&
+         entry->size == st->st_size &&
+         entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+         entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+/**
+ * Releases the memory of an entry.
+ */
+void file_cache_entry_free(struct file_cache_entry *entry){
+  munmap(entry->data, entry->size);
+  free(entry->path);
+  free(entry);
+}
+
+
+/**
+ * Loads a file in memory.
+ *
+ * @param file_realpath  real path of the file
+ * @param file_fd        descriptor of the file (-1 to open file_realpath)
+ * @param budget         maximum size of the file
+ * @return               new entry (not cached, with no reference), NULL if
+ *                       file could not be read, is empty, is too large or
+ *                       changed while it was read.
+ */
+struct file_cache_entry* file_cache_load(char *file_realpath, int file_fd,
+                                         off_t budget){
+  struct file_cache_entry *entry;
+  struct stat st;
+  off_t done;
+  ssize_t n;
+  int fd;
+
+  fd = file_fd != -1 ? file_fd : open(file_realpath, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size == 0 || st.st_size > budget){
+    if (fd != file_fd)
+      close(fd);
+    return NULL;
+  }
+
+  entry = malloc(sizeof(struct file_cache_entry));
+  entry->prev = entry->next = entry->hnext = NULL;
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  entry->mtime = st.st_mtim;
+  entry->size = st.st_size;
+  entry->refs = 0;
+  entry->cached = 0;
+
+  // shared mapping: children forked later on use the same pages
+  entry->data = mmap(NULL, entry->size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_ANONYMOUS, -1, 0
+  );
+  if (entry->data == MAP_FAILED){
+    LOG(LOG_WARN, "Could not allocate %lld bytes for %s",
+        (long long) entry->size,
+        file_realpath
+    );
+    free(entry);
+    if (fd != file_fd)
+      close(fd);
+    return NULL;
+  }
+
+  for (done = 0; done < entry->size; done += n){
+    n = pread(fd, entry->data + done, entry->size - done, done);
+    if (n < 0 && errno == EINTR)
+      n = 0;
+    else if (n <= 0)
+      break;
+  }
+
+  // the file must not have changed while it was read
+  if (done != entry->size || fstat(fd, &st) != 0 ||
+      !file_cache_entry_matches(entry, &st)){
+    LOG(LOG_WARN, "File %s changed while it was being cached", file_realpath);
+    munmap(entry->data, entry->size);
+    free(entry);
+    if (fd != file_fd)
+      close(fd);
+    return NULL;
+  }
+
+  if (fd != file_fd)
+    close(fd);
+  mprotect(entry->data, entry->size, PROT_READ);
+  entry->path = strdup(file_realpath);
+
+  return entry;
+}
+
+
+/**
+ * Looks for the cached entry of a path. Cache must be locked.
+ */
+struct file_cache_entry* file_cache_lookup(struct file_cache *cache,
+                                           char *file_realpath){
+  struct file_cache_entry *entry;
+
+  entry = cache->buckets[file_cache_hash(file_realpath)];
+  while (entry != NULL && strcmp(entry->path, file_realpath) != 0)
+    entry = entry->hnext;
+  return entry;
+}
+
+
+/**
+ * Removes an entry from the LRU list. Cache must be locked.
+ */
+void file_cache_unlink(struct file_cache *cache,
+                       struct file_cache_entry *entry){
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    cache->head = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    cache->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+
+/**
+ * Adds an entry at the head of the LRU list. Cache must be locked.
+ */
+void file_cache_link(struct file_cache *cache,
+                     struct file_cache_entry *entry){
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL)
+    cache->head->prev = entry;
+  else
+    cache->tail = entry;
+  cache->head = entry;
+}
+
+
+/**
+ * Removes an entry from the cache, releasing it if nobody is using it.
+ * Cache must be locked.
+ */
+void file_cache_remove(struct file_cache *cache,
+                       struct file_cache_entry *entry){
+  struct file_cache_entry **p;
+
+  p = &cache->buckets[file_cache_hash(entry->path)];
+  while (*p != entry)
+    p = &(*p)->hnext;
+  *p = entry->hnext;
+  entry->hnext = NULL;
+
+  file_cache_unlink(cache, entry);
+  entry->cached = 0;
+  cache->stats.files--;
+  cache->stats.used -= entry->size;
+
+  if (entry->refs == 0)
+    file_cache_entry_free(entry);
+}
+
+
+/**
+ * Evicts least recently used entries which are not in use, until size more
+ * bytes fit in the budget. Cache must be locked.
+ *
+ * @return  1 if size bytes fit in the budget, 0 otherwise
+ */
+int file_cache_make_room(struct file_cache *cache, off_t size){
+  struct file_cache_entry *entry, *prev;
+
+  entry = cache->tail;
+  while (cache->stats.used + size > cache->budget && entry != NULL){
+    prev = entry->prev;
+    if (entry->refs == 0){
+      LOG(LOG_DEBUG, "Evicting %s from cache", entry->path);
+      file_cache_remove(cache, entry);
+      cache->stats.evictions++;
+    }
+    entry = prev;
+  }
+
+  return cache->stats.used + size <= cache->budget;
+}
+
+
+int file_cache_init(struct file_cache *cache, off_t budget){
+  memset(cache, 0, sizeof(struct file_cache));
+  cache->budget = budget;
+  if (pthread_mutex_init(&cache->lock, NULL) != 0){
+    LOG(LOG_ERR, "Could not initialize file cache lock");
+    return 1;
+  }
+  return 0;
+}
+
+
+struct file_cache_entry* file_cache_get(struct file_cache *cache,
+                                        char *file_realpath, int fd){
+  struct file_cache_entry *entry, *loaded;
+  struct stat st;
+
+  if ((fd != -1 ? fstat(fd, &st) : stat(file_realpath, &st)) != 0)
+    return NULL;
+
+  pthread_mutex_lock(&cache->lock);
+
+  entry = file_cache_lookup(cache, file_realpath);
+  if (entry != NULL){
+    if (file_cache_entry_matches(entry, &st)){
+      cache->stats.hits++;
+      entry->refs++;
+      file_cache_unlink(cache, entry);
+      file_cache_link(cache, entry);
+      pthread_mutex_unlock(&cache->lock);
+      return entry;
+    }
+
+    LOG(LOG_INFO, "File %s changed, dropping it from cache", file_realpath);
+    file_cache_remove(cache, entry);
+    cache->stats.invalidations++;
+  }
+
+  cache->stats.misses++;
+  pthread_mutex_unlock(&cache->lock);
+
+  // other threads can use the cache while the file is being read
+  loaded = file_cache_load(file_realpath, fd,
+                           cache->budget < FILE_CACHE_MAX_FILE ?
+                             cache->budget : FILE_CACHE_MAX_FILE
+  );
+  if (loaded == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&cache->lock);
+
+  // someone else may have loaded the same file in the meantime
+  entry = file_cache_lookup(cache, file_realpath);
+  if (entry != NULL && entry->dev == loaded->dev && entry->ino == loaded->ino
+      && entry->size == loaded->size
+      && entry->mtime.tv_sec == loaded->mtime.tv_sec
+      && entry->mtime.tv_nsec == loaded->mtime.tv_nsec){
+    entry->refs++;
+    pthread_mutex_unlock(&cache->lock);
+    file_cache_entry_free(loaded);
+    return entry;
+  } else if (entry != NULL){
+    file_cache_remove(cache, entry);
+    cache->stats.invalidations++;
+  }
+
+  if (!file_cache_make_room(cache, loaded->size)){
+    pthread_mutex_unlock(&cache->lock);
+    LOG(LOG_WARN, "File cache is full of files in use, not caching %s",
+        file_realpath
+    );
+    file_cache_entry_free(loaded);
+    return NULL;
+  }
+
+  loaded->refs = 1;
+  loaded->cached = 1;
+  loaded->hnext = cache->buckets[file_cache_hash(file_realpath)];
+  cache->buckets[file_cache_hash(file_realpath)] = loaded;
+  file_cache_link(cache, loaded);
+  cache->stats.files++;
+  cache->stats.used += loaded->size;
+  LOG(LOG_DEBUG, "Cached %s (%lld bytes)",
+      file_realpath,
+      (long long) loaded->size
+  );
+
+  pthread_mutex_unlock(&cache->lock);
+  return loaded;
+}
+
+
+void file_cache_put(struct file_cache *cache, struct file_cache_entry *entry){
+  pthread_mutex_lock(&cache->lock);
+  entry->refs--;
+  if (entry->refs == 0 && !entry->cached)
+    file_cache_entry_free(entry);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+
+void file_cache_get_stats(struct file_cache *cache,
+                          struct file_cache_stats *stats){
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+
+void file_cache_log_stats(struct file_cache *cache){
+  struct file_cache_stats stats;
+
+  file_cache_get_stats(cache, &stats);
+  LOG(LOG_INFO,
+      "File cache: %lu hits, %lu misses, %lu evictions, %lu invalidations, "
+      "%d files, %lld/%lld bytes",
+      stats.hits,
+      stats.misses,
+      stats.evictions,
+      stats.invalidations,
+      stats.files,
+      (long long) stats.used,
+      (long long) cache->budget
+  );
+}
+
+
+void file_cache_free(struct file_cache *cache){
+  while (cache->head != NULL)
+    file_cache_remove(cache, cache->head);
+  pthread_mutex_destroy(&cache->lock);
+}
@@ -0,0 +1,114 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Implementation of histogram.h.
+ *
+ * A value v >= 2^SUB_BITS whose highest set bit is e goes to bucket
+ * (e - SUB_BITS + 1) * SUB_BUCKETS + (v >> (e - SUB_BITS)) - SUB_BUCKETS:
+ * the first SUB_BUCKETS buckets hold small values as they are, then each
+ * power of two gets SUB_BUCKETS buckets of width 2^(e - SUB_BITS).
+ *
+ * @see histogram.h
+ */
+
+
+#include "include/histogram.h"
+
+
+/**
+ * Returns the bucket of a value.
+ */
+int histogram_bucket(unsigned long value){
+  int e;
+
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return (int) value;
+  if (value > HISTOGRAM_MAX)
+    value = HISTOGRAM_MAX;
+
+  e = 63 - __builtin_clzl(value);
+  return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+         (int) (value >> (e - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_BUCKETS;
+}
+
+
+/**
+ * Returns the highest value of a bucket.
+ */
+unsigned long histogram_bucket_max(int bucket){
+  int e, sub;
+
+  if (bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+
+  e = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+  sub = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+  return (((unsigned long) sub + 1) << (e - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+
+void histogram_record(struct histogram *h, unsigned long value){
+  __atomic_fetch_add(&h->counts[histogram_bucket(value)], 1,
+                     __ATOMIC_RELAXED
+  );
+  __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+}
+
+
+void histogram_merge(struct histogram *dst, struct histogram *src){
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+  dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+}
+
+
+void histogram_delta(struct histogram *dst, struct histogram *now,
+                     struct histogram *before){
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    dst->counts[i] = now->counts[i] - before->counts[i];
+  dst->sum = now->sum - before->sum;
+}
+
+
+unsigned long histogram_count(struct histogram *h){
+  unsigned long count = 0;
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    count += h->counts[i];
+  return count;
+}
+
+
+unsigned long histogram_percentile(struct histogram *h, double percentile){
+  unsigned long count, rank, seen;
+  double exact;
+  int i;
+
+  count = histogram_count(h);
+  if (count == 0)
+    return 0;
+
+  // rank of the value at percentile (rounded up), from 1 to count
+  exact = percentile / 100.0 * count;
+  rank = (unsigned long) exact;
+  if (rank < exact)
+    rank++;
+  if (rank < 1)
+    rank = 1;
+  else if (rank > count)
+    rank = count;
+
+  seen = 0;
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++){
+    seen += h->counts[i];
+    if (seen >= rank)
+      return histogram_bucket_max(i);
+  }
+  return HISTOGRAM_MAX;
+}
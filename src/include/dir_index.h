@@ -0,0 +1,146 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief In-memory index of the files served by the TFTP server.
+ *
+ * The index maps the path of each file and directory of the served tree
+ * (relative to the served directory) to its type and size, so that finding
+ * out whether a requested file exists, and how large it is, takes a single
+ * hash table probe instead of a walk of its path on disk.
+ *
+ * The index is built at startup by a pool of threads, each reading a
+ * different directory, and it is kept current with inotify: pending events
+ * are applied before each lookup, so a lookup never misses a change made
+ * before it. Symbolic links are indexed as such, without following them:
+ * requests going through them, as well as names which are not in normal
+ * form (eg. with "." or ".." components), are left to the caller, which
+ * resolves them on disk.
+ *
+ * If the tree cannot be watched (eg. too many directories for the inotify
+ * limits) or some events are lost, the index is disabled and every lookup
+ * is left to the caller.
+ *
+ * An index can be used by many threads at the same time.
+ */
+
+#ifndef DIR_INDEX
+#define DIR_INDEX
+
+
+#include <pthread.h>
+#include <sys/types.h>
+
+
+/** Initial number of buckets of the hash table (doubled when full) */
+#define DIR_INDEX_BUCKETS 1024
+
+/** Maximum number of threads building the index */
+#define DIR_INDEX_MAX_THREADS 8
+
+/** Type of regular files */
+#define DIR_INDEX_FILE 0
+
+/** Type of directories */
+#define DIR_INDEX_DIR 1
+
+/** Type of anything else (symbolic links, devices, ...) */
+#define DIR_INDEX_OTHER 2
+
+
+/**
+ * A file or directory of the served tree.
+ */
+struct dir_index_entry{
+  struct dir_index_entry *hnext;  /**< Next entry in the same bucket */
+  unsigned int hash;              /**< Hash of the path */
+  char *path;                     /**< Path relative to the served directory*/
+  char type;                      /**< DIR_INDEX_FILE, DIR_INDEX_DIR or
+                                       DIR_INDEX_OTHER */
+  off_t size;                     /**< Size of a file (-1 while it is being
+                                       written) */
+};
+
+/**
+ * Counters of an index.
+ */
+struct dir_index_stats{
+  int files;               /**< Indexed files */
+  int dirs;                /**< Indexed directories */
+  double build_time;       /**< Time taken to build the index (s) */
+  unsigned long lookups;   /**< Names looked up */
+  unsigned long found;     /**< Names of indexed files */
+  unsigned long missing;   /**< Names known not to exist */
+  unsigned long unknown;   /**< Names left to the caller */
+  unsigned long updates;   /**< Changes applied from inotify events */
+};
+
+/**
+ * Structure which defines an index.
+ */
+struct dir_index{
+  pthread_mutex_t lock;   /**< Protects every other field */
+  int fd;                 /**< inotify instance (-1 if index is disabled) */
+  int dir_fd;             /**< Descriptor of the served directory */
+  char *dir_realpath;     /**< Real path of the served directory */
+  struct dir_index_entry **buckets;  /**< Hash table */
+  int n_buckets;          /**< Number of buckets */
+  int n_entries;          /**< Number of entries */
+  char **paths;           /**< Relative path of each watched directory, by
+                               watch descriptor */
+  int n_paths;            /**< Allocated size of paths */
+  struct dir_index_stats stats;  /**< Counters */
+};
+
+
+/**
+ * Builds the index of the served directory.
+ *
+ * @param index         index instance [out]
+ * @param dir_realpath  real path of the served directory
+ * @param n_threads     number of threads reading directories (at most
+ *                      DIR_INDEX_MAX_THREADS)
+ * @return              0 in case of success, 1 if the index is disabled
+ */
+int dir_index_init(struct dir_index *index, char *dir_realpath,
+                   int n_threads);
+
+/**
+ * Looks up a requested file.
+ *
+ * @param index      index instance
+ * @param filename   requested file name (leading slashes are ignored)
+ * @param size       size of the file (-1 if not known) [out]
+ * @return
+ * - 0 if the file exists: it is a regular file and none of its parents is a
+ *   symbolic link.
+ * - 1 if the file does not exist.
+ * - 2 if the file must be looked up on disk.
+ */
+int dir_index_lookup(struct dir_index *index, char *filename, off_t *size);
+
+/**
+ * Copies the counters of an index.
+ *
+ * @param index   index instance
+ * @param stats   copy of the counters [out]
+ */
+void dir_index_get_stats(struct dir_index *index,
+                         struct dir_index_stats *stats);
+
+/**
+ * Logs index counters.
+ *
+ * @param index   index instance
+ */
+void dir_index_log_stats(struct dir_index *index);
+
+/**
+ * Releases the index and stops watching the directory.
+ *
+ * @param index   index instance
+ */
+void dir_index_free(struct dir_index *index);
+
+
+#endif
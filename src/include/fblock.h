@@ -6,6 +6,14 @@
  *
  * This library provides functions for reading and writing a text or binary
  * file using a predefined block size.
+ * 
+ * Text files are converted to netascii while they are read and from netascii
+ * while they are written, so that blocks are converted on demand without 
+ * any temporary file.
+ * 
+ * Written blocks are collected in a buffer, which is written to the file 
+ * with a single pwrite once it is full, so that many small blocks result in 
+ * few large writes.
  */
 
 #ifndef FBLOCK
@@ -13,12 +21,14 @@
 
 
 #include <stdio.h>
+#include <sys/types.h>
+#include "netascii.h"
 
 
 /** Mask for getting text/binary mode */
 #define FBLOCK_MODE_MASK   0b01
 
-/** Open file in text mode */
+/** Open file in text mode (converted from/to netascii) */
 #define FBLOCK_MODE_TEXT   0b00
 
 /** Open file in binary mode */
@@ -33,18 +43,55 @@
 /** Open file in write mode */
 #define FBLOCK_WRITE       0b10
 
+/** 
+ * Map file in memory (binary read only), so that blocks can be read without 
+ * copying them.
+ * 
+ * The mapping is only meant to be read by the kernel (eg. through sendmsg):
+ * if the file is truncated while it is mapped, a read from user space would 
+ * raise SIGBUS and kill the whole process, while the kernel just fails the 
+ * system call with EFAULT. For this reason fblock_read still reads mapped 
+ * files with pread, and the actual size of the file is checked with fstat 
+ * before mapping it.
+ * 
+ * @see fblock_read_ptr
+ */
+#define FBLOCK_MMAP        0b100
+
+/** Mask for getting the sync policy (write mode only) */
+#define FBLOCK_SYNC_MASK   0b11000
+
+/** Sync data to disk in fblock_flush (and fblock_close) */
+#define FBLOCK_SYNC        0b01000
+
+/** Sync data to disk also every time the buffer is written */
+#define FBLOCK_SYNC_ALL    0b11000
+
+/** Fail if the file already exists (write mode only) */
+#define FBLOCK_EXCL        0b100000
+
+/** Size of the write buffer */
+#define FBLOCK_BUFFER_SIZE (1 << 18)
+
 
 /**
  * Structure which defines a file.
  */
 struct fblock{
-  FILE *file; /**< Pointer to the file */
+  FILE *file; /**< Pointer to the file (NULL if opened from memory) */
   int block_size;  /**< Predefined block size for i/o operations */
   char mode;  /**< Can be read xor write, text xor binary. */
   union{
-    unsigned int written;  /**< Bytes already written (for future use) */
-    unsigned int remaining;  /**< Remaining bytes to read  */
+    off_t written;  /**< Bytes already written (netascii ones in text mode) */
+    off_t remaining;  /**< Remaining bytes to read  */
   };
+  struct netascii_encoder *encoder; /**< Netascii encoder (text read only) */
+  struct netascii_decoder *decoder; /**< Netascii decoder (text write only) */
+  char *map;      /**< File mapped in memory (NULL if not mapped) */
+  off_t map_len;  /**< Length of the mapping */
+  char *buffer;   /**< Data not written to the file yet (write mode only) */
+  int buffer_len; /**< Number of bytes in buffer */
+  off_t offset;   /**< File offset where buffer is going to be written */
 };
 
 
@@ -63,30 +110,146 @@ struct fblock{
  */
 struct fblock fblock_open(char* filename, int block_size, char mode);
 
+/**
+ * Opens a file from a descriptor which is already open.
+ * 
+ * The descriptor is owned by the fblock from now on: it is closed by 
+ * fblock_close (or right away, in case of error).
+ * 
+ * If the size of the file is already known (eg. from an index of the 
+ * served directory), it is not asked to the file system again, unless the 
+ * file is going to be mapped (FBLOCK_MMAP).
+ *
+ * @param fd          file descriptor, opened with flags matching mode
+ * @param filename    name of the file, used in logs
+ * @param size        size of the file (-1 if not known, read only)
+ * @param block_size  size of the blocks
+ * @param mode        mode (read, write, text, binary)
+ * @return            fblock structure
+ * 
+ * @see fblock_open
+ */
+struct fblock fblock_fdopen(int fd, char* filename, off_t size, 
+                            int block_size, char mode);
+
+/**
+ * Opens a file which is already in memory for reading.
+ * 
+ * Memory is only borrowed: it is not released by fblock_close and it must 
+ * stay valid until then. Blocks can be read both with fblock_read and 
+ * fblock_read_ptr (binary mode only).
+ *
+ * @param data        content of the file
+ * @param size        size of the file
+ * @param block_size  size of the blocks
+ * @param mode        mode (text or binary, read only)
+ * @return            fblock structure
+ * 
+ * @see fblock_open
+ */
+struct fblock fblock_open_mem(char* data, off_t size, int block_size, 
+                              char mode);
+
 /**
  * Reads next block_size bytes from file.
+ * 
+ * In text mode, the bytes are the netascii conversion of the file, so that
+ * a block may contain less than block_size bytes of the file.
  *
  * @param m_fblock    fblock instance
  * @param buffer      block_size bytes buffer
- * @return            0 in case of success, otherwise number of bytes it could 
- *                    not read.
+ * @return            number of bytes read (less than block_size only at the 
+ *                    end of the file), -1 in case of error.
  */
 int fblock_read(struct fblock *m_fblock, char* buffer);
 
+/**
+ * Returns a pointer to the next block_size bytes of a mapped file, without
+ * copying them.
+ * 
+ * The pointer is valid until the file is closed. The file must not be 
+ * truncated in the meantime.
+ *
+ * @param m_fblock    fblock instance (opened with FBLOCK_MMAP or from memory)
+ * @param data        pointer to the block [out]
+ * @return            number of bytes in the block (less than block_size only 
+ *                    at the end of the file), -1 if file is not mapped
+ *                    or it is in text mode.
+ * 
+ * @see FBLOCK_MMAP
+ */
+int fblock_read_ptr(struct fblock *m_fblock, char** data);
+
+/**
+ * Moves to the given position of a file opened for reading, so that next
+ * block is read from there.
+ *
+ * @param m_fblock    fblock instance (binary read mode)
+ * @param offset      position in the file, not beyond its end
+ * @return            0 in case of success, 1 in case of text mode or invalid
+ *                    offset
+ */
+int fblock_seek(struct fblock *m_fblock, off_t offset);
+
 /**
  * Writes next block_size bytes to file.
+ * 
+ * In text mode, buffer contains netascii bytes, which are converted before
+ * being written to the file.
  *
  * @param m_fblock    fblock instance
  * @param buffer      block_size bytes buffer
  * @param block_size  if set to a non-0 value, override block_size defined in 
  *                    fblock.
- * @return            0 in case of success, otherwise number of bytes it could 
- *                    not write.
+ * @return            0 in case of success, -1 in case of bad formatted 
+ *                    netascii, otherwise number of bytes it could not write.
  */
 int fblock_write(struct fblock *m_fblock, char* buffer, int block_size);
 
 /**
- * Closes a file.
+ * Writes len bytes at the given position of the file, so that blocks can be
+ * written out of order.
+ * 
+ * Bytes which follow the buffered ones are still buffered, otherwise the 
+ * buffer is written to the file first.
+ *
+ * @param m_fblock    fblock instance (binary write mode)
+ * @param buffer      bytes to be written
+ * @param len         number of bytes
+ * @param offset      position in the file
+ * @return            0 in case of success, otherwise number of bytes it 
+ *                    could not write.
+ */
+int fblock_write_at(struct fblock *m_fblock, char* buffer, int len, 
+                    off_t offset);
+
+/**
+ * Reserves disk space for the data that is going to be written.
+ * 
+ * Space is allocated at once, reducing fragmentation and metadata updates, 
+ * but the file size is left unchanged: it grows as data is written.
+ * In text mode size is the number of netascii bytes, which is an upper 
+ * bound of the bytes written to the file.
+ * 
+ * Nothing is done if the file system does not support preallocation.
+ *
+ * @param m_fblock    fblock instance (write mode)
+ * @param size        number of bytes to reserve
+ * @return            0 in case of success (or if preallocation is not 
+ *                    supported), 1 if there is not enough space.
+ */
+int fblock_reserve(struct fblock *m_fblock, off_t size);
+
+/**
+ * Writes buffered data to the file, syncing it to disk if FBLOCK_SYNC is set.
+ *
+ * @param m_fblock    fblock instance (write mode)
+ * @return            0 in case of success, 1 otherwise
+ */
+int fblock_flush(struct fblock *m_fblock);
+
+/**
+ * Closes a file, flushing buffered data.
  *
  * @param m_fblock    fblock instance to be closed
  * @return            0 in case of success, EOF in case of failure
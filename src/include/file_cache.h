@@ -0,0 +1,155 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief In-memory cache of the files served by the TFTP server.
+ *
+ * When many clients request the same few files (eg. a boot storm), the files
+ * are read from disk only once and all sessions are served from the same
+ * read-only copy in memory.
+ *
+ * Files are cached whole, up to a total memory budget. When the budget is
+ * exceeded, the least recently used files are evicted. A cached file is
+ * invalidated as soon as its inode, size or modification time change.
+ *
+ * Copies are kept in shared anonymous mappings, so that they are also shared
+ * by any child process forked after they are loaded. A cache can be used by
+ * many threads at the same time.
+ */
+
+#ifndef FILE_CACHE
+#define FILE_CACHE
+
+
+#include <sys/types.h>
+#include <time.h>
+#include <pthread.h>
+
+
+/** Number of buckets of the hash table of cached files */
+#define FILE_CACHE_BUCKETS 1024
+
+/**
+ * Maximum size of a file loaded in the cache.
+ *
+ * Files are read synchronously by the thread which requests them, so every 
+ * other session of an event-loop worker stalls while a file is loaded. This 
+ * bounds the stall to the time needed to read this many bytes. Larger files 
+ * are served from disk.
+ */
+#ifndef FILE_CACHE_MAX_FILE
+#define FILE_CACHE_MAX_FILE (16 << 20)
+#endif
+
+
+/**
+ * A file loaded in memory.
+ *
+ * Entries are reference counted: they are released when they are no longer
+ * cached and nobody is using them.
+ */
+struct file_cache_entry{
+  struct file_cache_entry *prev;   /**< More recently used entry */
+  struct file_cache_entry *next;   /**< Less recently used entry */
+  struct file_cache_entry *hnext;  /**< Next entry in the same bucket */
+  char *path;             /**< Real path of the file */
+  dev_t dev;              /**< Device of the file when it was loaded */
+  ino_t ino;              /**< Inode of the file when it was loaded */
+  struct timespec mtime;  /**< Modification time when it was loaded */
+  off_t size;             /**< Size of the file */
+  char *data;             /**< Read-only copy of the file */
+  int refs;               /**< Number of users of the entry */
+  int cached;             /**< 1 if entry is still in the cache, 0 otherwise */
+};
+
+/**
+ * Counters of a file cache.
+ */
+struct file_cache_stats{
+  unsigned long hits;           /**< Requests served from memory */
+  unsigned long misses;         /**< Requests which needed a disk read */
+  unsigned long evictions;      /**< Files evicted to stay within budget */
+  unsigned long invalidations;  /**< Files dropped since they changed */
+  int files;                    /**< Number of cached files */
+  off_t used;                   /**< Bytes used by cached files */
+};
+
+/**
+ * Structure which defines a file cache.
+ */
+struct file_cache{
+  pthread_mutex_t lock;  /**< Protects every other field */
+  off_t budget;          /**< Maximum number of bytes of cached files */
+  struct file_cache_entry *buckets[FILE_CACHE_BUCKETS]; /**< Hash table */
+  struct file_cache_entry *head;  /**< Most recently used entry */
+  struct file_cache_entry *tail;  /**< Least recently used entry */
+  struct file_cache_stats stats;  /**< Counters */
+};
+
+
+/**
+ * Initializes an empty cache.
+ *
+ * @param cache   cache instance [out]
+ * @param budget  maximum number of bytes of cached files
+ * @return        0 in case of success, 1 otherwise
+ */
+int file_cache_init(struct file_cache *cache, off_t budget);
+
+/**
+ * Gets a file from the cache, loading it if it is not cached or if it
+ * changed since it was loaded.
+ *
+ * Empty files and files larger than the budget or than FILE_CACHE_MAX_FILE 
+ * are never cached. If the budget is exhausted by files in use, the file is
+ * not cached either, so that memory never exceeds the budget.
+ *
+ * If the file is already open, it is checked and read through fd, so that 
+ * its path is not walked again (fd is left open and its offset is not changed).
+ *
+ * @param cache          cache instance
+ * @param file_realpath  real path of the file
+ * @param fd             descriptor of the file (-1 if not open)
+ * @return               entry of the file (to be put back with
+ *                       file_cache_put) or NULL if it could not be cached
+ *
+ * @see file_cache_put
+ */
+struct file_cache_entry* file_cache_get(struct file_cache *cache,
+                                        char *file_realpath, int fd);
+
+/**
+ * Puts back an entry got with file_cache_get.
+ *
+ * @param cache   cache instance
+ * @param entry   entry which is no longer used
+ *
+ * @see file_cache_get
+ */
+void file_cache_put(struct file_cache *cache, struct file_cache_entry *entry);
+
+/**
+ * Copies the counters of a cache.
+ *
+ * @param cache   cache instance
+ * @param stats   copy of the counters [out]
+ */
+void file_cache_get_stats(struct file_cache *cache,
+                          struct file_cache_stats *stats);
+
+/**
+ * Logs cache counters.
+ *
+ * @param cache   cache instance
+ */
+void file_cache_log_stats(struct file_cache *cache);
+
+/**
+ * Releases all cached files. No entry must be in use.
+ *
+ * @param cache   cache instance
+ */
+void file_cache_free(struct file_cache *cache);
+
+
+#endif
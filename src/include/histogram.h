@@ -0,0 +1,93 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Log-bucketed latency histograms.
+ *
+ * Values (eg. microseconds) are counted in buckets whose width grows with
+ * the value, like in HdrHistogram: values below 2^HISTOGRAM_SUB_BITS have a
+ * bucket each, then every power of two is split into 2^HISTOGRAM_SUB_BITS
+ * buckets, so that any value is known with an error below 1/32 (about 3%).
+ * Values above HISTOGRAM_MAX are counted as HISTOGRAM_MAX.
+ *
+ * Recording a value takes two atomic additions and no lock, so that many
+ * threads (or processes, if the histogram is in shared memory) can record in
+ * the same histogram. Since buckets are the same for every histogram,
+ * histograms recorded by different threads can be merged by adding their
+ * buckets, and the values recorded in an interval are the difference of two
+ * snapshots.
+ */
+
+#ifndef HISTOGRAM
+#define HISTOGRAM
+
+
+/** Bits of a value which select the bucket within its power of two */
+#define HISTOGRAM_SUB_BITS 5
+
+/** Number of buckets within each power of two */
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/** Highest power of two of the values which are counted */
+#define HISTOGRAM_MAX_BITS 36
+
+/** Highest value which is counted (about 19 hours in microseconds) */
+#define HISTOGRAM_MAX ((1UL << HISTOGRAM_MAX_BITS) - 1)
+
+/** Number of buckets */
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+
+/**
+ * A histogram (all zeros when empty).
+ */
+struct histogram{
+  unsigned long counts[HISTOGRAM_BUCKETS];  /**< Values in each bucket */
+  unsigned long sum;                        /**< Sum of the values */
+};
+
+
+/**
+ * Counts a value.
+ *
+ * @param h       histogram
+ * @param value   recorded value
+ */
+void histogram_record(struct histogram *h, unsigned long value);
+
+/**
+ * Adds the values of a histogram to another one.
+ *
+ * @param dst   histogram which gets the values
+ * @param src   histogram whose values are added (can be updated meanwhile)
+ */
+void histogram_merge(struct histogram *dst, struct histogram *src);
+
+/**
+ * Computes the values recorded between two snapshots of a histogram.
+ *
+ * @param dst      histogram which gets the values
+ * @param now      latest snapshot
+ * @param before   earlier snapshot
+ */
+void histogram_delta(struct histogram *dst, struct histogram *now,
+                     struct histogram *before);
+
+/**
+ * Returns the number of values in a histogram.
+ */
+unsigned long histogram_count(struct histogram *h);
+
+/**
+ * Returns a percentile of the values in a histogram, that is the highest
+ * value of the bucket which holds it.
+ *
+ * @param h            histogram
+ * @param percentile   percentile (from 0 to 100, eg. 99.9)
+ * @return             value at percentile (0 if the histogram is empty)
+ */
+unsigned long histogram_percentile(struct histogram *h, double percentile);
+
+
+#endif
@@ -8,6 +8,9 @@
  * IP address string and integer port number and for binding to a random 
  * port (chosen using rand() builtin C function).
  * 
+ * It also provides functions for sending and receiving multicast datagrams
+ * on the interface used to reach a given host.
+ * 
  * @see sockaddr_in
  * @see rand
  */
@@ -48,6 +51,56 @@
  */
 int bind_random_port(int socket, struct sockaddr_in *addr);
 
+/**
+ * Binds socket to the given address, allowing other sockets to do the same.
+ * 
+ * SO_REUSEPORT is set on the socket before binding, so that many sockets 
+ * (eg one for each thread) can listen on the same port, with the kernel
+ * spreading incoming datagrams among them.
+ *
+ * @param socket    socket ID
+ * @param addr      inet addr structure
+ * @return          0 in case of success, 1 otherwise
+ */
+int bind_reuseport(int socket, struct sockaddr_in *addr);
+
+/**
+ * Finds the local address used to reach a host (no datagram is sent).
+ *
+ * @param peer      address of the host
+ * @param local     local address [out]
+ * @return          0 in case of success, 1 otherwise
+ */
+int get_local_addr(struct sockaddr_in *peer, struct in_addr *local);
+
+/**
+ * Makes multicast datagrams sent on the socket go through the interface of
+ * the given local address. Datagrams are also looped back, so that clients
+ * on the same host receive them: since they bind the group to the port of
+ * the socket, the port is made reusable and the socket does not receive 
+ * datagrams sent to the group.
+ *
+ * @param socket    socket ID
+ * @param ifaddr    local address of the interface
+ * @return          0 in case of success, 1 otherwise
+ */
+int set_multicast_if(int socket, struct in_addr *ifaddr);
+
+/**
+ * Binds socket to a multicast group and joins it on the interface of the 
+ * given local address.
+ * 
+ * SO_REUSEADDR is set on the socket before binding, so that many clients 
+ * on the same host can join the same group.
+ *
+ * @param socket    socket ID
+ * @param group     address and port of the group
+ * @param ifaddr    local address of the interface
+ * @return          0 in case of success, 1 otherwise
+ */
+int join_multicast_group(int socket, struct sockaddr_in *group, 
+                         struct in_addr *ifaddr);
+
 /**
  * Makes sockaddr_in structure given ip string and port of server.
  *
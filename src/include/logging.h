@@ -1,32 +1,42 @@
 /**
  * @file
  * @author Riccardo Mancini
- * 
+ *
  * @brief Logging macro.
- * 
+ *
  * This file contains a macro for logging in different levels.
  *
  * There are 5 levels of logging:
- *  - fatal (LOG_FATAL) 
+ *  - fatal (LOG_FATAL)
  *  - error (LOG_ERROR)
  *  - warning (LOG_WARN)
  *  - information (LOG_INFO)
  *  - debug (LOG_DEBUG)
- * 
+ *
  * The first three will be outputted to stderr, the latter two to stdout.
- * 
- * You can define a LOG_LEVEL for hiding some of the logging messages in a 
+ *
+ * You can define a LOG_LEVEL for hiding some of the logging messages in a
  * per-executable basis.
  * In order to do so, you need to put
  * ```
  * const int LOG_LEVEL = LOG_INFO;
  * ```
- * in the file containing the main and 
+ * in the file containing the main and
  * ```
  * extern const int LOG_LEVEL;
  * ```
  * in any other file using this macro.
- * 
+ *
+ * Levels above LOG_MAX_LEVEL (eg. -DLOG_MAX_LEVEL=LOG_WARN) are removed at
+ * compile time, so that their messages cost nothing, not even a comparison.
+ *
+ * By default messages are written as soon as they are logged. After
+ * log_start_async, messages are instead stored in a ring buffer of the
+ * calling thread (without any lock nor system call) and written in batches
+ * by a background thread, which is woken up right away only by errors.
+ * Each process has its own writer thread, which is started again in forked
+ * children when they first log something.
+ *
  * Adapted from https://stackoverflow.com/a/328660
  */
 
@@ -34,52 +44,58 @@
 #define LOGGING
 
 
-#include <stdio.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-
 #define LOG_FATAL    (1)
 #define LOG_ERR      (2)
 #define LOG_WARN     (3)
 #define LOG_INFO     (4)
 #define LOG_DEBUG    (5)
 
+/** Highest level which is compiled in */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+/** Number of messages in the ring buffer of each thread */
+#define LOG_RING_SIZE 512
+
+/** Maximum length of a message stored in a ring buffer (longer ones are
+ *  truncated) */
+#define LOG_MSG_LEN 480
+
 
 #define LOG(level, ...) do {  \
-                          if (level <= LOG_LEVEL) { \
-                            FILE *dbgstream; \
-                            char where[25]; \
-                            switch(level){ \
-                              case LOG_FATAL: \
-                                dbgstream = stderr; \
-                                fprintf(dbgstream, "[FATAL]"); \
-                                break; \
-                              case LOG_ERR: \
-                                dbgstream = stderr; \
-                                fprintf(dbgstream, "[ERROR]"); \
-                                break; \
-                              case LOG_WARN: \
-                                dbgstream = stderr; \
-                                fprintf(dbgstream, "[WARN ]"); \
-                                break; \
-                              case LOG_INFO: \
-                                dbgstream = stdout; \
-                                fprintf(dbgstream, "[INFO ]"); \
-                                break; \
-                              case LOG_DEBUG: \
-                                dbgstream = stdout; \
-                                fprintf(dbgstream, "[DEBUG]"); \
-                                break; \
-                            } \
-                            fprintf(dbgstream, "[%-5d]", (int) getpid()); \
-                            snprintf(where, 25, "%s:%d", __FILE__, __LINE__); \
-                            fprintf(dbgstream, " %-25s ", where); \
-                            fprintf(dbgstream, __VA_ARGS__); \
-                            fprintf(dbgstream, "\n"); \
-                            fflush(dbgstream); \
-                          } \
+                          if ((level) <= LOG_MAX_LEVEL && \
+                              (level) <= LOG_LEVEL) \
+                            log_write(level, __FILE__, __LINE__, \
+                                      __VA_ARGS__); \
                         } while (0)
 
 
+/**
+ * Writes (or stores, in asynchronous mode) a message. Use LOG instead.
+ *
+ * @param level   level of the message
+ * @param file    source file which logged the message
+ * @param line    line of the source file
+ * @param format  printf-like format of the message, followed by its arguments
+ */
+void log_write(int level, const char *file, int line, const char *format,
+               ...) __attribute__ ((format (printf, 4, 5)));
+
+/**
+ * Starts writing messages from a background thread.
+ *
+ * Pending messages are written at exit too.
+ *
+ * @return  0 in case of success, 1 otherwise (messages are still written
+ *          right away)
+ */
+int log_start_async();
+
+/**
+ * Writes pending messages and stops the background thread of this process.
+ */
+void log_stop_async();
+
+
 #endif
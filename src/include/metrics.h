@@ -0,0 +1,229 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Counters of the TFTP server, shared by all of its processes.
+ *
+ * Counters are kept in a region of shared memory mapped before any process
+ * is forked, so that transfers served by forked children are accounted for
+ * as well as the ones served by event loops. There are global counters
+ * (requests, ERRORs sent by code, transfers, DATA blocks and bytes sent,
+ * retransmissions, ...) and a slot of counters for each active transfer
+ * (session). All counters are updated with atomic operations, without locks.
+ *
+ * Latencies are counted in histograms (see histogram.h): the time from the
+ * arrival of a read request to the first reply sent (OACK or first DATA) and
+ * the round trip time of every DATA message (and OACK) which was not sent
+ * again. Each thread (or process) records in one of METRICS_SHARDS copies of
+ * each histogram, so that they seldom share a cache line; copies are merged
+ * when read. Percentiles of the latencies recorded in the last interval can
+ * be logged periodically.
+ *
+ * Counters are exported in the Prometheus text format on a Unix socket: each
+ * connection gets the current values and is then closed. If the client sends
+ * an HTTP GET first (eg. curl --unix-socket), the values come with an HTTP
+ * response header.
+ *
+ * Until metrics_init is called, every function does nothing (the client
+ * never calls it).
+ */
+
+#ifndef METRICS
+#define METRICS
+
+
+#include "histogram.h"
+#include <netinet/in.h>
+
+
+/** Maximum number of sessions with their own counters */
+#define METRICS_MAX_SESSIONS 1024
+
+/** Number of TFTP error codes (0 to 8) */
+#define METRICS_N_ERRORS 9
+
+/** Maximum length of the file name of a session (longer ones are cut at the
+ *  beginning) */
+#define METRICS_NAME_LEN 96
+
+/** Maximum size of the exported text */
+#define METRICS_TEXT_SIZE (1 << 20)
+
+/** Number of copies of each histogram */
+#define METRICS_SHARDS 16
+
+
+/**
+ * Counters of an active transfer.
+ */
+struct metrics_session{
+  int in_use;               /**< Set to 1 while the slot is taken */
+  int pid;                  /**< Process serving the transfer */
+  int upload;               /**< Set to 1 for write requests */
+  char filename[METRICS_NAME_LEN];  /**< Requested file */
+  struct sockaddr_in addr;  /**< Address of the client */
+  long long start;          /**< When the transfer started (ms since epoch) */
+  unsigned long bytes;      /**< DATA payload bytes sent */
+  unsigned long blocks;     /**< DATA messages sent */
+  unsigned long retransmits;  /**< DATA messages sent again */
+  long long request_time;   /**< When the read request arrived (us, see 
+                                 tftp_clock_us), 0 after the first reply */
+};
+
+/**
+ * Global counters.
+ */
+struct metrics_counters{
+  unsigned long rrqs;       /**< Read requests received */
+  unsigned long wrqs;       /**< Write requests received */
+  unsigned long other;      /**< Other messages received on the server port */
+  unsigned long rejected;   /**< Requests answered with an ERROR right away */
+  unsigned long started;    /**< Transfers started */
+  unsigned long completed;  /**< Transfers completed */
+  unsigned long failed;     /**< Transfers failed */
+  long active;              /**< Transfers in progress */
+  unsigned long untracked;  /**< Transfers without a session slot */
+  unsigned long bytes;      /**< DATA payload bytes sent */
+  unsigned long blocks;     /**< DATA messages sent */
+  unsigned long retransmits;  /**< DATA messages sent again */
+  unsigned long timeouts;   /**< Retransmission timeouts */
+  unsigned long errors[METRICS_N_ERRORS];  /**< ERRORs sent, by code */
+  long long start;          /**< When the server started (ms since epoch) */
+};
+
+/**
+ * Latency histograms recorded by some threads.
+ *
+ * Times are in microseconds.
+ */
+struct metrics_shard{
+  struct histogram first_reply;  /**< From read request to first reply */
+  struct histogram rtt;          /**< Round trip times */
+};
+
+/**
+ * The shared memory region.
+ */
+struct metrics{
+  struct metrics_counters global;  /**< Global counters */
+  int next_shard;                  /**< Shard of the next thread */
+  struct metrics_shard shards[METRICS_SHARDS];  /**< Latency histograms */
+  struct metrics_session sessions[METRICS_MAX_SESSIONS + 1];  /**< Slots of
+    active transfers (the last one is shared by transfers without a slot) */
+};
+
+
+/**
+ * Maps the shared counters and starts exporting them on a Unix socket and/or
+ * logging latency percentiles periodically.
+ *
+ * Must be called before forking any process which updates counters.
+ *
+ * @param socket_path     path of the socket (replaced if it exists), NULL 
+ *                        for none
+ * @param dump_interval   seconds between two logs of latency percentiles, 0
+ *                        for none
+ * @return                0 in case of success, 1 otherwise
+ */
+int metrics_init(char *socket_path, int dump_interval);
+
+/**
+ * Counts a message received on the server port.
+ *
+ * It also takes its arrival time, which is the start of the latency of the 
+ * first reply of the next transfer started by the calling thread (or by a 
+ * process forked afterwards).
+ *
+ * @param type   message type (TFTP_TYPE_RRQ, TFTP_TYPE_WRQ or anything else)
+ */
+void metrics_count_request(int type);
+
+/**
+ * Counts a request answered with an ERROR without starting a transfer.
+ */
+void metrics_count_rejected();
+
+/**
+ * Counts an ERROR message sent.
+ *
+ * @param error_code   TFTP error code
+ */
+void metrics_count_error(int error_code);
+
+/**
+ * Takes a slot for a new transfer.
+ *
+ * @param upload     1 for write requests, 0 for read requests
+ * @param filename   requested file
+ * @param addr       address of the client
+ * @return           slot of the transfer, NULL if metrics are not enabled
+ */
+struct metrics_session* metrics_session_start(int upload, char *filename,
+                                              struct sockaddr_in *addr);
+
+/**
+ * Releases the slot of a transfer.
+ *
+ * @param session   slot of the transfer (can be NULL)
+ * @param failed    1 if the transfer failed, 0 otherwise
+ */
+void metrics_session_end(struct metrics_session *session, int failed);
+
+/**
+ * Counts the first reply to a read request (OACK), if it was not counted yet.
+ *
+ * @param session   slot of the transfer (can be NULL)
+ */
+void metrics_count_reply(struct metrics_session *session);
+
+/**
+ * Counts a DATA message sent (and the first reply, like metrics_count_reply).
+ *
+ * @param session   slot of the transfer (can be NULL)
+ * @param bytes     payload size
+ */
+void metrics_count_block(struct metrics_session *session, int bytes);
+
+/**
+ * Counts the round trip time of a message.
+ *
+ * @param session   slot of the transfer (can be NULL)
+ * @param rtt       round trip time (us)
+ */
+void metrics_count_rtt(struct metrics_session *session, long long rtt);
+
+/**
+ * Counts a DATA message sent again.
+ *
+ * @param session   slot of the transfer (can be NULL)
+ */
+void metrics_count_retransmit(struct metrics_session *session);
+
+/**
+ * Counts a retransmission timeout.
+ *
+ * @param session   slot of the transfer (can be NULL)
+ */
+void metrics_count_timeout(struct metrics_session *session);
+
+/**
+ * Writes all counters in the Prometheus text format.
+ *
+ * Slots of processes which died without releasing them are released (the
+ * transfer is counted as failed).
+ *
+ * @param buffer   output buffer
+ * @param size     size of buffer
+ * @return         length of the text (at most size - 1)
+ */
+int metrics_format(char *buffer, int size);
+
+/**
+ * Stops exporting counters, logs the last latency percentiles (if they are
+ * logged periodically) and removes the socket. Only the process which called
+ * metrics_init does anything.
+ */
+void metrics_free();
+
+
+#endif
@@ -0,0 +1,146 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Negative lookup cache of the files requested to the TFTP server.
+ *
+ * PXE clients probe many configuration files which do not exist (by MAC
+ * address, by prefixes of their IP address in hex, ...) before finding one.
+ * This cache remembers the names of recently requested files which were not
+ * found, so that further requests for them are answered without resolving
+ * their path again.
+ *
+ * The cache holds a bounded number of names: when it is full, the least
+ * recently used one is evicted. The served directory and all of its
+ * subdirectories are watched with inotify: whenever anything is created,
+ * moved in or has its attributes changed, the whole cache is flushed.
+ * Pending events are read before each lookup, so a name is never reported
+ * missing after the file has been created. Targets of symbolic links outside
+ * of the directory are not watched.
+ *
+ * A cache can be used by many threads at the same time.
+ */
+
+#ifndef NEG_CACHE
+#define NEG_CACHE
+
+
+#include <pthread.h>
+
+
+/** Default maximum number of names in a negative cache */
+#define NEG_CACHE_SIZE 4096
+
+/** Number of buckets of the hash table of names */
+#define NEG_CACHE_BUCKETS 8192
+
+
+/**
+ * The name of a file which was not found.
+ */
+struct neg_cache_entry{
+  struct neg_cache_entry *prev;   /**< More recently used entry */
+  struct neg_cache_entry *next;   /**< Less recently used entry */
+  struct neg_cache_entry *hnext;  /**< Next entry in the same bucket */
+  unsigned int hash;              /**< Hash of the name */
+  char *name;                     /**< Requested file name */
+};
+
+/**
+ * Counters of a negative cache.
+ */
+struct neg_cache_stats{
+  unsigned long lookups;    /**< Names looked up */
+  unsigned long hits;       /**< Names known to be missing */
+  unsigned long inserts;    /**< Missing names added */
+  unsigned long evictions;  /**< Names evicted to stay within size */
+  unsigned long flushes;    /**< Flushes caused by directory changes */
+  int entries;              /**< Number of cached names */
+};
+
+/**
+ * Structure which defines a negative cache.
+ */
+struct neg_cache{
+  pthread_mutex_t lock;   /**< Protects every other field */
+  int fd;                 /**< inotify instance (-1 if cache is disabled) */
+  int size;               /**< Maximum number of names */
+  unsigned long generation;  /**< Incremented at each flush */
+  struct neg_cache_entry *buckets[NEG_CACHE_BUCKETS];  /**< Hash table */
+  struct neg_cache_entry *head;   /**< Most recently used entry */
+  struct neg_cache_entry *tail;   /**< Least recently used entry */
+  struct neg_cache_stats stats;   /**< Counters */
+  char **paths;           /**< Path of each watched directory, by watch 
+                               descriptor */
+  int n_paths;            /**< Allocated size of paths */
+};
+
+
+/**
+ * Initializes an empty cache watching the served directory.
+ *
+ * If the directory cannot be watched (eg. too many subdirectories for the
+ * inotify limits), the cache is disabled: lookups always miss.
+ *
+ * @param cache         cache instance [out]
+ * @param dir_realpath  real path of the served directory
+ * @param size          maximum number of names
+ * @return              0 in case of success, 1 if the cache is disabled
+ */
+int neg_cache_init(struct neg_cache *cache, char *dir_realpath, int size);
+
+/**
+ * Checks whether a file name is known to be missing.
+ *
+ * @param cache      cache instance
+ * @param name       requested file name
+ * @param generation generation of the cache, to be passed to
+ *                   neg_cache_insert if the file turns out to be missing
+ *                   [out]
+ * @return           1 if the file is known to be missing, 0 otherwise
+ *
+ * @see neg_cache_insert
+ */
+int neg_cache_lookup(struct neg_cache *cache, char *name,
+                     unsigned long *generation);
+
+/**
+ * Remembers that a file is missing.
+ *
+ * The name is not added if the directory changed since the lookup (the file
+ * may have been created after its path was resolved).
+ *
+ * @param cache      cache instance
+ * @param name       requested file name
+ * @param generation generation returned by neg_cache_lookup
+ *
+ * @see neg_cache_lookup
+ */
+void neg_cache_insert(struct neg_cache *cache, char *name,
+                      unsigned long generation);
+
+/**
+ * Copies the counters of a cache.
+ *
+ * @param cache   cache instance
+ * @param stats   copy of the counters [out]
+ */
+void neg_cache_get_stats(struct neg_cache *cache,
+                         struct neg_cache_stats *stats);
+
+/**
+ * Logs cache counters, with the hit rate.
+ *
+ * @param cache   cache instance
+ */
+void neg_cache_log_stats(struct neg_cache *cache);
+
+/**
+ * Releases all cached names and stops watching the directory.
+ *
+ * @param cache   cache instance
+ */
+void neg_cache_free(struct neg_cache *cache);
+
+
+#endif
@@ -5,11 +5,15 @@
  * @brief Conversion functions from netascii to Unix standard ASCII.
  *
  * This library provides two functions to convert a file from netascii to Unix
- * standard ASCII and viceversa.
+ * standard ASCII and viceversa, and a streaming encoder and decoder which 
+ * do the same conversions incrementally, one block at a time.
  * In particular, there are only two differences:
  * - `LF` in Unix becomes `CRLF` in netascii
  * - `CR` in Unix becomes `CRNUL` in netascii
  * 
+ * Runs of bytes which need no conversion are looked for with SSE2 or AVX2 
+ * instructions when the CPU supports them, and are copied in bulk.
+ * 
  * @see https://tools.ietf.org/html/rfc764
  */
 
@@ -18,6 +22,74 @@
 #define NETASCII
 
 
+/** Size of the buffers of the streaming encoder and decoder */
+#define NETASCII_BUF_LEN 4096
+
+/** Portable byte-at-a-time implementation of the conversion kernels */
+#define NETASCII_IMPL_SCALAR 0
+
+/** SSE2 implementation of the conversion kernels (16 bytes at a time) */
+#define NETASCII_IMPL_SSE2   1
+
+/** AVX2 implementation of the conversion kernels (32 bytes at a time) */
+#define NETASCII_IMPL_AVX2   2
+
+
+/**
+ * State of a streaming Unix to netascii conversion.
+ * 
+ * Unix bytes are loaded in buf by the user of the encoder (eg. fblock) and 
+ * are converted by netascii_encode as output space is made available. 
+ * The conversion state is kept between calls, so that CR and LF sequences 
+ * can cross the boundaries of both input buffers and output blocks.
+ * 
+ * @see netascii_encoder_init
+ * @see netascii_encode
+ */
+struct netascii_encoder{
+  char buf[NETASCII_BUF_LEN]; /**< Unix bytes to be converted */
+  int len;                    /**< Number of valid bytes in buf */
+  int pos;                    /**< Next byte of buf to be converted */
+  int prev_cr;                /**< Set to 1 if previous input byte was CR */
+  int skip_nul;               /**< Set to 1 if a NUL after CR must be dropped */
+  int pending;                /**< Byte which did not fit in output (or -1) */
+};
+
+
+/**
+ * State of a streaming netascii to Unix conversion.
+ * 
+ * Netascii bytes are decoded into buf, which can then be written to the 
+ * file. A CR which is the last byte of a block is kept until the next byte 
+ * is known.
+ * 
+ * @see netascii_decoder_init
+ * @see netascii_decode
+ */
+struct netascii_decoder{
+  char buf[NETASCII_BUF_LEN]; /**< Decoded Unix bytes */
+  int pending_cr;             /**< Set to 1 if last input byte was CR */
+};
+
+
+/**
+ * Returns the fastest implementation of the conversion kernels supported by 
+ * the CPU. It is selected automatically on first use.
+ * 
+ * @return NETASCII_IMPL_AVX2, NETASCII_IMPL_SSE2 or NETASCII_IMPL_SCALAR
+ */
+int netascii_best_impl();
+
+/**
+ * Selects the implementation of the conversion kernels used by both the 
+ * file and the streaming conversion functions. Output is the same for all 
+ * of them.
+ * 
+ * @param impl  NETASCII_IMPL_SCALAR, NETASCII_IMPL_SSE2 or NETASCII_IMPL_AVX2
+ * @return      0 in case of success, 1 if it is not supported by the CPU
+ */
+int netascii_select_impl(int impl);
+
 /**
  * Unix to netascii conversion.
  * 
@@ -41,9 +113,53 @@ int unix2netascii(char *unix_filename, char* netascii_filename);
  * - 1 in case of an error opening unix_filename file
  * - 2 in case of an error opening netascii_filename file
  * - 3 in case of an error writing to unix_filename file
- * - 3 in case of bad formatted netascii
+ * - 4 in case of bad formatted netascii
  */ 
 int netascii2unix(char* netascii_filename, char *unix_filename);
 
+/**
+ * Initializes a streaming Unix to netascii encoder with an empty buffer.
+ * 
+ * @param encoder   the encoder to be initialized [out]
+ */
+void netascii_encoder_init(struct netascii_encoder *encoder);
+
+/**
+ * Converts bytes in encoder buffer until either out is full or the buffer is
+ * empty. The conversion is the same of unix2netascii.
+ * 
+ * Once the buffer is empty (pos == len) and no byte is pending, it can be 
+ * filled again with the following bytes of the file.
+ * 
+ * @param encoder   encoder state
+ * @param out       output buffer [out]
+ * @param out_len   size of the output buffer
+ * @return          number of bytes written to out
+ * 
+ * @see unix2netascii
+ */
+int netascii_encode(struct netascii_encoder *encoder, char *out, int out_len);
+
+/**
+ * Initializes a streaming netascii to Unix decoder.
+ * 
+ * @param decoder   the decoder to be initialized [out]
+ */
+void netascii_decoder_init(struct netascii_decoder *decoder);
+
+/**
+ * Decodes up to NETASCII_BUF_LEN netascii bytes into decoder buffer. The 
+ * conversion is the same of netascii2unix.
+ * 
+ * @param decoder   decoder state
+ * @param in        netascii bytes
+ * @param in_len    number of bytes in in (at most NETASCII_BUF_LEN)
+ * @return          number of decoded bytes in decoder->buf, -1 in case of 
+ *                  bad formatted netascii
+ * 
+ * @see netascii2unix
+ */
+int netascii_decode(struct netascii_decoder *decoder, char *in, int in_len);
+
 
 #endif
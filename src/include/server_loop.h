@@ -0,0 +1,140 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ * 
+ * @brief Event-driven engine for the TFTP server.
+ *
+ * Instead of forking a new process for each request, every transfer is run as
+ * a non-blocking session inside a single process. Each session owns its own 
+ * socket (its TID) and all sockets are monitored through one epoll instance.
+ * Whenever a message is received, the corresponding session is advanced by 
+ * one step.
+ * 
+ * Retransmission deadlines of all sessions are kept in a binary min-heap, so
+ * that the loop sleeps until the earliest one and expired sessions are found
+ * in constant time.
+ * 
+ * Sessions serving write requests (when enabled) wait for one more deadline
+ * after the last block, in case its ACK was lost.
+ * 
+ * If a multicast group address is set, read requests with the multicast 
+ * option (RFC 2090) for the same file are served by a single session, which
+ * sends each block to the group once. Its clients are queued: the first one
+ * is the master client, whose ACKs drive the transfer. When it is done (or 
+ * it fails), the next client becomes master and the transfer goes on from 
+ * the first block it misses. The session ends when no client is left. Only
+ * octet files with at most 65535 blocks are sent in multicast, in lock-step
+ * (other requests fall back to unicast).
+ * 
+ * @see tftp_sender
+ * @see tftp_receiver
+ */
+
+#ifndef SERVER_LOOP
+#define SERVER_LOOP
+
+
+#include <netinet/in.h>
+#include "file_cache.h"
+#include "neg_cache.h"
+
+/** Maximum number of events handled for each epoll_wait call */
+#define SERVER_LOOP_MAX_EVENTS 64
+
+/** 
+ * Maximum time (in ms) the loop sleeps before checking whether to stop (if 
+ * no retransmission deadline comes first)
+ */
+#define SERVER_LOOP_TICK 1000
+
+/** Seconds between two logs of the loop counters (if they changed) */
+#define SERVER_LOOP_STATS_INTERVAL 10
+
+
+/** A transfer being served by the event loop (defined in server_loop.c) */
+struct session;
+
+/**
+ * Counters of an event loop instance.
+ */
+struct server_loop_stats{
+  unsigned long requests;   /**< Messages received on listening socket */
+  unsigned long rejected;   /**< Requests answered with an ERROR */
+  unsigned long started;    /**< Transfers started */
+  unsigned long completed;  /**< Transfers completed successfully */
+  unsigned long failed;     /**< Transfers terminated by an error */
+  unsigned long timeouts;   /**< Retransmission timeouts */
+  unsigned long mc_clients; /**< Clients served in multicast groups */
+  long long mc_saved;       /**< Bytes not sent thanks to multicast (file
+                                 size times clients which received it, 
+                                 minus DATA bytes actually sent) */
+};
+
+/**
+ * Structure which defines an event loop instance.
+ * 
+ * Instances do not share any state but the caches, so that many of them can 
+ * be run in different threads, each one with its own listening socket.
+ */
+struct server_loop{
+  int id;              /**< Identifier of the loop (eg worker number) */
+  int epfd;            /**< epoll instance */
+  int sd;              /**< Listening socket */
+  char *dir_realpath;  /**< Real path of the served directory */
+  int dir_fd;          /**< Descriptor of the served directory, files are 
+                            looked up relative to it (-1, the default, to 
+                            look them up by path) */
+  struct file_cache *cache;  /**< Cache of served files (can be NULL) */
+  struct neg_cache *neg_cache;  /**< Cache of missing files (can be NULL) */
+  struct dir_index *dir_index;  /**< Index of the served directory (can be 
+                                     NULL) */
+  int uploads;         /**< Set to 1 to accept write requests (default 0) */
+  char sync;           /**< Sync policy of uploaded files (FBLOCK_SYNC or 
+                            FBLOCK_SYNC_ALL, default 0) */
+  struct in_addr mc_addr;  /**< Multicast group address (INADDR_ANY, the
+                                default, disables multicast) */
+  int n_sessions;      /**< Number of active sessions */
+  struct session *sessions;        /**< List of active sessions */
+  struct session **timers;  /**< Heap of sessions by deadline */
+  int n_timers;             /**< Number of sessions in timers */
+  int timers_size;          /**< Allocated size of timers */
+  struct server_loop_stats stats;  /**< Counters */
+  volatile int stop;   /**< Set to 1 to make server_loop_run return */
+};
+
+
+/**
+ * Initializes an event loop serving requests coming from the given socket.
+ * 
+ * The listening socket is switched to non-blocking mode.
+ * 
+ * @param loop          event loop instance [out]
+ * @param id            identifier of the loop, used in logs
+ * @param sd            listening socket, already bound
+ * @param dir_realpath  real path of the served directory
+ * @param cache         cache of served files, possibly shared with other 
+ *                      loops (can be NULL)
+ * @return              0 in case of success, 1 otherwise
+ */
+int server_loop_init(struct server_loop *loop, int id, int sd, 
+                     char *dir_realpath, struct file_cache *cache);
+
+/**
+ * Runs the event loop until loop->stop is set.
+ * 
+ * Before returning, all active sessions are terminated.
+ * 
+ * @param loop   event loop instance
+ * @return       0 if the loop was stopped, 1 in case of a fatal error
+ */
+int server_loop_run(struct server_loop *loop);
+
+/**
+ * Logs loop counters.
+ * 
+ * @param loop   event loop instance
+ */
+void server_loop_log_stats(struct server_loop *loop);
+
+
+#endif
@@ -0,0 +1,231 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ * 
+ * @brief Request handling functions shared by the TFTP server engines.
+ *
+ * The server can either fork a new process for each request or serve all of
+ * them from a single event loop. This library contains the steps both engines
+ * have in common: checking that the requested file is inside the served 
+ * directory and opening it in the requested transfer mode, for reading 
+ * (RRQ) or for writing (WRQ).
+ *
+ * Requested files are looked up relative to a descriptor of the served 
+ * directory, opened once at startup, with openat2(RESOLVE_BENEATH): a single
+ * system call both checks that the file is inside the directory (symbolic 
+ * links included) and opens it. On kernels older than 5.6, which lack 
+ * openat2, the real paths of the file and of its parents are compared 
+ * instead. If the served tree is indexed in memory, missing files are found
+ * out without touching the disk at all.
+ */
+
+#ifndef SERVER_UTILS
+#define SERVER_UTILS
+
+
+#include "fblock.h"
+#include "tftp_msgs.h"
+#include "file_cache.h"
+#include "dir_index.h"
+
+
+/** 
+ * Maximum window size accepted by the server.
+ * 
+ * Each session keeps a whole window in memory, so this limits memory usage to
+ * MAX_WINDOWSIZE * (blksize + 4) bytes per session.
+ */
+#define MAX_WINDOWSIZE 64
+
+
+/** Finds longest common prefix length of strings str1 and str2 */
+int strlcpl(const char* str1, const char* str2);
+
+/** 
+ * Check whether file is inside dir.
+ * 
+ * @param path  file absolute path (can include .. and .  and multiple /)
+ * @param dir   directory real path (can't include .. and . and multiple /)
+ * @return      1 if true, 0 otherwise
+ * 
+ * @see realpath
+ */
+int path_inside_dir(char* path, char* dir);
+
+/**
+ * Opens the served directory, so that requested files can be looked up 
+ * relative to it.
+ * 
+ * @param dir_realpath   real path of the served directory
+ * @return               descriptor of the directory, -1 in case of error
+ */
+int open_served_dir(char* dir_realpath);
+
+/**
+ * Resolves the real path of a file requested by a client and opens it for
+ * reading.
+ * 
+ * If dir_fd is -1 (or openat2 is not available), the file is checked by 
+ * comparing real paths and then opened by path.
+ * 
+ * @param dir_fd         descriptor returned by open_served_dir, or -1 [in]
+ * @param dir_realpath   real path of the served directory [in]
+ * @param filename       filename as found in the request [in]
+ * @param file_realpath  real path of the file, PATH_MAX long [out]
+ * @param fd             descriptor of the file, to be passed to 
+ *                       open_request_file (or closed) [out]
+ * @return
+ * - 0 in case of success.
+ * - 1 in case of file not found.
+ * - 2 in case of file outside of dir_realpath.
+ * 
+ * @see open_served_dir
+ */
+int resolve_request_path(int dir_fd, char* dir_realpath, char* filename, 
+                         char* file_realpath, int *fd);
+
+/**
+ * Resolves the real path of a file requested by a client and opens it for
+ * reading, like resolve_request_path, looking it up in an index of the 
+ * served directory first.
+ * 
+ * Files the index knows to be missing are reported without touching the 
+ * disk. Indexed files are opened with a single openat2 and their size is 
+ * taken from the index. Anything else goes through resolve_request_path.
+ * 
+ * @param index          index of the served directory (can be NULL) [in]
+ * @param dir_fd         descriptor returned by open_served_dir, or -1 [in]
+ * @param dir_realpath   real path of the served directory [in]
+ * @param filename       filename as found in the request [in]
+ * @param file_realpath  real path of the file, PATH_MAX long [out]
+ * @param fd             descriptor of the file [out]
+ * @param size           size of the file (-1 if not known) [out]
+ * @return               same as resolve_request_path
+ * 
+ * @see resolve_request_path
+ */
+int resolve_indexed_path(struct dir_index *index, int dir_fd, 
+                         char* dir_realpath, char* filename, 
+                         char* file_realpath, int *fd, off_t *size);
+
+/**
+ * Resolves the real path of a file a client wants to write.
+ * 
+ * Unlike resolve_request_path, the file does not need to exist, but its 
+ * directory does.
+ * 
+ * @param dir_realpath   real path of the served directory [in]
+ * @param filename       filename as found in the request [in]
+ * @param file_realpath  real path of the file, PATH_MAX long [out]
+ * @return
+ * - 0 in case of success.
+ * - 1 in case of directory not found (or invalid filename).
+ * - 2 in case of file outside of dir_realpath.
+ */
+int resolve_upload_path(char* dir_realpath, char* filename, 
+                        char* file_realpath);
+
+/**
+ * Chooses which of the options requested by a client are accepted.
+ * 
+ * Requested values are lowered to the maximum supported by the server.
+ * The multicast option is always dropped: the caller can accept it again
+ * once it has assigned a group.
+ * 
+ * @param opts  requested options, replaced by accepted ones [in/out]
+ * 
+ * @see MAX_WINDOWSIZE
+ */
+void negotiate_options(struct tftp_opts *opts);
+
+/**
+ * Opens the requested file for reading in the given transfer mode.
+ * 
+ * In netascii mode the file is opened in text mode, so that it is converted
+ * while it is read.
+ * 
+ * If a cache is given, the file is read from it whenever possible. In that
+ * case, the entry of the file is in use until the file is closed.
+ * 
+ * If the file was already opened by resolve_request_path, its descriptor 
+ * is used (and closed, in any case, by the time the fblock is closed). 
+ * Otherwise, it is opened by path.
+ * 
+ * The block size of the fblock is the one accepted in opts (if any).
+ * 
+ * If the transfer size was requested, it is set to the file size in octet 
+ * mode. In netascii mode it is dropped, since the size after conversion is 
+ * not known in advance (RFC 2349).
+ * 
+ * @param file_realpath  real path of the file [in]
+ * @param fd             descriptor of the file (-1 if not open) [in]
+ * @param size           size of the file, if known from an index of the 
+ *                       served directory (-1 otherwise) [in]
+ * @param mode           transfer mode ("netascii" or "octet") [in]
+ * @param opts           accepted options (can be NULL) [in/out]
+ * @param cache          file cache (can be NULL) [in]
+ * @param entry          cache entry of the file (NULL if the file was not 
+ *                       read from the cache) [out]
+ * @param m_fblock       opened file [out]
+ * @return
+ * - 0 in case of success.
+ * - 1 in case the file could not be opened (not found?).
+ * - 2 in case of unknown mode.
+ * 
+ * @see close_request_file
+ */
+int open_request_file(char* file_realpath, int fd, off_t size, char* mode, 
+                      struct tftp_opts *opts, struct file_cache *cache, 
+                      struct file_cache_entry **entry,
+                      struct fblock *m_fblock);
+
+/**
+ * Closes a file opened by open_request_file.
+ * 
+ * @param cache          file cache given to open_request_file
+ * @param entry          cache entry returned by open_request_file
+ * @param m_fblock       file to be closed
+ * 
+ * @see open_request_file
+ */
+void close_request_file(struct file_cache *cache, 
+                        struct file_cache_entry *entry,
+                        struct fblock *m_fblock);
+
+/**
+ * Creates the file a client wants to write, in the given transfer mode.
+ * 
+ * Existing files are never overwritten.
+ * 
+ * @param file_realpath  real path of the file [in]
+ * @param mode           transfer mode ("netascii" or "octet") [in]
+ * @param opts           accepted options (can be NULL) [in]
+ * @param sync           sync policy (FBLOCK_SYNC or FBLOCK_SYNC_ALL, 0 to 
+ *                       leave it to the kernel) [in]
+ * @param m_fblock       opened file [out]
+ * @return
+ * - 0 in case of success.
+ * - 1 in case the file could not be created.
+ * - 2 in case of unknown mode.
+ * - 3 in case the file already exists.
+ * 
+ * @see close_upload_file
+ */
+int open_upload_file(char* file_realpath, char* mode, struct tftp_opts *opts,
+                     char sync, struct fblock *m_fblock);
+
+/**
+ * Closes a file opened by open_upload_file, deleting it if the upload 
+ * failed.
+ * 
+ * @param file_realpath  real path of the file
+ * @param m_fblock       file to be closed
+ * @param completed      1 if the upload completed successfully, 0 otherwise
+ * @return               0 if the file was kept, 1 if it was deleted
+ * 
+ * @see open_upload_file
+ */
+int close_upload_file(char* file_realpath, struct fblock *m_fblock, 
+                      int completed);
+
+#endif
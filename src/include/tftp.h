@@ -19,9 +19,207 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include "fblock.h"
+#include "tftp_msgs.h"
+#include "metrics.h"
 
-/** Maximum file size to prevent block # overflow */
-#define TFTP_MAX_FILE_SIZE 33554431
+/** Block numbers on the wire are 16 bits wide and roll over to 0 */
+#define TFTP_BLOCK_N_MASK 0xffff
+
+/** 
+ * Initial retransmission timeout (in ms), used until the round trip time is
+ * measured.
+ * 
+ * It can be overridden at build time (eg. -DTFTP_TIMEOUT=20 for benchmarks 
+ * over loopback).
+ */
+#ifndef TFTP_TIMEOUT
+#define TFTP_TIMEOUT 1000
+#endif
+
+/** 
+ * Minimum retransmission timeout computed from round trip times (in ms). 
+ * 
+ * It can be overridden at build time, like TFTP_TIMEOUT.
+ */
+#ifndef TFTP_MIN_RTO
+#define TFTP_MIN_RTO 50
+#endif
+
+/** Maximum retransmission timeout (in ms), the timeout is doubled up to it */
+#define TFTP_MAX_TIMEOUT 16000
+
+/** Number of retransmissions after which a transfer is aborted */
+#define TFTP_MAX_RETRIES 6
+
+
+/**
+ * Round trip time statistics of a file transmission.
+ * 
+ * Times are in microseconds.
+ */
+struct tftp_rtt_stats{
+  long samples;       /**< Number of measured round trips */
+  long long sum;      /**< Sum of measured round trip times */
+  long long min;      /**< Minimum round trip time */
+  long long max;      /**< Maximum round trip time */
+  long timeouts;      /**< Number of retransmission timeouts */
+  long resent;        /**< Number of DATA messages sent again */
+  long long bytes;    /**< Number of DATA payload bytes sent */
+};
+
+/**
+ * State of an ongoing file transmission.
+ * 
+ * It holds everything tftp_send_file needs between two received packets, so 
+ * that the same workflow can be driven either by a blocking loop or by an 
+ * external event loop (one datagram at a time).
+ * 
+ * Up to windowsize blocks are kept in flight (RFC 7440): blocks in 
+ * [base, next) have been sent but not acknowledged yet and their messages are
+ * kept in window, so that they can be sent again. If the file is mapped in 
+ * memory (FBLOCK_MMAP), only pointers to the payloads are kept in window_ptr
+ * and messages are sent with sendmsg without copying them.
+ * 
+ * Block numbers are counted from the beginning of the file with 64 bits and 
+ * only their 16 least significant bits are sent, so that files with more 
+ * than 65535 blocks roll over to block 0.
+ * 
+ * If no ACK moves the window forward before deadline, the whole window (or 
+ * the OACK) is sent again and the timeout is doubled. The timeout is 
+ * computed from the smoothed round trip time and its variation (RFC 6298),
+ * measured only on messages which were not sent again (Karn's algorithm), 
+ * unless the client requested a fixed one (RFC 2349). With a window larger 
+ * than one block, the first duplicate ACK of a window causes it to be sent 
+ * again, since the receiver acks its last block in order when one is lost; 
+ * any other duplicate ACK is ignored, so that packets are never doubled 
+ * (Sorcerer's Apprentice Syndrome).
+ * 
+ * The same sender uploads files on the client side: in that case the write 
+ * request plays the role of the OACK, being sent again until it is 
+ * acknowledged with an OACK or the ACK of block 0.
+ * 
+ * If a multicast group was accepted (RFC 2090), DATA messages are sent to 
+ * the group and the transfer is driven by the ACKs of the master client 
+ * only, which can move it to any block (see tftp_sender_set_master). Files 
+ * must have at most TFTP_BLOCK_N_MASK blocks, since clients cannot tell
+ * rolled over blocks apart.
+ * 
+ * @see tftp_sender_start
+ * @see tftp_sender_start_upload
+ * @see tftp_sender_recv
+ */
+struct tftp_sender{
+  struct fblock *m_fblock;  /**< File the data is read from */
+  int sd;                   /**< Socket used for sending DATA messages */
+  struct sockaddr_in addr;  /**< Address of the recipient of the file */
+  int block_size;           /**< Size of DATA payloads */
+  int windowsize;           /**< Maximum number of blocks in flight */
+  long long base;           /**< Oldest unacknowledged block */
+  long long next;           /**< Next block to be sent */
+  long long last_block;     /**< Number of the last block (0 if not read) */
+  char *window;             /**< DATA messages in flight (circular) */
+  char **window_ptr;        /**< Payloads in flight (mapped file only) */
+  int *window_len;          /**< Lengths of the messages (or payloads) */
+  long long *window_sent;   /**< When each block was sent (us, -1 if resent) */
+  long long oack_sent;      /**< When OACK was sent (us, -1 if resent) */
+  char *data;               /**< Buffer for reading a payload */
+  struct tftp_opts opts;    /**< Accepted options (sent in OACK) */
+  int oack_pending;         /**< Set to 1 while waiting for ACK of OACK (or
+                                 of the request) */
+  int first;                /**< Set to 1 until the server replies to the 
+                                 request (upload only) */
+  char *request;            /**< Write request (upload only, NULL 
+                                 otherwise) */
+  int request_len;          /**< Length of the request */
+  int adaptive;             /**< Set to 1 if rto follows round trip times */
+  long long srtt;           /**< Smoothed round trip time (us) */
+  long long rttvar;         /**< Round trip time variation (us) */
+  int rto;                  /**< Retransmission timeout without backoff (ms) */
+  int timeout;              /**< Current retransmission timeout (ms) */
+  int retries;              /**< Retransmissions since last progress */
+  long long deadline;       /**< When to retransmit (see tftp_clock_ms) */
+  int fast_resent;          /**< Set to 1 once the window was sent again on 
+                                 a duplicate ACK, until base moves */
+  struct tftp_rtt_stats stats;  /**< Round trip time statistics */
+  int done;                 /**< Set to 1 once the last block is acked */
+  int multicast;            /**< Set to 1 if DATA is sent to group */
+  struct sockaddr_in group; /**< Multicast group (multicast only) */
+  long long n_blocks;       /**< Number of blocks (multicast only) */
+  struct metrics_session *metrics;  /**< Shared counters of the transfer 
+                                         (NULL if not accounted) */
+};
+
+
+/**
+ * State of an ongoing file reception.
+ * 
+ * Like tftp_sender, it allows tftp_receive_file workflow to be driven one 
+ * datagram at a time.
+ * 
+ * If nothing arrives before deadline, the request (or the ACK of block 0, 
+ * until the first block arrives) or the ACK of the last block received in 
+ * order is sent again.
+ * 
+ * The same receiver serves write requests on the server side: in that case
+ * the "request" is the OACK (or the ACK of block 0) sent in reply to the 
+ * WRQ, and the receiver dallies after the last block, acknowledging it again
+ * if the sender did not get its ACK.
+ * 
+ * If the server accepts a multicast option (RFC 2090), the receiver joins the
+ * group and DATA messages arrive on mc_sd too, in any order: they are written
+ * in place and tracked in the blocks bitmap. Only the master client sends 
+ * ACKs (of the last block received in order) until it has the whole file; 
+ * the server makes another client master with a new OACK when needed.
+ * 
+ * @see tftp_receiver_start
+ * @see tftp_receiver_recv
+ */
+struct tftp_receiver{
+  struct fblock *m_fblock;  /**< File the data is written to */
+  int sd;                   /**< Socket used for sending ACK messages */
+  struct sockaddr_in addr;  /**< Address of the sender (its TID once known) */
+  struct tftp_opts opts;    /**< Requested (then accepted) options */
+  int first;                /**< Set to 1 until the first message arrives */
+  int block_size;           /**< Size of DATA payloads */
+  int max_block_size;       /**< Maximum block size that can be accepted */
+  int windowsize;           /**< Number of blocks for each ACK */
+  long long exp_block_n;    /**< Next expected block (not rolled over) */
+  int received;             /**< Blocks received since last ACK */
+  int gap;                  /**< Set to 1 once a gap has been signaled */
+  char *data;               /**< Buffer for a payload */
+  char *request;            /**< Sent again until the first block arrives */
+  int request_len;          /**< Length of the request */
+  int rto;                  /**< Retransmission timeout without backoff (ms) */
+  int timeout;              /**< Current retransmission timeout (ms) */
+  int retries;              /**< Retransmissions since last progress */
+  long long deadline;       /**< When to retransmit (see tftp_clock_ms) */
+  int done;                 /**< Set to 1 once the last block is received */
+  int dally;                /**< Set to 1 to wait for retransmissions after 
+                                 the last block, until deadline */
+  int mc_sd;                /**< Socket joined to the multicast group (-1 if
+                                 not multicast) */
+  int master;               /**< Set to 1 while master client (multicast) */
+  char *blocks;             /**< Bitmap of received blocks (multicast) */
+  long long last_block;     /**< Number of the last block (0 if unknown) */
+  long long n_received;     /**< Number of distinct blocks received */
+};
+
+
+/**
+ * Returns current time of a monotonic clock, used for retransmission 
+ * deadlines.
+ * 
+ * @return  time in milliseconds
+ */
+long long tftp_clock_ms();
+
+/**
+ * Returns current time of a monotonic clock, used for measuring round trip
+ * times.
+ * 
+ * @return  time in microseconds
+ */
+long long tftp_clock_us();
 
 
 /**
@@ -29,6 +227,7 @@
  * 
  * @param filename  the name of the requested file
  * @param mode      the desired mode of transfer (netascii or octet)
+ * @param opts      requested options (can be NULL)
  * @param sd        socket id of the (UDP) socket to be used to send the message
  * @param addr      address of the server
  * @return          0 in case of success, 1 otherwise
@@ -36,15 +235,15 @@
  * @see TFTP_STR_NETASCII 
  * @see TFTP_STR_OCTET 
  */
-int tftp_send_rrq(char* filename, char *mode, int sd, struct sockaddr_in *addr);
+int tftp_send_rrq(char* filename, char *mode, struct tftp_opts *opts, int sd, 
+                  struct sockaddr_in *addr);
 
 /**
  * Send a WRQ message to a server.
  * 
- * Do not used in current implementation.
- * 
  * @param filename  the name of the requested file
  * @param mode      the desired mode of transfer (netascii or octet)
+ * @param opts      requested options (can be NULL)
  * @param sd        socket id of the (UDP) socket to be used to send the message
  * @param addr      address of the server
  * @return          0 in case of success, 1 otherwise 
@@ -52,7 +251,8 @@ int tftp_send_rrq(char* filename, char *mode, int sd, struct sockaddr_in *addr);
  * @see TFTP_STR_NETASCII 
  * @see TFTP_STR_OCTET 
  */
-int tftp_send_wrq(char* filename, char *mode, int sd, struct sockaddr_in *addr);
+int tftp_send_wrq(char* filename, char *mode, struct tftp_opts *opts, int sd, 
+                  struct sockaddr_in *addr);
 
 /**
  * Send an ERROR message to the client (server).
@@ -93,65 +293,319 @@ int tftp_send_ack(int block_n, char* out_buffer, int sd,
  * In current implementation it is only used in client but it could be also 
  * used on the server side, potentially (some tweaks may be needed, though!).
  * 
- * @param m_fblock   block file where to write incoming data to
- * @param sd         socket id of the (UDP) socket to be used to send ACK 
- *                   messages
- * @param addr       address of the recipient of ACKs
+ * If options were requested, the server can reply with an OACK, which is 
+ * acknowledged with block number 0. The negotiated block size is then stored 
+ * in m_fblock->block_size.
+ * 
+ * With a window size greater than 1, only the last block of each window is
+ * acknowledged. Blocks received out of order are discarded and the last 
+ * block received in order is acknowledged, so that the sender can go back to
+ * the first missing one.
+ * 
+ * The request is sent by this function, and sent again if no reply arrives
+ * in time.
+ * 
+ * If the server acknowledges the transfer size, disk space is reserved 
+ * before any data arrives and the transfer is refused if it does not fit.
+ * 
+ * If the server accepts the multicast option, blocks are received from the
+ * group too and written in place, so m_fblock must be a binary file.
+ * 
+ * After each message, progress (if given) is called with the file and the 
+ * transfer size (-1 if not known): m_fblock->written is the number of bytes
+ * received so far.
+ * 
+ * @param m_fblock    block file where to write incoming data to
+ * @param opts        options sent in the request (can be NULL). They are 
+ *                    replaced by the options accepted by the server [in/out]
+ * @param request     request message (eg. RRQ)
+ * @param request_len length of the request message
+ * @param sd          socket id of the (UDP) socket to be used to send ACK 
+ *                    messages
+ * @param addr        address of the recipient of the request
+ * @param progress    function called whenever the transfer makes progress 
+ *                    (can be NULL)
  * @return
  * - 0 in case of success.
  * - 1 in case of file not found.
- * - 2 in case of error while sending ACK.
- * - 3 in case of unexpected sequence number.
- * - 4 in case of an error while unpacking data.
+ * - 2 in case of error while sending ACK (or the request).
+ * - 3 in case of sequence number beyond the window.
+ * - 4 in case of an error while unpacking (or receiving) data.
  * - 5 in case of an error while unpacking an incoming error message.
- * - 6 in case of en error while writing to the file.
+ * - 6 in case of en error while writing to the file (or bad netascii).
  * - 7 in case of an error message different from File Not Found (since it is 
  * the only erorr available in current implementation).
  * - 8 in case of the incoming message is neither DATA nor ERROR.
+ * - 9 in case of invalid OACK (option negotiation failure).
+ * - 10 in case of timeout (no message after TFTP_MAX_RETRIES retransmissions).
+ * - 11 in case there is not enough disk space for the file.
+ * - 12 in case the multicast group could not be joined.
  */
-int tftp_receive_file(struct fblock *m_fblock, int sd, 
-                      struct sockaddr_in *addr);
+int tftp_receive_file(struct fblock *m_fblock, struct tftp_opts *opts, 
+                      char *request, int request_len, int sd, 
+                      struct sockaddr_in *addr, 
+                      void (*progress)(struct fblock*, long long));
 
 /**
- * Receive an ACK message.
+ * Handle the entire workflow required to receive a file whose write request
+ * was accepted (server side).
  * 
- * In current implementation it is only used for receiving ACKs from client.
+ * Options are acknowledged with an OACK (or with the ACK of block 0 if there
+ * are none) and blocks are received like in tftp_receive_file. The transfer
+ * size (if any) is reserved on disk beforehand. After the last block, the 
+ * receiver waits for one more timeout in case its ACK was lost.
  * 
- * @param block_n [out] sequence number of the acknowledged block.
- * @param in_buffer     buffer to be used for receiving the ACK (useful for 
- *                      recycling the same buffer)
- * @param sd [in]       socket id of the (UDP) socket to be used to send the 
- *                      message
- * @param addr [in]     address of recipient of the ACK
- * @return
- * - 0 in case of success
- * - 1 in case of failure while receiving the message
- * - 2 in case of address and/or port mismatch in sender sockaddr
- * - error unpacking ACK message otherwise (8 + result of tftp_msg_unpack_ack)
+ * @param m_fblock    block file where to write incoming data to
+ * @param opts        accepted options (can be NULL)
+ * @param sd          socket id of the (UDP) socket to be used to send ACK 
+ *                    messages
+ * @param addr        address of the client (its TID)
+ * @return            same error codes of tftp_receive_file
  * 
- * @see tftp_msg_unpack_ack
+ * @see tftp_receive_file
  */
-int tftp_receive_ack(int *block_n, char* in_buffer, int sd, 
+int tftp_accept_file(struct fblock *m_fblock, struct tftp_opts *opts, int sd, 
                      struct sockaddr_in *addr);
 
+/**
+ * Prepares for receiving a file and sends the request.
+ * 
+ * @param receiver    receiver state to be initialized [out]
+ * @param m_fblock    block file where to write incoming data to
+ * @param opts        options sent in the request (can be NULL)
+ * @param request     request message (eg. RRQ), it is copied
+ * @param request_len length of the request message
+ * @param sd          socket id of the (UDP) socket to be used to send ACK 
+ *                    messages
+ * @param addr        address the request is sent to
+ * @return            0 in case of success, 2 in case of error sending the 
+ *                    request
+ * 
+ * @see tftp_receive_file
+ */
+int tftp_receiver_start(struct tftp_receiver *receiver, 
+                        struct fblock *m_fblock, struct tftp_opts *opts, 
+                        char *request, int request_len, int sd, 
+                        struct sockaddr_in *addr);
+
+/**
+ * Prepares for receiving a file whose write request was accepted and sends
+ * the OACK (or the ACK of block 0).
+ * 
+ * @param receiver    receiver state to be initialized [out]
+ * @param m_fblock    block file where to write incoming data to
+ * @param opts        accepted options (can be NULL)
+ * @param sd          socket id of the (UDP) socket to be used to send ACK 
+ *                    messages
+ * @param addr        address of the client (its TID)
+ * @return            0 in case of success, 2 in case of error sending the 
+ *                    reply, 11 if the transfer size does not fit on disk
+ * 
+ * @see tftp_accept_file
+ */
+int tftp_receiver_accept(struct tftp_receiver *receiver, 
+                         struct fblock *m_fblock, struct tftp_opts *opts, 
+                         int sd, struct sockaddr_in *addr);
+
+/**
+ * Handles a message received during a file reception.
+ * 
+ * Messages from unexpected sources are ignored. When the last block is 
+ * received, receiver->done is set to 1. Messages can be up to 
+ * tftp_msg_get_size_data(receiver->max_block_size) bytes long.
+ * 
+ * @param receiver   receiver state
+ * @param in_buffer  the received message
+ * @param len        length of the received message
+ * @param src        address the message was received from
+ * @return           0 if the reception can go on, same error codes of 
+ *                   tftp_receive_file otherwise
+ * 
+ * @see tftp_receive_file
+ */
+int tftp_receiver_recv(struct tftp_receiver *receiver, char *in_buffer, 
+                       int len, struct sockaddr_in *src);
+
+/**
+ * Handles the expiration of receiver->deadline, sending the last message 
+ * again.
+ * 
+ * @param receiver   receiver state
+ * @return           0 if the reception can go on, same error codes of 
+ *                   tftp_receive_file otherwise
+ * 
+ * @see tftp_receive_file
+ */
+int tftp_receiver_timeout(struct tftp_receiver *receiver);
+
+/**
+ * Frees resources held by the receiver (the fblock is not closed).
+ * 
+ * @param receiver   receiver state
+ */
+void tftp_receiver_free(struct tftp_receiver *receiver);
+
 /**
  * Handle the entire workflow required to send a file.
  * 
  * In current implementation it is only used in server but it could be also 
  * used on the client side, potentially (some tweaks may be needed, though!).
  * 
+ * If any option was accepted, an OACK is sent first and the transfer begins
+ * once it is acknowledged (with block number 0). DATA messages carry 
+ * m_fblock->block_size bytes, which must match the accepted block size.
+ * 
+ * Up to opts->windowsize blocks are sent before waiting for an ACK. If the 
+ * ACK is not for the last block sent, the following ones are sent again.
+ * If no ACK arrives in time, the window is sent again.
+ * 
  * @param m_fblock   block file where to read incoming data from
+ * @param opts       accepted options (can be NULL)
  * @param sd         socket id of the (UDP) socket to be used to send DATA 
  *                   messages
  * @param addr       address of the recipient of the file 
+ * @param metrics    shared counters of the transfer (can be NULL)
  * @return
  * - 0 in case of success.
  * - 1 in case of error sending a packet.
  * - 2 in case of error while receiving the ack.
- * - 3 in case of unexpected sequence number in ack.
- * - 4 in case of file too big
+ * - 3 in case of sequence number in ack outside of the window.
+ * - 4 in case of error reading the file.
+ * - 5 in case of timeout (no ACK after TFTP_MAX_RETRIES retransmissions).
+ * - 6 in case of an error message from the receiver.
+ */
+int tftp_send_file(struct fblock *m_fblock, struct tftp_opts *opts, int sd, 
+                   struct sockaddr_in *addr, struct metrics_session *metrics);
+
+/**
+ * Handle the entire workflow required to upload a file (client side).
+ * 
+ * The write request is sent (and sent again if needed) until the server 
+ * acknowledges it with an OACK or with the ACK of block 0, whose source is 
+ * the TID of the server. Then the file is sent like in tftp_send_file, with
+ * the options accepted by the server.
+ * 
+ * m_fblock->block_size must be the requested block size (or the default one
+ * if none is requested): it is lowered to the accepted one.
+ * 
+ * @param m_fblock    block file where to read data from
+ * @param opts        options sent in the request (can be NULL). They are 
+ *                    replaced by the options accepted by the server [in/out]
+ * @param request     write request message
+ * @param request_len length of the request message
+ * @param sd          socket id of the (UDP) socket to be used to send DATA 
+ *                    messages
+ * @param addr        address of the server
+ * @return
+ * - same error codes of tftp_send_file.
+ * - 7 in case of invalid OACK (option negotiation failure).
+ */
+int tftp_upload_file(struct fblock *m_fblock, struct tftp_opts *opts, 
+                     char *request, int request_len, int sd, 
+                     struct sockaddr_in *addr);
+
+/**
+ * Starts a file transmission, sending the OACK or the first DATA message.
+ * 
+ * The socket can be non-blocking since this function never waits for 
+ * incoming messages.
+ * 
+ * @param sender     sender state to be initialized [out]
+ * @param m_fblock   block file where to read data from
+ * @param opts       accepted options (can be NULL)
+ * @param sd         socket id of the (UDP) socket to be used to send DATA 
+ *                   messages
+ * @param addr       address of the recipient of the file 
+ * @param metrics    shared counters of the transfer (can be NULL)
+ * @return
+ * - 0 in case of success.
+ * - 1 in case of error sending a packet.
+ * - 4 in case of error reading the file.
+ * 
+ * @see tftp_send_file
+ */
+int tftp_sender_start(struct tftp_sender *sender, struct fblock *m_fblock, 
+                      struct tftp_opts *opts, int sd, 
+                      struct sockaddr_in *addr, 
+                      struct metrics_session *metrics);
+
+/**
+ * Starts a file upload, sending the write request.
+ * 
+ * @param sender      sender state to be initialized [out]
+ * @param m_fblock    block file where to read data from
+ * @param opts        options sent in the request (can be NULL)
+ * @param request     write request message, it is copied
+ * @param request_len length of the request message
+ * @param sd          socket id of the (UDP) socket to be used to send DATA 
+ *                    messages
+ * @param addr        address of the server
+ * @return            0 in case of success, 1 in case of error sending the 
+ *                    request
+ * 
+ * @see tftp_upload_file
+ */
+int tftp_sender_start_upload(struct tftp_sender *sender, 
+                             struct fblock *m_fblock, struct tftp_opts *opts,
+                             char *request, int request_len, int sd, 
+                             struct sockaddr_in *addr);
+
+/**
+ * Handles a message received during a file transmission.
+ * 
+ * Messages from unexpected sources are ignored. When the last block gets
+ * acknowledged, sender->done is set to 1.
+ * 
+ * @param sender     sender state
+ * @param in_buffer  the received message
+ * @param len        length of the received message
+ * @param src        address the message was received from
+ * @return           0 if the transmission can go on, same error codes of 
+ *                   tftp_send_file otherwise
+ * 
+ * @see tftp_send_file
+ */
+int tftp_sender_recv(struct tftp_sender *sender, char *in_buffer, int len, 
+                     struct sockaddr_in *src);
+
+/**
+ * Handles the expiration of sender->deadline, sending the OACK or the 
+ * window again.
+ * 
+ * @param sender     sender state
+ * @return           0 if the transmission can go on, same error codes of 
+ *                   tftp_send_file otherwise
+ * 
+ * @see tftp_send_file
+ */
+int tftp_sender_timeout(struct tftp_sender *sender);
+
+/**
+ * Makes another client the master of a multicast transmission, sending it an
+ * OACK. The transfer goes on from the block after the first one it misses.
+ * 
+ * @param sender     sender state (multicast)
+ * @param opts       options of the new master, with mc_master set to 1
+ * @param addr       address of the new master
+ * @return           0 in case of success, 1 in case of error sending the 
+ *                   OACK
+ */
+int tftp_sender_set_master(struct tftp_sender *sender, 
+                           struct tftp_opts *opts, struct sockaddr_in *addr);
+
+/**
+ * Logs round trip time statistics of a transmission.
+ * 
+ * @param sender     sender state
+ */
+void tftp_sender_log_stats(struct tftp_sender *sender);
+
+/**
+ * Frees resources held by the sender (the fblock is not closed).
+ * 
+ * @param sender     sender state
  */
-int tftp_send_file(struct fblock *m_fblock, int sd, struct sockaddr_in *addr);
+void tftp_sender_free(struct tftp_sender *sender);
 
 
 #endif
@@ -5,18 +5,25 @@
  * @brief Contructor for TFTP messages.
  *
  * This library provides functions for building TFTP messages.
- * There are 5 types of messages:
+ * There are 6 types of messages:
  *  - 1: Read request (RRQ)
  *  - 2: Write request (WRQ)
  *  - 3: Data (DATA)
  *  - 4: Acknowledgment (ACK)
  *  - 5: Error (ERROR)
+ *  - 6: Option acknowledgment (OACK)
+ * 
+ * Requests can carry options, as defined in RFC 2347.
+ * 
+ * @see https://tools.ietf.org/html/rfc2347
  */
 
 #ifndef TFTP_MSGS
 #define TFTP_MSGS
 
 
+#include <netinet/in.h>
+
 /** Read request message type */
 #define TFTP_TYPE_RRQ   1
 
@@ -32,6 +39,9 @@
 /** Error message type */
 #define TFTP_TYPE_ERROR 5
 
+/** Option acknowledgment message type */
+#define TFTP_TYPE_OACK  6
+
 /** String for netascii */
 #define TFTP_STR_NETASCII "netascii"
 
@@ -58,6 +68,70 @@
 /** Data message max size is equal to TFTP_DATA_BLOCK + 4 (header) */
 #define TFTP_MAX_DATA_MSG_SIZE 516
 
+/** Maximum request message size, options included (RFC 2347) */
+#define TFTP_MAX_REQUEST_LEN 512
+
+/** Block size option name (RFC 2348) */
+#define TFTP_OPT_BLKSIZE "blksize"
+
+/** Minimum value of the block size option (RFC 2348) */
+#define TFTP_MIN_BLKSIZE 8
+
+/** Maximum value of the block size option (RFC 2348) */
+#define TFTP_MAX_BLKSIZE 65464
+
+/** Window size option name (RFC 7440) */
+#define TFTP_OPT_WINDOWSIZE "windowsize"
+
+/** Minimum value of the window size option (RFC 7440) */
+#define TFTP_MIN_WINDOWSIZE 1
+
+/** Maximum value of the window size option (RFC 7440) */
+#define TFTP_MAX_WINDOWSIZE 65535
+
+/** Timeout option name (RFC 2349) */
+#define TFTP_OPT_TIMEOUT "timeout"
+
+/** Minimum value of the timeout option, in seconds (RFC 2349) */
+#define TFTP_MIN_TIMEOUT_OPT 1
+
+/** Maximum value of the timeout option, in seconds (RFC 2349) */
+#define TFTP_MAX_TIMEOUT_OPT 255
+
+/** Transfer size option name (RFC 2349) */
+#define TFTP_OPT_TSIZE "tsize"
+
+/** Multicast option name (RFC 2090) */
+#define TFTP_OPT_MULTICAST "multicast"
+
+/** 
+ * Maximum option value string length (multicast value is the longest, 
+ * eg 239.255.255.255,65535,1)
+ */
+#define TFTP_MAX_OPT_VALUE_LEN 24
+
+
+/**
+ * Options that can be carried by a request or an OACK message.
+ * 
+ * A value of 0 means that the option is not present, except for tsize which
+ * is 0 in read requests: -1 is used instead.
+ * 
+ * The multicast option has no value in requests. In OACKs, its value is 
+ * "addr,port,mc": the group where DATA messages are sent and whether the 
+ * client is the master client (the only one sending ACKs). Address and port
+ * can be left empty in OACKs after the first one (mc_group is zeroed).
+ */
+struct tftp_opts{
+  int blksize;     /**< Block size (RFC 2348) */
+  int windowsize;  /**< Window size (RFC 7440) */
+  int timeout;     /**< Retransmission timeout in seconds (RFC 2349) */
+  long long tsize; /**< Transfer size in bytes (RFC 2349) */
+  int multicast;   /**< Set to 1 if multicast option is present (RFC 2090) */
+  struct sockaddr_in mc_group;  /**< Multicast group (OACK only) */
+  int mc_master;   /**< Set to 1 for the master client (OACK only) */
+};
+
 
 /**
  * Retuns msg type given a message buffer.
@@ -73,6 +147,21 @@
  */
 int tftp_msg_type(char *buffer);
 
+/**
+ * Clears all options.
+ * 
+ * @param opts the options
+ */
+void tftp_opts_init(struct tftp_opts *opts);
+
+/**
+ * Checks whether no option is set.
+ * 
+ * @param opts the options (can be NULL)
+ * @return     1 if no option is set, 0 otherwise
+ */
+int tftp_opts_empty(struct tftp_opts *opts);
+
 
 /**
  * Builds a read request message.
@@ -84,19 +173,33 @@ int tftp_msg_type(char *buffer);
  *  -----------------------------------------------
  * ```
  * 
+ * It is followed by an (optional) list of options:
+ * ```
+ *    string  1 byte   string  1 byte
+ *  ---------------------------------
+ * |  opt1  |   0  |  value1 |   0  | ...
+ *  ---------------------------------
+ * ```
+ * 
  * @param filename  name of the file
  * @param mode      requested transfer mode ("netascii" or "octet")
+ * @param opts      requested options (can be NULL)
  * @param buffer    data buffer where to build the message
  */
-void tftp_msg_build_rrq(char* filename, char* mode, char* buffer);
+void tftp_msg_build_rrq(char* filename, char* mode, struct tftp_opts *opts, 
+                        char* buffer);
 
 /**
  * Unpacks a read request message.
  *
+ * Unknown options are ignored, as well as options with invalid values.
+ *
  * @param buffer      data buffer where the message to read is [in]
  * @param buffer_len  length of the buffer [in]
  * @param filename    name of the file [out]
  * @param mode        requested transfer mode ("netascii" or "octet") [out]
+ * @param opts        requested options. If NULL, options are considered 
+ *                    unexpected fields [out]
  * @return
  * - 0 in case of success.
  * - 1 in case of wrong operation code.
@@ -104,6 +207,7 @@ void tftp_msg_build_rrq(char* filename, char* mode, char* buffer);
  * - 3 in case of filename exceeding TFTP_MAX_FILENAME_LEN.
  * - 4 in case of mode string exceeding TFTP_MAX_MODE_LEN.
  * - 5 in case of unrecognized transfer mode.
+ * - 6 in case of malformed options.
  * 
  * @see TFTP_TYPE_RRQ
  * @see TFTP_MAX_FILENAME_LEN
@@ -112,16 +216,17 @@ void tftp_msg_build_rrq(char* filename, char* mode, char* buffer);
  * @see TFTP_STR_OCTET
  */
 int tftp_msg_unpack_rrq(char* buffer, int buffer_len, char* filename, 
-                        char* mode);
+                        char* mode, struct tftp_opts *opts);
 
 /**
  * Returns size in bytes of a read request message.
  *
  * @param filename  name of the file
  * @param mode      requested transfer mode ("netascii" or "octet")
+ * @param opts      requested options (can be NULL)
  * @return          size in bytes
  */
-int tftp_msg_get_size_rrq(char* filename, char* mode);
+int tftp_msg_get_size_rrq(char* filename, char* mode, struct tftp_opts *opts);
 
 /**
  * Builds a write request message.
@@ -134,19 +239,27 @@ int tftp_msg_get_size_rrq(char* filename, char* mode);
  *  -----------------------------------------------
  * ```
  * 
+ * It is followed by an (optional) list of options, like a read request.
+ * 
  * @param filename  name of the file
  * @param mode      requested transfer mode ("netascii" or "octet")
+ * @param opts      requested options (can be NULL)
  * @param buffer    data buffer where to build the message
  */
-void tftp_msg_build_wrq(char* filename, char* mode, char* buffer);
+void tftp_msg_build_wrq(char* filename, char* mode, struct tftp_opts *opts, 
+                        char* buffer);
 
 /**
  * Unpacks a write request message.
  *
+ * Unknown options are ignored, as well as options with invalid values.
+ *
  * @param buffer      data buffer where the message to read is [in]
  * @param buffer_len  length of the buffer [in]
  * @param filename    name of the file [out]
  * @param mode        requested transfer mode ("netascii" or "octet") [out]
+ * @param opts        requested options. If NULL, options are considered 
+ *                    unexpected fields [out]
  * @return
  * - 0 in case of success.
  * - 1 in case of wrong operation code.
@@ -154,6 +267,7 @@ void tftp_msg_build_wrq(char* filename, char* mode, char* buffer);
  * - 3 in case of filename exceeding TFTP_MAX_FILENAME_LEN.
  * - 4 in case of mode string exceeding TFTP_MAX_MODE_LEN.
  * - 5 in case of unrecognized transfer mode.
+ * - 6 in case of malformed options.
  * 
  * @see TFTP_TYPE_WRQ
  * @see TFTP_MAX_FILENAME_LEN
@@ -161,17 +275,18 @@ void tftp_msg_build_wrq(char* filename, char* mode, char* buffer);
  * @see TFTP_STR_NETASCII
  * @see TFTP_STR_OCTET
  */
-int tftp_msg_unpack_rrq(char* buffer, int buffer_len, char* filename, 
-                        char* mode);
+int tftp_msg_unpack_wrq(char* buffer, int buffer_len, char* filename, 
+                        char* mode, struct tftp_opts *opts);
 
 /**
  * Returns size in bytes of a write request message.
  *
  * @param filename  name of the file
  * @param mode      requested transfer mode ("netascii" or "octet")
+ * @param opts      requested options (can be NULL)
  * @return          size in bytes
  */
-int tftp_msg_get_size_wrq(char* filename, char* mode);
+int tftp_msg_get_size_wrq(char* filename, char* mode, struct tftp_opts *opts);
 
 /**
  * Builds a data message.
@@ -191,6 +306,17 @@ int tftp_msg_get_size_wrq(char* filename, char* mode);
  */
 void tftp_msg_build_data(int block_n, char* data, int data_size, char* buffer);
 
+/**
+ * Builds only the header of a data message, so that the data can be sent 
+ * from a different buffer (eg. with sendmsg).
+ * 
+ * @param block_n   block sequence number
+ * @param buffer    4 bytes buffer where to build the header
+ * 
+ * @see tftp_msg_build_data
+ */
+void tftp_msg_build_data_header(int block_n, char* buffer);
+
 /**
  * Unpacks a data message.
  *
@@ -280,10 +406,11 @@ int tftp_msg_get_size_ack();
  * - 5: Unknown transfer ID.
  * - 6: File already exists.
  * - 7: No such user.
+ * - 8: Option negotiation failure (RFC 2347).
  * 
- * In current implementation only errors 1 and 4 are implemented.
+ * In current implementation only errors 1, 4 and 8 are implemented.
  * 
- * @param error_code error code (from 0 to 7)
+ * @param error_code error code (from 0 to 8)
  * @param error_msg  error message
  * @param buffer    data buffer where to build the message
  */
@@ -301,7 +428,7 @@ void tftp_msg_build_error(int error_code, char* error_msg, char* buffer);
  * - 1 in case of wrong operation code.
  * - 2 in case of unexpected fields.
  * - 3 in case of error string exceeding TFTP_MAX_ERROR_LEN.
- * - 4 in case of unrecognize error code (must be within 0 and 7).
+ * - 4 in case of unrecognize error code (must be within 0 and 8).
  * 
  * @see TFTP_TYPE_ERROR
  * @see TFTP_MAX_ERROR_LEN
@@ -317,5 +444,44 @@ int tftp_msg_unpack_error(char* buffer, int buffer_len, int* error_code,
  */
 int tftp_msg_get_size_error(char* error_msg);
 
+/**
+ * Builds an option acknowledgment message.
+ * 
+ * Message format:
+ * ```
+ *  2 bytes    string  1 byte   string  1 byte
+ *  ------------------------------------------
+ * |  06   |  opt1  |   0  |  value1 |   0  | ...
+ *  ------------------------------------------
+ * ```
+ * 
+ * @param opts      accepted options
+ * @param buffer    data buffer where to build the message
+ */
+void tftp_msg_build_oack(struct tftp_opts *opts, char* buffer);
+
+/**
+ * Unpacks an option acknowledgment message.
+ *
+ * @param buffer     data buffer where the message to read is [in]
+ * @param buffer_len length of the buffer [in]
+ * @param opts       accepted options [out]
+ * @return
+ * - 0 in case of success.
+ * - 1 in case of wrong operation code.
+ * - 6 in case of malformed options.
+ * 
+ * @see TFTP_TYPE_OACK
+ */
+int tftp_msg_unpack_oack(char* buffer, int buffer_len, struct tftp_opts *opts);
+
+/**
+ * Returns size in bytes of an option acknowledgment message.
+ *
+ * @param opts      accepted options
+ * @return          size in bytes
+ */
+int tftp_msg_get_size_oack(struct tftp_opts *opts);
+
 
 #endif
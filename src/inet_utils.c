@@ -9,8 +9,10 @@
 
 
 #include "include/inet_utils.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -42,6 +44,101 @@ int bind_random_port(int socket, struct sockaddr_in *addr){
 }
 
 
+int bind_reuseport(int socket, struct sockaddr_in *addr){
+  int ret, one = 1;
+
+  ret = setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  if (ret == -1){
+    LOG(LOG_ERR, "Could not set SO_REUSEPORT");
+    return 1;
+  }
+
+  ret = bind(socket, (struct sockaddr*) addr, sizeof(*addr));
+  if (ret == -1){
+    LOG(LOG_ERR, "Could not bind to port %d", ntohs(addr->sin_port));
+    return 1;
+  }
+
+  return 0;
+}
+
+
+int get_local_addr(struct sockaddr_in *peer, struct in_addr *local){
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  int sd, ret;
+
+  // connecting a UDP socket only selects the route
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sd == -1)
+    return 1;
+
+  addrlen = sizeof(addr);
+  ret = connect(sd, (struct sockaddr*) peer, sizeof(*peer)) == -1 ||
+        getsockname(sd, (struct sockaddr*) &addr, &addrlen) == -1;
+  close(sd);
+
+  if (ret){
+    LOG(LOG_ERR, "Could not find route to %s", inet_ntoa(peer->sin_addr));
+    return 1;
+  }
+
+  *local = addr.sin_addr;
+  return 0;
+}
+
+
+int set_multicast_if(int socket, struct in_addr *ifaddr){
+  unsigned char loop = 1;
+  int one = 1, zero = 0;
+
+  if (setsockopt(socket, IPPROTO_IP, IP_MULTICAST_IF, ifaddr, 
+                 sizeof(*ifaddr)) == -1 ||
+      setsockopt(socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, 
+                 sizeof(loop)) == -1 ||
+      setsockopt(socket, IPPROTO_IP, IP_MULTICAST_ALL, &zero, 
+                 sizeof(zero)) == -1 ||
+      setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &one, 
+                 sizeof(one)) == -1){
+    LOG(LOG_ERR, "Could not set multicast interface");
+    return 1;
+  }
+
+  return 0;
+}
+
+
+int join_multicast_group(int socket, struct sockaddr_in *group, 
+                         struct in_addr *ifaddr){
+  struct ip_mreq mreq;
+  int one = 1;
+
+  if (setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1){
+    LOG(LOG_ERR, "Could not set SO_REUSEADDR");
+    return 1;
+  }
+
+  if (bind(socket, (struct sockaddr*) group, sizeof(*group)) == -1){
+    LOG(LOG_ERR, "Could not bind to multicast port %d", 
+        ntohs(group->sin_port)
+    );
+    return 1;
+  }
+
+  mreq.imr_multiaddr = group->sin_addr;
+  mreq.imr_interface = *ifaddr;
+  if (setsockopt(socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, 
+                 sizeof(mreq)) == -1){
+    LOG(LOG_ERR, "Could not join multicast group %s", 
+        inet_ntoa(group->sin_addr)
+    );
+    return 1;
+  }
+
+  return 0;
+}
+
+
 struct sockaddr_in make_sv_sockaddr_in(char* ip, int port){
   struct sockaddr_in addr;
   memset(&addr, 0, sizeof(addr));
@@ -0,0 +1,506 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Implementation of logging.h.
+ *
+ * In asynchronous mode each thread has its own ring buffer of records, with a
+ * single producer (the thread) and a single consumer (the writer thread of
+ * the process), so that both ends only need atomic loads and stores of the
+ * head and tail counters. Rings are never freed: the ring of a thread which
+ * exited is reused by the next thread which logs something.
+ *
+ * The message of each record is formatted by the thread which logs it, since
+ * its arguments may not outlive the call, while the level, source file and
+ * line are stored as they are and the prefix of the line is formatted by the
+ * writer. When a ring is full, the thread wakes the writer up and waits for
+ * it, so that no message is lost. Errors wake the writer up too, instead of
+ * being written by the thread itself, so that the messages of a thread are
+ * written in the order it logged them.
+ *
+ * @see logging.h
+ */
+
+
+#include "include/logging.h"
+#include <sys/types.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+
+/** Size of the output buffer of the writer */
+#define LOG_OUT_SIZE 65536
+
+/** Maximum length of a line written by the writer */
+#define LOG_LINE_LEN (LOG_MSG_LEN + 64)
+
+/** Maximum time the writer sleeps when there is nothing to write (ms) */
+#define LOG_MAX_WAIT 64
+
+
+/**
+ * A message stored in a ring buffer.
+ */
+struct log_record{
+  const char *file;       /**< Source file which logged the message */
+  int line;               /**< Line of the source file */
+  int level;              /**< Level of the message */
+  int len;                /**< Length of msg */
+  char msg[LOG_MSG_LEN];  /**< Formatted message */
+};
+
+/**
+ * Ring buffer of a thread.
+ */
+struct log_ring{
+  struct log_ring *next;  /**< Next ring of the process */
+  int owned;              /**< Whether a thread is using this ring */
+  unsigned long head
+    __attribute__ ((aligned(64)));  /**< Records stored (by the thread) */
+  unsigned long tail
+    __attribute__ ((aligned(64)));  /**< Records written (by the writer) */
+  struct log_record records[LOG_RING_SIZE];  /**< Records */
+};
+
+
+/** Whether messages are stored in rings */
+int log_async = 0;
+
+/** Whether the writer thread of this process is running */
+int log_writer_running = 0;
+
+/** Set to 1 to stop the writer thread */
+int log_writer_stop = 0;
+
+/** Writer thread of this process */
+pthread_t log_writer;
+
+/** List of rings (only grows) */
+struct log_ring *log_rings = NULL;
+
+/** Ring of the calling thread */
+__thread struct log_ring *log_thread_ring = NULL;
+
+/** Releases the ring of a thread when it exits */
+pthread_key_t log_ring_key;
+
+/** Protects starting and stopping the writer */
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Protects log_wake_pending */
+pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when a ring is full or an error is stored */
+pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+/** Whether a thread is waiting for the writer */
+int log_wake_pending = 0;
+
+/** Guards the one-time setup of log_start_async */
+pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Returns the header of a level.
+ */
+const char* log_level_str(int level){
+  switch (level){
+    case LOG_FATAL:
+      return "[FATAL]";
+    case LOG_ERR:
+      return "[ERROR]";
+    case LOG_WARN:
+      return "[WARN ]";
+    case LOG_INFO:
+      return "[INFO ]";
+    default:
+      return "[DEBUG]";
+  }
+}
+
+
+/**
+ * Formats the prefix of a line: level, pid, file and line.
+ *
+ * @return  length of the prefix
+ */
+int log_prefix(char *buffer, size_t size, int level, int pid,
+               const char *file, int line){
+  char where[25];
+
+  snprintf(where, sizeof(where), "%s:%d", file, line);
+  return snprintf(buffer, size, "%s[%-5d] %-25s ",
+                  log_level_str(level), pid, where
+  );
+}
+
+
+/**
+ * Writes a message right away.
+ */
+void log_write_sync(int level, const char *file, int line,
+                    const char *format, va_list args){
+  char prefix[64];
+  FILE *stream;
+
+  stream = level <= LOG_WARN ? stderr : stdout;
+  log_prefix(prefix, sizeof(prefix), level, (int) getpid(), file, line);
+
+  flockfile(stream);
+  fputs(prefix, stream);
+  vfprintf(stream, format, args);
+  fputc('\n', stream);
+  fflush(stream);
+  funlockfile(stream);
+}
+
+
+/**
+ * Writes a buffer, retrying after signals and short writes.
+ */
+void log_flush_buffer(int fd, char *buffer, int len){
+  ssize_t written;
+
+  while (len > 0){
+    written = write(fd, buffer, len);
+    if (written < 0 && errno == EINTR)
+      continue;
+    else if (written < 0)
+      return;
+    buffer += written;
+    len -= written;
+  }
+}
+
+
+/**
+ * Writes all records stored in the rings. Only one thread at a time.
+ *
+ * @param pid     pid of this process
+ * @param buffer  output buffer (LOG_OUT_SIZE)
+ * @return        number of records written
+ */
+int log_drain(int pid, char *buffer){
+  struct log_ring *ring;
+  struct log_record *rec;
+  unsigned long head, tail;
+  int len, start, n;
+
+  len = n = 0;
+  for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next){
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++){
+      if (len > LOG_OUT_SIZE - LOG_LINE_LEN){
+        log_flush_buffer(STDOUT_FILENO, buffer, len);
+        len = 0;
+      }
+      rec = &ring->records[tail % LOG_RING_SIZE];
+      start = len;
+      len += log_prefix(buffer + len, LOG_OUT_SIZE - len, rec->level, pid,
+                        rec->file, rec->line
+      );
+      memcpy(buffer + len, rec->msg, rec->len);
+      len += rec->len;
+      buffer[len++] = '\n';
+      n++;
+
+      // what comes before a warning is written before it
+      if (rec->level <= LOG_WARN){
+        log_flush_buffer(STDOUT_FILENO, buffer, start);
+        log_flush_buffer(STDERR_FILENO, buffer + start, len - start);
+        len = 0;
+      }
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  log_flush_buffer(STDOUT_FILENO, buffer, len);
+  return n;
+}
+
+
+/**
+ * Body of the writer thread: writes pending records, then sleeps for a time
+ * which doubles (up to LOG_MAX_WAIT) while there is nothing to write.
+ */
+void* log_writer_main(void *arg){
+  char *buffer;
+  struct timespec deadline;
+  int pid, wait_ms, stop;
+
+  buffer = malloc(LOG_OUT_SIZE);
+  pid = (int) getpid();
+  wait_ms = 1;
+
+  while (1){
+    stop = __atomic_load_n(&log_writer_stop, __ATOMIC_ACQUIRE);
+    if (log_drain(pid, buffer) != 0){
+      wait_ms = 1;
+      continue;
+    } else if (stop)
+      break;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += wait_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&log_wake_lock);
+    if (!log_wake_pending && !__atomic_load_n(&log_writer_stop,
+                                              __ATOMIC_ACQUIRE))
+      pthread_cond_timedwait(&log_wake, &log_wake_lock, &deadline);
+    log_wake_pending = 0;
+    pthread_mutex_unlock(&log_wake_lock);
+
+    if (wait_ms < LOG_MAX_WAIT)
+      wait_ms *= 2;
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+
+/**
+ * Wakes the writer up.
+ */
+void log_wake_writer(){
+  pthread_mutex_lock(&log_wake_lock);
+  log_wake_pending = 1;
+  pthread_cond_signal(&log_wake);
+  pthread_mutex_unlock(&log_wake_lock);
+}
+
+
+/**
+ * Starts the writer thread of this process, if it is not running yet.
+ *
+ * @return  0 if it is running, 1 otherwise
+ */
+int log_start_writer(){
+  sigset_t all, old;
+  int ret = 0;
+
+  pthread_mutex_lock(&log_lock);
+  if (!log_writer_running){
+    log_writer_stop = 0;
+
+    // signals are left to the other threads (the writer inherits the mask)
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&log_writer, NULL, log_writer_main, NULL) == 0)
+      __atomic_store_n(&log_writer_running, 1, __ATOMIC_RELEASE);
+    else
+      ret = 1;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+  }
+  pthread_mutex_unlock(&log_lock);
+  return ret;
+}
+
+
+/**
+ * Releases the ring of an exiting thread (destructor of log_ring_key).
+ */
+void log_release_ring(void *ring){
+  __atomic_store_n(&((struct log_ring*) ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Returns the ring of the calling thread, reusing the one of a thread which
+ * exited, or allocating a new one.
+ */
+struct log_ring* log_get_ring(){
+  struct log_ring *ring;
+  int owned;
+
+  if (log_thread_ring != NULL)
+    return log_thread_ring;
+
+  for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next){
+    owned = 0;
+    if (__atomic_compare_exchange_n(&ring->owned, &owned, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (ring == NULL){
+    ring = aligned_alloc(64, sizeof(struct log_ring));
+    if (ring == NULL)
+      return NULL;
+    ring->owned = 1;
+    ring->head = ring->tail = 0;
+    ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  pthread_setspecific(log_ring_key, ring);
+  log_thread_ring = ring;
+  return ring;
+}
+
+
+/**
+ * Stores a message in the ring of the calling thread.
+ *
+ * @return  0 in case of success, 1 if it has to be written right away
+ */
+int log_store(int level, const char *file, int line, const char *format,
+              va_list args){
+  struct log_ring *ring;
+  struct log_record *rec;
+  unsigned long head;
+  int len;
+
+  if (!__atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE) &&
+      log_start_writer() != 0)
+    return 1;
+
+  ring = log_get_ring();
+  if (ring == NULL)
+    return 1;
+
+  head = ring->head;
+  while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+         >= LOG_RING_SIZE){
+    log_wake_writer();
+    sched_yield();
+  }
+
+  rec = &ring->records[head % LOG_RING_SIZE];
+  rec->file = file;
+  rec->line = line;
+  rec->level = level;
+  len = vsnprintf(rec->msg, LOG_MSG_LEN, format, args);
+  if (len < 0)
+    len = 0;
+  else if (len >= LOG_MSG_LEN)
+    len = LOG_MSG_LEN - 1;
+  rec->len = len;
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  // errors are not left waiting
+  if (level <= LOG_ERR)
+    log_wake_writer();
+  return 0;
+}
+
+
+void log_write(int level, const char *file, int line, const char *format,
+               ...){
+  va_list args;
+
+  va_start(args, format);
+  if (!__atomic_load_n(&log_async, __ATOMIC_RELAXED) ||
+      log_store(level, file, line, format, args) != 0){
+    va_end(args);
+    va_start(args, format);
+    log_write_sync(level, file, line, format, args);
+  }
+  va_end(args);
+}
+
+
+/**
+ * Takes the locks of the logger before fork, so that they are in a known
+ * state in the child.
+ */
+void log_before_fork(){
+  pthread_mutex_lock(&log_lock);
+  pthread_mutex_lock(&log_wake_lock);
+}
+
+
+/**
+ * Releases the locks of the logger after fork (parent).
+ */
+void log_after_fork_parent(){
+  pthread_mutex_unlock(&log_wake_lock);
+  pthread_mutex_unlock(&log_lock);
+}
+
+
+/**
+ * Resets the logger after fork (child): the writer of the parent does not
+ * exist in the child, records stored before fork are written by the parent,
+ * and rings of the other threads of the parent are free.
+ */
+void log_after_fork_child(){
+  struct log_ring *ring;
+
+  pthread_mutex_init(&log_lock, NULL);
+  pthread_mutex_init(&log_wake_lock, NULL);
+  pthread_cond_init(&log_wake, NULL);
+  log_wake_pending = 0;
+  log_writer_running = 0;
+  log_writer_stop = 0;
+
+  for (ring = log_rings; ring != NULL; ring = ring->next){
+    ring->tail = ring->head;
+    ring->owned = ring == log_thread_ring;
+  }
+}
+
+
+/**
+ * One-time setup of asynchronous mode.
+ */
+void log_setup(){
+  pthread_key_create(&log_ring_key, log_release_ring);
+  pthread_atfork(log_before_fork, log_after_fork_parent,
+                 log_after_fork_child
+  );
+  atexit(log_stop_async);
+}
+
+
+int log_start_async(){
+  pthread_once(&log_once, log_setup);
+
+  // what has been written to stdout so far comes first
+  fflush(stdout);
+  __atomic_store_n(&log_async, 1, __ATOMIC_RELAXED);
+  if (log_start_writer() != 0){
+    __atomic_store_n(&log_async, 0, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+
+void log_stop_async(){
+  char *buffer;
+
+  __atomic_store_n(&log_async, 0, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&log_lock);
+  if (log_writer_running){
+    __atomic_store_n(&log_writer_stop, 1, __ATOMIC_RELEASE);
+    log_wake_writer();
+    pthread_join(log_writer, NULL);
+    log_writer_running = 0;
+
+    // records stored while the writer was stopping
+    buffer = malloc(LOG_OUT_SIZE);
+    if (buffer != NULL){
+      log_drain((int) getpid(), buffer);
+      free(buffer);
+    }
+  }
+  pthread_mutex_unlock(&log_lock);
+}
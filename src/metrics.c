@@ -0,0 +1,798 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Implementation of metrics.h.
+ *
+ * The region is an anonymous shared mapping, so it is inherited by forked
+ * children. A slot is taken by setting in_use from 0 to 2 (compare and
+ * swap), filling it and then setting it to 1, so that the exporter never
+ * shows a half-written slot.
+ *
+ * The same thread serves the socket and logs latency percentiles: between
+ * two logs it keeps the merged histograms of the previous one, so that the
+ * latencies of the last interval are their difference.
+ *
+ * @see metrics.h
+ */
+
+
+#define _GNU_SOURCE
+#include "include/metrics.h"
+#include "include/inet_utils.h"
+#include "include/tftp_msgs.h"
+#include "include/tftp.h"
+#include "include/histogram.h"
+#include "include/logging.h"
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+
+/** LOG_LEVEL will be defined in another file */
+extern const int LOG_LEVEL;
+
+
+/** How long to wait for the request of a client of the socket (ms) */
+#define METRICS_REQUEST_TIMEOUT 100
+
+/** Maximum length of the request of a client of the socket */
+#define METRICS_REQUEST_LEN 1024
+
+
+/** Shared counters (NULL if metrics are not enabled) */
+struct metrics *metrics_region = NULL;
+
+/** Listening Unix socket */
+int metrics_sd = -1;
+
+/** Path of the socket */
+struct sockaddr_un metrics_addr;
+
+/** Process which exports counters */
+int metrics_pid = 0;
+
+/** Thread which serves the socket and logs latencies */
+pthread_t metrics_thread;
+
+/** Pipe which wakes up the thread when it has to stop */
+int metrics_stop[2] = {-1, -1};
+
+/** Seconds between two logs of latency percentiles (0 for none) */
+int metrics_interval = 0;
+
+/** Arrival time of the last request received by this thread (us) */
+__thread long long metrics_request_time = 0;
+
+/** Shard of the histograms of this thread (-1 if not chosen yet) */
+__thread int metrics_shard = -1;
+
+
+/**
+ * Returns the current time in ms since epoch.
+ */
+long long metrics_now(){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * Adds to a shared counter.
+ */
+void metrics_add(unsigned long *counter, unsigned long n){
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Reads a shared counter.
+ */
+unsigned long metrics_get(unsigned long *counter){
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+
+void metrics_count_request(int type){
+  if (metrics_region == NULL)
+    return;
+
+  if (type == TFTP_TYPE_RRQ)
+    metrics_add(&metrics_region->global.rrqs, 1);
+  else if (type == TFTP_TYPE_WRQ)
+    metrics_add(&metrics_region->global.wrqs, 1);
+  else
+    metrics_add(&metrics_region->global.other, 1);
+
+  metrics_request_time = tftp_clock_us();
+}
+
+
+void metrics_count_rejected(){
+  if (metrics_region != NULL)
+    metrics_add(&metrics_region->global.rejected, 1);
+}
+
+
+void metrics_count_error(int error_code){
+  if (metrics_region != NULL && error_code >= 0 &&
+      error_code < METRICS_N_ERRORS)
+    metrics_add(&metrics_region->global.errors[error_code], 1);
+}
+
+
+struct metrics_session* metrics_session_start(int upload, char *filename,
+                                              struct sockaddr_in *addr){
+  struct metrics_session *s;
+  int i, in_use, len;
+
+  if (metrics_region == NULL)
+    return NULL;
+
+  metrics_add(&metrics_region->global.started, 1);
+  __atomic_fetch_add(&metrics_region->global.active, 1, __ATOMIC_RELAXED);
+
+  for (i = 0; i < METRICS_MAX_SESSIONS; i++){
+    s = &metrics_region->sessions[i];
+    in_use = 0;
+    if (__atomic_load_n(&s->in_use, __ATOMIC_RELAXED) == 0 &&
+        __atomic_compare_exchange_n(&s->in_use, &in_use, 2, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (i == METRICS_MAX_SESSIONS){
+    metrics_add(&metrics_region->global.untracked, 1);
+    return &metrics_region->sessions[METRICS_MAX_SESSIONS];
+  }
+
+  // the end of long paths is more meaningful
+  len = strlen(filename);
+  if (len >= METRICS_NAME_LEN)
+    filename += len - METRICS_NAME_LEN + 1;
+  strcpy(s->filename, filename);
+
+  s->pid = (int) getpid();
+  s->upload = upload;
+  s->addr = *addr;
+  s->start = metrics_now();
+  s->bytes = s->blocks = s->retransmits = 0;
+  s->request_time = upload ? 0 : metrics_request_time;
+  __atomic_store_n(&s->in_use, 1, __ATOMIC_RELEASE);
+  return s;
+}
+
+
+void metrics_session_end(struct metrics_session *session, int failed){
+  int in_use = 1;
+
+  if (session == NULL)
+    return;
+
+  // the exporter may have released it already (if it took the pid for dead)
+  if (session != &metrics_region->sessions[METRICS_MAX_SESSIONS] &&
+      !__atomic_compare_exchange_n(&session->in_use, &in_use, 0, 0,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    return;
+
+  metrics_add(failed ? &metrics_region->global.failed
+                     : &metrics_region->global.completed, 1);
+  __atomic_fetch_sub(&metrics_region->global.active, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Returns the latency histograms of the calling thread.
+ */
+struct metrics_shard* metrics_get_shard(){
+  if (metrics_shard == -1)
+    metrics_shard = __atomic_fetch_add(&metrics_region->next_shard, 1,
+                                       __ATOMIC_RELAXED) % METRICS_SHARDS;
+  return &metrics_region->shards[metrics_shard];
+}
+
+
+/**
+ * Lets forked children choose a shard of their own.
+ */
+void metrics_atfork_child(){
+  metrics_shard = -1;
+}
+
+
+void metrics_count_reply(struct metrics_session *session){
+  // the slot shared by untracked transfers never has a request time
+  if (session == NULL || session->request_time == 0)
+    return;
+
+  histogram_record(&metrics_get_shard()->first_reply,
+                   tftp_clock_us() - session->request_time
+  );
+  session->request_time = 0;
+}
+
+
+void metrics_count_block(struct metrics_session *session, int bytes){
+  if (session == NULL)
+    return;
+
+  if (session->request_time != 0)
+    metrics_count_reply(session);
+  metrics_add(&session->blocks, 1);
+  metrics_add(&session->bytes, bytes);
+  metrics_add(&metrics_region->global.blocks, 1);
+  metrics_add(&metrics_region->global.bytes, bytes);
+}
+
+
+void metrics_count_retransmit(struct metrics_session *session){
+  if (session == NULL)
+    return;
+
+  metrics_add(&session->retransmits, 1);
+  metrics_add(&metrics_region->global.retransmits, 1);
+}
+
+
+void metrics_count_timeout(struct metrics_session *session){
+  if (session != NULL)
+    metrics_add(&metrics_region->global.timeouts, 1);
+}
+
+
+void metrics_count_rtt(struct metrics_session *session, long long rtt){
+  if (session != NULL)
+    histogram_record(&metrics_get_shard()->rtt, rtt);
+}
+
+
+/**
+ * Merges the copies of the latency histograms of all shards.
+ *
+ * @param merged   output histograms (must be all zeros)
+ */
+void metrics_merge_shards(struct metrics_shard *merged){
+  int i;
+
+  for (i = 0; i < METRICS_SHARDS; i++){
+    histogram_merge(&merged->first_reply,
+                    &metrics_region->shards[i].first_reply
+    );
+    histogram_merge(&merged->rtt, &metrics_region->shards[i].rtt);
+  }
+}
+
+
+/**
+ * Appends formatted text to a buffer, as long as it fits.
+ */
+void metrics_printf(char *buffer, int size, int *len, const char *format,
+                    ...){
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(buffer + *len, size - *len, format, args);
+  va_end(args);
+
+  if (n > 0)
+    *len = *len + n < size ? *len + n : size - 1;
+}
+
+
+/**
+ * Appends the header of a metric.
+ */
+void metrics_printf_header(char *buffer, int size, int *len, char *name,
+                           char *type, char *help){
+  metrics_printf(buffer, size, len, "# HELP %s %s\n# TYPE %s %s\n",
+                 name, help, name, type
+  );
+}
+
+
+/**
+ * Copies a label value, escaping backslashes, double quotes and newlines.
+ */
+void metrics_escape(char *dst, char *src, int size){
+  int i = 0;
+
+  for (; *src != '\0' && i < size - 2; src++){
+    if (*src == '\\' || *src == '"' || *src == '\n'){
+      dst[i++] = '\\';
+      dst[i++] = *src == '\n' ? 'n' : *src;
+    } else
+      dst[i++] = *src;
+  }
+  dst[i] = '\0';
+}
+
+
+/**
+ * Releases the slots of processes which died while serving a transfer (eg.
+ * killed by a signal).
+ */
+void metrics_reap_sessions(){
+  struct metrics_session *s;
+  int i, in_use;
+
+  for (i = 0; i < METRICS_MAX_SESSIONS; i++){
+    s = &metrics_region->sessions[i];
+    in_use = 1;
+    if (__atomic_load_n(&s->in_use, __ATOMIC_ACQUIRE) == 1 &&
+        kill(s->pid, 0) == -1 && errno == ESRCH &&
+        __atomic_compare_exchange_n(&s->in_use, &in_use, 0, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+      LOG(LOG_WARN, "Process %d died while serving %s", s->pid, s->filename);
+      metrics_add(&metrics_region->global.failed, 1);
+      __atomic_fetch_sub(&metrics_region->global.active, 1,
+                         __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+/**
+ * Appends one counter of each active session.
+ */
+void metrics_printf_sessions(char *buffer, int size, int *len, char *name,
+                             char *type, char *help, int field){
+  struct metrics_session *s;
+  char filename[2 * METRICS_NAME_LEN], addr[MAX_SOCKADDR_STR_LEN];
+  double value;
+  int i;
+
+  metrics_printf_header(buffer, size, len, name, type, help);
+  for (i = 0; i < METRICS_MAX_SESSIONS; i++){
+    s = &metrics_region->sessions[i];
+    if (__atomic_load_n(&s->in_use, __ATOMIC_ACQUIRE) != 1)
+      continue;
+
+    metrics_escape(filename, s->filename, sizeof(filename));
+    sockaddr_in_to_string(s->addr, addr);
+    switch (field){
+      case 0:
+        value = s->start / 1000.0;
+        break;
+      case 1:
+        value = metrics_get(&s->bytes);
+        break;
+      case 2:
+        value = metrics_get(&s->blocks);
+        break;
+      default:
+        value = metrics_get(&s->retransmits);
+    }
+
+    metrics_printf(buffer, size, len,
+                   "%s{session=\"%d\",pid=\"%d\",direction=\"%s\","
+                   "client=\"%s\",file=\"%s\"} %.15g\n",
+                   name, i, s->pid, s->upload ? "upload" : "download",
+                   addr, filename, value
+    );
+  }
+}
+
+
+/**
+ * Appends a latency histogram as a summary (in seconds).
+ */
+void metrics_printf_summary(char *buffer, int size, int *len, char *name,
+                            char *help, struct histogram *h){
+  double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  int i;
+
+  metrics_printf_header(buffer, size, len, name, "summary", help);
+  for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    metrics_printf(buffer, size, len, "%s{quantile=\"%g\"} %.6f\n",
+                   name, quantiles[i],
+                   histogram_percentile(h, quantiles[i] * 100) / 1e6
+    );
+  metrics_printf(buffer, size, len, "%s_sum %.6f\n%s_count %lu\n",
+                 name, h->sum / 1e6, name, histogram_count(h)
+  );
+}
+
+
+int metrics_format(char *buffer, int size){
+  struct metrics_counters *g;
+  struct metrics_shard merged;
+  int i, len = 0;
+
+  if (metrics_region == NULL){
+    buffer[0] = '\0';
+    return 0;
+  }
+
+  metrics_reap_sessions();
+  g = &metrics_region->global;
+
+  metrics_printf_header(buffer, size, &len, "tftp_requests_total", "counter",
+                        "Messages received on the server port, by type."
+  );
+  metrics_printf(buffer, size, &len,
+                 "tftp_requests_total{type=\"rrq\"} %lu\n"
+                 "tftp_requests_total{type=\"wrq\"} %lu\n"
+                 "tftp_requests_total{type=\"other\"} %lu\n",
+                 metrics_get(&g->rrqs),
+                 metrics_get(&g->wrqs),
+                 metrics_get(&g->other)
+  );
+  metrics_printf_header(buffer, size, &len, "tftp_requests_rejected_total",
+                        "counter",
+                        "Requests answered with an ERROR without starting a "
+                        "transfer."
+  );
+  metrics_printf(buffer, size, &len, "tftp_requests_rejected_total %lu\n",
+                 metrics_get(&g->rejected)
+  );
+  metrics_printf_header(buffer, size, &len, "tftp_errors_sent_total",
+                        "counter", "ERROR messages sent, by code."
+  );
+  for (i = 0; i < METRICS_N_ERRORS; i++)
+    metrics_printf(buffer, size, &len,
+                   "tftp_errors_sent_total{code=\"%d\"} %lu\n",
+                   i, metrics_get(&g->errors[i])
+    );
+
+  metrics_printf_header(buffer, size, &len, "tftp_sessions_total", "counter",
+                        "Transfers, by outcome."
+  );
+  metrics_printf(buffer, size, &len,
+                 "tftp_sessions_total{state=\"started\"} %lu\n"
+                 "tftp_sessions_total{state=\"completed\"} %lu\n"
+                 "tftp_sessions_total{state=\"failed\"} %lu\n",
+                 metrics_get(&g->started),
+                 metrics_get(&g->completed),
+                 metrics_get(&g->failed)
+  );
+  metrics_printf_header(buffer, size, &len, "tftp_sessions_active", "gauge",
+                        "Transfers in progress."
+  );
+  metrics_printf(buffer, size, &len, "tftp_sessions_active %ld\n",
+                 __atomic_load_n(&g->active, __ATOMIC_RELAXED)
+  );
+  metrics_printf_header(buffer, size, &len, "tftp_sessions_untracked_total",
+                        "counter",
+                        "Transfers without per-session counters (too many at "
+                        "once)."
+  );
+  metrics_printf(buffer, size, &len, "tftp_sessions_untracked_total %lu\n",
+                 metrics_get(&g->untracked)
+  );
+
+  metrics_printf_header(buffer, size, &len, "tftp_sent_bytes_total",
+                        "counter", "DATA payload bytes sent."
+  );
+  metrics_printf(buffer, size, &len, "tftp_sent_bytes_total %lu\n",
+                 metrics_get(&g->bytes)
+  );
+  metrics_printf_header(buffer, size, &len, "tftp_sent_blocks_total",
+                        "counter", "DATA messages sent."
+  );
+  metrics_printf(buffer, size, &len, "tftp_sent_blocks_total %lu\n",
+                 metrics_get(&g->blocks)
+  );
+  metrics_printf_header(buffer, size, &len, "tftp_retransmitted_blocks_total",
+                        "counter", "DATA messages sent again."
+  );
+  metrics_printf(buffer, size, &len, "tftp_retransmitted_blocks_total %lu\n",
+                 metrics_get(&g->retransmits)
+  );
+  metrics_printf_header(buffer, size, &len, "tftp_timeouts_total", "counter",
+                        "Retransmission timeouts."
+  );
+  metrics_printf(buffer, size, &len, "tftp_timeouts_total %lu\n",
+                 metrics_get(&g->timeouts)
+  );
+  metrics_printf_header(buffer, size, &len, "tftp_start_time_seconds",
+                        "gauge", "When the server started (since epoch)."
+  );
+  metrics_printf(buffer, size, &len, "tftp_start_time_seconds %.3f\n",
+                 g->start / 1000.0
+  );
+
+  memset(&merged, 0, sizeof(merged));
+  metrics_merge_shards(&merged);
+  metrics_printf_summary(buffer, size, &len, "tftp_first_reply_seconds",
+                         "Time from a read request to the first reply.",
+                         &merged.first_reply
+  );
+  metrics_printf_summary(buffer, size, &len, "tftp_rtt_seconds",
+                         "Round trip time of DATA messages (and OACKs).",
+                         &merged.rtt
+  );
+
+  metrics_printf_sessions(buffer, size, &len,
+                          "tftp_session_start_time_seconds", "gauge",
+                          "When an active transfer started (since epoch).", 0
+  );
+  metrics_printf_sessions(buffer, size, &len, "tftp_session_sent_bytes",
+                          "gauge", "DATA payload bytes sent by an active "
+                          "transfer.", 1
+  );
+  metrics_printf_sessions(buffer, size, &len, "tftp_session_sent_blocks",
+                          "gauge", "DATA messages sent by an active transfer.",
+                          2
+  );
+  metrics_printf_sessions(buffer, size, &len,
+                          "tftp_session_retransmitted_blocks", "gauge",
+                          "DATA messages sent again by an active transfer.", 3
+  );
+
+  return len;
+}
+
+
+/**
+ * Writes a whole buffer to a socket.
+ *
+ * @return  0 in case of success, 1 otherwise
+ */
+int metrics_send_all(int sd, char *buffer, int len){
+  ssize_t sent;
+
+  while (len > 0){
+    sent = send(sd, buffer, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    else if (sent <= 0)
+      return 1;
+    buffer += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+
+/**
+ * Serves a client of the socket.
+ */
+void metrics_serve(int sd, char *text){
+  char request[METRICS_REQUEST_LEN], header[128];
+  struct pollfd pfd;
+  int len, http;
+
+  // clients which do not send anything get the bare text
+  pfd.fd = sd;
+  pfd.events = POLLIN;
+  http = 0;
+  if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT) == 1){
+    len = recv(sd, request, sizeof(request), 0);
+    http = len >= 4 && memcmp(request, "GET ", 4) == 0;
+  }
+
+  len = metrics_format(text, METRICS_TEXT_SIZE);
+  if (http){
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %d\r\n\r\n", len
+    );
+    if (metrics_send_all(sd, header, strlen(header)) != 0)
+      return;
+  }
+  metrics_send_all(sd, text, len);
+}
+
+
+/**
+ * Logs percentiles of a latency histogram.
+ */
+void metrics_log_latency(char *name, struct histogram *h){
+  unsigned long count;
+
+  count = histogram_count(h);
+  if (count == 0)
+    return;
+
+  LOG(LOG_INFO, "%s: %lu samples, avg %.3f ms, "
+      "p50/p90/p99/p99.9/max %.3f/%.3f/%.3f/%.3f/%.3f ms",
+      name, count, h->sum / 1000.0 / count,
+      histogram_percentile(h, 50) / 1000.0,
+      histogram_percentile(h, 90) / 1000.0,
+      histogram_percentile(h, 99) / 1000.0,
+      histogram_percentile(h, 99.9) / 1000.0,
+      histogram_percentile(h, 100) / 1000.0
+  );
+}
+
+
+/**
+ * Logs percentiles of the latencies recorded since the previous call.
+ *
+ * @param prev   merged histograms at the previous call (updated)
+ */
+void metrics_dump_latency(struct metrics_shard *prev){
+  struct metrics_shard *now, *delta;
+
+  now = calloc(2, sizeof(struct metrics_shard));
+  delta = now + 1;
+  metrics_merge_shards(now);
+  histogram_delta(&delta->first_reply, &now->first_reply, 
+                  &prev->first_reply
+  );
+  histogram_delta(&delta->rtt, &now->rtt, &prev->rtt);
+  *prev = *now;
+
+  metrics_log_latency("First reply", &delta->first_reply);
+  metrics_log_latency("Round trip", &delta->rtt);
+  free(now);
+}
+
+
+/**
+ * Body of the thread which serves the socket and logs latencies, until it 
+ * is woken up through metrics_stop.
+ */
+void* metrics_main(void *arg){
+  struct metrics_shard *prev;
+  struct pollfd fds[2];
+  long long next_dump;
+  char *text;
+  int sd, timeout;
+
+  text = metrics_sd != -1 ? malloc(METRICS_TEXT_SIZE) : NULL;
+  prev = calloc(1, sizeof(struct metrics_shard));
+  next_dump = tftp_clock_ms() + metrics_interval * 1000LL;
+
+  fds[0].fd = metrics_stop[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = metrics_sd;   // ignored if -1
+  fds[1].events = POLLIN;
+  while (1){
+    timeout = -1;
+    if (metrics_interval > 0){
+      timeout = next_dump - tftp_clock_ms();
+      if (timeout <= 0){
+        metrics_dump_latency(prev);
+        next_dump += metrics_interval * 1000LL;
+        continue;
+      }
+    }
+
+    if (poll(fds, 2, timeout) <= 0 || fds[1].revents == 0){
+      if (fds[0].revents != 0)
+        break;
+      continue;
+    }
+
+    sd = accept(metrics_sd, NULL, NULL);
+    if (sd == -1)
+      continue;
+
+    metrics_serve(sd, text);
+    close(sd);
+  }
+
+  // latencies since the last log
+  if (metrics_interval > 0)
+    metrics_dump_latency(prev);
+
+  free(prev);
+  free(text);
+  return NULL;
+}
+
+
+/**
+ * Closes the socket and pipe and releases the counters (metrics are 
+ * disabled).
+ */
+void metrics_unmap(){
+  if (metrics_sd != -1)
+    close(metrics_sd);
+  metrics_sd = -1;
+  if (metrics_stop[0] != -1){
+    close(metrics_stop[0]);
+    close(metrics_stop[1]);
+  }
+  metrics_stop[0] = metrics_stop[1] = -1;
+  munmap(metrics_region, sizeof(struct metrics));
+  metrics_region = NULL;
+}
+
+
+/**
+ * Listens on the Unix socket.
+ *
+ * @return  0 in case of success, 1 otherwise
+ */
+int metrics_listen(char *socket_path){
+  if (strlen(socket_path) >= sizeof(metrics_addr.sun_path)){
+    LOG(LOG_ERR, "Metrics socket path is too long: %s", socket_path);
+    return 1;
+  }
+
+  memset(&metrics_addr, 0, sizeof(metrics_addr));
+  metrics_addr.sun_family = AF_UNIX;
+  strcpy(metrics_addr.sun_path, socket_path);
+
+  metrics_sd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  unlink(socket_path);
+  if (bind(metrics_sd, (struct sockaddr*) &metrics_addr,
+           sizeof(metrics_addr)) != 0 || listen(metrics_sd, 16) != 0){
+    LOG(LOG_ERR, "Could not listen on metrics socket %s", socket_path);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+int metrics_init(char *socket_path, int dump_interval){
+  sigset_t all, old;
+  int ret;
+
+  metrics_region = mmap(NULL, sizeof(struct metrics), PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_ANONYMOUS, -1, 0
+  );
+  if (metrics_region == MAP_FAILED){
+    LOG(LOG_ERR, "Could not map metrics");
+    metrics_region = NULL;
+    return 1;
+  }
+  metrics_region->global.start = metrics_now();
+  metrics_interval = dump_interval;
+
+  if (pipe2(metrics_stop, O_CLOEXEC) != 0 ||
+      (socket_path != NULL && metrics_listen(socket_path) != 0)){
+    if (metrics_stop[0] == -1)
+      LOG(LOG_ERR, "Could not create metrics pipe");
+    metrics_unmap();
+    return 1;
+  }
+
+  // signals are left to the other threads (the thread inherits the mask)
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  ret = pthread_create(&metrics_thread, NULL, metrics_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret != 0){
+    LOG(LOG_ERR, "Could not create metrics thread");
+    if (metrics_sd != -1)
+      unlink(socket_path);
+    metrics_unmap();
+    return 1;
+  }
+
+  pthread_atfork(NULL, NULL, metrics_atfork_child);
+  metrics_pid = (int) getpid();
+  if (socket_path != NULL)
+    LOG(LOG_INFO, "Exporting metrics on %s", socket_path);
+  if (dump_interval > 0)
+    LOG(LOG_INFO, "Logging latencies every %d s", dump_interval);
+  return 0;
+}
+
+
+void metrics_free(){
+  if (metrics_stop[1] == -1 || metrics_pid != (int) getpid())
+    return;
+
+  // wakes up the thread
+  if (write(metrics_stop[1], "", 1) == 1)
+    pthread_join(metrics_thread, NULL);
+  if (metrics_sd != -1)
+    unlink(metrics_addr.sun_path);
+  close(metrics_stop[0]);
+  close(metrics_stop[1]);
+  metrics_stop[0] = metrics_stop[1] = -1;
+  if (metrics_sd != -1)
+    close(metrics_sd);
+  metrics_sd = -1;
+}
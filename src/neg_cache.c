@@ -0,0 +1,360 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Implementation of neg_cache.h.
+ *
+ * @see neg_cache.h
+ */
+
+
+#include "include/neg_cache.h"
+#include "include/logging.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <linux/limits.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** LOG_LEVEL will be defined in another file */
+extern const int LOG_LEVEL;
+
+
+/** Events which can make a missing file appear */
+#define NEG_CACHE_EVENTS (IN_CREATE|IN_MOVED_TO|IN_ATTRIB)
+
+
+/**
+ * Hashes a name (djb2).
+ */
+unsigned int neg_cache_hash(char *name){
+  unsigned int hash = 5381;
+  while (*name != '\0')
+    hash = hash * 33 + (unsigned char) *name++;
+  return hash;
+}
+
+
+/**
+ * Removes an entry from the LRU list. Cache must be locked.
+ */
+void neg_cache_unlink(struct neg_cache *cache, struct neg_cache_entry *entry){
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    cache->head = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    cache->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+
+/**
+ * Adds an entry at the head of the LRU list. Cache must be locked.
+ */
+void neg_cache_link(struct neg_cache *cache, struct neg_cache_entry *entry){
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL)
+    cache->head->prev = entry;
+  else
+    cache->tail = entry;
+  cache->head = entry;
+}
+
+
+/**
+ * Removes and releases an entry. Cache must be locked.
+ */
+void neg_cache_remove(struct neg_cache *cache, struct neg_cache_entry *entry){
+  struct neg_cache_entry **p;
+
+  p = &cache->buckets[entry->hash % NEG_CACHE_BUCKETS];
+  while (*p != entry)
+    p = &(*p)->hnext;
+  *p = entry->hnext;
+
+  neg_cache_unlink(cache, entry);
+  cache->stats.entries--;
+  free(entry->name);
+  free(entry);
+}
+
+
+/**
+ * Removes all entries and starts a new generation. Cache must be locked.
+ */
+void neg_cache_flush(struct neg_cache *cache){
+  while (cache->head != NULL)
+    neg_cache_remove(cache, cache->head);
+  cache->generation++;
+}
+
+
+/**
+ * Watches a directory and, recursively, all of its subdirectories (symbolic
+ * links are not followed). Cache must be locked.
+ *
+ * @return  0 in case of success, 1 if a directory could not be watched
+ */
+int neg_cache_watch(struct neg_cache *cache, char *path){
+  char sub_path[PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+  int wd, n, is_dir;
+
+  wd = inotify_add_watch(cache->fd, path,
+                         NEG_CACHE_EVENTS|IN_ONLYDIR|IN_DONT_FOLLOW
+  );
+  if (wd == -1){
+    LOG(LOG_WARN, "Could not watch directory %s", path);
+    return 1;
+  }
+
+  if (wd >= cache->n_paths){
+    n = cache->n_paths;
+    cache->n_paths = wd * 2 + 16;
+    cache->paths = realloc(cache->paths, cache->n_paths * sizeof(char*));
+    memset(cache->paths + n, 0, (cache->n_paths - n) * sizeof(char*));
+  }
+  free(cache->paths[wd]);
+  cache->paths[wd] = strdup(path);
+
+  dir = opendir(path);
+  if (dir == NULL)  // its files cannot be served anyway
+    return 0;
+
+  while ((de = readdir(dir)) != NULL){
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    if (snprintf(sub_path, sizeof(sub_path), "%s/%s", path, de->d_name)
+        >= sizeof(sub_path))
+      continue;
+
+    if (de->d_type == DT_UNKNOWN)
+      is_dir = lstat(sub_path, &st) == 0 && S_ISDIR(st.st_mode);
+    else
+      is_dir = de->d_type == DT_DIR;
+
+    if (is_dir && neg_cache_watch(cache, sub_path) != 0){
+      closedir(dir);
+      return 1;
+    }
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+
+/**
+ * Stops watching the directory and disables the cache. Cache must be locked.
+ */
+void neg_cache_disable(struct neg_cache *cache){
+  int i;
+
+  if (cache->fd != -1)
+    close(cache->fd);
+  cache->fd = -1;
+
+  for (i = 0; i < cache->n_paths; i++)
+    free(cache->paths[i]);
+  free(cache->paths);
+  cache->paths = NULL;
+  cache->n_paths = 0;
+
+  neg_cache_flush(cache);
+}
+
+
+/**
+ * Reads pending inotify events, flushing the cache if anything changed and
+ * watching new subdirectories. Cache must be locked.
+ */
+void neg_cache_read_events(struct neg_cache *cache){
+  char buffer[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  char sub_path[PATH_MAX];
+  struct inotify_event *event;
+  ssize_t len;
+  char *ptr;
+  int changed = 0;
+
+  while ((len = read(cache->fd, buffer, sizeof(buffer))) > 0){
+    for (ptr = buffer; ptr < buffer + len;
+         ptr += sizeof(struct inotify_event) + event->len){
+      event = (struct inotify_event*) ptr;
+
+      if (event->mask & IN_IGNORED){  // directory was removed
+        if (event->wd < cache->n_paths){
+          free(cache->paths[event->wd]);
+          cache->paths[event->wd] = NULL;
+        }
+        continue;
+      }
+
+      changed = 1;
+
+      if (event->mask & IN_Q_OVERFLOW){
+        LOG(LOG_WARN, "Lost directory events, negative cache flushed");
+        continue;
+      }
+
+      // new subdirectories (possibly with files in them) are watched too
+      if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE|IN_MOVED_TO))
+          && event->wd < cache->n_paths && cache->paths[event->wd] != NULL &&
+          snprintf(sub_path, sizeof(sub_path), "%s/%s",
+                   cache->paths[event->wd], event->name) < sizeof(sub_path) &&
+          neg_cache_watch(cache, sub_path) != 0){
+        LOG(LOG_WARN, "Disabling negative cache");
+        neg_cache_disable(cache);
+        return;
+      }
+    }
+  }
+
+  if (changed){
+    LOG(LOG_DEBUG, "Directory changed, flushing negative cache");
+    neg_cache_flush(cache);
+    cache->stats.flushes++;
+  }
+}
+
+
+/**
+ * Looks for the entry of a name. Cache must be locked.
+ */
+struct neg_cache_entry* neg_cache_find(struct neg_cache *cache, char *name,
+                                       unsigned int hash){
+  struct neg_cache_entry *entry;
+
+  entry = cache->buckets[hash % NEG_CACHE_BUCKETS];
+  while (entry != NULL &&
+         (entry->hash != hash || strcmp(entry->name, name) != 0))
+    entry = entry->hnext;
+  return entry;
+}
+
+
+int neg_cache_init(struct neg_cache *cache, char *dir_realpath, int size){
+  memset(cache, 0, sizeof(struct neg_cache));
+  cache->size = size;
+  pthread_mutex_init(&cache->lock, NULL);
+
+  cache->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (cache->fd == -1){
+    LOG(LOG_WARN, "inotify not available, negative cache disabled");
+    return 1;
+  }
+
+  if (neg_cache_watch(cache, dir_realpath) != 0){
+    LOG(LOG_WARN, "Negative cache disabled");
+    neg_cache_disable(cache);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+int neg_cache_lookup(struct neg_cache *cache, char *name,
+                     unsigned long *generation){
+  struct neg_cache_entry *entry;
+
+  pthread_mutex_lock(&cache->lock);
+
+  cache->stats.lookups++;
+  if (cache->fd != -1)
+    neg_cache_read_events(cache);
+
+  entry = neg_cache_find(cache, name, neg_cache_hash(name));
+  if (entry != NULL){
+    cache->stats.hits++;
+    neg_cache_unlink(cache, entry);
+    neg_cache_link(cache, entry);
+  }
+  *generation = cache->generation;
+
+  pthread_mutex_unlock(&cache->lock);
+  return entry != NULL;
+}
+
+
+void neg_cache_insert(struct neg_cache *cache, char *name,
+                      unsigned long generation){
+  struct neg_cache_entry *entry;
+  unsigned int hash;
+
+  pthread_mutex_lock(&cache->lock);
+
+  if (cache->fd == -1 || cache->size <= 0){
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+
+  // the file may have been created while its path was resolved
+  neg_cache_read_events(cache);
+  hash = neg_cache_hash(name);
+  if (generation != cache->generation ||
+      neg_cache_find(cache, name, hash) != NULL){
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+
+  if (cache->stats.entries >= cache->size){
+    neg_cache_remove(cache, cache->tail);
+    cache->stats.evictions++;
+  }
+
+  entry = malloc(sizeof(struct neg_cache_entry));
+  entry->hash = hash;
+  entry->name = strdup(name);
+  entry->hnext = cache->buckets[hash % NEG_CACHE_BUCKETS];
+  cache->buckets[hash % NEG_CACHE_BUCKETS] = entry;
+  neg_cache_link(cache, entry);
+  cache->stats.entries++;
+  cache->stats.inserts++;
+
+  pthread_mutex_unlock(&cache->lock);
+}
+
+
+void neg_cache_get_stats(struct neg_cache *cache,
+                         struct neg_cache_stats *stats){
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+
+void neg_cache_log_stats(struct neg_cache *cache){
+  struct neg_cache_stats stats;
+
+  neg_cache_get_stats(cache, &stats);
+  LOG(LOG_INFO,
+      "Negative cache: %lu lookups, %lu hits (%.1f%%), %lu inserts, "
+      "%lu evictions, %lu flushes, %d/%d names",
+      stats.lookups,
+      stats.hits,
+      stats.lookups != 0 ? 100.0 * stats.hits / stats.lookups : 0.0,
+      stats.inserts,
+      stats.evictions,
+      stats.flushes,
+      stats.entries,
+      cache->size
+  );
+}
+
+
+void neg_cache_free(struct neg_cache *cache){
+  neg_cache_disable(cache);
+  pthread_mutex_destroy(&cache->lock);
+}
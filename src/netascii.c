@@ -11,16 +11,151 @@
 #include "include/netascii.h"
 #include "include/logging.h"
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
 /** LOG_LEVEL will be defined in another file */
 extern const int LOG_LEVEL;
 
 
+/**
+ * Returns the length of the run of bytes at the beginning of buf which are 
+ * neither c1 nor c2 (scalar implementation).
+ *
+ * @param buf  bytes to be scanned
+ * @param len  number of bytes in buf
+ * @param c1   first byte to look for
+ * @param c2   second byte to look for (can be equal to c1)
+ * @return     index of the first c1 or c2 in buf, len if there is none
+ */
+int netascii_span_scalar(const char *buf, int len, char c1, char c2){
+  int i;
+
+  for (i = 0; i < len; i++)
+    if (buf[i] == c1 || buf[i] == c2)
+      break;
+
+  return i;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * SSE2 implementation of netascii_span_scalar (16 bytes at a time).
+ *
+ * @see netascii_span_scalar
+ */
+__attribute__((target("sse2")))
+int netascii_span_sse2(const char *buf, int len, char c1, char c2){
+  __m128i v1, v2, x;
+  int i, mask;
+
+  v1 = _mm_set1_epi8(c1);
+  v2 = _mm_set1_epi8(c2);
+
+  for (i = 0; i + 16 <= len; i += 16){
+    x = _mm_loadu_si128((const __m128i*)(buf + i));
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, v1), 
+                                          _mm_cmpeq_epi8(x, v2)
+    ));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + netascii_span_scalar(buf + i, len - i, c1, c2);
+}
+
+
+/**
+ * AVX2 implementation of netascii_span_scalar (32 bytes at a time).
+ *
+ * @see netascii_span_scalar
+ */
+__attribute__((target("avx2")))
+int netascii_span_avx2(const char *buf, int len, char c1, char c2){
+  __m256i v1, v2, x;
+  int i;
+  unsigned int mask;
+
+  v1 = _mm256_set1_epi8(c1);
+  v2 = _mm256_set1_epi8(c2);
+
+  for (i = 0; i + 32 <= len; i += 32){
+    x = _mm256_loadu_si256((const __m256i*)(buf + i));
+    mask = (unsigned int) _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(x, v1), _mm256_cmpeq_epi8(x, v2))
+    );
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + netascii_span_sse2(buf + i, len - i, c1, c2);
+}
+
+#endif
+
+
+int netascii_span_resolve(const char *buf, int len, char c1, char c2);
+
+/** Span implementation in use, selected on first use */
+int (*netascii_span)(const char *, int, char, char) = netascii_span_resolve;
+
+
+/**
+ * Selects the best implementation supported by the CPU and runs it.
+ *
+ * @see netascii_span_scalar
+ */
+int netascii_span_resolve(const char *buf, int len, char c1, char c2){
+  netascii_select_impl(netascii_best_impl());
+  return netascii_span(buf, len, c1, c2);
+}
+
+
+int netascii_best_impl(){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return NETASCII_IMPL_AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return NETASCII_IMPL_SSE2;
+#endif
+  return NETASCII_IMPL_SCALAR;
+}
+
+
+int netascii_select_impl(int impl){
+  if (impl == NETASCII_IMPL_SCALAR){
+    netascii_span = netascii_span_scalar;
+    return 0;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (impl == NETASCII_IMPL_SSE2 && __builtin_cpu_supports("sse2")){
+    netascii_span = netascii_span_sse2;
+    return 0;
+  }
+  if (impl == NETASCII_IMPL_AVX2 && __builtin_cpu_supports("avx2")){
+    netascii_span = netascii_span_avx2;
+    return 0;
+  }
+#endif
+
+  return 1;
+}
+
+
 int unix2netascii(char *unix_filename, char* netascii_filename){
   FILE *unixf, *netasciif;
-  char prev, tmp;
-  int ret, result;
+  struct netascii_encoder encoder;
+  char out[NETASCII_BUF_LEN];
+  int n, result;
 
   unixf = fopen(unix_filename, "r");
 
@@ -31,54 +166,40 @@ int unix2netascii(char *unix_filename, char* netascii_filename){
 
   netasciif = fopen(netascii_filename, "w");
 
-  if (unixf == NULL){
+  if (netasciif == NULL){
     LOG(LOG_ERR, "Error opening file %s", netascii_filename);
+    fclose(unixf);
     return 2;
   }
 
-  prev = EOF;
-
-  while ((tmp = (char) fgetc(unixf)) != EOF){
-    if (tmp == '\n' && prev != '\r'){ // LF -> CRLF
-      ret = putc('\r', netasciif);
-      if (ret == EOF)
-        break;
+  netascii_encoder_init(&encoder);
+  result = 0;
 
-      ret = putc('\n', netasciif);
-      if (ret == EOF)
+  for (;;){
+    // load more bytes only once everything has been converted
+    if (encoder.pos == encoder.len && encoder.pending == -1){
+      encoder.len = fread(encoder.buf, sizeof(char), NETASCII_BUF_LEN, unixf);
+      encoder.pos = 0;
+      if (encoder.len == 0)
         break;
+    }
 
-    } else if (tmp == '\r'){  // CR -> CRNUL
-      char next = (char) fgetc(unixf);
-      if (next != '\0')
-        ungetc(next, unixf);
-
-      ret = putc('\r', netasciif);
-      if (ret == EOF)
-        break;
+    n = netascii_encode(&encoder, out, NETASCII_BUF_LEN);
 
-      ret = putc('\0', netasciif);
-      if (ret == EOF)
-        break;      
-    } else{
-      ret = putc(tmp, netasciif);
-      if (ret == EOF)
-        break;
+    if (fwrite(out, sizeof(char), n, netasciif) != n){
+      result = 3;
+      break;
     }
-
-    prev = tmp;
   }
 
   // Error writing to netasciif
-  if (ret == EOF){
+  if (result == 3){
     LOG(LOG_ERR, "Error writing to file %s", netascii_filename);
-    result = 3;
   } else{
     LOG(LOG_INFO, "Unix file %s converted to netascii file %s", 
         unix_filename, 
         netascii_filename
     );
-    result = 0;
   }
 
   fclose(unixf);
@@ -89,8 +210,9 @@ int unix2netascii(char *unix_filename, char* netascii_filename){
 
 int netascii2unix(char* netascii_filename, char *unix_filename){
   FILE *unixf, *netasciif;
-  char tmp;
-  int ret;
+  struct netascii_decoder decoder;
+  char in[NETASCII_BUF_LEN];
+  int len, n;
   int result = 0;
 
   unixf = fopen(unix_filename, "w");
@@ -102,57 +224,161 @@ int netascii2unix(char* netascii_filename, char *unix_filename){
 
   netasciif = fopen(netascii_filename, "r");
 
-  if (unixf == NULL){
+  if (netasciif == NULL){
     LOG(LOG_ERR, "Error opening file %s", netascii_filename);
+    fclose(unixf);
     return 2;
   }
 
-  while ((tmp = (char) fgetc(netasciif)) != EOF){
-    if (tmp == '\r'){  // CRLF -> LF ; CRNUL -> CR
-      char next = (char) fgetc(netasciif);
-      if (next == '\0'){  // CRNUL -> CR
-       ret = putc('\r', unixf);
-       if (ret == EOF)
-        break;
-      } else if (next == '\n'){  // CRLF -> LF
-       ret = putc('\n', unixf);
-       if (ret == EOF)
-        break;
-      } else if (next == EOF) { // bad format
-        LOG(LOG_ERR, "Bad formatted netascii: unexpected EOF after CR");
-        result = 4;
-        break;  
-      } else{                   // bad format
-        LOG(LOG_ERR, "Bad formatted netascii: unexpected 0x%x after CR", next);
-        result = 4;
-        break;
-      } 
-    } else{
-
-      // nothing else needs to be done!
+  netascii_decoder_init(&decoder);
 
-      ret = putc(tmp, unixf);
-      if (ret == EOF)
-        break;
+  while ((len = fread(in, sizeof(char), NETASCII_BUF_LEN, netasciif)) > 0){
+    n = netascii_decode(&decoder, in, len);
+    if (n < 0){  // bad format
+      result = 4;
+      break;
     }
-  }
 
-  if (result == 0){
-    // Error writing to unixf
-    if (ret == EOF){
-      LOG(LOG_ERR, "Error writing to file %s", unix_filename);
+    if (fwrite(decoder.buf, sizeof(char), n, unixf) != n){
       result = 3;
-    } else{
-      LOG(LOG_INFO, "Netascii file %s converted to Unix file %s", 
-          netascii_filename, 
-          unix_filename
-      );
-      result = 0;
+      break;
     }
-  } // otherwise there was an error (4 or 5) and result was already set
+  }
+
+  if (result == 0 && decoder.pending_cr){ // bad format
+    LOG(LOG_ERR, "Bad formatted netascii: unexpected EOF after CR");
+    result = 4;
+  }
+
+  if (result == 3){
+    LOG(LOG_ERR, "Error writing to file %s", unix_filename);
+  } else if (result == 0){
+    LOG(LOG_INFO, "Netascii file %s converted to Unix file %s", 
+        netascii_filename, 
+        unix_filename
+    );
+  } // otherwise there was an error (4) and it was already logged
 
   fclose(unixf);
   fclose(netasciif);
 
   return result;
 }
+
+
+void netascii_encoder_init(struct netascii_encoder *encoder){
+  encoder->len = 0;
+  encoder->pos = 0;
+  encoder->prev_cr = 0;
+  encoder->skip_nul = 0;
+  encoder->pending = -1;
+}
+
+
+int netascii_encode(struct netascii_encoder *encoder, char *out, int out_len){
+  int n, second, run;
+  char tmp;
+
+  n = 0;
+
+  // second byte of a sequence left over by the previous call
+  if (encoder->pending != -1 && n < out_len){
+    out[n++] = (char) encoder->pending;
+    encoder->pending = -1;
+  }
+
+  while (n < out_len && encoder->pos < encoder->len){
+    // bytes other than CR and LF are copied as they are
+    if (!encoder->skip_nul){
+      run = encoder->len - encoder->pos;
+      if (run > out_len - n)
+        run = out_len - n;
+      run = netascii_span(encoder->buf + encoder->pos, run, '\r', '\n');
+
+      if (run > 0){
+        memcpy(out + n, encoder->buf + encoder->pos, run);
+        n += run;
+        encoder->pos += run;
+        encoder->prev_cr = 0;
+        continue;
+      }
+    }
+
+    tmp = encoder->buf[encoder->pos++];
+
+    if (encoder->skip_nul){  // CRNUL is left as it is
+      encoder->skip_nul = 0;
+      if (tmp == '\0')
+        continue;
+    }
+
+    if (tmp == '\n' && !encoder->prev_cr){ // LF -> CRLF
+      out[n++] = '\r';
+      second = '\n';
+    } else if (tmp == '\r'){  // CR -> CRNUL
+      out[n++] = '\r';
+      second = '\0';
+      encoder->skip_nul = 1;
+    } else{
+      out[n++] = tmp;
+      second = -1;
+    }
+
+    if (second != -1){
+      if (n < out_len)
+        out[n++] = (char) second;
+      else
+        encoder->pending = second;
+    }
+
+    encoder->prev_cr = tmp == '\r';
+  }
+
+  return n;
+}
+
+
+void netascii_decoder_init(struct netascii_decoder *decoder){
+  decoder->pending_cr = 0;
+}
+
+
+int netascii_decode(struct netascii_decoder *decoder, char *in, int in_len){
+  int i, n, run;
+  char tmp;
+
+  n = 0;
+  i = 0;
+  while (i < in_len){
+    // bytes other than CR are copied as they are
+    if (!decoder->pending_cr){
+      run = netascii_span(in + i, in_len - i, '\r', '\r');
+      memcpy(decoder->buf + n, in + i, run);
+      n += run;
+      i += run;
+
+      if (i == in_len)
+        break;
+    }
+
+    tmp = in[i++];
+
+    if (decoder->pending_cr){  // CRLF -> LF ; CRNUL -> CR
+      decoder->pending_cr = 0;
+      if (tmp == '\0')
+        decoder->buf[n++] = '\r';
+      else if (tmp == '\n')
+        decoder->buf[n++] = '\n';
+      else{
+        LOG(LOG_ERR, "Bad formatted netascii: unexpected 0x%x after CR", tmp);
+        return -1;
+      }
+    } else if (tmp == '\r'){
+      decoder->pending_cr = 1;
+    } else{
+      decoder->buf[n++] = tmp;
+    }
+  }
+
+  return n;
+}
@@ -0,0 +1,986 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ * 
+ * @brief Implementation of server_loop.h.
+ * 
+ * @see server_loop.h
+ */
+
+
+#define _GNU_SOURCE
+#include "include/server_loop.h"
+#include "include/server_utils.h"
+#include "include/tftp_msgs.h"
+#include "include/tftp.h"
+#include "include/fblock.h"
+#include "include/inet_utils.h"
+#include "include/logging.h"
+#include "include/metrics.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <linux/limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+
+/** LOG_LEVEL will be defined in another file */
+extern const int LOG_LEVEL;
+
+
+/** Maximum length for a RRQ message */
+#define MAX_MSG_LEN TFTP_MAX_REQUEST_LEN
+
+
+/**
+ * A client of a multicast transfer.
+ */
+struct mc_client{
+  struct mc_client *next;     /**< Next client in the queue */
+  struct sockaddr_in addr;    /**< Address of the client */
+  struct tftp_opts opts;      /**< Options accepted for the client */
+};
+
+/**
+ * A transfer being served by the event loop.
+ */
+struct session{
+  struct session *prev;       /**< Previous session in the list */
+  struct session *next;       /**< Next session in the list */
+  int sd;                     /**< Socket of the session (its TID) */
+  struct fblock m_fblock;     /**< File being sent (or received) */
+  struct file_cache_entry *entry;  /**< Cache entry of the file (or NULL) */
+  int upload;                 /**< Set to 1 if file is being received */
+  char *path;                 /**< Real path of the received (or multicast)
+                                   file */
+  struct tftp_sender sender;  /**< State of the transmission */
+  struct tftp_receiver receiver;  /**< State of the reception */
+  int timer_idx;              /**< Position in timers heap (-1 if none) */
+  int multicast;              /**< Set to 1 if file is sent to a group */
+  struct mc_client *clients;  /**< Clients of the group (master first) */
+  int n_clients;              /**< Number of clients in the queue */
+  unsigned long completed;    /**< Clients which received the whole file */
+  struct metrics_session *metrics;  /**< Shared counters (or NULL) */
+};
+
+
+/**
+ * Returns the retransmission deadline of a session.
+ */
+long long session_deadline(struct session *s){
+  return s->upload ? s->receiver.deadline : s->sender.deadline;
+}
+
+
+/**
+ * Swaps two sessions in the timers heap.
+ */
+void server_loop_timer_swap(struct server_loop *loop, int i, int j){
+  struct session *tmp = loop->timers[i];
+  loop->timers[i] = loop->timers[j];
+  loop->timers[j] = tmp;
+  loop->timers[i]->timer_idx = i;
+  loop->timers[j]->timer_idx = j;
+}
+
+
+/**
+ * Restores the heap property after the deadline of a session has changed.
+ */
+void server_loop_timer_update(struct server_loop *loop, struct session *s){
+  int i, parent, child;
+
+  i = s->timer_idx;
+  while (i > 0){
+    parent = (i - 1) / 2;
+    if (session_deadline(loop->timers[parent]) <= session_deadline(s))
+      break;
+    server_loop_timer_swap(loop, i, parent);
+    i = parent;
+  }
+
+  while ((child = 2 * i + 1) < loop->n_timers){
+    if (child + 1 < loop->n_timers && 
+        session_deadline(loop->timers[child + 1]) < 
+          session_deadline(loop->timers[child]))
+      child++;
+    if (session_deadline(loop->timers[child]) >= session_deadline(s))
+      break;
+    server_loop_timer_swap(loop, i, child);
+    i = child;
+  }
+}
+
+
+/**
+ * Adds a session to the timers heap.
+ */
+void server_loop_timer_add(struct server_loop *loop, struct session *s){
+  if (loop->n_timers == loop->timers_size){
+    loop->timers_size = loop->timers_size ? loop->timers_size * 2 : 16;
+    loop->timers = realloc(loop->timers, 
+                           loop->timers_size * sizeof(struct session*)
+    );
+  }
+
+  s->timer_idx = loop->n_timers++;
+  loop->timers[s->timer_idx] = s;
+  server_loop_timer_update(loop, s);
+}
+
+
+/**
+ * Removes a session from the timers heap.
+ */
+void server_loop_timer_remove(struct server_loop *loop, struct session *s){
+  int i;
+
+  i = s->timer_idx;
+  s->timer_idx = -1;
+  loop->n_timers--;
+  if (i == loop->n_timers)
+    return;
+
+  // last session takes the place of the removed one
+  loop->timers[i] = loop->timers[loop->n_timers];
+  loop->timers[i]->timer_idx = i;
+  server_loop_timer_update(loop, loop->timers[i]);
+}
+
+
+/**
+ * Releases the clients of a multicast session and accounts for the bytes 
+ * saved by sending the file to all of them at once.
+ */
+void session_mc_close(struct server_loop *loop, struct session *s){
+  struct mc_client *c;
+  long long saved;
+
+  while (s->clients != NULL){
+    c = s->clients;
+    s->clients = c->next;
+    free(c);
+  }
+
+  saved = (long long) s->completed * s->m_fblock.map_len - 
+          s->sender.stats.bytes;
+  loop->stats.mc_saved += saved;
+  LOG(LOG_INFO, "Multicast of %s: %lu clients served, %lld bytes sent, "
+      "%lld bytes saved", 
+      s->path,
+      s->completed,
+      s->sender.stats.bytes,
+      saved
+  );
+}
+
+
+/**
+ * Sends an OACK to a client of a multicast session, from the session socket.
+ * 
+ * @return  0 in case of success, 1 otherwise
+ */
+int session_mc_send_oack(struct session *s, struct mc_client *c){
+  char out_buffer[TFTP_MAX_REQUEST_LEN];
+  int msglen;
+
+  msglen = tftp_msg_get_size_oack(&c->opts);
+  tftp_msg_build_oack(&c->opts, out_buffer);
+  if (sendto(s->sd, out_buffer, msglen, 0, (struct sockaddr*)&c->addr, 
+             sizeof(c->addr)) != msglen){
+    LOG(LOG_ERR, "Error sending OACK to multicast client");
+    return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Appends a client to the queue of a multicast session.
+ */
+struct mc_client* session_mc_add(struct server_loop *loop, struct session *s, 
+                                 struct tftp_opts *opts, 
+                                 struct sockaddr_in *cl_addr){
+  struct mc_client *c, **p;
+
+  c = malloc(sizeof(struct mc_client));
+  c->next = NULL;
+  c->addr = *cl_addr;
+  c->opts = *opts;
+
+  for (p = &s->clients; *p != NULL; p = &(*p)->next)
+    ;
+  *p = c;
+  s->n_clients++;
+  loop->stats.mc_clients++;
+  return c;
+}
+
+
+/**
+ * Removes the first client of a multicast session and makes the next one 
+ * master, until one gets the OACK.
+ * 
+ * @return  0 if there is a new master, 1 if the session is over (or it is 
+ *          not a multicast session)
+ */
+int session_mc_next(struct server_loop *loop, struct session *s){
+  struct mc_client *c;
+
+  if (!s->multicast)
+    return 1;
+
+  while (s->clients != NULL){
+    c = s->clients;
+    s->clients = c->next;
+    s->n_clients--;
+    free(c);
+
+    c = s->clients;
+    if (c == NULL)
+      break;
+
+    c->opts.mc_master = 1;
+    if (tftp_sender_set_master(&s->sender, &c->opts, &c->addr) == 0){
+      LOG(LOG_INFO, "New master client (%d clients left)", s->n_clients);
+      return 0;
+    }
+    loop->stats.failed++;
+  }
+
+  return 1;
+}
+
+
+/**
+ * Terminates a session, releasing all of its resources.
+ */
+void session_close(struct server_loop *loop, struct session *s){
+  if (s->prev != NULL)
+    s->prev->next = s->next;
+  else
+    loop->sessions = s->next;
+  if (s->next != NULL)
+    s->next->prev = s->prev;
+
+  if (s->timer_idx != -1)
+    server_loop_timer_remove(loop, s);
+
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s->sd, NULL);
+  close(s->sd);
+  if (s->multicast)
+    session_mc_close(loop, s);
+  if (s->upload){
+    tftp_receiver_free(&s->receiver);
+    close_upload_file(s->path, &s->m_fblock, s->receiver.done);
+  } else{
+    if (s->sender.m_fblock != NULL)
+      tftp_sender_log_stats(&s->sender);
+    tftp_sender_free(&s->sender);
+    close_request_file(loop->cache, s->entry, &s->m_fblock);
+  }
+  metrics_session_end(s->metrics, 
+                      !(s->upload ? s->receiver.done : s->sender.done)
+  );
+  free(s->path);
+  free(s);
+  loop->n_sessions--;
+  LOG(LOG_DEBUG, "%d sessions still active", loop->n_sessions);
+}
+
+
+/**
+ * Makes a new session send its file to the multicast group, with the 
+ * requesting client as master. If the file cannot be sent in multicast, the
+ * option is dropped and the file is sent in unicast.
+ * 
+ * The group port is the port of the session (its TID), so that each session
+ * has its own group. Multicast DATA messages leave from the interface used 
+ * to reach the first client.
+ */
+void session_mc_setup(struct server_loop *loop, struct session *s, 
+                      char *file_realpath, struct tftp_opts *opts, 
+                      struct sockaddr_in *cl_addr){
+  struct sockaddr_in my_addr;
+  struct in_addr ifaddr;
+  unsigned int addrlen;
+
+  opts->multicast = 0;
+
+  // blocks are read in any order and block numbers must not roll over
+  if (s->m_fblock.map == NULL || s->m_fblock.encoder != NULL || 
+      s->m_fblock.map_len / s->m_fblock.block_size >= TFTP_BLOCK_N_MASK){
+    LOG(LOG_INFO, "File cannot be sent in multicast, using unicast");
+    return;
+  }
+
+  addrlen = sizeof(my_addr);
+  if (getsockname(s->sd, (struct sockaddr*)&my_addr, &addrlen) != 0 || 
+      get_local_addr(cl_addr, &ifaddr) != 0 || 
+      set_multicast_if(s->sd, &ifaddr) != 0){
+    LOG(LOG_WARN, "Could not set up multicast, using unicast");
+    return;
+  }
+
+  opts->multicast = 1;
+  memset(&opts->mc_group, 0, sizeof(opts->mc_group));
+  opts->mc_group.sin_family = AF_INET;
+  opts->mc_group.sin_addr = loop->mc_addr;
+  opts->mc_group.sin_port = my_addr.sin_port;
+  opts->mc_master = 1;
+  // each block is acknowledged by the master client
+  opts->windowsize = 0;
+
+  s->multicast = 1;
+  s->path = strdup(file_realpath);
+  session_mc_add(loop, s, opts, cl_addr);
+}
+
+
+/**
+ * Adds a client to an ongoing multicast session, sending it the OACK. A 
+ * client which is already in the queue gets the OACK again.
+ */
+void session_mc_join(struct server_loop *loop, struct session *s, 
+                     struct tftp_opts *opts, struct sockaddr_in *cl_addr){
+  struct mc_client *c;
+
+  for (c = s->clients; c != NULL; c = c->next)
+    if (sockaddr_in_cmp(c->addr, *cl_addr) == 0){
+      LOG(LOG_DEBUG, "Retransmitted request, sending OACK again");
+      session_mc_send_oack(s, c);
+      return;
+    }
+
+  opts->multicast = 1;
+  opts->mc_group = s->sender.group;
+  opts->mc_master = 0;
+  opts->windowsize = 0;
+  if (opts->tsize >= 0)
+    opts->tsize = s->m_fblock.map_len;
+
+  loop->stats.started++;
+  c = session_mc_add(loop, s, opts, cl_addr);
+  LOG(LOG_INFO, "Client joined multicast of %s (%d clients)", 
+      s->path, 
+      s->n_clients
+  );
+  session_mc_send_oack(s, c);
+}
+
+
+/**
+ * Looks for a multicast session sending a file with a given block size.
+ * 
+ * @return  the session, NULL if there is none
+ */
+struct session* server_loop_find_group(struct server_loop *loop, 
+                                       char *file_realpath, int block_size){
+  struct session *s;
+
+  for (s = loop->sessions; s != NULL; s = s->next)
+    if (s->multicast && s->sender.block_size == block_size && 
+        strcmp(s->path, file_realpath) == 0)
+      return s;
+  return NULL;
+}
+
+
+/**
+ * Handles a message sent to a multicast session by a client which is not
+ * the master: its ACK of the last block (or an ERROR) means that it leaves
+ * the group.
+ * 
+ * @return  1 if the message was handled, 0 if it does not come from a 
+ *          client of the session
+ */
+int session_mc_on_client(struct server_loop *loop, struct session *s, 
+                         char *in_buffer, int len, 
+                         struct sockaddr_in *src_addr){
+  struct mc_client *c, **p;
+  int type, block_n;
+
+  for (p = &s->clients->next; *p != NULL; p = &(*p)->next)
+    if (sockaddr_in_cmp((*p)->addr, *src_addr) == 0)
+      break;
+  if (*p == NULL)
+    return 0;
+
+  if (len < 4)
+    return 1;
+
+  type = tftp_msg_type(in_buffer);
+  if (type == TFTP_TYPE_ACK && 
+      tftp_msg_unpack_ack(in_buffer, len, &block_n) == 0 && 
+      block_n == s->sender.n_blocks){
+    LOG(LOG_INFO, "Multicast client received the whole file");
+    s->completed++;
+    loop->stats.completed++;
+  } else if (type == TFTP_TYPE_ERROR){
+    LOG(LOG_WARN, "Multicast client left with an error");
+    loop->stats.failed++;
+  } else
+    return 1;
+
+  c = *p;
+  *p = c->next;
+  s->n_clients--;
+  free(c);
+  return 1;
+}
+
+
+/**
+ * Opens the requested file and sends the OACK or the first DATA message. In
+ * case of error, the session is closed.
+ * 
+ * @return  0 in case of success, 1 otherwise
+ */
+int session_start_send(struct server_loop *loop, struct session *s, 
+                       char *file_realpath, int fd, off_t size, char *mode, 
+                       struct tftp_opts *opts, struct sockaddr_in *cl_addr){
+  int ret;
+
+  ret = open_request_file(file_realpath, fd, size, mode, opts, loop->cache, 
+                          &s->entry, &s->m_fblock
+  );
+  if (ret == 1){
+    LOG(LOG_WARN, "Error opening file. Not found?");
+    tftp_send_error(1, "File not found.", s->sd, cl_addr);
+    loop->stats.failed++;
+    session_close(loop, s);
+    return 1;
+  } else if (ret != 0){
+    LOG(LOG_WARN, "Error opening file: %d", ret);
+    tftp_send_error(0, "Could not open file.", s->sd, cl_addr);
+    loop->stats.failed++;
+    session_close(loop, s);
+    return 1;
+  }
+
+  if (opts->multicast)
+    session_mc_setup(loop, s, file_realpath, opts, cl_addr);
+
+  LOG(LOG_INFO, "Sending file...");
+  ret = tftp_sender_start(&s->sender, &s->m_fblock, opts, s->sd, cl_addr, 
+                          s->metrics
+  );
+  if (ret != 0){
+    LOG(LOG_ERR, "Error sending file: %d", ret);
+    loop->stats.failed++;
+    session_close(loop, s);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Starts sending (or receiving) a file to (or from) a client in a new 
+ * session.
+ * 
+ * fd is the descriptor of the requested file, opened by resolve_request_path
+ * (-1 for uploads), and size its size if known (-1 otherwise). fd is closed
+ * in any case.
+ */
+void session_start(struct server_loop *loop, int upload, char *file_realpath,
+                   int fd, off_t size, char *mode, struct tftp_opts *opts, 
+                   struct sockaddr_in *cl_addr){
+  struct sockaddr_in my_addr;
+  struct session *s;
+  struct epoll_event ev;
+  int ret, tid;
+
+  s = malloc(sizeof(struct session));
+  s->m_fblock.file = NULL;
+  s->m_fblock.map = NULL;
+  s->entry = NULL;
+  s->upload = upload;
+  s->path = upload ? strdup(file_realpath) : NULL;
+  s->timer_idx = -1;
+  s->multicast = 0;
+  s->clients = NULL;
+  s->n_clients = 0;
+  s->completed = 0;
+  memset(&s->sender, 0, sizeof(s->sender));
+  memset(&s->receiver, 0, sizeof(s->receiver));
+  s->receiver.mc_sd = -1;  // not a descriptor of the session until accepted
+
+  s->sd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK, 0);
+  my_addr = make_my_sockaddr_in(0);
+  tid = bind_random_port(s->sd, &my_addr);
+  if (tid == 0){
+    LOG(LOG_ERR, "Could not bind to random port");
+    close(s->sd);
+    if (fd != -1)
+      close(fd);
+    free(s->path);
+    free(s);
+    loop->stats.failed++;
+    return;
+  } else
+    LOG(LOG_INFO, "Bound to port %d", tid);
+
+  s->prev = NULL;
+  s->next = loop->sessions;
+  if (loop->sessions != NULL)
+    loop->sessions->prev = s;
+  loop->sessions = s;
+  loop->n_sessions++;
+  loop->stats.started++;
+  s->metrics = metrics_session_start(upload, file_realpath, cl_addr);
+
+  if (upload){
+    ret = open_upload_file(file_realpath, mode, opts, loop->sync, 
+                           &s->m_fblock
+    );
+    if (ret == 3)
+      tftp_send_error(6, "File already exists.", s->sd, cl_addr);
+    else if (ret == 1)
+      tftp_send_error(2, "Access violation.", s->sd, cl_addr);
+
+    if (ret == 0){
+      LOG(LOG_INFO, "Receiving file...");
+      ret = tftp_receiver_accept(&s->receiver, &s->m_fblock, opts, s->sd, 
+                                 cl_addr
+      );
+    }
+
+    if (ret != 0){
+      LOG(LOG_ERR, "Error receiving file: %d", ret);
+      loop->stats.failed++;
+      session_close(loop, s);
+      return;
+    }
+  } else if (session_start_send(loop, s, file_realpath, fd, size, mode, 
+                                opts, cl_addr) != 0)
+    return;
+
+  server_loop_timer_add(loop, s);
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = s;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s->sd, &ev) == -1){
+    LOG(LOG_ERR, "Could not add session socket to epoll");
+    loop->stats.failed++;
+    session_close(loop, s);
+  }
+}
+
+
+/**
+ * Handles a write request received on the listening socket.
+ */
+void server_loop_handle_wrq(struct server_loop *loop, char *in_buffer, 
+                            int len, struct sockaddr_in *cl_addr){
+  char filename[TFTP_MAX_FILENAME_LEN+1], mode[TFTP_MAX_MODE_LEN+1];
+  char file_realpath[PATH_MAX];
+  struct tftp_opts opts;
+  int ret;
+
+  ret = tftp_msg_unpack_wrq(in_buffer, len, filename, mode, &opts);
+  if (ret != 0){
+    LOG(LOG_WARN, "Error unpacking WRQ");
+    tftp_send_error(0, "Malformed WRQ packet.", loop->sd, cl_addr);
+    loop->stats.rejected++;
+    metrics_count_rejected();
+    return;
+  }
+
+  negotiate_options(&opts);
+
+  ret = resolve_upload_path(loop->dir_realpath, filename, file_realpath);
+  if (ret == 2){
+    tftp_send_error(2, "Access violation.", loop->sd, cl_addr);
+    loop->stats.rejected++;
+    metrics_count_rejected();
+    return;
+  } else if (ret != 0){
+    tftp_send_error(1, "File Not Found.", loop->sd, cl_addr);
+    loop->stats.rejected++;
+    metrics_count_rejected();
+    return;
+  }
+
+  LOG(LOG_INFO, "User wants to write file %s in mode %s", filename, mode);
+
+  session_start(loop, 1, file_realpath, -1, -1, mode, &opts, cl_addr);
+}
+
+
+/**
+ * Handles a message received on the listening socket.
+ */
+void server_loop_handle_request(struct server_loop *loop, char *in_buffer, 
+                                int len, struct sockaddr_in *cl_addr){
+  char filename[TFTP_MAX_FILENAME_LEN+1], mode[TFTP_MAX_MODE_LEN+1];
+  char file_realpath[PATH_MAX];
+  char addr_str[MAX_SOCKADDR_STR_LEN];
+  struct tftp_opts opts;
+  struct session *s;
+  unsigned long generation;
+  int ret, type, multicast, fd;
+  off_t size;
+
+  type = tftp_msg_type(in_buffer);
+  sockaddr_in_to_string(*cl_addr, addr_str);
+  LOG(LOG_INFO, "Received message with type %d from %s", type, addr_str);
+
+  loop->stats.requests++;
+  metrics_count_request(type);
+
+  if (type == TFTP_TYPE_WRQ && loop->uploads){
+    server_loop_handle_wrq(loop, in_buffer, len, cl_addr);
+    return;
+  } else if (type != TFTP_TYPE_RRQ){
+    LOG(LOG_WARN, "Wrong op code: %d", type);
+    tftp_send_error(4, "Illegal TFTP operation.", loop->sd, cl_addr);
+    loop->stats.rejected++;
+    metrics_count_rejected();
+    return;
+  }
+
+  ret = tftp_msg_unpack_rrq(in_buffer, len, filename, mode, &opts);
+  if (ret != 0){
+    LOG(LOG_WARN, "Error unpacking RRQ");
+    tftp_send_error(0, "Malformed RRQ packet.", loop->sd, cl_addr);
+    loop->stats.rejected++;
+    metrics_count_rejected();
+    return;
+  }
+
+  // only octet files can be sent in multicast (see session_mc_setup)
+  multicast = opts.multicast && loop->mc_addr.s_addr != INADDR_ANY && 
+              strcasecmp(mode, TFTP_STR_OCTET) == 0;
+  negotiate_options(&opts);
+
+  // recently missing files are not looked up again
+  if (loop->neg_cache != NULL && 
+      neg_cache_lookup(loop->neg_cache, filename, &generation)){
+    LOG(LOG_INFO, "File %s is known to be missing", filename);
+    tftp_send_error(1, "File Not Found.", loop->sd, cl_addr);
+    loop->stats.rejected++;
+    metrics_count_rejected();
+    return;
+  }
+
+  ret = resolve_indexed_path(loop->dir_index, loop->dir_fd, 
+                             loop->dir_realpath, filename, file_realpath, &fd,
+                             &size
+  );
+  if (ret == 2){
+    tftp_send_error(4, "Access violation.", loop->sd, cl_addr);
+    loop->stats.rejected++;
+    metrics_count_rejected();
+    return;
+  } else if (ret != 0){
+    if (loop->neg_cache != NULL)
+      neg_cache_insert(loop->neg_cache, filename, generation);
+    tftp_send_error(1, "File Not Found.", loop->sd, cl_addr);
+    loop->stats.rejected++;
+    metrics_count_rejected();
+    return;
+  }
+
+  LOG(LOG_INFO, "User wants to read file %s in mode %s", filename, mode);
+
+  if (multicast){
+    s = server_loop_find_group(loop, file_realpath, 
+                               opts.blksize != 0 ? opts.blksize 
+                                                 : TFTP_DATA_BLOCK
+    );
+    if (s != NULL){
+      close(fd);
+      session_mc_join(loop, s, &opts, cl_addr);
+      return;
+    }
+    opts.multicast = 1;
+  }
+
+  session_start(loop, 0, file_realpath, fd, size, mode, &opts, cl_addr);
+}
+
+
+/**
+ * Reads all pending requests from the listening socket.
+ */
+void server_loop_on_listener(struct server_loop *loop){
+  char in_buffer[MAX_MSG_LEN];
+  struct sockaddr_in cl_addr;
+  unsigned int addrlen;
+  int len;
+
+  while (1){
+    addrlen = sizeof(cl_addr);
+    len = recvfrom(loop->sd, in_buffer, MAX_MSG_LEN, 0, 
+                   (struct sockaddr*)&cl_addr, 
+                   &addrlen
+    );
+    if (len < 0)  // EAGAIN: nothing else to read
+      break;
+    if (len < 2)  // not even an opcode
+      continue;
+
+    server_loop_handle_request(loop, in_buffer, len, &cl_addr);
+  }
+}
+
+
+/**
+ * Reads all pending messages from the socket of a session.
+ */
+void server_loop_on_session(struct server_loop *loop, struct session *s){
+  char in_buffer[TFTP_MAX_BLKSIZE+4];  // DATA messages of uploads
+  struct sockaddr_in src_addr;
+  unsigned int addrlen;
+  int len, ret;
+
+  while (1){
+    addrlen = sizeof(src_addr);
+    len = recvfrom(s->sd, in_buffer, sizeof(in_buffer), 0, 
+                   (struct sockaddr*)&src_addr, 
+                   &addrlen
+    );
+    if (len < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      LOG(LOG_ERR, "Error receiving ack");
+      loop->stats.failed++;
+      session_close(loop, s);
+      return;
+    }
+
+    if (s->upload){
+      ret = tftp_receiver_recv(&s->receiver, in_buffer, len, &src_addr);
+      if (ret != 0){
+        LOG(LOG_ERR, "Error receiving file: %d", ret);
+        loop->stats.failed++;
+        session_close(loop, s);
+        return;
+      }
+      // once done, session dallies until its deadline (see on_timers)
+      server_loop_timer_update(loop, s);
+      continue;
+    }
+
+    // only the master client is handled by the sender
+    if (s->multicast && sockaddr_in_cmp(s->sender.addr, src_addr) != 0 && 
+        session_mc_on_client(loop, s, in_buffer, len, &src_addr))
+      continue;
+
+    ret = tftp_sender_recv(&s->sender, in_buffer, len, &src_addr);
+    if (ret != 0){
+      LOG(LOG_ERR, "Error sending file: %d", ret);
+      loop->stats.failed++;
+      if (session_mc_next(loop, s) != 0){
+        session_close(loop, s);
+        return;
+      }
+    } else if (s->sender.done){
+      LOG(LOG_INFO, "File sent successfully");
+      loop->stats.completed++;
+      s->completed++;
+      if (session_mc_next(loop, s) != 0){
+        session_close(loop, s);
+        return;
+      }
+    }
+
+    server_loop_timer_update(loop, s);
+  }
+}
+
+
+/**
+ * Handles sessions whose retransmission deadline has expired.
+ */
+void server_loop_on_timers(struct server_loop *loop){
+  struct session *s;
+  long long now;
+  int ret;
+
+  now = tftp_clock_ms();
+  while (loop->n_timers > 0 && session_deadline(loop->timers[0]) <= now){
+    s = loop->timers[0];
+
+    if (s->upload && s->receiver.done){
+      // no retransmitted block: the last ACK was not lost
+      LOG(LOG_INFO, "File received successfully");
+      loop->stats.completed++;
+      session_close(loop, s);
+      continue;
+    }
+
+    loop->stats.timeouts++;
+    if (s->upload)
+      ret = tftp_receiver_timeout(&s->receiver);
+    else
+      ret = tftp_sender_timeout(&s->sender);
+    if (ret != 0){
+      LOG(LOG_ERR, "Error in transfer: %d", ret);
+      loop->stats.failed++;
+      if (s->upload || session_mc_next(loop, s) != 0)
+        session_close(loop, s);
+      else
+        server_loop_timer_update(loop, s);
+    } else
+      server_loop_timer_update(loop, s);
+  }
+}
+
+
+/**
+ * Computes how long the loop can sleep before the earliest deadline.
+ * 
+ * @return  time in ms, at most SERVER_LOOP_TICK
+ */
+int server_loop_wait_time(struct server_loop *loop){
+  long long left;
+
+  if (loop->n_timers == 0)
+    return SERVER_LOOP_TICK;
+
+  left = session_deadline(loop->timers[0]) - tftp_clock_ms();
+  if (left < 0)
+    return 0;
+  else if (left > SERVER_LOOP_TICK)
+    return SERVER_LOOP_TICK;
+  return left;
+}
+
+
+int server_loop_init(struct server_loop *loop, int id, int sd, 
+                     char *dir_realpath, struct file_cache *cache){
+  struct epoll_event ev;
+  int flags;
+
+  loop->id = id;
+  loop->sd = sd;
+  loop->dir_realpath = dir_realpath;
+  loop->dir_fd = -1;
+  loop->cache = cache;
+  loop->neg_cache = NULL;
+  loop->dir_index = NULL;
+  loop->uploads = 0;
+  loop->sync = 0;
+  loop->mc_addr.s_addr = INADDR_ANY;
+  loop->n_sessions = 0;
+  loop->sessions = NULL;
+  loop->timers = NULL;
+  loop->n_timers = 0;
+  loop->timers_size = 0;
+  memset(&loop->stats, 0, sizeof(loop->stats));
+  loop->stop = 0;
+
+  flags = fcntl(sd, F_GETFL, 0);
+  if (flags == -1 || fcntl(sd, F_SETFL, flags|O_NONBLOCK) == -1){
+    LOG(LOG_ERR, "Could not set listening socket as non-blocking");
+    return 1;
+  }
+
+  loop->epfd = epoll_create1(0);
+  if (loop->epfd == -1){
+    LOG(LOG_ERR, "Could not create epoll instance");
+    return 1;
+  }
+
+  // listening socket is the only one with a NULL pointer
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sd, &ev) == -1){
+    LOG(LOG_ERR, "Could not add listening socket to epoll");
+    close(loop->epfd);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+void server_loop_log_stats(struct server_loop *loop){
+  LOG(LOG_INFO, 
+      "Worker %d: %lu requests, %lu rejected, %lu started, %lu completed, "
+      "%lu failed, %lu timeouts, %d active, %lu multicast clients, "
+      "%lld bytes saved by multicast", 
+      loop->id,
+      loop->stats.requests,
+      loop->stats.rejected,
+      loop->stats.started,
+      loop->stats.completed,
+      loop->stats.failed,
+      loop->stats.timeouts,
+      loop->n_sessions,
+      loop->stats.mc_clients,
+      loop->stats.mc_saved
+  );
+}
+
+
+int server_loop_run(struct server_loop *loop){
+  struct epoll_event events[SERVER_LOOP_MAX_EVENTS];
+  struct server_loop_stats last_stats;
+  time_t last_log;
+  int n, i, result;
+
+  LOG(LOG_INFO, "Event loop %d is running", loop->id);
+
+  last_stats = loop->stats;
+  last_log = time(NULL);
+  result = 0;
+
+  while (!loop->stop){
+    n = epoll_wait(loop->epfd, events, SERVER_LOOP_MAX_EVENTS, 
+                   server_loop_wait_time(loop)
+    );
+    if (n == -1){
+      if (errno == EINTR)
+        continue;
+      LOG(LOG_FATAL, "epoll_wait error");
+      perror("epoll_wait error:");
+      result = 1;
+      break;
+    }
+
+    for (i = 0; i < n; i++){
+      if (events[i].data.ptr == NULL)
+        server_loop_on_listener(loop);
+      else
+        server_loop_on_session(loop, events[i].data.ptr);
+    }
+
+    server_loop_on_timers(loop);
+
+    if (time(NULL) - last_log >= SERVER_LOOP_STATS_INTERVAL){
+      if (memcmp(&last_stats, &loop->stats, sizeof(last_stats)) != 0){
+        server_loop_log_stats(loop);
+        // caches are shared: only the first loop logs them
+        if (loop->cache != NULL && loop->id == 0)
+          file_cache_log_stats(loop->cache);
+        if (loop->neg_cache != NULL && loop->id == 0)
+          neg_cache_log_stats(loop->neg_cache);
+        if (loop->dir_index != NULL && loop->id == 0)
+          dir_index_log_stats(loop->dir_index);
+      }
+      last_stats = loop->stats;
+      last_log = time(NULL);
+    }
+  }
+
+  while (loop->sessions != NULL){
+    LOG(LOG_WARN, "Interrupting transfer");
+    loop->stats.failed++;
+    session_close(loop, loop->sessions);
+  }
+  close(loop->epfd);
+  free(loop->timers);
+  loop->timers = NULL;
+
+  return result;
+}
@@ -0,0 +1,449 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ * 
+ * @brief Implementation of server_utils.h.
+ * 
+ * @see server_utils.h
+ */
+
+
+#define _GNU_SOURCE
+#include "include/server_utils.h"
+#include "include/tftp_msgs.h"
+#include "include/logging.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <linux/limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+
+/** LOG_LEVEL will be defined in another file */
+extern const int LOG_LEVEL;
+
+/** Set to 1 as soon as openat2 turns out not to be available */
+int openat2_unavailable = 0;
+
+
+int strlcpl(const char* str1, const char* str2){
+  int n;
+  for (n = 0; str1[n] != '\0' && str2[n] != '\0' && str1[n] == str2[n]; n++);
+  return n;
+}
+
+
+int path_inside_dir(char* path, char* dir){
+  char *parent, *orig_parent, *ret_realpath;
+  char parent_realpath[PATH_MAX];
+  int result;
+
+  orig_parent = parent = malloc(strlen(path) + 1);
+  strcpy(parent, path);
+
+  do{
+    parent = dirname(parent);
+    ret_realpath = realpath(parent, parent_realpath);
+  } while (ret_realpath == NULL);
+
+  if (strlcpl(parent_realpath, dir) < strlen(dir))
+    result = 0;
+  else
+    result = 1;
+  
+  free(orig_parent);
+  return result;
+}
+
+
+int open_served_dir(char* dir_realpath){
+  int fd;
+
+  fd = open(dir_realpath, O_PATH|O_DIRECTORY|O_CLOEXEC);
+  if (fd == -1)
+    LOG(LOG_WARN, "Could not open directory %s", dir_realpath);
+  return fd;
+}
+
+
+/**
+ * Opens a file for reading without ever leaving the directory of dir_fd 
+ * (paths with too many .., absolute symbolic links or symbolic links 
+ * pointing outside are rejected) and without following magic links (eg. 
+ * /proc/self/fd/N).
+ * 
+ * @param dir_fd    descriptor of the directory
+ * @param filename  path of the file, relative to the directory
+ * @return          descriptor of the file, -1 in case of error (errno is 
+ *                  EXDEV if the file is outside the directory, ENOSYS if 
+ *                  openat2 is not available)
+ */
+int open_beneath(int dir_fd, char* filename){
+#ifdef SYS_openat2
+  struct open_how how;
+
+  memset(&how, 0, sizeof(how));
+  how.flags = O_RDONLY|O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH|RESOLVE_NO_MAGICLINKS;
+  return syscall(SYS_openat2, dir_fd, filename, &how, sizeof(how));
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+/**
+ * Finds the real path of an open file, as seen by the kernel.
+ * 
+ * @param fd             descriptor of the file
+ * @param file_path      path the file was opened from (used if /proc is not 
+ *                       mounted)
+ * @param file_realpath  real path of the file, PATH_MAX long [out]
+ * @return               0 in case of success, 1 otherwise
+ */
+int fd_realpath(int fd, char* file_path, char* file_realpath){
+  char link[32];
+  ssize_t len;
+
+  sprintf(link, "/proc/self/fd/%d", fd);
+  len = readlink(link, file_realpath, PATH_MAX - 1);
+  if (len > 0 && file_realpath[0] == '/'){
+    file_realpath[len] = '\0';
+    return 0;
+  }
+
+  return realpath(file_path, file_realpath) == NULL;
+}
+
+
+int resolve_request_path(int dir_fd, char* dir_realpath, char* filename, 
+                         char* file_realpath, int *fd){
+  char file_path[PATH_MAX];
+  char *ret_realpath, *rel_path;
+
+  strcpy(file_path, dir_realpath);
+  strcat(file_path, "/");
+  strcat(file_path, filename);
+
+  *fd = -1;
+  if (dir_fd != -1 && !openat2_unavailable){
+    // as in file_path, a leading / refers to the served directory
+    for (rel_path = filename; *rel_path == '/'; rel_path++);
+
+    *fd = open_beneath(dir_fd, rel_path);
+    if (*fd != -1){
+      if (fd_realpath(*fd, file_path, file_realpath) == 0)
+        return 0;
+      LOG(LOG_WARN, "Could not find real path of %s", file_path);
+      close(*fd);
+      *fd = -1;
+      return 1;
+    } else if (errno == EXDEV){
+      LOG(LOG_WARN, "User tried to access file %s outside set directory %s",
+          file_path, 
+          dir_realpath
+      );
+      return 2;
+    } else if (errno != ENOSYS && errno != EPERM){
+      LOG(LOG_WARN, "File not found: %s", file_path);
+      return 1;
+    }
+
+    // old kernel (or openat2 forbidden by a seccomp filter)
+    LOG(LOG_WARN, "openat2 not available, checking real paths instead");
+    openat2_unavailable = 1;
+  }
+  
+  // check if file is inside directory (or inside any of its subdirs)
+  if (!path_inside_dir(file_path, dir_realpath)){
+    // it is not! I caught you, Trudy!
+    LOG(LOG_WARN, "User tried to access file %s outside set directory %s", 
+        file_path, 
+        dir_realpath
+    );
+    return 2;
+  }
+
+  ret_realpath = realpath(file_path, file_realpath);
+
+  // file not found
+  if (ret_realpath == NULL){
+    LOG(LOG_WARN, "File not found: %s", file_path);
+    return 1;
+  }
+
+  *fd = open(file_realpath, O_RDONLY|O_CLOEXEC);
+  if (*fd == -1){
+    LOG(LOG_WARN, "Could not open file %s", file_realpath);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Appends a relative path to the real path of a directory, dropping empty 
+ * and . components (and the trailing / of the root directory), so that the
+ * result is the same realpath would return if no component is a symbolic
+ * link.
+ * 
+ * @param dir_realpath   real path of the directory
+ * @param rel_path       path relative to the directory
+ * @param file_realpath  joined path, PATH_MAX long [out]
+ * @return               0 in case of success, 1 if rel_path has .. 
+ *                       components or the result is too long
+ */
+int join_normal_path(char* dir_realpath, char* rel_path, 
+                     char* file_realpath){
+  char *component, *end;
+  size_t len, n;
+
+  len = strlen(dir_realpath);
+  if (len > 0 && dir_realpath[len - 1] == '/')
+    len--;
+  if (len >= PATH_MAX)
+    return 1;
+  memcpy(file_realpath, dir_realpath, len);
+
+  for (component = rel_path; *component != '\0'; component = end){
+    end = strchr(component, '/');
+    if (end == NULL)
+      end = component + strlen(component);
+    n = end - component;
+
+    if (n == 2 && component[0] == '.' && component[1] == '.')
+      return 1;
+
+    if (n != 0 && (n != 1 || component[0] != '.')){
+      if (len + 1 + n >= PATH_MAX)
+        return 1;
+      file_realpath[len++] = '/';
+      memcpy(file_realpath + len, component, n);
+      len += n;
+    }
+
+    if (*end == '/')
+      end++;
+  }
+
+  if (len == 0)
+    file_realpath[len++] = '/';
+  file_realpath[len] = '\0';
+  return 0;
+}
+
+
+int resolve_indexed_path(struct dir_index *index, int dir_fd, 
+                         char* dir_realpath, char* filename, 
+                         char* file_realpath, int *fd, off_t *size){
+  char *rel_path;
+  int ret;
+
+  *size = -1;
+  if (index == NULL || dir_fd == -1 || openat2_unavailable)
+    return resolve_request_path(dir_fd, dir_realpath, filename, 
+                                file_realpath, fd
+    );
+
+  ret = dir_index_lookup(index, filename, size);
+  if (ret == 1){
+    LOG(LOG_WARN, "File not found: %s/%s", dir_realpath, filename);
+    *fd = -1;
+    return 1;
+  } else if (ret != 0)
+    return resolve_request_path(dir_fd, dir_realpath, filename, 
+                                file_realpath, fd
+    );
+
+  for (rel_path = filename; *rel_path == '/'; rel_path++);
+
+  // indexed paths have no symbolic links, so the real path (which names the
+  // file in the cache and in multicast groups) is only a matter of joining
+  *fd = open_beneath(dir_fd, rel_path);
+  if (*fd != -1 && 
+      join_normal_path(dir_realpath, rel_path, file_realpath) == 0)
+    return 0;
+
+  // the tree changed in the meantime (or the path could not be joined)
+  if (*fd != -1)
+    close(*fd);
+  *size = -1;
+  return resolve_request_path(dir_fd, dir_realpath, filename, file_realpath,
+                              fd
+  );
+}
+
+
+int resolve_upload_path(char* dir_realpath, char* filename, 
+                        char* file_realpath){
+  char file_path[PATH_MAX], parent[PATH_MAX], base[PATH_MAX];
+  char parent_realpath[PATH_MAX];
+
+  strcpy(file_path, dir_realpath);
+  strcat(file_path, "/");
+  strcat(file_path, filename);
+
+  if (!path_inside_dir(file_path, dir_realpath)){
+    LOG(LOG_WARN, "User tried to write file %s outside set directory %s", 
+        file_path, 
+        dir_realpath
+    );
+    return 2;
+  }
+
+  // dirname and basename may modify their argument
+  strcpy(parent, file_path);
+  strcpy(base, file_path);
+  strcpy(base, basename(base));
+  if (strcmp(base, ".") == 0 || strcmp(base, "..") == 0 || 
+      strcmp(base, "/") == 0){
+    LOG(LOG_WARN, "Invalid file name: %s", filename);
+    return 1;
+  }
+
+  if (realpath(dirname(parent), parent_realpath) == NULL){
+    LOG(LOG_WARN, "Directory not found: %s", parent);
+    return 1;
+  }
+
+  if (strlen(parent_realpath) + strlen(base) + 2 > PATH_MAX){
+    LOG(LOG_WARN, "Path too long: %s", file_path);
+    return 1;
+  }
+
+  strcpy(file_realpath, parent_realpath);
+  strcat(file_realpath, "/");
+  strcat(file_realpath, base);
+  return 0;
+}
+
+
+void negotiate_options(struct tftp_opts *opts){
+  if (opts->windowsize > MAX_WINDOWSIZE)
+    opts->windowsize = MAX_WINDOWSIZE;
+
+  // multicast needs a group, which only the event loop can assign
+  opts->multicast = 0;
+}
+
+
+int open_request_file(char* file_realpath, int fd, off_t size, char* mode, 
+                      struct tftp_opts *opts, struct file_cache *cache, 
+                      struct file_cache_entry **entry,
+                      struct fblock *m_fblock){
+  int block_size;
+  char fblock_mode;
+
+  *entry = NULL;
+
+  if (opts != NULL && opts->blksize != 0)
+    block_size = opts->blksize;
+  else
+    block_size = TFTP_DATA_BLOCK;
+
+  if (strcasecmp(mode, TFTP_STR_OCTET) == 0){
+    fblock_mode = FBLOCK_READ|FBLOCK_MODE_BINARY|FBLOCK_MMAP;
+  } else if (strcasecmp(mode, TFTP_STR_NETASCII) == 0){
+    fblock_mode = FBLOCK_READ|FBLOCK_MODE_TEXT;
+  } else{
+    LOG(LOG_ERR, "Unknown mode: %s", mode);
+    if (fd != -1)
+      close(fd);
+    return 2;
+  }
+
+  if (cache != NULL)
+    *entry = file_cache_get(cache, file_realpath, fd);
+
+  if (*entry != NULL){
+    if (fd != -1)
+      close(fd);
+    *m_fblock = fblock_open_mem((*entry)->data, 
+                                (*entry)->size, 
+                                block_size, 
+                                fblock_mode
+    );
+  } else{
+    if (fd != -1)
+      *m_fblock = fblock_fdopen(fd, file_realpath, size, block_size, 
+                                fblock_mode
+      );
+    else
+      *m_fblock = fblock_open(file_realpath, block_size, fblock_mode);
+    if (m_fblock->file == NULL)
+      return 1;
+  }
+
+  if (opts != NULL && opts->tsize >= 0){
+    if (m_fblock->encoder == NULL)
+      opts->tsize = m_fblock->remaining;
+    else
+      opts->tsize = -1;
+  }
+
+  return 0;
+}
+
+
+void close_request_file(struct file_cache *cache, 
+                        struct file_cache_entry *entry,
+                        struct fblock *m_fblock){
+  if (m_fblock->file != NULL || m_fblock->map != NULL)
+    fblock_close(m_fblock);
+  if (entry != NULL)
+    file_cache_put(cache, entry);
+}
+
+
+int open_upload_file(char* file_realpath, char* mode, struct tftp_opts *opts,
+                     char sync, struct fblock *m_fblock){
+  int block_size;
+  char fblock_mode;
+
+  if (opts != NULL && opts->blksize != 0)
+    block_size = opts->blksize;
+  else
+    block_size = TFTP_DATA_BLOCK;
+
+  if (strcasecmp(mode, TFTP_STR_OCTET) == 0){
+    fblock_mode = FBLOCK_WRITE|FBLOCK_MODE_BINARY;
+  } else if (strcasecmp(mode, TFTP_STR_NETASCII) == 0){
+    fblock_mode = FBLOCK_WRITE|FBLOCK_MODE_TEXT;
+  } else{
+    LOG(LOG_ERR, "Unknown mode: %s", mode);
+    return 2;
+  }
+
+  *m_fblock = fblock_open(file_realpath, block_size, 
+                          fblock_mode|FBLOCK_EXCL|(sync & FBLOCK_SYNC_MASK)
+  );
+  if (m_fblock->file == NULL)
+    return errno == EEXIST ? 3 : 1;
+
+  return 0;
+}
+
+
+int close_upload_file(char* file_realpath, struct fblock *m_fblock, 
+                      int completed){
+  if (m_fblock->file == NULL)
+    return 0;
+
+  if (fblock_close(m_fblock) != 0 || !completed){
+    LOG(LOG_WARN, "Upload of %s failed, deleting it", file_realpath);
+    unlink(file_realpath);
+    return 1;
+  }
+
+  return 0;
+}
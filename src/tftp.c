@@ -14,24 +14,101 @@
 #include "include/debug_utils.h"
 #include "include/inet_utils.h"
 #include "include/logging.h"
+#include "include/metrics.h"
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
 
 
 /** LOG_LEVEL will be defined in another file */
 extern const int LOG_LEVEL;
 
 
-int tftp_send_rrq(char* filename, char *mode, int sd, struct sockaddr_in *addr){
+long long tftp_clock_ms(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+long long tftp_clock_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * Doubles the retransmission timeout and computes the next deadline.
+ * 
+ * @param timeout   current timeout, doubled up to TFTP_MAX_TIMEOUT [in/out]
+ * @param retries   number of retransmissions, incremented [in/out]
+ * @param deadline  next deadline [out]
+ * @return          1 if there have been too many retransmissions, 0 otherwise
+ */
+int tftp_backoff(int *timeout, int *retries, long long *deadline){
+  (*retries)++;
+  if (*retries > TFTP_MAX_RETRIES)
+    return 1;
+
+  *timeout *= 2;
+  if (*timeout > TFTP_MAX_TIMEOUT)
+    *timeout = TFTP_MAX_TIMEOUT;
+  *deadline = tftp_clock_ms() + *timeout;
+  return 0;
+}
+
+
+/**
+ * Waits until a message can be read from one of two sockets or a deadline 
+ * expires.
+ * 
+ * @param sd        socket id
+ * @param sd2       socket id of the other socket (-1 if none)
+ * @param deadline  deadline (see tftp_clock_ms)
+ * @return          1 if a message can be read from sd, 2 if it can be read 
+ *                  from sd2 only, 0 if deadline expired, -1 in case of error
+ */
+int tftp_wait(int sd, int sd2, long long deadline){
+  struct pollfd pfd[2];
+  long long left;
+  int ret;
+
+  pfd[0].fd = sd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = sd2;  // ignored by poll if negative
+  pfd[1].events = POLLIN;
+  pfd[1].revents = 0;
+
+  do{
+    left = deadline - tftp_clock_ms();
+    if (left < 0)
+      left = 0;
+    ret = poll(pfd, 2, left);
+  } while (ret == -1 && errno == EINTR);
+
+  if (ret <= 0)
+    return ret;
+  return pfd[0].revents ? 1 : 2;
+}
+
+
+int tftp_send_rrq(char* filename, char *mode, struct tftp_opts *opts, int sd, 
+                  struct sockaddr_in *addr){
   int msglen, len;
   char *out_buffer;
 
-  msglen = tftp_msg_get_size_rrq(filename, mode);
+  msglen = tftp_msg_get_size_rrq(filename, mode, opts);
   out_buffer = malloc(msglen);
 
-  tftp_msg_build_rrq(filename, mode, out_buffer);
+  tftp_msg_build_rrq(filename, mode, opts, out_buffer);
   len = sendto(sd, out_buffer, msglen, 0, 
                (struct sockaddr*) addr, 
                sizeof(*addr)
@@ -47,14 +124,15 @@ int tftp_send_rrq(char* filename, char *mode, int sd, struct sockaddr_in *addr){
 }
 
 
-int tftp_send_wrq(char* filename, char *mode, int sd, struct sockaddr_in *addr){
+int tftp_send_wrq(char* filename, char *mode, struct tftp_opts *opts, int sd, 
+                  struct sockaddr_in *addr){
   int msglen, len;
   char *out_buffer;
 
-  msglen = tftp_msg_get_size_wrq(filename, mode);
+  msglen = tftp_msg_get_size_wrq(filename, mode, opts);
   out_buffer = malloc(msglen);
 
-  tftp_msg_build_wrq(filename, mode, out_buffer);
+  tftp_msg_build_wrq(filename, mode, opts, out_buffer);
   len = sendto(sd, out_buffer, msglen, 0, 
                (struct sockaddr*) addr, 
                sizeof(*addr)
@@ -79,6 +157,7 @@ int tftp_send_error(int error_code, char* error_msg, int sd,
   out_buffer = malloc(msglen);
 
   tftp_msg_build_error(error_code, error_msg, out_buffer);
+  metrics_count_error(error_code);
   len = sendto(sd, out_buffer, msglen, 0, 
                (struct sockaddr*) addr, 
                sizeof(*addr)
@@ -115,207 +194,1608 @@ int tftp_send_ack(int block_n, char* out_buffer, int sd,
 }
 
 
-int tftp_receive_file(struct fblock *m_fblock, int sd, 
-                      struct sockaddr_in *addr){
-  char in_buffer[TFTP_MAX_DATA_MSG_SIZE], data[TFTP_DATA_BLOCK], out_buffer[4];
-  int exp_block_n, rcv_block_n;
-  int len, data_size, ret, type;
-  unsigned int addrlen;
-  struct sockaddr_in cl_addr, orig_cl_addr;
+/**
+ * Checks options acknowledged by the server against the requested ones.
+ * 
+ * @param requested  options sent in the request
+ * @param accepted   options found in the OACK
+ * @return           1 if accepted options are valid, 0 otherwise
+ */
+int tftp_check_oack(struct tftp_opts *requested, struct tftp_opts *accepted){
+  if (accepted->blksize != 0 && 
+      (requested->blksize == 0 || accepted->blksize > requested->blksize)){
+    LOG(LOG_ERR, "Server acknowledged an invalid blksize: %d", 
+        accepted->blksize
+    );
+    return 0;
+  }
+  if (accepted->windowsize != 0 && 
+      (requested->windowsize == 0 || 
+       accepted->windowsize > requested->windowsize)){
+    LOG(LOG_ERR, "Server acknowledged an invalid windowsize: %d", 
+        accepted->windowsize
+    );
+    return 0;
+  }
+  if (accepted->timeout != 0 && accepted->timeout != requested->timeout){
+    LOG(LOG_ERR, "Server acknowledged an invalid timeout: %d", 
+        accepted->timeout
+    );
+    return 0;
+  }
+  if (accepted->tsize >= 0 && requested->tsize < 0){
+    LOG(LOG_ERR, "Server acknowledged a tsize which was not requested: %lld", 
+        accepted->tsize
+    );
+    return 0;
+  }
+  if (accepted->multicast && 
+      (!requested->multicast || accepted->mc_group.sin_port == 0)){
+    LOG(LOG_ERR, "Server acknowledged an invalid multicast option");
+    return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Initializes the receiver state, without sending anything.
+ * 
+ * @see tftp_receiver_start
+ */
+void tftp_receiver_init(struct tftp_receiver *receiver, 
+                        struct fblock *m_fblock, struct tftp_opts *opts, 
+                        char *request, int request_len, int sd, 
+                        struct sockaddr_in *addr){
+  receiver->m_fblock = m_fblock;
+  receiver->sd = sd;
+  receiver->addr = *addr;
+  receiver->done = 0;
+  receiver->dally = 0;
+  receiver->first = 1;
+  receiver->mc_sd = -1;
+  receiver->master = 0;
+  receiver->blocks = NULL;
+  receiver->last_block = 0;
+  receiver->n_received = 0;
+
+  if (opts != NULL)
+    receiver->opts = *opts;
+  else
+    tftp_opts_init(&receiver->opts);
+
+  // until the server acknowledges options, defaults are used
+  receiver->block_size = TFTP_DATA_BLOCK;
+  receiver->windowsize = 1;
+
+  receiver->max_block_size = TFTP_DATA_BLOCK;
+  if (receiver->opts.blksize > receiver->max_block_size)
+    receiver->max_block_size = receiver->opts.blksize;
+  receiver->data = malloc(receiver->max_block_size);
 
   // init expected block number
-  exp_block_n = 1;
+  receiver->exp_block_n = 1;
+  receiver->received = 0;
+  receiver->gap = 0;
+
+  receiver->request = malloc(request_len);
+  memcpy(receiver->request, request, request_len);
+  receiver->request_len = request_len;
+
+  // a timeout requested by the client is used from the beginning
+  if (receiver->opts.timeout != 0)
+    receiver->rto = receiver->opts.timeout * 1000;
+  else
+    receiver->rto = TFTP_TIMEOUT;
+  receiver->timeout = receiver->rto;
+  receiver->retries = 0;
+  receiver->deadline = tftp_clock_ms() + receiver->timeout;
+}
 
-  addrlen = sizeof(cl_addr);
 
-  do{
-    LOG(LOG_DEBUG, "Waiting for part %d", exp_block_n);
-    
-    len = recvfrom(sd, in_buffer, tftp_msg_get_size_data(TFTP_DATA_BLOCK), 0, 
-                   (struct sockaddr*)&cl_addr, 
-                   &addrlen
+/**
+ * Sends the request (or the message which replaced it).
+ * 
+ * @param receiver  receiver state
+ * @return          0 in case of success, 2 otherwise
+ */
+int tftp_receiver_send_request(struct tftp_receiver *receiver){
+  int len;
+
+  len = sendto(receiver->sd, receiver->request, receiver->request_len, 0, 
+               (struct sockaddr*) &receiver->addr, 
+               sizeof(receiver->addr)
+  );
+  if (len != receiver->request_len){
+    LOG(LOG_ERR, "Error sending request: len (%d) != msglen (%d)", 
+        len, 
+        receiver->request_len
     );
+    return 2;
+  }
 
-    // first block -> I need to save servers TID (aka its "original" sockaddr)
-    if (exp_block_n == 1){
-      char addr_str[MAX_SOCKADDR_STR_LEN];
-      sockaddr_in_to_string(cl_addr, addr_str); 
-    
-      if (addr->sin_addr.s_addr != cl_addr.sin_addr.s_addr){
-        LOG(LOG_WARN, "Received message from unexpected source: %s", addr_str);
-        continue;
-      } else{
-        LOG(LOG_INFO, "Receiving packets from %s", addr_str);
-        orig_cl_addr = cl_addr;
-      }
-    } else{
-      if (sockaddr_in_cmp(orig_cl_addr, cl_addr) != 0){
-        char addr_str[MAX_SOCKADDR_STR_LEN];
-        sockaddr_in_to_string(cl_addr, addr_str); 
-        LOG(LOG_WARN, "Received message from unexpected source: %s", addr_str);
-        continue;
-      } else{
-        LOG(LOG_DEBUG, "Sender is the same!");
-      }
+  return 0;
+}
+
+
+/**
+ * Replaces the request with the ACK of block 0, which is sent again instead
+ * of the request until the first block arrives.
+ * 
+ * @param receiver  receiver state
+ */
+void tftp_receiver_request_ack0(struct tftp_receiver *receiver){
+  free(receiver->request);
+  receiver->request_len = tftp_msg_get_size_ack();
+  receiver->request = malloc(receiver->request_len);
+  tftp_msg_build_ack(0, receiver->request);
+}
+
+
+int tftp_receiver_start(struct tftp_receiver *receiver, 
+                        struct fblock *m_fblock, struct tftp_opts *opts, 
+                        char *request, int request_len, int sd, 
+                        struct sockaddr_in *addr){
+  tftp_receiver_init(receiver, m_fblock, opts, request, request_len, sd, 
+                     addr
+  );
+  return tftp_receiver_send_request(receiver);
+}
+
+
+/**
+ * Resets the retransmission timer of the receiver after some progress.
+ * 
+ * @param receiver  receiver state
+ */
+void tftp_receiver_progress(struct tftp_receiver *receiver){
+  receiver->timeout = receiver->rto;
+  receiver->retries = 0;
+  receiver->deadline = tftp_clock_ms() + receiver->timeout;
+}
+
+
+/**
+ * Applies the accepted options to the receiver, reserving disk space for the
+ * transfer size (if known).
+ *
+ * @param receiver  receiver state
+ * @param opts      accepted options
+ * @return          0 in case of success, 11 if the file does not fit on disk
+ *                  (an ERROR is sent)
+ */
+int tftp_receiver_apply_opts(struct tftp_receiver *receiver, 
+                             struct tftp_opts *opts){
+  int rcvbuf, cur_rcvbuf;
+  socklen_t optlen;
+
+  receiver->opts = *opts;
+  if (opts->blksize != 0)
+    receiver->block_size = opts->blksize;
+  if (opts->windowsize != 0)
+    receiver->windowsize = opts->windowsize;
+  if (opts->timeout != 0)
+    receiver->rto = opts->timeout * 1000;
+  else
+    receiver->rto = TFTP_TIMEOUT;
+  receiver->m_fblock->block_size = receiver->block_size;
+
+  LOG(LOG_INFO, 
+      "Accepted options: blksize = %d, windowsize = %d, timeout = %d, "
+      "tsize = %lld", 
+      receiver->block_size, 
+      receiver->windowsize,
+      opts->timeout,
+      opts->tsize
+  );
+
+  // make room in socket buffer for a whole window (never shrink it: kernel 
+  // accounting per datagram is much larger than the payload for small blocks)
+  if (receiver->windowsize > 1){
+    rcvbuf = receiver->windowsize * 
+             tftp_msg_get_size_data(receiver->block_size) * 2;
+    optlen = sizeof(cur_rcvbuf);
+    if (getsockopt(receiver->sd, SOL_SOCKET, SO_RCVBUF, &cur_rcvbuf, &optlen)
+        || cur_rcvbuf < rcvbuf)
+      setsockopt(receiver->sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+
+  // a file which does not fit is refused before any data is sent
+  if (opts->tsize > 0 && fblock_reserve(receiver->m_fblock, opts->tsize)){
+    tftp_send_error(3, "Disk full or allocation exceeded.", receiver->sd, 
+                    &receiver->addr
+    );
+    return 11;
+  }
+
+  return 0;
+}
+
+
+int tftp_receiver_accept(struct tftp_receiver *receiver, 
+                         struct fblock *m_fblock, struct tftp_opts *opts, 
+                         int sd, struct sockaddr_in *addr){
+  char *reply;
+  int reply_len, ret;
+
+  // options are acknowledged by an OACK, otherwise by the ACK of block 0
+  if (!tftp_opts_empty(opts)){
+    reply_len = tftp_msg_get_size_oack(opts);
+    reply = malloc(reply_len);
+    tftp_msg_build_oack(opts, reply);
+  } else{
+    reply_len = tftp_msg_get_size_ack();
+    reply = malloc(reply_len);
+    tftp_msg_build_ack(0, reply);
+  }
+
+  tftp_receiver_init(receiver, m_fblock, opts, reply, reply_len, sd, addr);
+  free(reply);
+
+  // client TID is already known
+  receiver->first = 0;
+  receiver->dally = 1;
+
+  ret = tftp_receiver_apply_opts(receiver, &receiver->opts);
+  if (ret != 0)
+    return ret;
+
+  return tftp_receiver_send_request(receiver);
+}
+
+
+/**
+ * Joins the multicast group acknowledged by the server, on the interface 
+ * used to reach it.
+ *
+ * @param receiver  receiver state
+ * @return          0 in case of success, 12 otherwise
+ */
+int tftp_receiver_join(struct tftp_receiver *receiver){
+  struct in_addr ifaddr;
+  char addr_str[MAX_SOCKADDR_STR_LEN];
+
+  receiver->mc_sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (receiver->mc_sd == -1 || get_local_addr(&receiver->addr, &ifaddr) ||
+      join_multicast_group(receiver->mc_sd, &receiver->opts.mc_group, 
+                           &ifaddr)){
+    tftp_send_error(0, "Could not join multicast group.", receiver->sd, 
+                    &receiver->addr
+    );
+    return 12;
+  }
+
+  receiver->blocks = calloc((TFTP_BLOCK_N_MASK + 1) / 8, 1);
+  receiver->master = receiver->opts.mc_master;
+
+  sockaddr_in_to_string(receiver->opts.mc_group, addr_str);
+  LOG(LOG_INFO, "Joined multicast group %s%s", 
+      addr_str, 
+      receiver->master ? " as master client" : ""
+  );
+  return 0;
+}
+
+
+/**
+ * Sends the ACK of the master client of a multicast transfer: the last block
+ * received in order (the last one once all blocks have been received).
+ *
+ * @param receiver  receiver state
+ * @return          0 in case of success, 2 otherwise
+ */
+int tftp_receiver_send_mc_ack(struct tftp_receiver *receiver){
+  char out_buffer[4];
+  long long block_n;
+
+  block_n = receiver->done ? receiver->last_block : receiver->exp_block_n - 1;
+  return tftp_send_ack(block_n & TFTP_BLOCK_N_MASK, out_buffer, receiver->sd, 
+                       &receiver->addr
+  ) ? 2 : 0;
+}
+
+
+/**
+ * Handles the OACK message sent by the server in reply to the request.
+ *
+ * @param receiver  receiver state
+ * @param in_buffer the received message
+ * @param len       length of the received message
+ * @return          0 in case of success, same error codes of 
+ *                  tftp_receive_file otherwise
+ */
+int tftp_receiver_on_oack(struct tftp_receiver *receiver, char *in_buffer, 
+                          int len){
+  struct tftp_opts oack_opts;
+  int ret;
+
+  ret = tftp_msg_unpack_oack(in_buffer, len, &oack_opts);
+  if (ret != 0 || !tftp_check_oack(&receiver->opts, &oack_opts)){
+    tftp_send_error(8, "Option negotiation failure.", receiver->sd, 
+                    &receiver->addr
+    );
+    return 9;
+  }
+
+  ret = tftp_receiver_apply_opts(receiver, &oack_opts);
+  if (ret != 0)
+    return ret;
+
+  if (oack_opts.multicast){
+    ret = tftp_receiver_join(receiver);
+    if (ret != 0)
+      return ret;
+  }
+
+  tftp_receiver_progress(receiver);
+
+  // from now on, the ACK of the OACK is sent again until data arrives
+  tftp_receiver_request_ack0(receiver);
+
+  // only the master client acknowledges multicast blocks
+  if (receiver->mc_sd != -1 && !receiver->master)
+    return 0;
+  return tftp_receiver_send_request(receiver);
+}
+
+
+/**
+ * Handles an OACK message received during a multicast transfer, which tells
+ * whether the client is (now) the master client.
+ *
+ * @param receiver  receiver state
+ * @param in_buffer the received message
+ * @param len       length of the received message
+ * @return          0 in case of success, same error codes of 
+ *                  tftp_receive_file otherwise
+ */
+int tftp_receiver_on_mc_oack(struct tftp_receiver *receiver, char *in_buffer, 
+                             int len){
+  struct tftp_opts oack_opts;
+
+  if (tftp_msg_unpack_oack(in_buffer, len, &oack_opts) != 0 || 
+      !oack_opts.multicast){
+    LOG(LOG_WARN, "Ignoring invalid OACK");
+    return 0;
+  }
+
+  if (oack_opts.mc_master && !receiver->master)
+    LOG(LOG_INFO, "Became master client");
+  receiver->master = oack_opts.mc_master;
+
+  if (!receiver->master)
+    return 0;
+
+  // server goes on from the first missing block
+  tftp_receiver_progress(receiver);
+  return tftp_receiver_send_mc_ack(receiver);
+}
+
+
+/**
+ * Handles a DATA message of a multicast transfer.
+ *
+ * Blocks can arrive in any order, since the client may have joined the 
+ * group after the transfer started: each one is written at its place, once.
+ * The master client acknowledges every block with the last block received 
+ * in order. Once all blocks are received, their number is acknowledged 
+ * (even by other clients, so that the server stops waiting for them).
+ *
+ * @param receiver  receiver state
+ * @param in_buffer the received message
+ * @param len       length of the received message
+ * @return          0 in case of success, same error codes of 
+ *                  tftp_receive_file otherwise
+ */
+int tftp_receiver_on_mc_data(struct tftp_receiver *receiver, char *in_buffer, 
+                             int len){
+  int rcv_block_n, data_size, ret;
+
+  ret = tftp_msg_unpack_data(in_buffer, len, &rcv_block_n, receiver->data, 
+                             &data_size
+  );
+  if (ret != 0 || data_size > receiver->block_size || rcv_block_n == 0 ||
+      (receiver->last_block != 0 && rcv_block_n > receiver->last_block)){
+    LOG(LOG_ERR, "Received invalid multicast DATA");
+    return 4;
+  }
+
+  if (receiver->done)
+    return receiver->master ? tftp_receiver_send_mc_ack(receiver) : 0;
+
+  // any block shows that the transfer is going on
+  tftp_receiver_progress(receiver);
+
+  if (!(receiver->blocks[rcv_block_n / 8] & (1 << (rcv_block_n % 8)))){
+    LOG(LOG_DEBUG, "Part %d has size %d", rcv_block_n, data_size);
+
+    if (fblock_write_at(receiver->m_fblock, receiver->data, data_size, 
+                        (off_t) (rcv_block_n - 1) * receiver->block_size)){
+      tftp_send_error(3, "Disk full or allocation exceeded.", receiver->sd, 
+                      &receiver->addr
+      );
+      return 6;
     }
-    
-    type = tftp_msg_type(in_buffer);
-    if (type == TFTP_TYPE_ERROR){
-      int error_code;
-      char error_msg[TFTP_MAX_ERROR_LEN];
-      
-      ret = tftp_msg_unpack_error(in_buffer, len, &error_code, error_msg);
-      if (ret != 0){
-        LOG(LOG_ERR, "Error unpacking error msg");
-        return 5;
-      }
-
-      if (error_code == 1){
-        LOG(LOG_INFO, "File not found");
-        return 1;
-      } else{
-        LOG(LOG_ERR, "Received error %d: %s", error_code, error_msg);
-        return 7;
-      }
-
-    } else if (type != TFTP_TYPE_DATA){
-      LOG(LOG_ERR, "Received packet of type %d, expecting DATA or ERROR.",type);
-      return 8;
+
+    receiver->blocks[rcv_block_n / 8] |= 1 << (rcv_block_n % 8);
+    receiver->n_received++;
+    if (data_size < receiver->block_size)
+      receiver->last_block = rcv_block_n;
+
+    while (receiver->exp_block_n <= TFTP_BLOCK_N_MASK && 
+           (receiver->blocks[receiver->exp_block_n / 8] & 
+            (1 << (receiver->exp_block_n % 8))))
+      receiver->exp_block_n++;
+  }
+
+  if (receiver->last_block != 0 && 
+      receiver->n_received == receiver->last_block){
+    if (fblock_flush(receiver->m_fblock)){
+      tftp_send_error(3, "Disk full or allocation exceeded.", receiver->sd, 
+                      &receiver->addr
+      );
+      return 6;
     }
+    receiver->done = 1;
+    // wait in case the last ACK is lost (and the server asks again)
+    receiver->dally = 1;
+    return tftp_receiver_send_mc_ack(receiver);
+  }
 
-    ret = tftp_msg_unpack_data(in_buffer, len, &rcv_block_n, data, &data_size);
+  return receiver->master ? tftp_receiver_send_mc_ack(receiver) : 0;
+}
 
-    if (ret != 0){
-      LOG(LOG_ERR, "Error unpacking data: %d", ret);
-      return 4;
+
+/**
+ * Handles a DATA message.
+ *
+ * Blocks are written in order. Whenever a block is missing, the last block 
+ * received in order is acknowledged (once), so that the sender can start 
+ * sending again from the missing one (RFC 7440). Duplicate blocks are 
+ * handled in the same way.
+ * 
+ * Buffered data is flushed before the last block is acknowledged, so that 
+ * the sender is told about write errors. After that, any block is a 
+ * retransmission caused by a lost ACK, which is sent again.
+ *
+ * @param receiver  receiver state
+ * @param in_buffer the received message
+ * @param len       length of the received message
+ * @return          0 in case of success, same error codes of 
+ *                  tftp_receive_file otherwise
+ */
+int tftp_receiver_on_data(struct tftp_receiver *receiver, char *in_buffer, 
+                          int len){
+  char out_buffer[4];
+  int rcv_block_n, data_size, ret, last, distance;
+
+  if (receiver->done){
+    LOG(LOG_DEBUG, "Sending ack of last block again");
+    return tftp_send_ack((receiver->exp_block_n - 1) & TFTP_BLOCK_N_MASK, 
+                         out_buffer, receiver->sd, &receiver->addr
+    ) ? 2 : 0;
+  }
+
+  ret = tftp_msg_unpack_data(in_buffer, len, &rcv_block_n, receiver->data, 
+                             &data_size
+  );
+
+  if (ret != 0){
+    LOG(LOG_ERR, "Error unpacking data: %d", ret);
+    return 4;
+  }
+
+  if (data_size > receiver->block_size){
+    LOG(LOG_ERR, "Part %d is too big: %d > %d", 
+        rcv_block_n, 
+        data_size, 
+        receiver->block_size
+    );
+    return 4;
+  }
+
+  // distance from the expected block, taking roll over into account: 
+  // blocks in the second half of the range are old ones
+  distance = (rcv_block_n - receiver->exp_block_n) & TFTP_BLOCK_N_MASK;
+
+  if (distance >= receiver->windowsize && distance <= TFTP_BLOCK_N_MASK / 2){
+    LOG(LOG_ERR, 
+        "Received unexpected block_n: rcv_block_n = %d, exp_block_n = %lld", 
+        rcv_block_n, 
+        receiver->exp_block_n & TFTP_BLOCK_N_MASK
+    );
+    return 3;
+  }
+
+  if (distance != 0){
+    LOG(LOG_DEBUG, "Received part %d while waiting for %lld", 
+        rcv_block_n, 
+        receiver->exp_block_n & TFTP_BLOCK_N_MASK
+    );
+
+    if (!receiver->gap){
+      // tell sender where to start again from
+      if (tftp_send_ack((receiver->exp_block_n - 1) & TFTP_BLOCK_N_MASK, 
+                        out_buffer, receiver->sd, &receiver->addr))
+        return 2;
+      receiver->gap = 1;
+      receiver->received = 0;
     }
+    return 0;
+  }
 
-    if (rcv_block_n != exp_block_n){
-      LOG(LOG_ERR, 
-          "Received unexpected block_n: rcv_block_n = %d != %d = exp_block_n", 
-          rcv_block_n, 
-          exp_block_n
+  receiver->gap = 0;
+  receiver->exp_block_n++;
+  receiver->received++;
+  tftp_receiver_progress(receiver);
+
+  LOG(LOG_DEBUG, "Part %d has size %d", rcv_block_n, data_size);
+
+  if (data_size != 0){
+    ret = fblock_write(receiver->m_fblock, receiver->data, data_size);
+    if (ret < 0){
+      LOG(LOG_ERR, "Part %d is not valid netascii", rcv_block_n);
+      tftp_send_error(4, "Illegal TFTP operation.", receiver->sd, 
+                      &receiver->addr
       );
-      return 3;
+      return 6;
+    } else if (ret != 0){
+      tftp_send_error(3, "Disk full or allocation exceeded.", receiver->sd, 
+                      &receiver->addr
+      );
+      return 6;
     }
+  }
 
-    exp_block_n++;
+  last = data_size < receiver->block_size;
 
-    LOG(LOG_DEBUG, "Part %d has size %d", rcv_block_n, data_size);
+  if (last && fblock_flush(receiver->m_fblock)){
+    tftp_send_error(3, "Disk full or allocation exceeded.", receiver->sd, 
+                    &receiver->addr
+    );
+    return 6;
+  }
 
-    if (data_size != 0){
-      if (fblock_write(m_fblock, data, data_size))
-        return 6;
-    }
-    
+  // only the last block of each window is acknowledged
+  if (last || receiver->received == receiver->windowsize){
     LOG(LOG_DEBUG, "Sending ack");
 
-    if (tftp_send_ack(rcv_block_n, out_buffer, sd, &cl_addr))
+    if (tftp_send_ack(rcv_block_n, out_buffer, receiver->sd, &receiver->addr))
       return 2;
+    receiver->received = 0;
+  }
+
+  if (last)
+    receiver->done = 1;
 
-  } while(data_size == TFTP_DATA_BLOCK);
   return 0;
 }
 
 
-int tftp_receive_ack(int *block_n, char* in_buffer, int sd, 
-                     struct sockaddr_in *addr){
-  int msglen, len, ret;
-  unsigned int addrlen;
-  struct sockaddr_in cl_addr;
+int tftp_receiver_recv(struct tftp_receiver *receiver, char *in_buffer, 
+                       int len, struct sockaddr_in *src){
+  char addr_str[MAX_SOCKADDR_STR_LEN];
+  int ret, type;
 
-  msglen = tftp_msg_get_size_ack();
-  addrlen = sizeof(cl_addr);
+  // first message -> I need to save servers TID (aka its "original" sockaddr)
+  if (receiver->first){
+    sockaddr_in_to_string(*src, addr_str); 
+  
+    if (receiver->addr.sin_addr.s_addr != src->sin_addr.s_addr){
+      LOG(LOG_WARN, "Received message from unexpected source: %s", addr_str);
+      return 0;
+    } else{
+      LOG(LOG_INFO, "Receiving packets from %s", addr_str);
+      receiver->addr = *src;
+    }
+  } else{
+    if (sockaddr_in_cmp(receiver->addr, *src) != 0){
+      sockaddr_in_to_string(*src, addr_str); 
+      LOG(LOG_WARN, "Received message from unexpected source: %s", addr_str);
+      // eg. a second transfer started by a retransmitted request
+      tftp_send_error(5, "Unknown transfer ID.", receiver->sd, src);
+      return 0;
+    } else{
+      LOG(LOG_DEBUG, "Sender is the same!");
+    }
+  }
+
+  if (len < 4){
+    LOG(LOG_ERR, "Received message is too short: %d", len);
+    return 4;
+  }
+  
+  type = tftp_msg_type(in_buffer);
+  if (type == TFTP_TYPE_ERROR){
+    int error_code;
+    char error_msg[TFTP_MAX_ERROR_LEN+1];
+    
+    ret = tftp_msg_unpack_error(in_buffer, len, &error_code, error_msg);
+    if (ret != 0){
+      LOG(LOG_ERR, "Error unpacking error msg");
+      return 5;
+    }
 
-  len = recvfrom(sd, in_buffer, msglen, 0, 
-                 (struct sockaddr*)&cl_addr, 
-                 &addrlen
+    if (error_code == 1){
+      LOG(LOG_INFO, "File not found");
+      return 1;
+    } else{
+      LOG(LOG_ERR, "Received error %d: %s", error_code, error_msg);
+      return 7;
+    }
+
+  } else if (type == TFTP_TYPE_OACK && receiver->first && 
+             !tftp_opts_empty(&receiver->opts)){
+    receiver->first = 0;
+    return tftp_receiver_on_oack(receiver, in_buffer, len);
+
+  } else if (type == TFTP_TYPE_OACK && receiver->mc_sd != -1){
+    return tftp_receiver_on_mc_oack(receiver, in_buffer, len);
+
+  } else if (type != TFTP_TYPE_DATA){
+    LOG(LOG_ERR, "Received packet of type %d, expecting DATA or ERROR.",type);
+    return 8;
+  }
+
+  if (receiver->first){
+    // server ignored options (if any): fall back to defaults
+    tftp_opts_init(&receiver->opts);
+    receiver->rto = TFTP_TIMEOUT;
+    receiver->m_fblock->block_size = receiver->block_size;
+    receiver->first = 0;
+    tftp_receiver_request_ack0(receiver);
+  }
+
+  if (receiver->mc_sd != -1)
+    return tftp_receiver_on_mc_data(receiver, in_buffer, len);
+  return tftp_receiver_on_data(receiver, in_buffer, len);
+}
+
+
+int tftp_receiver_timeout(struct tftp_receiver *receiver){
+  char out_buffer[4];
+
+  if (tftp_backoff(&receiver->timeout, &receiver->retries, 
+                   &receiver->deadline)){
+    LOG(LOG_ERR, "No reply after %d retransmissions", TFTP_MAX_RETRIES);
+    return 10;
+  }
+
+  if (receiver->mc_sd != -1){
+    LOG(LOG_WARN, "Timeout waiting for multicast data");
+    return receiver->master ? tftp_receiver_send_mc_ack(receiver) : 0;
+  }
+
+  if (receiver->exp_block_n == 1){
+    LOG(LOG_WARN, "No data received yet, sending request (or ACK 0) again");
+    return tftp_receiver_send_request(receiver);
+  }
+
+  LOG(LOG_WARN, "Timeout waiting for part %lld, sending ack again", 
+      receiver->exp_block_n
   );
 
-  if (sockaddr_in_cmp(*addr, cl_addr) != 0){
-    char str_addr[MAX_SOCKADDR_STR_LEN];
-    sockaddr_in_to_string(cl_addr, str_addr);
-    LOG(LOG_WARN, "Message is coming from unexpected source: %s", str_addr);
+  // sender will go back to the first block which has not been received
+  if (tftp_send_ack((receiver->exp_block_n - 1) & TFTP_BLOCK_N_MASK, 
+                    out_buffer, receiver->sd, &receiver->addr))
     return 2;
+  receiver->gap = 0;
+  receiver->received = 0;
+
+  return 0;
+}
+
+
+void tftp_receiver_free(struct tftp_receiver *receiver){
+  free(receiver->data);
+  free(receiver->request);
+  free(receiver->blocks);
+  receiver->data = NULL;
+  receiver->request = NULL;
+  receiver->blocks = NULL;
+  if (receiver->mc_sd != -1)
+    close(receiver->mc_sd);
+  receiver->mc_sd = -1;
+}
+
+
+/**
+ * Runs a started receiver until the file is received (and, if dally is set,
+ * until its deadline expires with no retransmitted block).
+ * 
+ * @param receiver  receiver state
+ * @param progress  function called whenever the transfer makes progress 
+ *                  (can be NULL)
+ * @return          same error codes of tftp_receive_file
+ */
+int tftp_receiver_run(struct tftp_receiver *receiver, 
+                      void (*progress)(struct fblock*, long long)){
+  struct sockaddr_in src_addr;
+  unsigned int addrlen;
+  char *in_buffer;
+  int in_buffer_len, len, ret, ready;
+
+  in_buffer_len = tftp_msg_get_size_data(receiver->max_block_size);
+  in_buffer = malloc(in_buffer_len);
+  ret = 0;
+
+  while (ret == 0 && (!receiver->done || receiver->dally)){
+    LOG(LOG_DEBUG, "Waiting for part %lld", receiver->exp_block_n);
+
+    // multicast DATA messages arrive on another socket
+    ready = tftp_wait(receiver->sd, receiver->mc_sd, receiver->deadline);
+    if (ready == 0){
+      if (receiver->done)  // the last ACK was not lost
+        break;
+      ret = tftp_receiver_timeout(receiver);
+      continue;
+    } else if (ready < 0){
+      LOG(LOG_ERR, "Error waiting for data");
+      perror("Error");
+      ret = 4;
+      break;
+    }
+
+    addrlen = sizeof(src_addr);
+    len = recvfrom(ready == 1 ? receiver->sd : receiver->mc_sd, 
+                   in_buffer, in_buffer_len, 0, 
+                   (struct sockaddr*)&src_addr, 
+                   &addrlen
+    );
+
+    if (len < 0){
+      LOG(LOG_ERR, "Error receiving data");
+      perror("Error");
+      ret = 4;
+      break;
+    }
+
+    ret = tftp_receiver_recv(receiver, in_buffer, len, &src_addr);
+
+    if (ret == 0 && progress != NULL)
+      progress(receiver->m_fblock, receiver->opts.tsize);
+  }
+
+  free(in_buffer);
+  return ret;
+}
+
+
+int tftp_receive_file(struct fblock *m_fblock, struct tftp_opts *opts, 
+                      char *request, int request_len, int sd, 
+                      struct sockaddr_in *addr, 
+                      void (*progress)(struct fblock*, long long)){
+  struct tftp_receiver receiver;
+  int ret;
+
+  ret = tftp_receiver_start(&receiver, m_fblock, opts, request, request_len,
+                            sd, addr
+  );
+  if (ret == 0)
+    ret = tftp_receiver_run(&receiver, progress);
+
+  if (opts != NULL)
+    *opts = receiver.opts;
+
+  tftp_receiver_free(&receiver);
+  return ret;
+}
+
+
+int tftp_accept_file(struct fblock *m_fblock, struct tftp_opts *opts, int sd, 
+                     struct sockaddr_in *addr){
+  struct tftp_receiver receiver;
+  int ret;
+
+  ret = tftp_receiver_accept(&receiver, m_fblock, opts, sd, addr);
+  if (ret == 0)
+    ret = tftp_receiver_run(&receiver, NULL);
+
+  tftp_receiver_free(&receiver);
+  return ret;
+}
+
+
+/**
+ * Sends (or resends) a DATA message in the window.
+ *
+ * @param sender  sender state
+ * @param block_n sequence number of the block (must be in the window)
+ * @return        0 in case of success, 1 otherwise
+ */
+int tftp_sender_send_block(struct tftp_sender *sender, long long block_n){
+  int slot, len, msglen;
+  char *msg;
+  char header[4];
+  struct iovec iov[2];
+  struct msghdr mh;
+  struct sockaddr_in *dest;
+
+  slot = block_n % sender->windowsize;
+
+  // multicast blocks are sent to the whole group
+  dest = sender->multicast ? &sender->group : &sender->addr;
+
+  if (sender->window_ptr != NULL){
+    // zero-copy: header and payload (in the mapped file) are sent together
+    tftp_msg_build_data_header(block_n & TFTP_BLOCK_N_MASK, header);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = sender->window_ptr[slot];
+    iov[1].iov_len = sender->window_len[slot];
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = dest;
+    mh.msg_namelen = sizeof(*dest);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+
+    msglen = tftp_msg_get_size_data(sender->window_len[slot]);
+    len = sendmsg(sender->sd, &mh, 0);
+  } else{
+    msg = sender->window + slot * tftp_msg_get_size_data(sender->block_size);
+    msglen = sender->window_len[slot];
+
+    // dump_buffer_hex(msg, msglen);
+
+    len = sendto(sender->sd, msg, msglen, 0, 
+                 (struct sockaddr*)dest, 
+                 sizeof(*dest)
+    );
+  }
+
+  if (len < 0 && errno == EFAULT && sender->window_ptr != NULL){
+    // the mapped file was truncated: only this transfer is affected
+    LOG(LOG_ERR, "File changed while it was being sent");
+    tftp_send_error(0, "File changed.", sender->sd, &sender->addr);
+    return 1;
   }
 
   if (len != msglen){
-    LOG(LOG_ERR, "Error receiving ACK: len (%d) != msglen (%d)", len, msglen);
+    LOG(LOG_ERR, "Error sending DATA: len (%d) != msglen (%d)", len, msglen);
     return 1;
   }
 
-  ret = tftp_msg_unpack_ack(in_buffer, len, block_n);
-  if (ret != 0){
-    LOG(LOG_ERR, "Error unpacking ack: %d", ret);
-    return 8+ret;
+  sender->stats.bytes += msglen - 4;
+  metrics_count_block(sender->metrics, msglen - 4);
+  return 0;
+}
+
+
+/**
+ * Reads and sends new blocks until the window is full or the file is over.
+ *
+ * @param sender  sender state
+ * @return        0 in case of success, 1 in case of error sending a packet,
+ *                4 in case of error reading the file
+ */
+int tftp_sender_fill_window(struct tftp_sender *sender){
+  struct fblock *m_fblock = sender->m_fblock;
+  int slot, data_size;
+
+  while (sender->last_block == 0 && 
+         sender->next < sender->base + sender->windowsize){
+    LOG(LOG_DEBUG, "Sending part %lld", sender->next);
+
+    slot = sender->next % sender->windowsize;
+
+    if (sender->window_ptr != NULL)
+      data_size = fblock_read_ptr(m_fblock, &sender->window_ptr[slot]);
+    else
+      data_size = fblock_read(m_fblock, sender->data);
+
+    if (data_size < 0){
+      LOG(LOG_ERR, "Error reading part %lld", sender->next);
+      tftp_send_error(0, "Error reading file.", sender->sd, &sender->addr);
+      return 4;
+    }
+
+    LOG(LOG_DEBUG, "Part %lld has size %d", sender->next, data_size);
+
+    if (sender->window_ptr != NULL){
+      sender->window_len[slot] = data_size;
+    } else{
+      tftp_msg_build_data(sender->next & TFTP_BLOCK_N_MASK, 
+                          sender->data, 
+                          data_size, 
+                          sender->window + 
+                            slot * tftp_msg_get_size_data(sender->block_size)
+      );
+      sender->window_len[slot] = tftp_msg_get_size_data(data_size);
+    }
+
+    // a block shorter than block_size marks the end of the file
+    if (data_size < sender->block_size)
+      sender->last_block = sender->next;
+
+    sender->window_sent[slot] = tftp_clock_us();
+    if (tftp_sender_send_block(sender, sender->next))
+      return 1;
+
+    sender->next++;
   }
 
+  LOG(LOG_DEBUG, "Waiting for ack");
   return 0;
 }
 
 
-int tftp_send_file(struct fblock *m_fblock, int sd, struct sockaddr_in *addr){
-  char in_buffer[4], data[TFTP_DATA_BLOCK], out_buffer[TFTP_MAX_DATA_MSG_SIZE];
-  int block_n, rcv_block_n;
-  int len, data_size, msglen, ret;
+/**
+ * Sends again all blocks in the window.
+ *
+ * @param sender  sender state
+ * @return        0 in case of success, 1 in case of error sending a packet
+ */
+int tftp_sender_resend_window(struct tftp_sender *sender){
+  long long n;
 
-  if (m_fblock->remaining > TFTP_MAX_FILE_SIZE){
-    LOG(LOG_ERR, "File is too big: %d", m_fblock->remaining);
-    tftp_send_error(0, "File is too big.", sd, addr);
-    return 4;
+  for (n = sender->base; n < sender->next; n++){
+    LOG(LOG_DEBUG, "Resending part %lld", n);
+    if (tftp_sender_send_block(sender, n))
+      return 1;
+
+    // its ACK can't be used for measuring round trip time any more
+    sender->window_sent[n % sender->windowsize] = -1;
+    sender->stats.resent++;
+    metrics_count_retransmit(sender->metrics);
   }
 
-  // init sequence number
-  block_n = 1;
+  return 0;
+}
 
-  do{
-    LOG(LOG_DEBUG, "Sending part %d", block_n);
 
-    if (m_fblock->remaining > TFTP_DATA_BLOCK)
-      data_size = TFTP_DATA_BLOCK;
-    else
-      data_size = m_fblock->remaining;
+/**
+ * Updates round trip time estimates with the ACK of a message, computing a
+ * new retransmission timeout (RFC 6298).
+ *
+ * @param sender  sender state
+ * @param sent    when the acknowledged message was sent (us), -1 if it was 
+ *                sent more than once (the measure would be ambiguous)
+ * @return        1 if round trip time was measured, 0 otherwise
+ */
+int tftp_sender_rtt_sample(struct tftp_sender *sender, long long sent){
+  long long rtt, delta, rto;
+
+  if (sent < 0)
+    return 0;
+
+  rtt = tftp_clock_us() - sent;
+  if (sender->stats.samples == 0 || rtt < sender->stats.min)
+    sender->stats.min = rtt;
+  if (rtt > sender->stats.max)
+    sender->stats.max = rtt;
+  sender->stats.sum += rtt;
+  sender->stats.samples++;
+  metrics_count_rtt(sender->metrics, rtt);
+
+  if (sender->stats.samples == 1){
+    sender->srtt = rtt;
+    sender->rttvar = rtt / 2;
+  } else{
+    delta = sender->srtt > rtt ? sender->srtt - rtt : rtt - sender->srtt;
+    sender->rttvar = (3 * sender->rttvar + delta) / 4;
+    sender->srtt = (7 * sender->srtt + rtt) / 8;
+  }
 
-    if (data_size != 0)
-      fblock_read(m_fblock, data);
+  if (sender->adaptive){
+    rto = (sender->srtt + 4 * sender->rttvar + 999) / 1000;
+    if (rto < TFTP_MIN_RTO)
+      rto = TFTP_MIN_RTO;
+    else if (rto > TFTP_MAX_TIMEOUT)
+      rto = TFTP_MAX_TIMEOUT;
+    sender->rto = rto;
+  }
 
-    LOG(LOG_DEBUG, "Part %d has size %d", block_n, data_size);
+  return 1;
+}
 
-    msglen = tftp_msg_get_size_data(data_size);
-    tftp_msg_build_data(block_n, data, data_size, out_buffer);
-    
-    // dump_buffer_hex(out_buffer, msglen);
-    
-    len = sendto(sd, out_buffer, msglen, 0, 
-                 (struct sockaddr*)addr, 
-                 sizeof(*addr)
+
+/**
+ * Sends an OACK message with the accepted options (it will be acked as 
+ * block 0).
+ *
+ * @param sender  sender state
+ * @param opts    accepted options
+ * @return        0 in case of success, 1 otherwise
+ */
+int tftp_sender_send_oack(struct tftp_sender *sender, struct tftp_opts *opts){
+  char *out_buffer;
+  int len, msglen, result;
+
+  msglen = tftp_msg_get_size_oack(opts);
+  out_buffer = malloc(msglen);
+  tftp_msg_build_oack(opts, out_buffer);
+
+  sender->oack_sent = sender->oack_sent == 0 ? tftp_clock_us() : -1;
+  len = sendto(sender->sd, out_buffer, msglen, 0, 
+               (struct sockaddr*)&sender->addr, 
+               sizeof(sender->addr)
+  );
+
+  if (len != msglen){
+    LOG(LOG_ERR, "Error sending OACK: len (%d) != msglen (%d)", len, msglen);
+    result = 1;
+  } else{
+    LOG(LOG_DEBUG, "Waiting for ack of OACK");
+    metrics_count_reply(sender->metrics);
+    result = 0;
+  }
+
+  free(out_buffer);
+  return result;
+}
+
+
+/**
+ * Sends the write request again (upload only).
+ *
+ * @param sender  sender state
+ * @return        0 in case of success, 1 otherwise
+ */
+int tftp_sender_send_request(struct tftp_sender *sender){
+  int len;
+
+  sender->oack_sent = sender->oack_sent == 0 ? tftp_clock_us() : -1;
+  len = sendto(sender->sd, sender->request, sender->request_len, 0, 
+               (struct sockaddr*)&sender->addr, 
+               sizeof(sender->addr)
+  );
+
+  if (len != sender->request_len){
+    LOG(LOG_ERR, "Error sending request: len (%d) != msglen (%d)", 
+        len, 
+        sender->request_len
+    );
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Initializes the sender state, without sending anything.
+ * 
+ * Buffers are sized for the block and window sizes in opts, which can only 
+ * be lowered afterwards.
+ * 
+ * @see tftp_sender_start
+ */
+void tftp_sender_init(struct tftp_sender *sender, struct fblock *m_fblock, 
+                      struct tftp_opts *opts, int sd, 
+                      struct sockaddr_in *addr){
+  sender->m_fblock = m_fblock;
+  sender->sd = sd;
+  sender->addr = *addr;
+  sender->done = 0;
+  sender->window = NULL;
+  sender->window_ptr = NULL;
+  sender->window_len = NULL;
+  sender->data = NULL;
+  sender->oack_sent = 0;
+  sender->metrics = NULL;
+  memset(&sender->stats, 0, sizeof(sender->stats));
+
+  if (opts != NULL)
+    sender->opts = *opts;
+  else
+    tftp_opts_init(&sender->opts);
+
+  // a timeout requested by the client is never changed
+  sender->srtt = 0;
+  sender->rttvar = 0;
+  if (sender->opts.timeout != 0){
+    sender->adaptive = 0;
+    sender->rto = sender->opts.timeout * 1000;
+  } else{
+    sender->adaptive = 1;
+    sender->rto = TFTP_TIMEOUT;
+  }
+  sender->timeout = sender->rto;
+  sender->retries = 0;
+  sender->deadline = tftp_clock_ms() + sender->timeout;
+  sender->fast_resent = 0;
+
+  sender->block_size = m_fblock->block_size;
+  if (opts != NULL && opts->windowsize != 0)
+    sender->windowsize = opts->windowsize;
+  else
+    sender->windowsize = 1;
+
+  if (m_fblock->map != NULL && m_fblock->encoder == NULL){
+    // blocks are never copied: the window only points to the mapped file
+    sender->window_ptr = malloc(sender->windowsize * sizeof(char*));
+  } else{
+    sender->window = malloc(sender->windowsize * 
+                            tftp_msg_get_size_data(sender->block_size)
+    );
+    sender->data = malloc(sender->block_size);
+  }
+  sender->window_len = malloc(sender->windowsize * sizeof(int));
+  sender->window_sent = malloc(sender->windowsize * sizeof(long long));
+
+  // init sequence numbers
+  sender->base = 1;
+  sender->next = 1;
+  sender->last_block = 0;
+
+  sender->first = 0;
+  sender->request = NULL;
+  sender->request_len = 0;
+
+  // blocks of a multicast transfer can be read in any order
+  sender->multicast = sender->opts.multicast && 
+                      sender->opts.mc_group.sin_port != 0;
+  if (sender->multicast){
+    sender->group = sender->opts.mc_group;
+    sender->n_blocks = m_fblock->remaining / sender->block_size + 1;
+  } else
+    sender->n_blocks = 0;
+}
+
+
+int tftp_sender_start(struct tftp_sender *sender, struct fblock *m_fblock, 
+                      struct tftp_opts *opts, int sd, 
+                      struct sockaddr_in *addr, 
+                      struct metrics_session *metrics){
+  tftp_sender_init(sender, m_fblock, opts, sd, addr);
+  sender->metrics = metrics;
+
+  if (!tftp_opts_empty(opts)){
+    // OACK is acked as block 0, then the first window is sent
+    sender->oack_pending = 1;
+    return tftp_sender_send_oack(sender, &sender->opts);
+  }
+
+  sender->oack_pending = 0;
+  return tftp_sender_fill_window(sender);
+}
+
+
+/**
+ * Resets the retransmission timer of the sender after some progress.
+ * 
+ * The timeout is brought back to the computed one only if round trip time 
+ * was measured, otherwise the backed off timeout is kept (Karn's algorithm).
+ * 
+ * @param sender  sender state
+ * @param sent    when the acknowledged message was sent (us), -1 if it was 
+ *                sent more than once
+ */
+void tftp_sender_progress(struct tftp_sender *sender, long long sent){
+  if (tftp_sender_rtt_sample(sender, sent) || sender->retries == 0)
+    sender->timeout = sender->rto;
+  sender->retries = 0;
+  sender->deadline = tftp_clock_ms() + sender->timeout;
+}
+
+
+int tftp_sender_start_upload(struct tftp_sender *sender, 
+                             struct fblock *m_fblock, struct tftp_opts *opts,
+                             char *request, int request_len, int sd, 
+                             struct sockaddr_in *addr){
+  tftp_sender_init(sender, m_fblock, opts, sd, addr);
+
+  // the request is acknowledged as block 0, like an OACK
+  sender->first = 1;
+  sender->request = malloc(request_len);
+  memcpy(sender->request, request, request_len);
+  sender->request_len = request_len;
+  sender->oack_pending = 1;
+
+  return tftp_sender_send_request(sender);
+}
+
+
+/**
+ * Applies the options accepted by the receiver of an upload.
+ *
+ * @param sender  sender state
+ * @param opts    accepted options
+ */
+void tftp_sender_apply_opts(struct tftp_sender *sender, 
+                            struct tftp_opts *opts){
+  int block_size;
+
+  block_size = opts->blksize != 0 ? opts->blksize : TFTP_DATA_BLOCK;
+  sender->opts = *opts;
+  sender->windowsize = opts->windowsize != 0 ? opts->windowsize : 1;
+
+  // buffers were sized for the requested block size, which is smaller than
+  // the default one if the receiver ignored it (nothing was sent yet)
+  if (sender->window != NULL && block_size > sender->block_size){
+    free(sender->window);
+    free(sender->data);
+    sender->window = malloc(sender->windowsize * 
+                            tftp_msg_get_size_data(block_size)
+    );
+    sender->data = malloc(block_size);
+  }
+
+  sender->block_size = block_size;
+  sender->m_fblock->block_size = sender->block_size;
+
+  if (opts->timeout != 0){
+    sender->adaptive = 0;
+    sender->rto = opts->timeout * 1000;
+  } else
+    sender->adaptive = 1;
+
+  LOG(LOG_INFO, 
+      "Accepted options: blksize = %d, windowsize = %d, timeout = %d, "
+      "tsize = %lld", 
+      sender->block_size, 
+      sender->windowsize,
+      opts->timeout,
+      opts->tsize
+  );
+}
+
+
+/**
+ * Handles the OACK sent by the server in reply to a write request.
+ *
+ * @param sender    sender state
+ * @param in_buffer the received message
+ * @param len       length of the received message
+ * @return          0 if the transmission can go on, same error codes of 
+ *                  tftp_upload_file otherwise
+ */
+int tftp_sender_on_oack(struct tftp_sender *sender, char *in_buffer, 
+                        int len){
+  struct tftp_opts oack_opts;
+
+  if (tftp_msg_unpack_oack(in_buffer, len, &oack_opts) != 0 || 
+      !tftp_check_oack(&sender->opts, &oack_opts)){
+    tftp_send_error(8, "Option negotiation failure.", sender->sd, 
+                    &sender->addr
     );
+    return 7;
+  }
+
+  tftp_sender_apply_opts(sender, &oack_opts);
+  sender->oack_pending = 0;
+  tftp_sender_progress(sender, sender->oack_sent);
+  return tftp_sender_fill_window(sender);
+}
+
+
+/**
+ * Handles an ACK of the master client of a multicast transfer.
+ * 
+ * The master client acknowledges the last block it received in order, which
+ * can be outside of the window if it joined the group late (or it became 
+ * master after receiving later blocks): the transfer goes on from the block
+ * after it, seeking the file if needed. The number of the last block means
+ * that the master client received the whole file.
+ *
+ * @param sender    sender state
+ * @param acked     acknowledged block
+ * @return          0 if the transmission can go on, same error codes of 
+ *                  tftp_send_file otherwise
+ */
+int tftp_sender_on_mc_ack(struct tftp_sender *sender, long long acked){
+  long long sent = -1;
+
+  if (acked > sender->n_blocks){
+    LOG(LOG_ERR, "Received wrong block n: received %lld > %lld", 
+        acked, 
+        sender->n_blocks
+    );
+    return 3;
+  }
+
+  if (sender->oack_pending){
+    sender->oack_pending = 0;
+    sent = sender->oack_sent;
+  } else if (acked == sender->base - 1){
+    LOG(LOG_DEBUG, "Duplicate ack %lld", acked);
+    return 0;
+  } else if (acked >= sender->base && acked < sender->next)
+    sent = sender->window_sent[acked % sender->windowsize];
+
+  tftp_sender_progress(sender, sent);
+
+  if (acked == sender->n_blocks){
+    sender->done = 1;
+    return 0;
+  }
 
-    if (len != msglen){
+  if (acked >= sender->base - 1 && acked < sender->next){
+    sender->base = acked + 1;
+    if (tftp_sender_resend_window(sender))
       return 1;
+    return tftp_sender_fill_window(sender);
+  }
+
+  LOG(LOG_DEBUG, "Master client needs part %lld, moving there", acked + 1);
+  if (fblock_seek(sender->m_fblock, (off_t) acked * sender->block_size)){
+    LOG(LOG_ERR, "Error seeking part %lld", acked + 1);
+    return 4;
+  }
+  sender->base = acked + 1;
+  sender->next = acked + 1;
+  sender->last_block = 0;
+  return tftp_sender_fill_window(sender);
+}
+
+
+int tftp_sender_set_master(struct tftp_sender *sender, 
+                           struct tftp_opts *opts, struct sockaddr_in *addr){
+  sender->addr = *addr;
+  sender->opts = *opts;
+  sender->done = 0;
+  sender->oack_pending = 1;
+  sender->oack_sent = 0;
+  sender->timeout = sender->rto;
+  sender->retries = 0;
+  sender->deadline = tftp_clock_ms() + sender->timeout;
+  return tftp_sender_send_oack(sender, &sender->opts);
+}
+
+
+int tftp_sender_recv(struct tftp_sender *sender, char *in_buffer, int len, 
+                     struct sockaddr_in *src){
+  int rcv_block_n, ret;
+  long long acked;
+
+  if (sender->first && sender->addr.sin_addr.s_addr == src->sin_addr.s_addr){
+    // first reply to a write request comes from the TID of the server
+    sender->addr = *src;
+    sender->first = 0;
+  } else if (sockaddr_in_cmp(sender->addr, *src) != 0){  //unexpected source
+    char str_addr[MAX_SOCKADDR_STR_LEN];
+    sockaddr_in_to_string(*src, str_addr);
+    LOG(LOG_WARN, "Message is coming from unexpected source: %s", str_addr);
+    return 0;
+  }
+
+  if (len >= 4 && tftp_msg_type(in_buffer) == TFTP_TYPE_ERROR){
+    int error_code;
+    char error_msg[TFTP_MAX_ERROR_LEN+1];
+
+    if (tftp_msg_unpack_error(in_buffer, len, &error_code, error_msg) == 0)
+      LOG(LOG_ERR, "Received error %d: %s", error_code, error_msg);
+    return 6;
+  }
+
+  if (len >= 2 && tftp_msg_type(in_buffer) == TFTP_TYPE_OACK && 
+      sender->oack_pending && sender->request != NULL)
+    return tftp_sender_on_oack(sender, in_buffer, len);
+
+  if (len != tftp_msg_get_size_ack()){
+    LOG(LOG_ERR, "Error receiving ACK: len (%d) != msglen (%d)", 
+        len, 
+        tftp_msg_get_size_ack()
+    );
+    return 2;
+  }
+
+  ret = tftp_msg_unpack_ack(in_buffer, len, &rcv_block_n);
+  if (ret != 0){
+    LOG(LOG_ERR, "Error unpacking ack: %d", ret);
+    return 2;
+  }
+
+  // multicast files have at most TFTP_BLOCK_N_MASK blocks (no roll over)
+  if (sender->multicast)
+    return tftp_sender_on_mc_ack(sender, rcv_block_n);
+
+  if (sender->oack_pending){
+    if (rcv_block_n != 0){
+      LOG(LOG_ERR, "Received wrong block n: received %d != expected 0", 
+          rcv_block_n
+      );
+      return 3;
     }
+    if (sender->request != NULL){
+      // server ignored options (if any): fall back to defaults
+      struct tftp_opts defaults;
+      tftp_opts_init(&defaults);
+      tftp_sender_apply_opts(sender, &defaults);
+    }
+    sender->oack_pending = 0;
+    tftp_sender_progress(sender, sender->oack_sent);
+    return tftp_sender_fill_window(sender);
+  }
+
+  // window is never larger than 65535 blocks, so the (rolled over) block 
+  // number can be mapped back to the only candidate in [base-1, base+65534]
+  acked = sender->base - 1 + 
+          ((rcv_block_n - (sender->base - 1)) & TFTP_BLOCK_N_MASK);
+
+  // already acknowledged block: resending the window on every duplicate
+  // would double every following block (Sorcerer's Apprentice Syndrome), 
+  // so it is sent again only on the first one (a receiver with a window 
+  // acks the last block in order when one is lost), the rest is left to the
+  // timeout
+  if (acked == sender->base - 1){
+    LOG(LOG_DEBUG, "Duplicate ack %d", rcv_block_n);
+    if (sender->windowsize == 1 || sender->fast_resent)
+      return 0;
+
+    sender->fast_resent = 1;
+    return tftp_sender_resend_window(sender);
+  }
+
+  // ack of the previous window, delayed or duplicated by the network after
+  // the window was sent again: the receiver has already acked a later block
+  // (that ack can be at most a whole window behind)
+  if (acked >= sender->next &&
+      (((sender->base - 1) - rcv_block_n) & TFTP_BLOCK_N_MASK) <=
+      sender->windowsize){
+    LOG(LOG_DEBUG, "Stale ack %d", rcv_block_n);
+    return 0;
+  }
+
+  if (acked >= sender->next){
+    LOG(LOG_ERR, "Received wrong block n: received %d not in [%lld, %lld]", 
+        rcv_block_n, 
+        (sender->base - 1) & TFTP_BLOCK_N_MASK,
+        (sender->next - 1) & TFTP_BLOCK_N_MASK
+    );
+    return 3;
+  }
+
+  sender->base = acked + 1;
+  sender->fast_resent = 0;
+  tftp_sender_progress(sender, sender->window_sent[acked % sender->windowsize]);
+
+  if (acked == sender->last_block){
+    sender->done = 1;
+    return 0;
+  }
+
+  // receiver lost the blocks after the acked one: go back and resend them
+  if (tftp_sender_resend_window(sender))
+    return 1;
+
+  return tftp_sender_fill_window(sender);
+}
 
-    LOG(LOG_DEBUG, "Waiting for ack");
 
-    ret = tftp_receive_ack(&rcv_block_n, in_buffer, sd, addr);
+int tftp_sender_timeout(struct tftp_sender *sender){
+  sender->stats.timeouts++;
+  metrics_count_timeout(sender->metrics);
+  if (tftp_backoff(&sender->timeout, &sender->retries, &sender->deadline)){
+    LOG(LOG_ERR, "No ack after %d retransmissions", TFTP_MAX_RETRIES);
+    return 5;
+  }
+
+  if (sender->oack_pending && sender->request != NULL){
+    LOG(LOG_WARN, "No reply to request, sending it again");
+    return tftp_sender_send_request(sender);
+  } else if (sender->oack_pending){
+    LOG(LOG_WARN, "Timeout waiting for ack of OACK, sending it again");
+    return tftp_sender_send_oack(sender, &sender->opts);
+  }
+
+  LOG(LOG_WARN, "Timeout waiting for ack of part %lld, sending window again",
+      sender->base
+  );
+  return tftp_sender_resend_window(sender);
+}
+
+
+void tftp_sender_log_stats(struct tftp_sender *sender){
+  struct tftp_rtt_stats *stats = &sender->stats;
+
+  if (stats->samples == 0){
+    LOG(LOG_INFO, "RTT: no samples, %ld timeouts, %ld blocks resent", 
+        stats->timeouts, 
+        stats->resent
+    );
+    return;
+  }
+
+  LOG(LOG_INFO, 
+      "RTT: %ld samples, min/avg/max %.3f/%.3f/%.3f ms, srtt %.3f ms, "
+      "rttvar %.3f ms, rto %d ms, %ld timeouts, %ld blocks resent", 
+      stats->samples, 
+      stats->min / 1000.0, 
+      (double) stats->sum / stats->samples / 1000.0, 
+      stats->max / 1000.0, 
+      sender->srtt / 1000.0, 
+      sender->rttvar / 1000.0, 
+      sender->rto, 
+      stats->timeouts, 
+      stats->resent
+  );
+}
+
 
-    if (ret == 2){  //unexpected source
+void tftp_sender_free(struct tftp_sender *sender){
+  free(sender->window);
+  free(sender->window_ptr);
+  free(sender->window_len);
+  free(sender->window_sent);
+  free(sender->data);
+  free(sender->request);
+  sender->window = NULL;
+  sender->window_ptr = NULL;
+  sender->window_len = NULL;
+  sender->window_sent = NULL;
+  sender->data = NULL;
+  sender->request = NULL;
+}
+
+
+/**
+ * Runs a started sender until the last block is acknowledged.
+ * 
+ * @param sender    sender state
+ * @return          same error codes of tftp_send_file
+ */
+int tftp_sender_run(struct tftp_sender *sender){
+  char in_buffer[TFTP_MAX_ERROR_LEN+5];
+  struct sockaddr_in src_addr;
+  unsigned int addrlen;
+  int len, ret, ready;
+
+  ret = 0;
+  while (ret == 0 && !sender->done){
+    ready = tftp_wait(sender->sd, -1, sender->deadline);
+    if (ready == 0){
+      ret = tftp_sender_timeout(sender);
       continue;
-    } else if (ret != 0){
-      LOG(LOG_ERR, "Error receiving ack: %d", ret);
-      return 2;
+    } else if (ready < 0){
+      LOG(LOG_ERR, "Error waiting for ack");
+      perror("Error");
+      ret = 2;
+      break;
     }
 
-    if (rcv_block_n != block_n){
-      LOG(LOG_ERR, "Received wrong block n: received %d != expected %d", 
-          rcv_block_n, 
-          block_n
-      );
-      return 3;
+    addrlen = sizeof(src_addr);
+    len = recvfrom(sender->sd, in_buffer, sizeof(in_buffer), 0, 
+                   (struct sockaddr*)&src_addr, 
+                   &addrlen
+    );
+
+    if (len < 0){
+      LOG(LOG_ERR, "Error receiving ack");
+      perror("Error");
+      ret = 2;
+      break;
     }
 
-    block_n++;
+    ret = tftp_sender_recv(sender, in_buffer, len, &src_addr);
+  }
 
-  } while(data_size == TFTP_DATA_BLOCK);
-  return 0;
+  return ret;
+}
+
+
+int tftp_send_file(struct fblock *m_fblock, struct tftp_opts *opts, int sd, 
+                   struct sockaddr_in *addr, struct metrics_session *metrics){
+  struct tftp_sender sender;
+  int ret;
+
+  ret = tftp_sender_start(&sender, m_fblock, opts, sd, addr, metrics);
+  if (ret == 0)
+    ret = tftp_sender_run(&sender);
+
+  tftp_sender_log_stats(&sender);
+  tftp_sender_free(&sender);
+  return ret;
+}
+
+
+int tftp_upload_file(struct fblock *m_fblock, struct tftp_opts *opts, 
+                     char *request, int request_len, int sd, 
+                     struct sockaddr_in *addr){
+  struct tftp_sender sender;
+  int ret;
+
+  ret = tftp_sender_start_upload(&sender, m_fblock, opts, request, 
+                                 request_len, sd, addr
+  );
+  if (ret == 0)
+    ret = tftp_sender_run(&sender);
+
+  if (opts != NULL)
+    *opts = sender.opts;
+
+  tftp_sender_log_stats(&sender);
+  tftp_sender_free(&sender);
+  return ret;
 }
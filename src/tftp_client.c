@@ -2,7 +2,13 @@
  * @file
  * @author Riccardo Mancini
  * 
- * @brief Implementation of the TFTP client that can only make read requests.
+ * @brief Implementation of the TFTP client.
+ * 
+ * Files are downloaded with the !get command (read requests) and uploaded 
+ * with the !put command (write requests, if the server accepts them).
+ * 
+ * With the -m flag, binary downloads request the multicast option (RFC 
+ * 2090), so that the server can send the same file to many clients at once.
  */
 
 
@@ -21,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 /** Defining LOG_LEVEL for tftp_client executable */
 const int LOG_LEVEL = LOG_WARN;
@@ -38,6 +45,12 @@ const int LOG_LEVEL = LOG_WARN;
 /** String for bin*/
 #define MODE_BIN "bin"
 
+/** Minimum interval between two updates of the progress bar (ms) */
+#define PROGRESS_INTERVAL 200
+
+/** Width of the progress bar */
+#define PROGRESS_BAR_LEN 30
+
 
 /** 
  * Global transfer_mode variable for storing user chosen transfer mode string.
@@ -47,6 +60,25 @@ const int LOG_LEVEL = LOG_WARN;
  */
 char* transfer_mode;
 
+/**
+ * Global request_opts variable for storing options to be sent in requests.
+ * 
+ * Options are set from command line arguments.
+ */
+struct tftp_opts request_opts;
+
+/** Set to 1 if binary files are requested in multicast */
+int multicast;
+
+/** Set to 1 if progress of transfers is shown (stdout is a terminal) */
+int show_progress;
+
+/** When the current transfer started (see tftp_clock_ms) */
+long long transfer_start;
+
+/** When progress of the current transfer was last shown, 0 if never */
+long long progress_shown;
+
 
 /**
  * Splits a string at each delim.
@@ -98,8 +130,90 @@ void split_string(char* line, char* delim, int max_argc, int *argc,
  * Prints command usage information.
  */
 void print_help(){
-  printf("Usage: ./tftp_client SERVER_IP SERVER_PORT\n");
-  printf("Example: ./tftp_client 127.0.0.1 69");
+  printf("Usage: ./tftp_client [-b BLKSIZE] [-w WINDOWSIZE] [-t TIMEOUT] "
+         "[-m] SERVER_IP SERVER_PORT\n");
+  printf("Example: ./tftp_client 127.0.0.1 69\n");
+  printf("Options:\n");
+  printf("  -b BLKSIZE     request block size BLKSIZE (%d-%d, RFC 2348)\n", 
+         TFTP_MIN_BLKSIZE, 
+         TFTP_MAX_BLKSIZE
+  );
+  printf("  -w WINDOWSIZE  request window size WINDOWSIZE (%d-%d, RFC 7440)\n",
+         TFTP_MIN_WINDOWSIZE, 
+         TFTP_MAX_WINDOWSIZE
+  );
+  printf("  -t TIMEOUT     request retransmission timeout TIMEOUT seconds "
+         "(%d-%d, RFC 2349)\n",
+         TFTP_MIN_TIMEOUT_OPT, 
+         TFTP_MAX_TIMEOUT_OPT
+  );
+  printf("  -m             request binary files in multicast (RFC 2090)\n");
+}
+
+/**
+ * Prints the progress of the current transfer on a single line, with its 
+ * throughput and, if the transfer size is known, the estimated time left.
+ * 
+ * @param received  bytes received so far
+ * @param tsize     transfer size (-1 if not known)
+ */
+void print_progress_line(long long received, long long tsize){
+  char bar[PROGRESS_BAR_LEN+1];
+  double elapsed, speed;
+  long long eta;
+  int i, filled;
+
+  elapsed = (tftp_clock_ms() - transfer_start) / 1000.0;
+  speed = elapsed > 0 ? received / elapsed : 0;
+
+  if (tsize <= 0){
+    printf("\r%12lld KB  %8.2f MB/s", 
+           received / 1024, 
+           speed / (1024*1024)
+    );
+    fflush(stdout);
+    return;
+  }
+
+  if (received > tsize)
+    received = tsize;
+
+  filled = received * PROGRESS_BAR_LEN / tsize;
+  for (i = 0; i < PROGRESS_BAR_LEN; i++)
+    bar[i] = i < filled ? '#' : '-';
+  bar[PROGRESS_BAR_LEN] = '\0';
+
+  printf("\r[%s] %3lld%%  %8.2f MB/s", 
+         bar, 
+         received * 100 / tsize, 
+         speed / (1024*1024)
+  );
+  if (speed > 0){
+    eta = (tsize - received) / speed;
+    printf("  ETA %02lld:%02lld:%02lld", eta / 3600, eta / 60 % 60, eta % 60);
+  } else{
+    printf("  ETA --:--:--");
+  }
+  fflush(stdout);
+}
+
+/**
+ * Shows the progress of the current transfer, at most once every 
+ * PROGRESS_INTERVAL ms.
+ * 
+ * @param m_fblock  file being received
+ * @param tsize     transfer size (-1 if not known)
+ * 
+ * @see tftp_receive_file
+ */
+void on_progress(struct fblock *m_fblock, long long tsize){
+  long long now = tftp_clock_ms();
+
+  if (now - progress_shown < PROGRESS_INTERVAL)
+    return;
+
+  progress_shown = now;
+  print_progress_line(m_fblock->written, tsize);
 }
 
 /**
@@ -112,6 +226,8 @@ void cmd_help(){
   printf("dei file (testo o binario)\n");
   printf("!get filename nome_locale --> richiede al server il nome del file ");
   printf("<filename> e lo salva localmente con il nome <nome_locale>\n");
+  printf("!put nome_locale filename --> invia al server il file locale ");
+  printf("<nome_locale> e lo salva con il nome <filename>\n");
   printf("!quit --> termina il client\n");
 }
 
@@ -141,27 +257,33 @@ int cmd_get(char* remote_filename, char* local_filename, char* sv_ip,
             int sv_port){
   struct sockaddr_in my_addr, sv_addr;
   int sd;
-  int ret, tid, result;
+  int ret, tid, result, request_len;
   struct fblock m_fblock;
-  char *tmp_filename;
+  struct tftp_opts opts;
+  char *request;
 
   LOG(LOG_INFO, "Initializing...\n");
 
+  opts = request_opts;
+
+  // server tells file size, so that space can be reserved in advance
+  opts.tsize = 0;
+
+  // multicast blocks are written in place, which needs a binary file
+  opts.multicast = multicast && strcmp(transfer_mode, TFTP_STR_OCTET) == 0;
+
   sd = socket(AF_INET, SOCK_DGRAM, 0);
   if (strcmp(transfer_mode, TFTP_STR_OCTET) == 0)
     m_fblock = fblock_open(local_filename, 
                            TFTP_DATA_BLOCK, 
                            FBLOCK_WRITE|FBLOCK_MODE_BINARY
     );
-  else if (strcmp(transfer_mode, TFTP_STR_NETASCII) == 0){
-    tmp_filename = malloc(strlen(local_filename)+5);
-    strcpy(tmp_filename, local_filename);
-    strcat(tmp_filename, ".tmp");
-    m_fblock = fblock_open(tmp_filename, 
+  else if (strcmp(transfer_mode, TFTP_STR_NETASCII) == 0)
+    m_fblock = fblock_open(local_filename, 
                            TFTP_DATA_BLOCK, 
                            FBLOCK_WRITE|FBLOCK_MODE_TEXT
     );
-  }else
+  else
     return 2;
 
   LOG(LOG_INFO, "Opening socket...");
@@ -182,42 +304,140 @@ int cmd_get(char* remote_filename, char* local_filename, char* sv_ip,
          transfer_mode
   );
 
-  ret = tftp_send_rrq(remote_filename, transfer_mode, sd, &sv_addr);
-  if (ret != 0){
-    fblock_close(&m_fblock);
-    return 8+ret;
-  }
+  // RRQ is sent (and sent again if needed) by tftp_receive_file
+  request_len = tftp_msg_get_size_rrq(remote_filename, transfer_mode, &opts);
+  request = malloc(request_len);
+  tftp_msg_build_rrq(remote_filename, transfer_mode, &opts, request);
 
   printf("Trasferimento file in corso.\n");
 
-  ret = tftp_receive_file(&m_fblock, sd, &sv_addr);
+  transfer_start = tftp_clock_ms();
+  progress_shown = 0;
 
+  ret = tftp_receive_file(&m_fblock, &opts, request, request_len, sd, 
+                          &sv_addr, show_progress ? on_progress : NULL
+  );
+  free(request);
+
+  // complete the progress line
+  if (progress_shown != 0){
+    if (ret == 0)
+      print_progress_line(m_fblock.written, opts.tsize);
+    printf("\n");
+  }
   
   if (ret == 1){    // File not found
     printf("File non trovato.\n");
     result = 0;
+  } else if (ret == 10){  // Timeout
+    printf("Il server non risponde.\n");
+    result = 16+ret;
+  } else if (ret == 11){  // Disk full
+    printf("Spazio su disco insufficiente (%lld byte).\n", opts.tsize);
+    result = 16+ret;
   } else if (ret != 0){
     LOG(LOG_ERR, "Error while receiving file!");
     result = 16+ret;
   } else{
-    int n_blocks = (m_fblock.written+m_fblock.block_size-1)/m_fblock.block_size;
-    printf("Trasferimento completato (%d/%d blocchi)\n", n_blocks, n_blocks);
+    long long n_blocks = (m_fblock.written+m_fblock.block_size-1) / 
+                         m_fblock.block_size;
+    printf("Trasferimento completato (%lld/%lld blocchi)\n", n_blocks, n_blocks);
     printf("Salvataggio %s completato.\n", local_filename);
 
     result = 0;
   }
 
   fblock_close(&m_fblock);
-  if (strcmp(transfer_mode, TFTP_STR_NETASCII) == 0){
-    netascii2unix(tmp_filename, local_filename);
-    remove(tmp_filename);
-    free(tmp_filename);
-  }
 
   return result;
 
 }
 
+/**
+ * Handles !put command, writing file to server.
+ */
+int cmd_put(char* local_filename, char* remote_filename, char* sv_ip, 
+            int sv_port){
+  struct sockaddr_in my_addr, sv_addr;
+  int sd;
+  int ret, tid, result, request_len, block_size;
+  struct fblock m_fblock;
+  struct tftp_opts opts;
+  char *request;
+
+  opts = request_opts;
+  block_size = opts.blksize != 0 ? opts.blksize : TFTP_DATA_BLOCK;
+
+  if (strcmp(transfer_mode, TFTP_STR_OCTET) == 0)
+    m_fblock = fblock_open(local_filename, 
+                           block_size, 
+                           FBLOCK_READ|FBLOCK_MODE_BINARY|FBLOCK_MMAP
+    );
+  else if (strcmp(transfer_mode, TFTP_STR_NETASCII) == 0)
+    m_fblock = fblock_open(local_filename, 
+                           block_size, 
+                           FBLOCK_READ|FBLOCK_MODE_TEXT
+    );
+  else
+    return 2;
+
+  if (m_fblock.file == NULL && m_fblock.map == NULL){
+    printf("File locale %s non trovato.\n", local_filename);
+    return 0;
+  }
+
+  // server can reserve space in advance (size is unknown in text mode)
+  if (m_fblock.encoder == NULL)
+    opts.tsize = m_fblock.remaining;
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  sv_addr = make_sv_sockaddr_in(sv_ip, sv_port);
+  my_addr = make_my_sockaddr_in(0);
+  tid = bind_random_port(sd, &my_addr);
+  if (tid == 0){
+    LOG(LOG_ERR, "Error while binding to random port");
+    perror("Could not bind to random port:");
+    fblock_close(&m_fblock);
+    close(sd);
+    return 1;
+  } else
+    LOG(LOG_INFO, "Bound to port %d", tid);
+
+  printf("Invio file %s (%s) al server in corso.\n", 
+         local_filename, 
+         transfer_mode
+  );
+
+  // WRQ is sent (and sent again if needed) by tftp_upload_file
+  request_len = tftp_msg_get_size_wrq(remote_filename, transfer_mode, &opts);
+  request = malloc(request_len);
+  tftp_msg_build_wrq(remote_filename, transfer_mode, &opts, request);
+
+  ret = tftp_upload_file(&m_fblock, &opts, request, request_len, sd, 
+                         &sv_addr
+  );
+  free(request);
+
+  if (ret == 5){  // Timeout
+    printf("Il server non risponde.\n");
+    result = 16+ret;
+  } else if (ret == 6){  // Error from server
+    printf("Il server ha rifiutato il file.\n");
+    result = 16+ret;
+  } else if (ret != 0){
+    LOG(LOG_ERR, "Error while sending file!");
+    result = 16+ret;
+  } else{
+    printf("Invio %s completato.\n", remote_filename);
+    result = 0;
+  }
+
+  fblock_close(&m_fblock);
+  close(sd);
+
+  return result;
+}
+
 /**
  * Handles !quit command.
  */
@@ -234,6 +454,7 @@ int main(int argc, char** argv){
   char read_buffer[READ_BUFFER_SIZE];
   int cmd_argc;
   char *cmd_argv[MAX_ARGS];
+  int opt;
 
   //init random seed
   srand(time(NULL));
@@ -241,14 +462,55 @@ int main(int argc, char** argv){
   // default mode = bin
   transfer_mode = TFTP_STR_OCTET;
 
-  if (argc != 3){
+  // no options by default
+  tftp_opts_init(&request_opts);
+  multicast = 0;
+
+  show_progress = isatty(STDOUT_FILENO);
+
+  while ((opt = getopt(argc, argv, "b:w:t:m")) != -1){
+    switch (opt){
+      case 'b':
+        request_opts.blksize = atoi(optarg);
+        if (request_opts.blksize < TFTP_MIN_BLKSIZE || 
+            request_opts.blksize > TFTP_MAX_BLKSIZE){
+          print_help();
+          return 1;
+        }
+        break;
+      case 'w':
+        request_opts.windowsize = atoi(optarg);
+        if (request_opts.windowsize < TFTP_MIN_WINDOWSIZE || 
+            request_opts.windowsize > TFTP_MAX_WINDOWSIZE){
+          print_help();
+          return 1;
+        }
+        break;
+      case 't':
+        request_opts.timeout = atoi(optarg);
+        if (request_opts.timeout < TFTP_MIN_TIMEOUT_OPT || 
+            request_opts.timeout > TFTP_MAX_TIMEOUT_OPT){
+          print_help();
+          return 1;
+        }
+        break;
+      case 'm':
+        multicast = 1;
+        break;
+      default:
+        print_help();
+        return 1;
+    }
+  }
+
+  if (argc - optind != 2){
     print_help();
     return 1;
   }
 
   // TODO: check args
-  sv_ip = argv[1];
-  sv_port = atoi(argv[2]);
+  sv_ip = argv[optind];
+  sv_port = atoi(argv[optind+1]);
 
   while(1){
     printf("> ");
@@ -273,6 +535,14 @@ int main(int argc, char** argv){
            printf("Il comando richiede due argomenti:");
            printf(" <filename> e <nome_locale>\n");
         }
+      } else if (strcmp(cmd_argv[0], "!put") == 0){
+        if (cmd_argc == 3){
+          ret = cmd_put(cmd_argv[1], cmd_argv[2], sv_ip, sv_port);
+          LOG(LOG_DEBUG, "cmd_put returned value: %d", ret);
+        } else{
+           printf("Il comando richiede due argomenti:");
+           printf(" <nome_locale> e <filename>\n");
+        }
       } else if (strcmp(cmd_argv[0], "!quit") == 0){
         if (cmd_argc == 1){
           cmd_quit();
@@ -15,6 +15,8 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
 
 
 /** LOG_LEVEL will be defined in another file */
@@ -26,77 +28,332 @@ int tftp_msg_type(char *buffer){
 }
 
 
-void tftp_msg_build_rrq(char* filename, char* mode, char* buffer){
-  *((uint16_t*)buffer) = htons(TFTP_TYPE_RRQ);
-  buffer += 2;
-  strcpy(buffer, filename);
-  buffer += strlen(filename)+1;
-  strcpy(buffer, mode);
+void tftp_opts_init(struct tftp_opts *opts){
+  memset(opts, 0, sizeof(struct tftp_opts));
+  opts->tsize = -1;
 }
 
 
-int tftp_msg_unpack_rrq(char* buffer, int buffer_len, char* filename, char* mode){
-  int offset = 0;
-  if (tftp_msg_type(buffer) != TFTP_TYPE_RRQ){
-    LOG(LOG_ERR, "Expected RRQ message (1), found %d", tftp_msg_type(buffer));
-    return 1;
+int tftp_opts_empty(struct tftp_opts *opts){
+  return opts == NULL || 
+         (opts->blksize == 0 && opts->windowsize == 0 && opts->timeout == 0 
+          && opts->tsize < 0 && !opts->multicast);
+}
+
+
+/**
+ * Appends an option with a string value to a message.
+ * 
+ * @param name      option name
+ * @param value_str option value
+ * @param buffer    where to write the option (can be NULL to compute its 
+ *                  size)
+ * @return          number of bytes (to be) written
+ */
+int tftp_msg_build_opt_str(char* name, char* value_str, char* buffer){
+  int len;
+
+  len = strlen(name) + strlen(value_str) + 2;
+
+  if (buffer != NULL){
+    strcpy(buffer, name);
+    strcpy(buffer + strlen(name) + 1, value_str);
   }
+  return len;
+}
 
-  offset += 2;
-  if (strlen(buffer+offset) > TFTP_MAX_FILENAME_LEN){
-    LOG(LOG_ERR, "Filename too long (%d > %d): %s", 
-        (int) strlen(buffer+offset), 
-        TFTP_MAX_FILENAME_LEN, buffer+offset
-    );
-    return 3;
+
+/**
+ * Appends an option to a message.
+ * 
+ * @param name    option name
+ * @param value   option value
+ * @param buffer  where to write the option (can be NULL to compute its size)
+ * @return        number of bytes (to be) written
+ */
+int tftp_msg_build_opt(char* name, long long value, char* buffer){
+  char value_str[TFTP_MAX_OPT_VALUE_LEN+1];
+
+  sprintf(value_str, "%lld", value);
+  return tftp_msg_build_opt_str(name, value_str, buffer);
+}
+
+
+/**
+ * Formats the value of the multicast option ("addr,port,mc", or an empty 
+ * string if the group is not set, as in requests).
+ * 
+ * @param opts       the options
+ * @param value_str  formatted value, TFTP_MAX_OPT_VALUE_LEN+1 long [out]
+ */
+void tftp_msg_format_multicast(struct tftp_opts *opts, char* value_str){
+  char addr_str[INET_ADDRSTRLEN];
+
+  if (opts->mc_group.sin_port == 0){  // request
+    value_str[0] = '\0';
+    return;
   }
-  strcpy(filename, buffer+offset);
 
-  offset += strlen(filename)+1;
-  if (strlen(buffer+offset) > TFTP_MAX_MODE_LEN){
-    LOG(LOG_ERR, "Mode string too long (%d > %d): %s", 
-        (int) strlen(buffer+offset), 
-        TFTP_MAX_MODE_LEN, 
-        buffer+offset
+  inet_ntop(AF_INET, &opts->mc_group.sin_addr, addr_str, sizeof(addr_str));
+  sprintf(value_str, "%s,%d,%d", 
+          addr_str, 
+          ntohs(opts->mc_group.sin_port), 
+          opts->mc_master
+  );
+}
+
+
+/**
+ * Writes all options that are set to a message.
+ * 
+ * @param opts    the options (can be NULL)
+ * @param buffer  where to write options (can be NULL to compute their size)
+ * @return        number of bytes (to be) written
+ */
+int tftp_msg_build_opts(struct tftp_opts *opts, char* buffer){
+  int len = 0;
+
+  if (opts == NULL)
+    return 0;
+
+  if (opts->blksize != 0)
+    len += tftp_msg_build_opt(TFTP_OPT_BLKSIZE, opts->blksize, 
+                              buffer != NULL ? buffer+len : NULL
     );
-    return 4;
-  }
-  strcpy(mode, buffer+offset);
 
-  offset += strlen(mode)+1;
-  if (buffer_len != offset){
-    LOG(LOG_ERR, "Packet contains unexpected fields");
-    return 2;
+  if (opts->windowsize != 0)
+    len += tftp_msg_build_opt(TFTP_OPT_WINDOWSIZE, opts->windowsize, 
+                              buffer != NULL ? buffer+len : NULL
+    );
+
+  if (opts->timeout != 0)
+    len += tftp_msg_build_opt(TFTP_OPT_TIMEOUT, opts->timeout, 
+                              buffer != NULL ? buffer+len : NULL
+    );
+
+  if (opts->tsize >= 0)
+    len += tftp_msg_build_opt(TFTP_OPT_TSIZE, opts->tsize, 
+                              buffer != NULL ? buffer+len : NULL
+    );
+
+  if (opts->multicast){
+    char value_str[TFTP_MAX_OPT_VALUE_LEN+1];
+
+    tftp_msg_format_multicast(opts, value_str);
+    len += tftp_msg_build_opt_str(TFTP_OPT_MULTICAST, value_str, 
+                                  buffer != NULL ? buffer+len : NULL
+    );
   }
-  if (strcasecmp(mode, TFTP_STR_NETASCII) == 0 || 
-      strcasecmp(mode, TFTP_STR_OCTET) == 0)
+
+  return len;
+}
+
+
+/**
+ * Parses an option value, checking it is within given range.
+ * 
+ * @param name    option name (for logging)
+ * @param str     option value string
+ * @param min     minimum accepted value
+ * @param max     maximum accepted value, greater values are lowered to max
+ * @return        parsed value or 0 if it is not valid
+ */
+int tftp_msg_parse_opt_value(char* name, char* str, int min, int max){
+  char *end;
+  long value;
+
+  value = strtol(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || value < min){
+    LOG(LOG_WARN, "Ignoring invalid value for option %s: %s", name, str);
     return 0;
-  else{
-    LOG(LOG_ERR, "Unrecognized transfer mode: %s", mode);
-    return 5;
   }
+
+  if (value > max)
+    value = max;
+  return (int) value;
+}
+
+
+/**
+ * Parses the value of the transfer size option.
+ * 
+ * @param str     option value string
+ * @return        parsed value or -1 if it is not valid
+ */
+long long tftp_msg_parse_tsize(char* str){
+  char *end;
+  long long value;
+
+  errno = 0;
+  value = strtoll(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || value < 0 || errno != 0){
+    LOG(LOG_WARN, "Ignoring invalid value for option %s: %s", 
+        TFTP_OPT_TSIZE, 
+        str
+    );
+    return -1;
+  }
+  return value;
+}
+
+
+/**
+ * Parses the value of the multicast option.
+ * 
+ * @param str     option value string ("" or "addr,port,mc")
+ * @param opts    options where the group and the master flag are stored 
+ *                [out]
+ * @return        1 if the value is valid, 0 otherwise
+ */
+int tftp_msg_parse_multicast(char* str, struct tftp_opts *opts){
+  char value[TFTP_MAX_OPT_VALUE_LEN+1];
+  char *addr_str, *port_str, *mc_str, *end;
+  long port;
+
+  memset(&opts->mc_group, 0, sizeof(opts->mc_group));
+  opts->mc_master = 0;
+
+  if (*str == '\0')  // request
+    return 1;
+
+  if (strlen(str) > TFTP_MAX_OPT_VALUE_LEN)
+    return 0;
+  strcpy(value, str);
+
+  addr_str = value;
+  port_str = strchr(addr_str, ',');
+  if (port_str == NULL)
+    return 0;
+  *port_str++ = '\0';
+  mc_str = strchr(port_str, ',');
+  if (mc_str == NULL)
+    return 0;
+  *mc_str++ = '\0';
+
+  if (strcmp(mc_str, "0") != 0 && strcmp(mc_str, "1") != 0)
+    return 0;
+  opts->mc_master = *mc_str == '1';
+
+  // address and port can be omitted only together
+  if (*addr_str == '\0' && *port_str == '\0')
+    return 1;
+
+  port = strtol(port_str, &end, 10);
+  if (*port_str == '\0' || *end != '\0' || port < 1 || port > 65535 ||
+      inet_pton(AF_INET, addr_str, &opts->mc_group.sin_addr) != 1 ||
+      !IN_MULTICAST(ntohl(opts->mc_group.sin_addr.s_addr)))
+    return 0;
+
+  opts->mc_group.sin_family = AF_INET;
+  opts->mc_group.sin_port = htons(port);
+  return 1;
 }
 
 
-int tftp_msg_get_size_rrq(char* filename, char* mode){
-  return 4 + strlen(filename) + strlen(mode);
+/**
+ * Reads options from a message.
+ * 
+ * Unknown options and options with invalid values are ignored.
+ * 
+ * @param buffer      pointer to the first option [in]
+ * @param buffer_len  remaining length of the message [in]
+ * @param opts        parsed options [out]
+ * @return            0 in case of success, 6 in case of malformed options
+ */
+int tftp_msg_unpack_opts(char* buffer, int buffer_len, struct tftp_opts *opts){
+  char *name, *value;
+  int offset = 0;
+
+  tftp_opts_init(opts);
+
+  while (offset < buffer_len){
+    name = buffer + offset;
+    offset += strnlen(name, buffer_len - offset) + 1;
+    if (offset >= buffer_len){
+      LOG(LOG_ERR, "Option %.*s has no value", TFTP_MAX_OPT_VALUE_LEN, name);
+      return 6;
+    }
+
+    value = buffer + offset;
+    offset += strnlen(value, buffer_len - offset) + 1;
+    if (offset > buffer_len){
+      LOG(LOG_ERR, "Option %s value is not terminated", name);
+      return 6;
+    }
+
+    if (strcasecmp(name, TFTP_OPT_BLKSIZE) == 0)
+      opts->blksize = tftp_msg_parse_opt_value(name, value, 
+                                               TFTP_MIN_BLKSIZE, 
+                                               TFTP_MAX_BLKSIZE
+      );
+    else if (strcasecmp(name, TFTP_OPT_WINDOWSIZE) == 0)
+      opts->windowsize = tftp_msg_parse_opt_value(name, value, 
+                                                  TFTP_MIN_WINDOWSIZE, 
+                                                  TFTP_MAX_WINDOWSIZE
+      );
+    else if (strcasecmp(name, TFTP_OPT_TIMEOUT) == 0)
+      opts->timeout = tftp_msg_parse_opt_value(name, value, 
+                                               TFTP_MIN_TIMEOUT_OPT, 
+                                               TFTP_MAX_TIMEOUT_OPT
+      );
+    else if (strcasecmp(name, TFTP_OPT_TSIZE) == 0)
+      opts->tsize = tftp_msg_parse_tsize(value);
+    else if (strcasecmp(name, TFTP_OPT_MULTICAST) == 0){
+      opts->multicast = tftp_msg_parse_multicast(value, opts);
+      if (!opts->multicast)
+        LOG(LOG_WARN, "Ignoring invalid value for option %s: %s", name, 
+            value
+        );
+    } else
+      LOG(LOG_WARN, "Ignoring unknown option %s", name);
+  }
+
+  return 0;
 }
 
 
-void tftp_msg_build_wrq(char* filename, char* mode, char* buffer){
-  *((uint16_t*)buffer) = htons(TFTP_TYPE_WRQ);
+/**
+ * Builds a request message (RRQ or WRQ).
+ * 
+ * @param type      message type
+ * @param filename  name of the file
+ * @param mode      requested transfer mode ("netascii" or "octet")
+ * @param opts      requested options (can be NULL)
+ * @param buffer    data buffer where to build the message
+ */
+void tftp_msg_build_request(int type, char* filename, char* mode, 
+                            struct tftp_opts *opts, char* buffer){
+  *((uint16_t*)buffer) = htons(type);
   buffer += 2;
   strcpy(buffer, filename);
   buffer += strlen(filename)+1;
   strcpy(buffer, mode);
+  buffer += strlen(mode)+1;
+  tftp_msg_build_opts(opts, buffer);
 }
 
 
-int tftp_msg_unpack_wrq(char* buffer, int buffer_len, char* filename, 
-                        char* mode){
+/**
+ * Unpacks a request message (RRQ or WRQ).
+ * 
+ * @param buffer      data buffer where the message to read is [in]
+ * @param buffer_len  length of the buffer [in]
+ * @param type        expected message type [in]
+ * @param filename    name of the file [out]
+ * @param mode        requested transfer mode [out]
+ * @param opts        requested options (can be NULL) [out]
+ * @return            same error codes of tftp_msg_unpack_rrq
+ */
+int tftp_msg_unpack_request(char* buffer, int buffer_len, int type, 
+                            char* filename, char* mode, 
+                            struct tftp_opts *opts){
   int offset = 0;
-  if (tftp_msg_type(buffer) != TFTP_TYPE_WRQ){
-    LOG(LOG_ERR, "Expected WRQ message (2), found %d", tftp_msg_type(buffer));
+  if (tftp_msg_type(buffer) != type){
+    LOG(LOG_ERR, "Expected %s message (%d), found %d", 
+        type == TFTP_TYPE_RRQ ? "RRQ" : "WRQ",
+        type,
+        tftp_msg_type(buffer)
+    );
     return 1;
   }
 
@@ -104,13 +361,12 @@ int tftp_msg_unpack_wrq(char* buffer, int buffer_len, char* filename,
   if (strlen(buffer+offset) > TFTP_MAX_FILENAME_LEN){
     LOG(LOG_ERR, "Filename too long (%d > %d): %s", 
         (int) strlen(buffer+offset), 
-        TFTP_MAX_FILENAME_LEN, 
-        buffer+offset
+        TFTP_MAX_FILENAME_LEN, buffer+offset
     );
     return 3;
   }
-
   strcpy(filename, buffer+offset);
+
   offset += strlen(filename)+1;
   if (strlen(buffer+offset) > TFTP_MAX_MODE_LEN){
     LOG(LOG_ERR, "Mode string too long (%d > %d): %s", 
@@ -120,15 +376,22 @@ int tftp_msg_unpack_wrq(char* buffer, int buffer_len, char* filename,
     );
     return 4;
   }
-
   strcpy(mode, buffer+offset);
+
   offset += strlen(mode)+1;
-  if (buffer_len != offset){
+  if (opts != NULL){
+    if (buffer_len < offset){
+      LOG(LOG_ERR, "Packet is not terminated");
+      return 2;
+    }
+    if (tftp_msg_unpack_opts(buffer+offset, buffer_len-offset, opts) != 0)
+      return 6;
+  } else if (buffer_len != offset){
     LOG(LOG_ERR, "Packet contains unexpected fields");
     return 2;
   }
-
-  if (strcmp(mode, TFTP_STR_NETASCII) == 0 || strcmp(mode, TFTP_STR_OCTET) == 0)
+  if (strcasecmp(mode, TFTP_STR_NETASCII) == 0 || 
+      strcasecmp(mode, TFTP_STR_OCTET) == 0)
     return 0;
   else{
     LOG(LOG_ERR, "Unrecognized transfer mode: %s", mode);
@@ -137,19 +400,57 @@ int tftp_msg_unpack_wrq(char* buffer, int buffer_len, char* filename,
 }
 
 
-int tftp_msg_get_size_wrq(char* filename, char* mode){
-  return 4 + strlen(filename) + strlen(mode);
+void tftp_msg_build_rrq(char* filename, char* mode, struct tftp_opts *opts, 
+                        char* buffer){
+  tftp_msg_build_request(TFTP_TYPE_RRQ, filename, mode, opts, buffer);
+}
+
+
+int tftp_msg_unpack_rrq(char* buffer, int buffer_len, char* filename, 
+                        char* mode, struct tftp_opts *opts){
+  return tftp_msg_unpack_request(buffer, buffer_len, TFTP_TYPE_RRQ, filename,
+                                 mode, opts
+  );
+}
+
+
+int tftp_msg_get_size_rrq(char* filename, char* mode, struct tftp_opts *opts){
+  return 4 + strlen(filename) + strlen(mode) + tftp_msg_build_opts(opts, NULL);
+}
+
+
+void tftp_msg_build_wrq(char* filename, char* mode, struct tftp_opts *opts, 
+                        char* buffer){
+  tftp_msg_build_request(TFTP_TYPE_WRQ, filename, mode, opts, buffer);
+}
+
+
+int tftp_msg_unpack_wrq(char* buffer, int buffer_len, char* filename, 
+                        char* mode, struct tftp_opts *opts){
+  return tftp_msg_unpack_request(buffer, buffer_len, TFTP_TYPE_WRQ, filename,
+                                 mode, opts
+  );
+}
+
+
+int tftp_msg_get_size_wrq(char* filename, char* mode, struct tftp_opts *opts){
+  return 4 + strlen(filename) + strlen(mode) + tftp_msg_build_opts(opts, NULL);
 }
 
 
 void tftp_msg_build_data(int block_n, char* data, int data_size, char* buffer){
-  *((uint16_t*)buffer) = htons(TFTP_TYPE_DATA);
-  *((uint16_t*)(buffer+2)) = htons((uint16_t) block_n);
+  tftp_msg_build_data_header(block_n, buffer);
   buffer += 4;
   memcpy(buffer, data, data_size);
 }
 
 
+void tftp_msg_build_data_header(int block_n, char* buffer){
+  *((uint16_t*)buffer) = htons(TFTP_TYPE_DATA);
+  *((uint16_t*)(buffer+2)) = htons((uint16_t) block_n);
+}
+
+
 int tftp_msg_unpack_data(char* buffer, int buffer_len, int* block_n, char* data, 
                          int* data_size){
   if (tftp_msg_type(buffer) != TFTP_TYPE_DATA){
@@ -219,7 +520,7 @@ int tftp_msg_unpack_error(char* buffer, int buffer_len, int* error_code,
     }
 
     *error_code = (int) ntohs(*((uint16_t*)(buffer+2)));
-    if (*error_code < 0 || *error_code > 7){
+    if (*error_code < 0 || *error_code > 8){
       LOG(LOG_ERR, "Unrecognized error code: %d", *error_code);
       return 4;
     }
@@ -246,3 +547,24 @@ int tftp_msg_unpack_error(char* buffer, int buffer_len, int* error_code,
 int tftp_msg_get_size_error(char* error_msg){
   return 5 + strlen(error_msg);
 }
+
+
+void tftp_msg_build_oack(struct tftp_opts *opts, char* buffer){
+  *((uint16_t*)buffer) = htons(TFTP_TYPE_OACK);
+  tftp_msg_build_opts(opts, buffer+2);
+}
+
+
+int tftp_msg_unpack_oack(char* buffer, int buffer_len, struct tftp_opts *opts){
+  if (tftp_msg_type(buffer) != TFTP_TYPE_OACK){
+    LOG(LOG_ERR, "Expected OACK message (6), found %d", tftp_msg_type(buffer));
+    return 1;
+  }
+
+  return tftp_msg_unpack_opts(buffer+2, buffer_len-2, opts);
+}
+
+
+int tftp_msg_get_size_oack(struct tftp_opts *opts){
+  return 2 + tftp_msg_build_opts(opts, NULL);
+}
@@ -2,9 +2,35 @@
  * @file
  * @author Riccardo Mancini
  * 
- * @brief Implementation of the TFTP server that can only handle read requests.
+ * @brief Implementation of the TFTP server.
  * 
- * The server is multiprocessed, with each process handling one request.
+ * The server handles read requests and, with the -u flag, write requests. 
+ * Uploaded files never overwrite existing ones and are buffered in memory, so
+ * that they are written to disk in large chunks. The -s flag sets whether 
+ * (and how often) they are synced to disk.
+ * 
+ * By default the server is multiprocessed, with each process handling one 
+ * request. Requests are parsed and checked (mode, path and file existence) 
+ * by the listener, so that invalid ones are answered without spawning a 
+ * process. Names of missing files are cached (unless the -n flag is given),
+ * so that clients probing them again (eg. PXE) are answered right away. With
+ * the -i flag, the whole served tree is indexed in memory at startup. With 
+ * the -e flag, all requests are served by a single process through an event
+ * loop instead. With the -t flag, many event loops are run in different 
+ * threads, each one with its own listening socket bound to the same port 
+ * (SO_REUSEPORT), letting the kernel spread requests among them.
+ * 
+ * Event loops can share an in-memory cache of the served files (-c flag), so
+ * that popular files are read from disk only once. With the -m flag, they 
+ * also serve clients requesting the same file at the same time with a single
+ * multicast transfer (RFC 2090).
+ * 
+ * With the -M flag, counters of requests and transfers, shared by all 
+ * processes, are exported on a Unix socket in the Prometheus text format.
+ * With the -L flag, percentiles of the time to the first reply and of round
+ * trip times are logged periodically.
+ * 
+ * @see server_loop.h
  */
 
 
@@ -17,6 +43,12 @@
 #include "include/inet_utils.h"
 #include "include/debug_utils.h"
 #include "include/netascii.h"
+#include "include/server_utils.h"
+#include "include/server_loop.h"
+#include "include/file_cache.h"
+#include "include/neg_cache.h"
+#include "include/dir_index.h"
+#include "include/metrics.h"
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -29,7 +61,9 @@
 #include <unistd.h>
 #include <time.h>
 #include <linux/limits.h>
-#include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
 
 
 /** Defining LOG_LEVEL for tftp_server executable */
@@ -37,64 +71,169 @@ const int LOG_LEVEL = LOG_INFO;
 
 
 /** Maximum length for a RRQ message */
-#define MAX_MSG_LEN TFTP_MAX_MODE_LEN+TFTP_MAX_FILENAME_LEN+4
+#define MAX_MSG_LEN TFTP_MAX_REQUEST_LEN
+
+/** Maximum number of worker threads */
+#define MAX_WORKERS 256
 
+/** Maximum size of the file cache (in MB) */
+#define MAX_CACHE_MB (1 << 20)
 
-/** Finds longest common prefix length of strings str1 and str2 */
-int strlcpl(const char* str1, const char* str2){
-  int n;
-  for (n = 0; str1[n] != '\0' && str2[n] != '\0' && str1[n] == str2[n]; n++);
-  return n;
+/** Sync policy names (-s flag) */
+#define SYNC_STR_NONE "none"
+#define SYNC_STR_END "end"
+#define SYNC_STR_ALL "all"
+
+
+/**
+ * Prints command usage information.
+ */
+void print_help(){
+  printf("Usage: ./tftp_server [-e] [-t THREADS] [-c CACHE_MB] [-u] "
+         "[-s SYNC] [-m GROUP] [-n] [-i] [-M SOCKET] [-L SECONDS] "
+         "LISTEN_PORT FILES_DIR\n");
+  printf("Example: ./tftp_server 69 .\n");
+  printf("Options:\n");
+  printf("  -e          serve all requests from a single event-driven process\n");
+  printf("  -t THREADS  run THREADS event loops sharing the port (implies -e)\n");
+  printf("  -c CACHE_MB keep up to CACHE_MB of served files in memory "
+         "(implies -e)\n");
+  printf("  -u          accept write requests (uploads)\n");
+  printf("  -s SYNC     when uploaded files are synced to disk: none "
+         "(default),\n"
+         "              end (once they are complete) or all (every write)\n");
+  printf("  -m GROUP    send files to multicast clients through the GROUP "
+         "address\n"
+         "              (eg. 239.255.0.1, implies -e)\n");
+  printf("  -n          do not cache names of missing files\n");
+  printf("  -i          index FILES_DIR in memory at startup (kept current "
+         "with inotify)\n");
+  printf("  -M SOCKET   export counters on the Unix socket SOCKET (Prometheus "
+         "text format)\n");
+  printf("  -L SECONDS  log latency percentiles every SECONDS\n");
+}
+
+/** Set to 1 by SIGINT or SIGTERM to stop the listener (fork model) */
+volatile sig_atomic_t stop_listener = 0;
+
+/** Handles SIGINT and SIGTERM in the listener (fork model) */
+void on_stop_signal(int sig){
+  stop_listener = 1;
 }
 
-/** 
- * Check whether file is inside dir.
+/**
+ * Checks a request in the listener, before spawning a process for it (fork 
+ * model).
  * 
- * @param path  file absolute path (can include .. and .  and multiple /)
- * @param dir   directory real path (can't include .. and . and multiple /)
- * @return      1 if true, 0 otherwise
+ * Malformed requests, unknown modes, paths outside of the served directory 
+ * and missing files are answered with an ERROR right away, so that a flood
+ * of invalid requests does not cost a process each.
  * 
- * @see realpath
+ * @param dir_realpath   real path of the served directory
+ * @param dir_fd         descriptor of the served directory (or -1)
+ * @param type           type of the request (RRQ or WRQ)
+ * @param in_buffer      the received request
+ * @param len            length of the request
+ * @param sd             listening socket, used for sending ERRORs
+ * @param cl_addr        address of the client
+ * @param neg_cache      cache of missing files (can be NULL)
+ * @param dir_index      index of the served directory (can be NULL)
+ * @param file_realpath  real path of the requested file [out]
+ * @param fd             descriptor of the requested file (-1 for uploads)
+ *                       [out]
+ * @param size           size of the requested file (-1 if not known) [out]
+ * @param mode           requested mode [out]
+ * @param opts           accepted options [out]
+ * @return               0 if the request is valid, 1 if it was rejected
  */
-int path_inside_dir(char* path, char* dir){
-  char *parent, *orig_parent, *ret_realpath;
-  char parent_realpath[PATH_MAX];
-  int result;
+int check_request(char *dir_realpath, int dir_fd, int type, char *in_buffer,
+                  int len, int sd, struct sockaddr_in *cl_addr, 
+                  struct neg_cache *neg_cache, struct dir_index *dir_index,
+                  char *file_realpath, int *fd, off_t *size, char *mode, 
+                  struct tftp_opts *opts){
+  char filename[TFTP_MAX_FILENAME_LEN+1];
+  unsigned long generation;
+  int ret;
+
+  *fd = -1;
+  *size = -1;
+
+  if (type == TFTP_TYPE_WRQ)
+    ret = tftp_msg_unpack_wrq(in_buffer, len, filename, mode, opts);
+  else
+    ret = tftp_msg_unpack_rrq(in_buffer, len, filename, mode, opts);
+  if (ret != 0){
+    LOG(LOG_WARN, "Error unpacking %s", 
+        type == TFTP_TYPE_WRQ ? "WRQ" : "RRQ"
+    );
+    tftp_send_error(0, type == TFTP_TYPE_WRQ ? "Malformed WRQ packet." 
+                                             : "Malformed RRQ packet.", 
+                    sd, cl_addr
+    );
+    return 1;
+  }
 
-  orig_parent = parent = malloc(strlen(path) + 1);
-  strcpy(parent, path);
+  if (strcasecmp(mode, TFTP_STR_OCTET) != 0 && 
+      strcasecmp(mode, TFTP_STR_NETASCII) != 0){
+    LOG(LOG_WARN, "Unknown mode: %s", mode);
+    tftp_send_error(0, "Unknown transfer mode.", sd, cl_addr);
+    return 1;
+  }
 
-  do{
-    parent = dirname(parent);
-    ret_realpath = realpath(parent, parent_realpath);
-  } while (ret_realpath == NULL);
+  negotiate_options(opts);
 
-  if (strlcpl(parent_realpath, dir) < strlen(dir))
-    result = 0;
-  else
-    result = 1;
-  
-  free(orig_parent);
-  return result;
-}
+  if (type == TFTP_TYPE_WRQ){
+    ret = resolve_upload_path(dir_realpath, filename, file_realpath);
+    if (ret == 2){
+      tftp_send_error(2, "Access violation.", sd, cl_addr);
+      return 1;
+    }
+  } else{
+    // recently missing files are not looked up again
+    if (neg_cache != NULL && 
+        neg_cache_lookup(neg_cache, filename, &generation)){
+      LOG(LOG_INFO, "File %s is known to be missing", filename);
+      tftp_send_error(1, "File Not Found.", sd, cl_addr);
+      return 1;
+    }
 
-/**
- * Prints command usage information.
- */
-void print_help(){
-  printf("Usage: ./tftp_server LISTEN_PORT FILES_DIR\n");
-  printf("Example: ./tftp_server 69 .\n");
+    ret = resolve_indexed_path(dir_index, dir_fd, dir_realpath, filename, 
+                               file_realpath, fd, size
+    );
+    if (ret == 2){
+      tftp_send_error(4, "Access violation.", sd, cl_addr);
+      return 1;
+    } else if (ret != 0 && neg_cache != NULL)
+      neg_cache_insert(neg_cache, filename, generation);
+  }
+  if (ret != 0){
+    tftp_send_error(1, "File Not Found.", sd, cl_addr);
+    return 1;
+  }
+
+  LOG(LOG_INFO, "User wants to %s file %s in mode %s", 
+      type == TFTP_TYPE_WRQ ? "write" : "read",
+      filename, 
+      mode
+  );
+  return 0;
 }
 
 /**
  * Sends file to a client.
+ * 
+ * fd is the descriptor of the file opened by the listener (or -1) and size
+ * its size, if known (-1 otherwise). metrics are the shared counters of the
+ * transfer (or NULL).
  */
-int send_file(char* filename, char* mode, struct sockaddr_in *cl_addr){
+int send_file(char* filename, int fd, off_t size, char* mode, 
+              struct tftp_opts *opts, struct sockaddr_in *cl_addr, 
+              struct metrics_session *metrics){
   struct sockaddr_in my_addr;
   int sd;
   int ret, tid, result;
   struct fblock m_fblock;
-  char *tmp_filename;
+  struct file_cache_entry *entry;
 
   sd = socket(AF_INET, SOCK_DGRAM, 0);
   my_addr = make_my_sockaddr_in(0);
@@ -102,60 +241,223 @@ int send_file(char* filename, char* mode, struct sockaddr_in *cl_addr){
   if (tid == 0){
     LOG(LOG_ERR, "Could not bind to random port");
     perror("Could not bind to random port:");
-    fblock_close(&m_fblock);
+    if (fd != -1)
+      close(fd);
     return 4;
   } else
     LOG(LOG_INFO, "Bound to port %d", tid);
 
-  if (strcasecmp(mode, TFTP_STR_OCTET) == 0){
-    m_fblock = fblock_open(filename, 
-                           TFTP_DATA_BLOCK, 
-                           FBLOCK_READ|FBLOCK_MODE_BINARY
-    );
-  } else if (strcasecmp(mode, TFTP_STR_NETASCII) == 0){
-    tmp_filename = malloc(strlen(filename)+5);
-    strcpy(tmp_filename, filename);
-    strcat(tmp_filename, ".tmp");
-    ret = unix2netascii(filename, tmp_filename);   
-    if (ret != 0){
-      LOG(LOG_ERR, "Error converting text file to netascii: %d", ret);
-      return 3;
-    }
-    m_fblock = fblock_open(tmp_filename, 
-                           TFTP_DATA_BLOCK, 
-                           FBLOCK_READ|FBLOCK_MODE_TEXT
-    );
+  ret = open_request_file(filename, fd, size, mode, opts, NULL, &entry, 
+                          &m_fblock
+  );
+  if (ret == 1){
+    LOG(LOG_WARN, "Error opening file. Not found?");
+    tftp_send_error(1, "File not found.", sd, cl_addr);
+    return 1;
+  } else if (ret != 0)
+    return ret;
+
+  LOG(LOG_INFO, "Sending file...");
+  ret = tftp_send_file(&m_fblock, opts, sd, cl_addr, metrics);
+  
+  if (ret != 0){
+    LOG(LOG_ERR, "Error sending file: %d", ret);
+    result = 16+ret;
   } else{
-    LOG(LOG_ERR, "Unknown mode: %s", mode);
-    return 2;
+    LOG(LOG_INFO, "File sent successfully");
+    result = 0;
   }
+
+  close_request_file(NULL, entry, &m_fblock);
+
+  return result;
+}
+
+/**
+ * Receives file from a client.
+ */
+int receive_file(char* filename, char* mode, struct tftp_opts *opts, 
+                 char sync, struct sockaddr_in *cl_addr){
+  struct sockaddr_in my_addr;
+  int sd;
+  int ret, tid, result;
+  struct fblock m_fblock;
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  my_addr = make_my_sockaddr_in(0);
+  tid = bind_random_port(sd, &my_addr);
+  if (tid == 0){
+    LOG(LOG_ERR, "Could not bind to random port");
+    perror("Could not bind to random port:");
+    return 4;
+  } else
+    LOG(LOG_INFO, "Bound to port %d", tid);
+
+  ret = open_upload_file(filename, mode, opts, sync, &m_fblock);
+  if (ret == 3){
+    tftp_send_error(6, "File already exists.", sd, cl_addr);
+    return 3;
+  } else if (ret == 1){
+    tftp_send_error(2, "Access violation.", sd, cl_addr);
+    return 1;
+  } else if (ret != 0)
+    return ret;
+
+  LOG(LOG_INFO, "Receiving file...");
+  ret = tftp_accept_file(&m_fblock, opts, sd, cl_addr);
   
-  if (m_fblock.file == NULL){
-    LOG(LOG_WARN, "Error opening file. Not found?");
-    tftp_send_error(1, "File not found.", sd, cl_addr);
-    result = 1;
+  if (ret != 0){
+    LOG(LOG_ERR, "Error receiving file: %d", ret);
+    result = 16+ret;
   } else{
-    LOG(LOG_INFO, "Sending file...");
-    ret = tftp_send_file(&m_fblock, sd, cl_addr);
-    
-    if (ret != 0){
-      LOG(LOG_ERR, "Error sending file: %d", ret);
-      result = 16+ret;
-    } else{
-      LOG(LOG_INFO, "File sent successfully");
-      result = 0;
+    LOG(LOG_INFO, "File received successfully");
+    result = 0;
+  }
+
+  if (close_upload_file(filename, &m_fblock, result == 0) != 0 && result == 0)
+    result = 6;
+
+  return result;
+}
+
+/** Body of a worker thread: runs its own event loop */
+void* worker_main(void *arg){
+  struct server_loop *loop = (struct server_loop*) arg;
+
+  if (server_loop_run(loop) != 0)
+    LOG(LOG_ERR, "Worker %d terminated with an error", loop->id);
+  return NULL;
+}
+
+/**
+ * Runs the event-driven server with n_workers threads.
+ * 
+ * Each thread gets its own listening socket bound to my_port with 
+ * SO_REUSEPORT. If cache_size is not 0, all threads share a file cache of 
+ * cache_size bytes. If neg_cache_size is not 0, they also share a cache of 
+ * up to neg_cache_size names of missing files. Files are looked up relative
+ * to dir_fd (if not -1) and in dir_index (if not NULL), which is shared by
+ * all threads too. The calling thread waits for SIGINT or SIGTERM, then 
+ * stops all workers and logs their counters.
+ */
+int run_workers(int n_workers, int my_port, char *dir_realpath, int dir_fd,
+                off_t cache_size, int uploads, char sync, 
+                struct in_addr mc_addr, int neg_cache_size, 
+                struct dir_index *dir_index){
+  struct server_loop *loops;
+  struct file_cache cache, *cache_ptr;
+  struct neg_cache neg_cache, *neg_cache_ptr;
+  struct server_loop_stats total;
+  struct sockaddr_in my_addr;
+  pthread_t *threads;
+  sigset_t sigset;
+  int i, sd, sig, n_started;
+
+  // signals are blocked in workers and handled by sigwait in this thread
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGINT);
+  sigaddset(&sigset, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+  //init random seed
+  srand(time(NULL));
+
+  cache_ptr = NULL;
+  if (cache_size != 0){
+    if (file_cache_init(&cache, cache_size) != 0)
+      return 1;
+    cache_ptr = &cache;
+  }
+
+  neg_cache_ptr = NULL;
+  if (neg_cache_size != 0){
+    neg_cache_init(&neg_cache, dir_realpath, neg_cache_size);
+    neg_cache_ptr = &neg_cache;
+  }
+
+  loops = calloc(n_workers, sizeof(struct server_loop));
+  threads = calloc(n_workers, sizeof(pthread_t));
+
+  for (n_started = 0; n_started < n_workers; n_started++){
+    sd = socket(AF_INET, SOCK_DGRAM, 0);
+    my_addr = make_my_sockaddr_in(my_port);
+    if (bind_reuseport(sd, &my_addr) != 0){
+      perror("Could not bind: ");
+      LOG(LOG_FATAL, "Could not bind to port %d", my_port);
+      break;
+    }
+
+    if (server_loop_init(&loops[n_started], n_started, sd, dir_realpath, 
+                         cache_ptr) != 0){
+      LOG(LOG_FATAL, "Could not initialize event loop");
+      close(sd);
+      break;
+    }
+    loops[n_started].uploads = uploads;
+    loops[n_started].sync = sync;
+    loops[n_started].mc_addr = mc_addr;
+    loops[n_started].neg_cache = neg_cache_ptr;
+    loops[n_started].dir_fd = dir_fd;
+    loops[n_started].dir_index = dir_index;
+
+    if (pthread_create(&threads[n_started], NULL, worker_main, 
+                       &loops[n_started]) != 0){
+      LOG(LOG_FATAL, "Could not create worker thread");
+      close(sd);
+      break;
     }
   }
 
-  fblock_close(&m_fblock);
+  if (n_started == n_workers){
+    LOG(LOG_INFO, "Server is running with %d workers", n_workers);
+    sigwait(&sigset, &sig);
+    LOG(LOG_INFO, "Received signal %d, stopping workers", sig);
+  }
 
-  if (strcasecmp(mode, TFTP_STR_NETASCII) == 0){
-    LOG(LOG_DEBUG, "Removing temp file %s", tmp_filename);
-    remove(tmp_filename);
-    free(tmp_filename);
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < n_started; i++){
+    loops[i].stop = 1;
+    pthread_join(threads[i], NULL);
+    close(loops[i].sd);
+    server_loop_log_stats(&loops[i]);
+    total.requests += loops[i].stats.requests;
+    total.rejected += loops[i].stats.rejected;
+    total.started += loops[i].stats.started;
+    total.completed += loops[i].stats.completed;
+    total.failed += loops[i].stats.failed;
+    total.timeouts += loops[i].stats.timeouts;
+    total.mc_clients += loops[i].stats.mc_clients;
+    total.mc_saved += loops[i].stats.mc_saved;
   }
 
-  return result;
+  LOG(LOG_INFO, 
+      "Total: %lu requests, %lu rejected, %lu started, %lu completed, "
+      "%lu failed, %lu timeouts, %lu multicast clients, "
+      "%lld bytes saved by multicast", 
+      total.requests, 
+      total.rejected, 
+      total.started, 
+      total.completed, 
+      total.failed,
+      total.timeouts,
+      total.mc_clients,
+      total.mc_saved
+  );
+
+  if (cache_ptr != NULL){
+    file_cache_log_stats(cache_ptr);
+    file_cache_free(cache_ptr);
+  }
+  if (neg_cache_ptr != NULL){
+    neg_cache_log_stats(neg_cache_ptr);
+    neg_cache_free(neg_cache_ptr);
+  }
+  if (dir_index != NULL)
+    dir_index_log_stats(dir_index);
+
+  free(loops);
+  free(threads);
+  return n_started == n_workers ? 0 : 1;
 }
 
 /** Main */
@@ -164,21 +466,124 @@ int main(int argc, char** argv){
   char *dir_rel_path;
   char *ret_realpath;
   char dir_realpath[PATH_MAX];
-  int ret, type, len;
+  int ret, type, len, dir_fd, fd;
   char in_buffer[MAX_MSG_LEN];
   unsigned int addrlen;
   int sd;
   struct sockaddr_in my_addr, cl_addr;
   int pid;
   char addr_str[MAX_SOCKADDR_STR_LEN];
+  int opt, n_workers, cache_mb, uploads;
+  char sync;
+  struct in_addr mc_addr;
+  char mode[TFTP_MAX_MODE_LEN+1], file_realpath[PATH_MAX];
+  struct tftp_opts opts;
+  struct sigaction sa;
+  unsigned long requests, rejected, spawned;
+  struct neg_cache neg_cache, *neg_cache_ptr;
+  int neg_cache_size;
+  struct dir_index dir_index, *dir_index_ptr;
+  int index_dir;
+  off_t size;
+  char *metrics_path;
+  int latency_interval;
+  struct metrics_session *metrics;
+
+  n_workers = 0;  // fork model
+  cache_mb = 0;   // no cache
+  uploads = 0;    // read only
+  sync = 0;       // left to the kernel
+  mc_addr.s_addr = INADDR_ANY;  // no multicast
+  neg_cache_size = NEG_CACHE_SIZE;
+  index_dir = 0;
+  metrics_path = NULL;
+  latency_interval = 0;
+
+  while ((opt = getopt(argc, argv, "et:c:us:m:niM:L:")) != -1){
+    switch (opt){
+      case 'e':
+        if (n_workers == 0)
+          n_workers = 1;
+        break;
+      case 't':
+        n_workers = atoi(optarg);
+        if (n_workers < 1 || n_workers > MAX_WORKERS){
+          printf("THREADS must be within 1 and %d\n", MAX_WORKERS);
+          return 1;
+        }
+        break;
+      case 'c':
+        cache_mb = atoi(optarg);
+        if (cache_mb < 1 || cache_mb > MAX_CACHE_MB){
+          printf("CACHE_MB must be within 1 and %d\n", MAX_CACHE_MB);
+          return 1;
+        }
+        if (n_workers == 0)
+          n_workers = 1;
+        break;
+      case 'u':
+        uploads = 1;
+        break;
+      case 's':
+        if (strcasecmp(optarg, SYNC_STR_NONE) == 0)
+          sync = 0;
+        else if (strcasecmp(optarg, SYNC_STR_END) == 0)
+          sync = FBLOCK_SYNC;
+        else if (strcasecmp(optarg, SYNC_STR_ALL) == 0)
+          sync = FBLOCK_SYNC_ALL;
+        else{
+          printf("SYNC must be one of %s, %s, %s\n", 
+                 SYNC_STR_NONE, SYNC_STR_END, SYNC_STR_ALL
+          );
+          return 1;
+        }
+        break;
+      case 'm':
+        if (inet_aton(optarg, &mc_addr) == 0 || 
+            !IN_MULTICAST(ntohl(mc_addr.s_addr))){
+          printf("GROUP must be a multicast address (224.0.0.0/4)\n");
+          return 1;
+        }
+        if (n_workers == 0)
+          n_workers = 1;
+        break;
+      case 'n':
+        neg_cache_size = 0;
+        break;
+      case 'i':
+        index_dir = 1;
+        break;
+      case 'M':
+        metrics_path = optarg;
+        break;
+      case 'L':
+        latency_interval = atoi(optarg);
+        if (latency_interval < 1){
+          printf("SECONDS must be at least 1\n");
+          return 1;
+        }
+        break;
+      default:
+        print_help();
+        return 1;
+    }
+  }
 
-  if (argc != 3){
+  if (argc - optind != 2){
     print_help();
     return 1;
   }
 
-  my_port = atoi(argv[1]);
-  dir_rel_path = argv[2];
+  my_port = atoi(argv[optind]);
+  dir_rel_path = argv[optind+1];
+
+  // messages of each request are written in batches by another thread
+  log_start_async();
+
+  // counters are shared with forked processes
+  if ((metrics_path != NULL || latency_interval > 0) && 
+      metrics_init(metrics_path, latency_interval) != 0)
+    return 1;
 
   ret_realpath = realpath(dir_rel_path, dir_realpath);
   if (ret_realpath == NULL){
@@ -186,7 +591,29 @@ int main(int argc, char** argv){
     return 1;
   }
 
-  addrlen = sizeof(cl_addr);
+  // opened once, requested files are looked up relative to it
+  dir_fd = open_served_dir(dir_realpath);
+
+  // large trees are read by one thread per core
+  dir_index_ptr = NULL;
+  if (index_dir){
+    if (dir_index_init(&dir_index, dir_realpath, 
+                       sysconf(_SC_NPROCESSORS_ONLN)) == 0)
+      dir_index_ptr = &dir_index;
+    else
+      dir_index_free(&dir_index);
+  }
+
+  if (n_workers > 0){
+    ret = run_workers(n_workers, my_port, dir_realpath, dir_fd, 
+                      (off_t) cache_mb << 20, uploads, sync, mc_addr, 
+                      neg_cache_size, dir_index_ptr
+    );
+    if (dir_index_ptr != NULL)
+      dir_index_free(dir_index_ptr);
+    metrics_free();
+    return ret;
+  }
 
   sd = socket(AF_INET, SOCK_DGRAM, 0);
   my_addr = make_my_sockaddr_in(my_port);
@@ -197,77 +624,122 @@ int main(int argc, char** argv){
     return 1;
   }
 
+  // children are reaped by the kernel
+  signal(SIGCHLD, SIG_IGN);
+
+  // recvfrom is interrupted (no SA_RESTART), so that counters get logged
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  neg_cache_ptr = NULL;
+  if (neg_cache_size != 0){
+    neg_cache_init(&neg_cache, dir_realpath, neg_cache_size);
+    neg_cache_ptr = &neg_cache;
+  }
+
   LOG(LOG_INFO, "Server is running");
 
-  while (1){
+  pid = 1;  // listener
+  requests = rejected = spawned = 0;
+  while (!stop_listener){
+    addrlen = sizeof(cl_addr);
     len = recvfrom(sd, in_buffer, MAX_MSG_LEN, 0, 
                    (struct sockaddr*)&cl_addr, 
                    &addrlen
     );
+    if (len < 0 && errno == EINTR)
+      continue;
+    else if (len < 0){
+      LOG(LOG_FATAL, "Error receiving request");
+      perror("Error receiving request:");
+      return 1;
+    } else if (len < 2)  // not even an opcode
+      continue;
+
+    requests++;
     type = tftp_msg_type(in_buffer);
+    metrics_count_request(type);
     sockaddr_in_to_string(cl_addr, addr_str);
     LOG(LOG_INFO, "Received message with type %d from %s", type, addr_str);
-    if (type == TFTP_TYPE_RRQ){
-      pid = fork();
-      if (pid == -1){ // error
-        LOG(LOG_FATAL, "Fork error");
-        perror("Fork error:");
-        return 1;
-      } else if (pid != 0 ){  // father
-        LOG(LOG_INFO, "Received RRQ, spawned new process %d", (int) pid);
-        continue; // father process continues loop
-      } else{         // child
-        char filename[TFTP_MAX_FILENAME_LEN], mode[TFTP_MAX_MODE_LEN];
-        char file_path[PATH_MAX], file_realpath[PATH_MAX];
-
-        //init random seed
-        srand(time(NULL));
-
-        ret = tftp_msg_unpack_rrq(in_buffer, len, filename, mode);
-
-        if (ret != 0){
-          LOG(LOG_WARN, "Error unpacking RRQ");
-          tftp_send_error(0, "Malformed RRQ packet.", sd, &cl_addr);
-          break; // child process exits loop  
-        }
-
-        strcpy(file_path, dir_realpath);
-        strcat(file_path, "/");
-        strcat(file_path, filename);
-        
-        // check if file is inside directory (or inside any of its subdirs)
-        if (!path_inside_dir(file_path, dir_realpath)){
-          // it is not! I caught you, Trudy!
-          LOG(LOG_WARN, "User tried to access file %s outside set directory %s", 
-              file_realpath, 
-              dir_realpath
-          );
+    if (type != TFTP_TYPE_RRQ && (type != TFTP_TYPE_WRQ || !uploads)){
+      LOG(LOG_WARN, "Wrong op code: %d", type);
+      tftp_send_error(4, "Illegal TFTP operation.", sd, &cl_addr);
+      rejected++;
+      metrics_count_rejected();
+      continue; // main process continues loop
+    }
 
-          tftp_send_error(4, "Access violation.", sd, &cl_addr);
-          break; // child process exits loop              
-        }
+    // invalid requests are answered without spawning a process
+    if (check_request(dir_realpath, dir_fd, type, in_buffer, len, sd, 
+                      &cl_addr, neg_cache_ptr, dir_index_ptr, file_realpath, 
+                      &fd, &size, mode, &opts) != 0){
+      rejected++;
+      metrics_count_rejected();
+      continue;
+    }
 
-        ret_realpath = realpath(file_path, file_realpath);
+    pid = fork();
+    if (pid == -1){ // error
+      LOG(LOG_FATAL, "Fork error");
+      perror("Fork error:");
+      return 1;
+    } else if (pid != 0 ){  // father
+      spawned++;
+      if (fd != -1)  // the child has its own copy
+        close(fd);
+      LOG(LOG_INFO, "Received %s, spawned new process %d", 
+          type == TFTP_TYPE_RRQ ? "RRQ" : "WRQ",
+          (int) pid
+      );
+      continue; // father process continues loop
+    }
 
-        // file not found
-        if (ret_realpath == NULL){
-          LOG(LOG_WARN, "File not found: %s", file_path);
-          tftp_send_error(1, "File Not Found.", sd, &cl_addr);
-          break; // child process exits loop
-        }
+    // child (it does not need the cache nor its inotify instance)
+    if (neg_cache_ptr != NULL)
+      neg_cache_free(neg_cache_ptr);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
 
-        LOG(LOG_INFO, "User wants to read file %s in mode %s", filename, mode);
+    //init random seed
+    srand(time(NULL));
 
-        ret = send_file(file_realpath, mode, &cl_addr);
-        if (ret != 0)
-          LOG(LOG_WARN, "Write terminated with an error: %d", ret);
-        break;  // child process exits loop
-      }
+    metrics = metrics_session_start(type == TFTP_TYPE_WRQ, file_realpath, 
+                                    &cl_addr
+    );
+    if (type == TFTP_TYPE_WRQ){
+      ret = receive_file(file_realpath, mode, &opts, sync, &cl_addr);
+      if (ret != 0)
+        LOG(LOG_WARN, "Upload terminated with an error: %d", ret);
     } else{
-      LOG(LOG_WARN, "Wrong op code: %d", type);
-      tftp_send_error(4, "Illegal TFTP operation.", sd, &cl_addr);
-      // main process continues loop
-    } 
+      ret = send_file(file_realpath, fd, size, mode, &opts, &cl_addr, 
+                      metrics
+      );
+      if (ret != 0)
+        LOG(LOG_WARN, "Write terminated with an error: %d", ret);
+    }
+    metrics_session_end(metrics, ret != 0);
+    break;  // child process exits loop
+  }
+
+  if (pid != 0){
+    LOG(LOG_INFO, "Listener: %lu requests, %lu rejected, %lu processes "
+        "spawned", 
+        requests, 
+        rejected, 
+        spawned
+    );
+    if (neg_cache_ptr != NULL){
+      neg_cache_log_stats(neg_cache_ptr);
+      neg_cache_free(neg_cache_ptr);
+    }
+    if (dir_index_ptr != NULL){
+      dir_index_log_stats(dir_index_ptr);
+      dir_index_free(dir_index_ptr);
+    }
+    metrics_free();
   }
 
   LOG(LOG_INFO, "Exiting process %d", (int) getpid());
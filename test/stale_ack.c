@@ -0,0 +1,231 @@
+/**
+ * @file
+ * @author Riccardo Mancini
+ *
+ * @brief Test of a delayed ACK from an earlier window reaching the server.
+ *
+ * Downloads a file with a window of WINDOWSIZE blocks, acknowledging each
+ * whole window. Right after the ACK of the second window, the ACK of the
+ * first one is sent again, as if the network had delayed (or duplicated) it.
+ * The server must ignore it and go on with the transfer, instead of aborting
+ * it because the block is not in the current window.
+ *
+ * The first block of the fourth window is then dropped, as if it was lost,
+ * and the last block in order is acked again when the next one arrives: the
+ * server must send the window again right away, since it was asked for a 
+ * timeout longer than this test waits for each message.
+ *
+ * If the file is long enough for block numbers to roll over (with a small
+ * BLKSIZE), the same is done again after the roll over. Then an ACK far
+ * outside of the window is sent: the server must abort the transfer, rather
+ * than ignoring it as a stale one.
+ *
+ * The downloaded file is written to OUTPUT, so that it can be compared with
+ * the original one (when the transfer is not aborted).
+ *
+ * Usage: stale_ack SERVER_IP SERVER_PORT FILENAME OUTPUT [BLKSIZE]
+ */
+
+
+#include "../src/include/tftp.h"
+#include "../src/include/tftp_msgs.h"
+#include "../src/include/inet_utils.h"
+#include "../src/include/logging.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Only errors are logged */
+const int LOG_LEVEL = LOG_ERR;
+
+/** Window size requested to the server */
+#define WINDOWSIZE 4
+
+/** How long to wait for each message (ms) */
+#define REPLY_TIMEOUT 2000
+
+/** Timeout requested to the server (s), longer than REPLY_TIMEOUT */
+#define SERVER_TIMEOUT 5
+
+/** Number of blocks before block numbers roll over */
+#define ROLLOVER 65536
+
+/** How far behind the acknowledged block the ACK outside of the window is */
+#define FAR_BEHIND 1000
+
+
+/**
+ * Sends an ACK to the server.
+ */
+void send_ack(int sd, int block_n, struct sockaddr_in *sv_addr){
+  char out_buffer[4];
+
+  tftp_msg_build_ack(block_n, out_buffer);
+  sendto(sd, out_buffer, tftp_msg_get_size_ack(), 0,
+         (struct sockaddr*) sv_addr, sizeof(*sv_addr)
+  );
+}
+
+
+/** Main */
+int main(int argc, char** argv){
+  char out_buffer[TFTP_MAX_REQUEST_LEN], in_buffer[TFTP_MAX_DATA_MSG_SIZE];
+  char data[TFTP_DATA_BLOCK], error_msg[TFTP_MAX_ERROR_LEN+1];
+  struct sockaddr_in sv_addr, my_addr;
+  socklen_t addr_len;
+  struct tftp_opts opts;
+  struct pollfd pfd;
+  int sd, len, block_n, data_size, error_code, replayed, far_sent, lost;
+  int block_size;
+  long expected;
+  FILE *out;
+
+  if (argc < 5){
+    printf("Usage: %s SERVER_IP SERVER_PORT FILENAME OUTPUT [BLKSIZE]\n",
+           argv[0]
+    );
+    return 1;
+  }
+
+  block_size = argc > 5 ? atoi(argv[5]) : TFTP_DATA_BLOCK;
+  if (block_size < 8 || block_size > TFTP_DATA_BLOCK){
+    printf("BLKSIZE must be within 8 and %d\n", TFTP_DATA_BLOCK);
+    return 1;
+  }
+
+  sv_addr = make_sv_sockaddr_in(argv[1], atoi(argv[2]));
+
+  out = fopen(argv[4], "wb");
+  if (out == NULL){
+    printf("Could not open %s\n", argv[4]);
+    return 1;
+  }
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  my_addr = make_my_sockaddr_in(0);
+  bind_random_port(sd, &my_addr);
+
+  pfd.fd = sd;
+  pfd.events = POLLIN;
+
+  tftp_opts_init(&opts);
+  opts.windowsize = WINDOWSIZE;
+  opts.timeout = SERVER_TIMEOUT;
+  if (block_size != TFTP_DATA_BLOCK)
+    opts.blksize = block_size;
+  tftp_msg_build_rrq(argv[3], TFTP_STR_OCTET, &opts, out_buffer);
+  sendto(sd, out_buffer, tftp_msg_get_size_rrq(argv[3], TFTP_STR_OCTET, &opts),
+         0, (struct sockaddr*) &sv_addr, sizeof(sv_addr)
+  );
+
+  expected = 0;  // waiting for the OACK
+  replayed = 0;
+  far_sent = 0;
+  lost = 0;
+  data_size = block_size;
+  while (data_size == block_size){
+    if (poll(&pfd, 1, REPLY_TIMEOUT) != 1){
+      if (far_sent){
+        printf("Transfer aborted after an ACK outside of the window\n");
+        return 0;
+      }
+      printf("No message from the server after block %ld\n", expected - 1);
+      return 1;
+    }
+
+    // replies come from the TID of the transfer
+    addr_len = sizeof(sv_addr);
+    len = recvfrom(sd, in_buffer, sizeof(in_buffer), 0,
+                   (struct sockaddr*) &sv_addr, &addr_len
+    );
+    if (len < 4)
+      continue;
+
+    if (tftp_msg_type(in_buffer) == TFTP_TYPE_ERROR){
+      if (tftp_msg_unpack_error(in_buffer, len, &error_code, error_msg) == 0)
+        printf("Received error %d: %s\n", error_code, error_msg);
+      return !far_sent;
+    }
+
+    if (expected == 0){
+      if (tftp_msg_type(in_buffer) != TFTP_TYPE_OACK){
+        printf("Server did not acknowledge the window size\n");
+        return 1;
+      }
+      send_ack(sd, 0, &sv_addr);
+      expected = 1;
+      continue;
+    }
+
+    if (tftp_msg_unpack_data(in_buffer, len, &block_n, data, &data_size) != 0
+        || block_n != (expected & TFTP_BLOCK_N_MASK)){
+      // the block after the lost one: ack the last one in order (once)
+      if (lost == 1){
+        send_ack(sd, (expected - 1) & TFTP_BLOCK_N_MASK, &sv_addr);
+        lost = 2;
+      }
+      data_size = block_size;  // blocks are only taken in order
+      continue;
+    }
+
+    if (expected == 3 * WINDOWSIZE + 1 && !lost){
+      lost = 1;
+      data_size = block_size;
+      continue;
+    }
+
+    fwrite(data, 1, data_size, out);
+    expected++;
+
+    if (block_n % WINDOWSIZE == 0 || data_size < block_size){
+      send_ack(sd, block_n, &sv_addr);
+
+      // the delayed ACK of the previous window reaches the server now
+      if (expected - 1 == 2 * WINDOWSIZE ||
+          expected - 1 == ROLLOVER + 2 * WINDOWSIZE){
+        send_ack(sd, (expected - 1 - WINDOWSIZE) & TFTP_BLOCK_N_MASK,
+                 &sv_addr
+        );
+        replayed++;
+      }
+
+      // an ACK which was never sent in this transfer (far behind)
+      if (expected - 1 == ROLLOVER + 4 * WINDOWSIZE){
+        send_ack(sd, (expected - 1 - FAR_BEHIND) & TFTP_BLOCK_N_MASK,
+                 &sv_addr
+        );
+        far_sent = 1;
+      }
+    }
+  }
+
+  fclose(out);
+  close(sd);
+
+  if (!replayed){
+    printf("File is too short to replay an ACK\n");
+    return 1;
+  }
+
+  if (lost != 2){
+    printf("File is too short to lose a block\n");
+    return 1;
+  }
+
+  if (far_sent){
+    printf("Server ignored an ACK outside of the window\n");
+    return 1;
+  }
+
+  printf("Downloaded %ld blocks, %d ACKs of the previous window replayed, "
+         "block %d lost\n",
+         expected - 1, replayed, 3 * WINDOWSIZE + 1
+  );
+  return 0;
+}